@@ -51,6 +51,15 @@ struct waveform_attribute
 #define error_printf(fmt, ...) do { fprintf(stderr, fmt, ##__VA_ARGS__); fflush(stderr); \
                                   } while(0)
 
+/** Compile a hot loop for several x86-64 ISAs and pick one at load
+ * time (GCC function multiversioning, needs ifunc). */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) \
+    && (defined(__linux) || defined(__FreeBSD__))
+  #define SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+  #define SIMD_CLONES
+#endif
+
 #define MIN(x,y) (((x)>(y))?(y):(x))
 #define MAX(x,y) (((x)<(y))?(y):(x))
 
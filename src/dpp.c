@@ -0,0 +1,405 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "dpp.h"
+#include "wavproc.h"
+
+#define L DPP_LANES
+
+/* Lanes are interleaved, sample i of lane j at x[i * L + j]. */
+
+/* The mean or the median of raw[0, nBase), 0 if nBase is 0. */
+static float baseline_of(const RAW_WAVEFORM_BASE_TYPE *raw, size_t nBase, int medianQ)
+{
+    size_t i;
+    int64_t sum;
+    if (nBase == 0) return 0.0f;
+    if (medianQ) return (float)wavproc_select(raw, nBase, (nBase - 1) / 2);
+    for (i=0, sum=0; i<nBase; i++) sum += raw[i];
+    return (float)sum / nBase;
+}
+
+/* Baseline of every lane from its first nBase samples. */
+static void baselines(float *base, const RAW_WAVEFORM_BASE_TYPE *raw, size_t nWfm, size_t stride,
+                      size_t nBase, int medianQ)
+{
+    size_t j;
+    for (j=0; j<nWfm; j++) base[j] = baseline_of(raw + j * stride, nBase, medianQ);
+}
+
+/* Interleave nWfm rows of n samples into x, baseline subtracted and
+ * turned positive.  Lanes past nWfm are left alone. */
+SIMD_CLONES
+static void load_lanes(float *restrict x, const RAW_WAVEFORM_BASE_TYPE *restrict raw, size_t nWfm,
+                       size_t stride, size_t n, const float *restrict base, float pol)
+{
+    size_t i, j;
+    for (j=0; j<nWfm; j++) {
+        for (i=0; i<n; i++)
+            x[i * L + j] = pol * ((float)raw[j * stride + i] - base[j]);
+    }
+}
+
+/* Trapezoid of rise k and flat top l - k by the recursion of Jordanov
+ * and Knoll: d is the difference of x delayed by 0, k, l and k + l,
+ * accumulated once into p, pole-zero corrected into p + m * d, and
+ * accumulated again into a.  Steps are shaped by p alone, exponential
+ * decays by a; s = gp * p + ga * a.  x must hold the k + l samples
+ * before x[0], zeros from rest, and p and a carry on from them. */
+SIMD_CLONES
+static void trapezoid(float *restrict s, const float *restrict x, size_t n, size_t k, size_t l,
+                      float m, float gp, float ga, float *restrict p, float *restrict acc)
+{
+    float d;
+    const float *x0;
+    size_t i, j;
+
+    for (i=0; i<n; i++) {
+        x0 = x + i * L;
+        for (j=0; j<L; j++) {
+            d = x0[j] - x0[(ptrdiff_t)j - (ptrdiff_t)(k * L)] - x0[(ptrdiff_t)j - (ptrdiff_t)(l * L)]
+                + x0[(ptrdiff_t)j - (ptrdiff_t)((k + l) * L)];
+            p[j] += d;
+            acc[j] += p[j] + m * d;
+            s[i * L + j] = gp * p[j] + ga * acc[j];
+        }
+    }
+}
+
+/* Zero crossing of f * x[i] - x[i - D], falling, searched in [i0, i1)
+ * of lane j and moved back by D: the time x reaches f of its height.
+ * @return -1 if there is none. */
+static double cfd_time(const float *x, size_t j, size_t i0, size_t i1, double f, size_t D)
+{
+    double c0, c1;
+    size_t i;
+
+    c0 = f * x[((ptrdiff_t)i0 - 1) * L + j] - x[((ptrdiff_t)i0 - 1 - (ptrdiff_t)D) * L + j];
+    for (i=i0; i<i1; i++, c0=c1) {
+        c1 = f * x[i * L + j] - x[((ptrdiff_t)i - (ptrdiff_t)D) * L + j];
+        if (c0 > 0 && c1 <= 0) return (double)(i - 1) + c0 / (c0 - c1) - (double)D;
+    }
+    return -1;
+}
+
+/* p + m * d turns an exponential decay of time tau into a step,
+ * m = 1 / (exp(1 / tau) - 1); the trapezoid of height A then tops at
+ * A * k * (m + 1) in a, that of a step at A * k in p. */
+static void pole_zero(double *m, double *gain, double tau, size_t k)
+{
+    *m = tau > 0 ? 1.0 / expm1(1.0 / tau) : 0.0;
+    *gain = tau > 0 ? 1.0 / (k * (*m + 1.0)) : 1.0 / k;
+}
+
+typedef struct dpp_job
+{
+    const RAW_WAVEFORM_BASE_TYPE *raw;
+    size_t nWfm;
+    size_t stride;
+    size_t n;
+    const struct dpp_param *pp;
+    struct dpp_pulse **found;  /**< pulses of each group of lanes */
+    size_t *nFound;
+} dpp_job_t;
+
+static void process_group(void *arg, size_t g)
+{
+    const dpp_job_t *job = (const dpp_job_t*)arg;
+    const struct dpp_param *pp = job->pp;
+    const size_t n = job->n, k = MAX(1, pp->rise), l = k + pp->gap, nPeak = MAX(1, pp->nPeak);
+    const size_t w0 = g * L, nW = MIN(L, job->nWfm - w0);
+    const size_t pad = MAX(k + l, pp->cfdDelay + 1);
+    const size_t maxPos = n / (pp->holdoff + 1) + 1;
+    const RAW_WAVEFORM_BASE_TYPE *row;
+    struct wavproc_trigger trig;
+    struct dpp_pulse *pulse;
+    float base[L], p[L] = {0}, acc[L] = {0}, *x, *s;
+    double m, gain, e, t;
+    size_t j, q, i, nPos, *pos, nFound = 0;
+
+    pole_zero(&m, &gain, pp->tau, k);
+
+    x = (float*)calloc((pad + n) * L, sizeof(float));
+    s = (float*)malloc(n * L * sizeof(float));
+    pos = (size_t*)malloc(maxPos * sizeof(size_t));
+    job->found[g] = (struct dpp_pulse*)malloc(nW * maxPos * sizeof(struct dpp_pulse));
+    baselines(base, job->raw + w0 * job->stride, nW, job->stride, MIN(pp->nBase, n),
+              pp->baseMedian);
+    load_lanes(x + pad * L, job->raw + w0 * job->stride, nW, job->stride, n, base,
+               (float)pp->polarity);
+    trapezoid(s, x + pad * L, n, k, l, (float)m, pp->tau > 0 ? 0.0f : (float)gain,
+              pp->tau > 0 ? (float)gain : 0.0f, p, acc);
+
+    /* A slope trigger ignores the baseline and the tails of earlier
+     * pulses, on which a level trigger would fire again on noise. */
+    trig.level = pp->threshold;
+    trig.polarity = pp->polarity;
+    trig.span = MAX(1, pp->cfdDelay);
+    trig.holdoff = pp->holdoff;
+    for (j=0; j<nW; j++) {
+        row = job->raw + (w0 + j) * job->stride;
+        nPos = wavproc_trigger_scan(pos, maxPos, row, n, &trig);
+        for (q=0; q<nPos; q++) {
+            pulse = &job->found[g][nFound++];
+            pulse->wfm = w0 + j;
+            t = cfd_time(x + pad * L, j, pos[q], MIN(n, pos[q] + pp->cfdDelay + pp->peakDelay + 1),
+                         pp->cfdFraction, pp->cfdDelay);
+            pulse->time = t < 0 ? (double)pos[q] : t;
+            if (pos[q] + pp->peakDelay + nPeak > n) {
+                pulse->energy = NAN;
+                continue;
+            }
+            for (i=0, e=0; i<nPeak; i++) e += s[(pos[q] + pp->peakDelay + i) * L + j];
+            pulse->energy = e / nPeak;
+        }
+    }
+    job->nFound[g] = nFound;
+    free(x);
+    free(s);
+    free(pos);
+}
+
+size_t dpp_process(struct dpp_pulse *pulses, size_t maxPulses, const RAW_WAVEFORM_BASE_TYPE *raw,
+                   size_t nWfm, size_t stride, size_t n, const struct dpp_param *pp,
+                   thpool_t *pool)
+{
+    const size_t nGroups = (nWfm + L - 1) / L;
+    dpp_job_t job = {raw, nWfm, stride, n, pp, NULL, NULL};
+    size_t g, c, k = 0;
+
+    if (nWfm == 0 || n < 2) return 0;
+    job.found = (struct dpp_pulse**)calloc(nGroups, sizeof(struct dpp_pulse*));
+    job.nFound = (size_t*)calloc(nGroups, sizeof(size_t));
+    if (pool) {
+        thpool_run(pool, process_group, &job, nGroups);
+    } else {
+        for (g=0; g<nGroups; g++) process_group(&job, g);
+    }
+    for (g=0; g<nGroups; g++) {
+        c = MIN(job.nFound[g], maxPulses - k);
+        memcpy(pulses + k, job.found[g], c * sizeof(struct dpp_pulse));
+        k += c;
+        free(job.found[g]);
+    }
+    free(job.found);
+    free(job.nFound);
+    return k;
+}
+
+/* Samples of every lane a dpp_stream filters at once. */
+#define DPP_STREAM_BLOCK 16384
+
+/* Samples after a trigger needed to measure its pulse. */
+static size_t pulse_span(const struct dpp_param *pp)
+{
+    return MAX(pp->cfdDelay + pp->peakDelay + 1, pp->peakDelay + MAX(1, pp->nPeak));
+}
+
+struct dpp_stream *dpp_stream_create(const struct dpp_param *pp, size_t nLanes)
+{
+    const size_t k = MAX(1, pp->rise), l = k + pp->gap, need = pulse_span(pp);
+    struct dpp_stream *ds;
+    struct dpp_state *st;
+    size_t j, nWork;
+
+    if (nLanes == 0 || nLanes > L) {
+        error_printf("%s(): %zd lanes, 1 to %d are supported.\n", __func__, nLanes, L);
+        return NULL;
+    }
+    if ((ds = (struct dpp_stream*)calloc(1, sizeof(struct dpp_stream))) == NULL) goto fail;
+    ds->pp = *pp;
+    ds->nLanes = nLanes;
+    /* The trapezoid looks back k + l samples, the CFD of a pulse still
+     * to be measured cfdDelay + 1 before its trigger. */
+    ds->nHist = MAX(k + l, need + pp->cfdDelay + 1);
+    ds->maxPend = need / (pp->holdoff + 1) + 1;
+    nWork = ds->nHist + DPP_STREAM_BLOCK;
+    ds->x = (float*)calloc(nWork * L, sizeof(float));
+    ds->s = (float*)calloc(nWork * L, sizeof(float));
+    ds->raw = (RAW_WAVEFORM_BASE_TYPE*)malloc(nWork * nLanes * sizeof(RAW_WAVEFORM_BASE_TYPE));
+    ds->pos = (size_t*)malloc((nWork / 2 + 1) * sizeof(size_t));
+    if (!ds->x || !ds->s || !ds->raw || !ds->pos) goto fail;
+    for (j=0; j<nLanes; j++) {
+        st = &ds->lane[j];
+        st->x = (float*)calloc(ds->nHist, sizeof(float));
+        st->s = (float*)calloc(ds->nHist, sizeof(float));
+        st->raw = (RAW_WAVEFORM_BASE_TYPE*)calloc(ds->nHist, sizeof(RAW_WAVEFORM_BASE_TYPE));
+        st->pend = (uint64_t*)malloc(ds->maxPend * sizeof(uint64_t));
+        if (!st->x || !st->s || !st->raw || !st->pend) goto fail;
+        if (pp->nBase && wavproc_rolling_init(&st->rm, pp->nBase) < 0) goto fail;
+    }
+    return ds;
+fail:
+    error_printf("%s(): allocation failure.\n", __func__);
+    dpp_stream_destroy(ds);
+    return NULL;
+}
+
+void dpp_stream_destroy(struct dpp_stream *ds)
+{
+    struct dpp_state *st;
+    size_t j;
+
+    if (ds == NULL) return;
+    for (j=0; j<ds->nLanes; j++) {
+        st = &ds->lane[j];
+        free(st->x);
+        free(st->s);
+        free(st->raw);
+        free(st->pend);
+        wavproc_rolling_free(&st->rm);
+    }
+    free(ds->x);
+    free(ds->s);
+    free(ds->raw);
+    free(ds->pos);
+    free(ds);
+}
+
+void dpp_stream_reset(struct dpp_stream *ds)
+{
+    struct dpp_state *st;
+    size_t j;
+
+    for (j=0; j<ds->nLanes; j++) {
+        st = &ds->lane[j];
+        st->p = st->acc = st->base = 0.0f;
+        memset(st->x, 0, ds->nHist * sizeof(float));
+        memset(st->s, 0, ds->nHist * sizeof(float));
+        st->nIn = st->holdUntil = 0;
+        st->nPend = 0;
+        if (ds->pp.nBase) wavproc_rolling_clear(&st->rm);
+    }
+}
+
+/* Measure the pulse triggered at work sample w of lane j, whose
+ * samples up to w + pulse_span() are in the work buffers. */
+static void measure(struct dpp_pulse *pulse, const struct dpp_stream *ds, size_t j, size_t w)
+{
+    const struct dpp_param *pp = &ds->pp;
+    const size_t nPeak = MAX(1, pp->nPeak);
+    double t, e;
+    size_t i;
+
+    t = cfd_time(ds->x, j, w, w + pp->cfdDelay + pp->peakDelay + 1, pp->cfdFraction,
+                 pp->cfdDelay);
+    pulse->wfm = j;
+    pulse->time = t < 0 ? (double)w : t;
+    for (i=0, e=0; i<nPeak; i++) e += ds->s[(w + pp->peakDelay + i) * L + j];
+    pulse->energy = e / nPeak;
+}
+
+/* Filter samples [i0, i0 + n) of the records of every lane, n up to
+ * DPP_STREAM_BLOCK, and measure the pulses whose samples are all in.
+ * t0 is the time of sample i0 of the first record in the call. */
+static size_t stream_block(struct dpp_pulse *pulses, size_t maxPulses, struct dpp_stream *ds,
+                           const RAW_WAVEFORM_BASE_TYPE *raw, size_t stride, size_t n,
+                           double t0)
+{
+    const struct dpp_param *pp = &ds->pp;
+    const size_t H = ds->nHist, nWork = H + n, need = pulse_span(pp);
+    const size_t k = MAX(1, pp->rise), l = k + pp->gap;
+    const float pol = (float)pp->polarity;
+    struct wavproc_trigger trig;
+    struct dpp_state *st;
+    RAW_WAVEFORM_BASE_TYPE *rw;
+    float base[L] = {0}, p[L] = {0}, acc[L] = {0}, old;
+    double m, gain;
+    size_t i, j, q, c, w, valid, nPos, nFound = 0;
+    uint64_t at;
+
+    pole_zero(&m, &gain, pp->tau, k);
+    for (j=0; j<ds->nLanes; j++) {
+        st = &ds->lane[j];
+        if (st->nIn == 0) st->base = baseline_of(raw + j * stride, MIN(pp->nBase, n), pp->baseMedian);
+        base[j] = st->base;
+        p[j] = st->p;
+        acc[j] = st->acc;
+        for (i=0; i<H; i++) {
+            ds->x[i * L + j] = st->x[i];
+            ds->s[i * L + j] = st->s[i];
+        }
+        rw = ds->raw + j * nWork;
+        memcpy(rw, st->raw, H);
+        memcpy(rw + H, raw + j * stride, n);
+    }
+    load_lanes(ds->x + H * L, raw, ds->nLanes, stride, n, base, pol);
+    trapezoid(ds->s + H * L, ds->x + H * L, n, k, l, (float)m, pp->tau > 0 ? 0.0f : (float)gain,
+              pp->tau > 0 ? (float)gain : 0.0f, p, acc);
+
+    /* The holdoff carries over from one block to the next, so it is
+     * applied here rather than by the scan; the samples kept from the
+     * blocks before give the new ones a full slope history. */
+    trig.level = pp->threshold;
+    trig.polarity = pp->polarity;
+    trig.span = MAX(1, pp->cfdDelay);
+    trig.holdoff = 0;
+    for (j=0; j<ds->nLanes; j++) {
+        st = &ds->lane[j];
+        /* Pulses triggered in earlier blocks, in order. */
+        for (q=0, c=0; q<st->nPend; q++) {
+            w = st->pend[q] + H - st->nIn;
+            if (w + need > nWork) {
+                st->pend[c++] = st->pend[q];
+            } else if (nFound < maxPulses) {
+                measure(&pulses[nFound], ds, j, w);
+                pulses[nFound++].time += t0 - (double)H;
+            }
+        }
+        st->nPend = c;
+        valid = MIN(H, st->nIn);
+        rw = ds->raw + j * nWork;
+        nPos = wavproc_trigger_scan(ds->pos, nWork / 2 + 1, rw + H - valid, valid + n, &trig);
+        for (q=0; q<nPos; q++) {
+            w = ds->pos[q] + H - valid;
+            at = st->nIn + w - H;
+            if (w < H || at < st->holdUntil) continue;
+            st->holdUntil = at + pp->holdoff + 1;
+            if (w + need > nWork) {
+                if (st->nPend < ds->maxPend) st->pend[st->nPend++] = at;
+            } else if (nFound < maxPulses) {
+                measure(&pulses[nFound], ds, j, w);
+                pulses[nFound++].time += t0 - (double)H;
+            }
+        }
+    }
+
+    for (j=0; j<ds->nLanes; j++) {
+        st = &ds->lane[j];
+        st->p = p[j];
+        st->acc = acc[j];
+        for (i=0; i<H; i++) {
+            st->x[i] = ds->x[(n + i) * L + j];
+            st->s[i] = ds->s[(n + i) * L + j];
+        }
+        memcpy(st->raw, ds->raw + j * nWork + n, H);
+        st->nIn += n;
+        if (pp->nBase == 0) continue;
+        /* The baseline follows the median of the last nBase samples;
+         * the kept samples move with it so that the filters see no step. */
+        wavproc_rolling_median(NULL, &st->rm, raw + j * stride, n);
+        old = st->base;
+        st->base = (float)wavproc_rolling_baseline(&st->rm);
+        for (i=0; i<H; i++) st->x[i] += pol * (old - st->base);
+    }
+    return nFound;
+}
+
+size_t dpp_stream_process(struct dpp_pulse *pulses, size_t maxPulses, struct dpp_stream *ds,
+                          const RAW_WAVEFORM_BASE_TYPE *raw, size_t nRec, size_t nPt)
+{
+    size_t r, i0, n, k = 0;
+
+    for (r=0; r<nRec; r++) {
+        for (i0=0; i0<nPt; i0+=n) {
+            n = MIN(DPP_STREAM_BLOCK, nPt - i0);
+            k += stream_block(pulses + k, maxPulses - k, ds, raw + r * ds->nLanes * nPt + i0, nPt,
+                              n, (double)(r * nPt + i0));
+        }
+    }
+    return k;
+}
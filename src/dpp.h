@@ -0,0 +1,117 @@
+/** \file dpp.h
+ * Digital pulse processing of raw waveforms: trapezoidal shaping with
+ * pole-zero correction for the energy and constant-fraction timing.
+ *
+ * Waveforms are processed DPP_LANES at a time, one waveform per SIMD
+ * lane, so that the recursive filters run across waveforms instead of
+ * along time.  dpp_process() is for independent waveforms, such as the
+ * events or FastFrame frames of a file: each one gets its baseline from
+ * the mean, or the median, of its first nBase samples and the filters
+ * start from rest; groups of lanes are spread over a thread pool.
+ * A dpp_stream is for continuous streams, one per lane, such as the
+ * channels of the live record stream: the filters, the trigger holdoff
+ * and a rolling baseline carry on from one call to the next, and pulses
+ * near the end of a call are measured in the next one.
+ */
+#ifndef __DPP_H__
+#define __DPP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+#include "thpool.h"
+#include "wavproc.h"
+
+/** Waveforms filtered together, one per lane. */
+#define DPP_LANES 16
+
+/** Pulse processing settings, times in samples. */
+struct dpp_param
+{
+    int      polarity;    /**< +1 positive pulses, -1 negative */
+    size_t   nBase;       /**< leading samples averaged for the baseline; a
+                               dpp_stream then follows the median of the
+                               last nBase */
+    int      baseMedian;  /**< take their median instead, robust to pulses
+                               among them */
+    int      threshold;   /**< trigger on a rise by this many ADC counts
+                               within cfdDelay samples */
+    size_t   holdoff;     /**< samples after a trigger without a new one */
+    size_t   rise;        /**< rise time of the trapezoid, > 0 */
+    size_t   gap;         /**< flat top of the trapezoid, 0: triangle */
+    double   tau;         /**< decay time of the pulses for the pole-zero
+                               correction, 0: steps, no correction */
+    size_t   peakDelay;   /**< the trapezoid is read this long after the trigger */
+    size_t   nPeak;       /**< ... and averaged over nPeak samples, >= 1 */
+    double   cfdFraction; /**< constant fraction, 0 < cfdFraction < 1 */
+    size_t   cfdDelay;    /**< delay of the CFD, about the rise of the pulses */
+};
+
+struct dpp_pulse
+{
+    size_t wfm;           /**< waveform of the pulse, from 0 */
+    double time;          /**< CFD time, samples from the start of the waveform */
+    double energy;        /**< trapezoid height in ADC counts, NAN if the
+                               trapezoid is read past the end of a
+                               waveform of dpp_process() */
+};
+
+/** Find and measure the pulses of nWfm waveforms of n samples, the
+ * first at raw, the next stride samples further each.
+ * @param[out] pulses at most maxPulses pulses, ordered by waveform,
+ *                    then time.
+ * @param[in] pool thread pool, NULL: the calling thread only.
+ * @return number of pulses stored.
+ */
+size_t dpp_process(struct dpp_pulse *pulses, size_t maxPulses, const RAW_WAVEFORM_BASE_TYPE *raw,
+                   size_t nWfm, size_t stride, size_t n, const struct dpp_param *pp,
+                   thpool_t *pool);
+
+/** Filter state of one lane of a dpp_stream. */
+struct dpp_state
+{
+    float    p, acc;      /**< trapezoid accumulators */
+    float    base;        /**< baseline subtracted from the samples */
+    struct wavproc_rolling rm; /**< the last nBase samples, for the next base */
+    float   *x;           /**< last nHist samples, baseline subtracted and
+                               turned positive */
+    float   *s;           /**< their trapezoid */
+    RAW_WAVEFORM_BASE_TYPE *raw; /**< last nHist raw samples, for the trigger */
+    uint64_t nIn;         /**< samples so far */
+    uint64_t holdUntil;   /**< first sample a trigger may fire at */
+    size_t   nPend;       /**< triggers waiting for samples to be measured */
+    uint64_t *pend;       /**< their samples, at most maxPend */
+};
+
+/** Up to DPP_LANES continuous streams filtered together. */
+struct dpp_stream
+{
+    struct dpp_param pp;
+    size_t nLanes;
+    size_t nHist;         /**< samples kept from one call to the next */
+    size_t maxPend;
+    struct dpp_state lane[DPP_LANES];
+    float *x, *s;         /**< scratch, lanes interleaved */
+    RAW_WAVEFORM_BASE_TYPE *raw;
+    size_t *pos;
+};
+
+/** @return NULL if nLanes is out of range or on allocation failure. */
+struct dpp_stream *dpp_stream_create(const struct dpp_param *pp, size_t nLanes);
+void dpp_stream_destroy(struct dpp_stream *ds);
+/** Start over from rest, after a gap in the streams. */
+void dpp_stream_reset(struct dpp_stream *ds);
+/** Feed the next nRec * nPt samples of every lane, from nRec records of
+ * nLanes * nPt samples, lane by lane, the first at raw.
+ * @param[out] pulses at most maxPulses pulses, ordered by time within
+ *                    each lane.  wfm is the lane, time counts from the
+ *                    first sample of this call and is negative for
+ *                    pulses of earlier calls measured only now.  Each
+ *                    lane gives at most nRec * nPt / (holdoff + 1) + 1
+ *                    + maxPend.
+ * @return number of pulses stored.
+ */
+size_t dpp_stream_process(struct dpp_pulse *pulses, size_t maxPulses, struct dpp_stream *ds,
+                          const RAW_WAVEFORM_BASE_TYPE *raw, size_t nRec, size_t nPt);
+
+#endif /* __DPP_H__ */
@@ -1,22 +1,239 @@
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <hdf5.h>
+#include <zlib.h>
 #include "common.h"
+#include "thpool.h"
+#include "wavproc.h"
 #include "hdf5rawWaveformIo.h"
 
-struct HDF5IO(waveform_file) *HDF5IO(open_file)(const char *fname,
-                                                size_t nWfmPerChunk,
-                                                size_t nCh)
+static const struct {
+    const char *name;
+    H5Z_filter_t id;
+} filterTable[] = {
+    [HDF5IO(FILTER_NONE)]    = {"none",    H5Z_FILTER_NONE},
+    [HDF5IO(FILTER_DEFLATE)] = {"deflate", H5Z_FILTER_DEFLATE},
+    [HDF5IO(FILTER_LZ4)]     = {"lz4",     H5Z_FILTER_LZ4},
+    [HDF5IO(FILTER_ZSTD)]    = {"zstd",    H5Z_FILTER_ZSTD},
+    [HDF5IO(FILTER_BLOSC)]   = {"blosc",   H5Z_FILTER_BLOSC},
+};
+#define N_FILTERS (sizeof(filterTable)/sizeof(filterTable[0]))
+
+/* Levels the filters accept; lz4 and none take none. */
+static int parse_level(enum HDF5IO(filter) filter, const char *str, int *level)
 {
-    hid_t rootGid, attrSid, attrAid;
+    char *end;
+    long v, lo, hi;
+
+    switch (filter) {
+    case HDF5IO(FILTER_DEFLATE):
+    case HDF5IO(FILTER_BLOSC):
+        lo = 0; hi = 9;
+        break;
+    case HDF5IO(FILTER_ZSTD):
+        lo = 1; hi = 22;
+        break;
+    default:
+        return -1;
+    }
+    v = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || v < lo || v > hi) return -1;
+    *level = (int)v;
+    return 0;
+}
+
+int HDF5IO(parse_compression)(const char *spec,
+                              struct HDF5IO(compression) *comp)
+{
+    char buf[NAME_BUF_SIZE], *tok, *lvl, *save;
+    size_t i;
+    int filterQ = 0;
+
+    comp->filter = HDF5IO(FILTER_NONE);
+    comp->level = 0;
+    comp->shuffle = 0;
+    comp->contiguous = 0;
+    strlcpy(buf, spec, NAME_BUF_SIZE);
+    for (tok = strtok_r(buf, ",+", &save); tok; tok = strtok_r(NULL, ",+", &save)) {
+        if (strcmp(tok, "shuffle") == 0) {
+            comp->shuffle = 1;
+            continue;
+        }
+        if (strcmp(tok, "contiguous") == 0) {
+            comp->contiguous = 1;
+            continue;
+        }
+        if ((lvl = strchr(tok, ':'))) { *lvl++ = '\0'; }
+        for (i=0; i<N_FILTERS; i++) {
+            if (strcmp(tok, filterTable[i].name) == 0) break;
+        }
+        if (i == N_FILTERS) {
+            error_printf("%s(): unknown filter \"%s\" in \"%s\"\n", __func__, tok, spec);
+            return -1;
+        }
+        if (filterQ++) {
+            error_printf("%s(): more than one filter in \"%s\"\n", __func__, spec);
+            return -1;
+        }
+        comp->filter = (enum HDF5IO(filter))i;
+        if (lvl) {
+            if (parse_level(comp->filter, lvl, &comp->level) < 0) {
+                error_printf("%s(): bad level \"%s\" for %s in \"%s\"\n",
+                             __func__, lvl, tok, spec);
+                return -1;
+            }
+        } else if (comp->filter == HDF5IO(FILTER_DEFLATE)) {
+            comp->level = 6;
+        } else if (comp->filter == HDF5IO(FILTER_ZSTD)) {
+            comp->level = 3;
+        } else if (comp->filter == HDF5IO(FILTER_BLOSC)) {
+            comp->level = 5;
+        }
+    }
+    if (comp->contiguous && (comp->filter != HDF5IO(FILTER_NONE) || comp->shuffle)) {
+        error_printf("%s(): contiguous layout cannot be filtered: \"%s\"\n", __func__, spec);
+        return -1;
+    }
+    return 0;
+}
+
+int HDF5IO(format_compression)(const struct HDF5IO(compression) *comp,
+                               char *buf, size_t n)
+{
+    const char *name = filterTable[comp->filter].name;
+
+    if (comp->contiguous) return snprintf(buf, n, "contiguous");
+    if (comp->filter == HDF5IO(FILTER_NONE) || comp->filter == HDF5IO(FILTER_LZ4))
+        return snprintf(buf, n, "%s%s", comp->shuffle ? "shuffle," : "", name);
+    return snprintf(buf, n, "%s%s:%d", comp->shuffle ? "shuffle," : "", name, comp->level);
+}
+
+int HDF5IO(compression_available)(const struct HDF5IO(compression) *comp)
+{
+    if (comp->shuffle && comp->filter != HDF5IO(FILTER_BLOSC)
+        && H5Zfilter_avail(H5Z_FILTER_SHUFFLE) <= 0) return 0;
+    if (comp->filter == HDF5IO(FILTER_NONE)) return 1;
+    return H5Zfilter_avail(filterTable[comp->filter].id) > 0;
+}
+
+/** Add the filter pipeline described by comp to a dataset creation
+ * property list. */
+static herr_t set_compression(hid_t pid, const struct HDF5IO(compression) *comp)
+{
+    /* cd_values[0..3] of blosc are filled in by the filter itself;
+     * cd_values[6] = 1 selects its lz4 codec. */
+    unsigned int bloscCd[7] = {0, 0, 0, 0, 0, 0, 1};
+    unsigned int cd;
+    herr_t ret = 0;
+
+    /* blosc does its own shuffle better than the HDF5 one. */
+    if (comp->shuffle && comp->filter != HDF5IO(FILTER_BLOSC)) ret = H5Pset_shuffle(pid);
+    if (ret < 0) return ret;
+
+    switch (comp->filter) {
+    case HDF5IO(FILTER_NONE):
+        break;
+    case HDF5IO(FILTER_DEFLATE):
+        ret = H5Pset_deflate(pid, (unsigned)comp->level);
+        break;
+    case HDF5IO(FILTER_LZ4):
+        cd = 0; /* default block size */
+        ret = H5Pset_filter(pid, H5Z_FILTER_LZ4, H5Z_FLAG_MANDATORY, 1, &cd);
+        break;
+    case HDF5IO(FILTER_ZSTD):
+        cd = (unsigned)comp->level;
+        ret = H5Pset_filter(pid, H5Z_FILTER_ZSTD, H5Z_FLAG_MANDATORY, 1, &cd);
+        break;
+    case HDF5IO(FILTER_BLOSC):
+        bloscCd[4] = (unsigned)comp->level;
+        bloscCd[5] = comp->shuffle ? 1 : 0;
+        ret = H5Pset_filter(pid, H5Z_FILTER_BLOSC, H5Z_FLAG_MANDATORY, 7, bloscCd);
+        break;
+    }
+    return ret;
+}
+
+static void chunk_writer_free(struct HDF5IO(chunk_writer) *cw);
+
+static void write_string_attribute(hid_t locId, const char *name, const char *str)
+{
+    hid_t attrSid, attrTid, attrAid;
+
+    attrTid = H5Tcopy(H5T_C_S1);
+    H5Tset_size(attrTid, strlen(str) + 1);
+    attrSid = H5Screate(H5S_SCALAR);
+    attrAid = H5Acreate(locId, name, attrTid, attrSid, H5P_DEFAULT, H5P_DEFAULT);
+    H5Awrite(attrAid, attrTid, str);
+    H5Aclose(attrAid);
+    H5Sclose(attrSid);
+    H5Tclose(attrTid);
+}
+
+static struct HDF5IO(waveform_file) *create_file(const char *fname,
+                                                 size_t nWfmPerChunk,
+                                                 size_t nCh,
+                                                 const struct HDF5IO(compression) *comp,
+                                                 int swmr)
+{
+    hid_t rootGid, attrSid, attrAid, fapl;
     herr_t ret;
+    char buf[NAME_BUF_SIZE];
 
     struct HDF5IO(waveform_file) *wavFile;
     wavFile = (struct HDF5IO(waveform_file) *)
         malloc(sizeof(struct HDF5IO(waveform_file)));
-    wavFile->waveFid = H5Fcreate(fname, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (comp) {
+        wavFile->comp = *comp;
+    } else {
+        HDF5IO(parse_compression)(HDF5IO_COMPRESSION_DEFAULT, &wavFile->comp);
+    }
+    if (!HDF5IO(compression_available)(&wavFile->comp)) {
+        HDF5IO(format_compression)(&wavFile->comp, buf, NAME_BUF_SIZE);
+        error_printf("%s(): compression \"%s\" is not available, check HDF5_PLUGIN_PATH\n",
+                     __func__, buf);
+        free(wavFile);
+        return NULL;
+    }
+    if (swmr && wavFile->comp.contiguous) {
+        error_printf("%s(): SWMR needs chunked, extendible datasets\n", __func__);
+        free(wavFile);
+        return NULL;
+    }
+    fapl = H5Pcreate(H5P_FILE_ACCESS);
+    if (swmr) H5Pset_libver_bounds(fapl, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
+    wavFile->waveFid = H5Fcreate(fname, H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+    H5Pclose(fapl);
+    if (wavFile->waveFid < 0) {
+        free(wavFile);
+        return NULL;
+    }
     wavFile->nWfmPerChunk = nWfmPerChunk;
     wavFile->nCh = nCh;
+    wavFile->swmr = swmr;
+    wavFile->swmrStarted = 0;
+    wavFile->wrDid = -1;
+    wavFile->rdDid = -1;
+    wavFile->chunkWriter = NULL;
+    wavFile->mapFd = -1;
+    wavFile->mapBase = NULL;
+    wavFile->mapLen = 0;
+    wavFile->chunkLen = 0;
+    wavFile->chMask = (1U << nCh) - 1;
+    wavFile->nFrames = 0;
+    wavFile->lodFactor = 0;
+    wavFile->lodMinBins = HDF5IO_LOD_MIN_BINS;
+    wavFile->lodWrDid = -1;
+    wavFile->lodRdDid = -1;
+    wavFile->lodBuf = NULL;
 
     rootGid = H5Gopen(wavFile->waveFid, "/", H5P_DEFAULT);
 
@@ -39,21 +256,60 @@ struct HDF5IO(waveform_file) *HDF5IO(open_file)(const char *fname,
     ret = H5Awrite(attrAid, H5T_NATIVE_HSIZE, &nCh);
     H5Sclose(attrSid);
     H5Aclose(attrAid);
+    HDF5IO(format_compression)(&wavFile->comp, buf, NAME_BUF_SIZE);
+    write_string_attribute(rootGid, "compression", buf);
     H5Gclose(rootGid);
 
     wavFile->nPt = SCOPE_MEM_LENGTH_MAX;
     return wavFile;
 }
 
+struct HDF5IO(waveform_file) *HDF5IO(open_file)(const char *fname,
+                                                size_t nWfmPerChunk,
+                                                size_t nCh,
+                                                const struct HDF5IO(compression) *comp)
+{
+    return create_file(fname, nWfmPerChunk, nCh, comp, 0);
+}
+
+struct HDF5IO(waveform_file) *HDF5IO(open_file_swmr)(const char *fname, size_t nCh,
+                                                     const struct HDF5IO(compression) *comp)
+{
+    return create_file(fname, HDF5IO_NWFM_UNLIMITED, nCh, comp, 1);
+}
+
 struct HDF5IO(waveform_file) *HDF5IO(open_file_for_read)(const char *fname)
 {
-    hid_t attrAid;
+    hid_t attrAid, attrTid;
     herr_t ret;
+    char buf[NAME_BUF_SIZE];
 
     struct HDF5IO(waveform_file) *wavFile;
     wavFile = (struct HDF5IO(waveform_file) *)
         malloc(sizeof(struct HDF5IO(waveform_file)));
-    wavFile->waveFid = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT);
+    /* A file being written in SWMR mode can only be opened this way;
+     * anything else is opened normally. */
+    H5E_BEGIN_TRY {
+        wavFile->waveFid = H5Fopen(fname, H5F_ACC_RDONLY | H5F_ACC_SWMR_READ, H5P_DEFAULT);
+    } H5E_END_TRY;
+    if (wavFile->waveFid < 0)
+        wavFile->waveFid = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (wavFile->waveFid < 0) {
+        free(wavFile);
+        return NULL;
+    }
+    wavFile->wrDid = -1;
+    wavFile->rdDid = -1;
+    wavFile->chunkWriter = NULL;
+    wavFile->mapFd = -1;
+    wavFile->mapBase = NULL;
+    wavFile->mapLen = 0;
+    wavFile->chunkLen = 0;
+    wavFile->lodFactor = 0;
+    wavFile->lodMinBins = HDF5IO_LOD_MIN_BINS;
+    wavFile->lodWrDid = -1;
+    wavFile->lodRdDid = -1;
+    wavFile->lodBuf = NULL;
 
     attrAid = H5Aopen_by_name(wavFile->waveFid, "/", "nEvents",
                               H5P_DEFAULT, H5P_DEFAULT);
@@ -67,6 +323,31 @@ struct HDF5IO(waveform_file) *HDF5IO(open_file_for_read)(const char *fname)
                               H5P_DEFAULT, H5P_DEFAULT);
     ret = H5Aread(attrAid, H5T_NATIVE_HSIZE, &(wavFile->nCh));
     H5Aclose(attrAid);
+    wavFile->chMask = (1U << wavFile->nCh) - 1;
+    wavFile->nFrames = 0;
+    wavFile->swmr = wavFile->nWfmPerChunk == HDF5IO_NWFM_UNLIMITED;
+    wavFile->swmrStarted = 0;
+    /* Files written before the attribute existed used the default. */
+    if (H5Aexists_by_name(wavFile->waveFid, "/", "compression", H5P_DEFAULT) > 0) {
+        attrAid = H5Aopen_by_name(wavFile->waveFid, "/", "compression",
+                                  H5P_DEFAULT, H5P_DEFAULT);
+        attrTid = H5Tcopy(H5T_C_S1);
+        H5Tset_size(attrTid, NAME_BUF_SIZE);
+        ret = H5Aread(attrAid, attrTid, buf);
+        H5Tclose(attrTid);
+        H5Aclose(attrAid);
+        HDF5IO(parse_compression)(buf, &wavFile->comp);
+    } else {
+        HDF5IO(parse_compression)(HDF5IO_COMPRESSION_DEFAULT, &wavFile->comp);
+    }
+    if (H5Aexists_by_name(wavFile->waveFid, "/", "lodFactor", H5P_DEFAULT) > 0) {
+        attrAid = H5Aopen_by_name(wavFile->waveFid, "/", "lodFactor", H5P_DEFAULT, H5P_DEFAULT);
+        ret = H5Aread(attrAid, H5T_NATIVE_HSIZE, &(wavFile->lodFactor));
+        H5Aclose(attrAid);
+        attrAid = H5Aopen_by_name(wavFile->waveFid, "/", "lodMinBins", H5P_DEFAULT, H5P_DEFAULT);
+        ret = H5Aread(attrAid, H5T_NATIVE_HSIZE, &(wavFile->lodMinBins));
+        H5Aclose(attrAid);
+    }
 
     wavFile->nPt = SCOPE_MEM_LENGTH_MAX;
     return wavFile;
@@ -76,6 +357,14 @@ int HDF5IO(close_file)(struct HDF5IO(waveform_file) *wavFile)
 {
     herr_t ret;
 
+    chunk_writer_free(wavFile->chunkWriter);
+    if (wavFile->wrDid >= 0) H5Dclose(wavFile->wrDid);
+    if (wavFile->rdDid >= 0) H5Dclose(wavFile->rdDid);
+    if (wavFile->lodWrDid >= 0) H5Dclose(wavFile->lodWrDid);
+    if (wavFile->lodRdDid >= 0) H5Dclose(wavFile->lodRdDid);
+    free(wavFile->lodBuf);
+    if (wavFile->mapBase) munmap(wavFile->mapBase, wavFile->mapLen);
+    if (wavFile->mapFd >= 0) close(wavFile->mapFd);
     ret = H5Fclose(wavFile->waveFid);
     free(wavFile);
     return (int)ret;
@@ -83,9 +372,19 @@ int HDF5IO(close_file)(struct HDF5IO(waveform_file) *wavFile)
 
 int HDF5IO(flush_file)(struct HDF5IO(waveform_file) *wavFile)
 {
-    hid_t attrAid;
+    hid_t attrAid, tDid;
     herr_t ret;
 
+    /* SWMR: attributes are frozen, readers count events from the
+     * extent of /C0, which a dataset flush publishes. */
+    if (wavFile->swmrStarted) {
+        ret = H5Dflush(wavFile->wrDid);
+        if ((tDid = H5Dopen(wavFile->waveFid, "/T0", H5P_DEFAULT)) >= 0) {
+            H5Dflush(tDid);
+            H5Dclose(tDid);
+        }
+        return (int)ret;
+    }
     attrAid = H5Aopen_by_name(wavFile->waveFid, "/", "nEvents",
                               H5P_DEFAULT, H5P_DEFAULT);
     ret = H5Awrite(attrAid, H5T_NATIVE_HSIZE, &(wavFile->nEvents));
@@ -95,6 +394,49 @@ int HDF5IO(flush_file)(struct HDF5IO(waveform_file) *wavFile)
     return (int)ret;
 }
 
+int HDF5IO(write_count)(struct HDF5IO(waveform_file) *wavFile, const char *name, size_t count)
+{
+    hid_t attrSid, attrAid;
+    hsize_t v = count;
+    herr_t ret;
+
+    if (wavFile->swmrStarted) return -1;
+    if (H5Aexists_by_name(wavFile->waveFid, "/", name, H5P_DEFAULT) > 0) {
+        attrAid = H5Aopen_by_name(wavFile->waveFid, "/", name, H5P_DEFAULT, H5P_DEFAULT);
+    } else {
+        attrSid = H5Screate(H5S_SCALAR);
+        attrAid = H5Acreate_by_name(wavFile->waveFid, "/", name, H5T_NATIVE_HSIZE, attrSid,
+                                    H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        H5Sclose(attrSid);
+    }
+    if (attrAid < 0) return -1;
+    ret = H5Awrite(attrAid, H5T_NATIVE_HSIZE, &v);
+    H5Aclose(attrAid);
+    return (int)ret;
+}
+
+/** FastFrame: frames of nPt / nFrames samples are laid end to end
+ * along the time axis of an event.  Make chunks hold whole frames,
+ * as many as fit in HDF5IO_FRAME_CHUNK_BYTES while dividing nFrames. */
+static int set_frames(struct HDF5IO(waveform_file) *wavFile, size_t nFrames)
+{
+    size_t frameLen, k, kMax;
+
+    wavFile->nFrames = nFrames;
+    if (nFrames == 0) return 0;
+    if (wavFile->nPt % nFrames) {
+        error_printf("%s(): nPt %zd is not a multiple of nFrames %zd\n", __func__,
+                     wavFile->nPt, nFrames);
+        return -1;
+    }
+    frameLen = wavFile->nPt / nFrames;
+    if (wavFile->chunkLen && wavFile->chunkLen % frameLen == 0) return 0;
+    kMax = MAX(1, HDF5IO_FRAME_CHUNK_BYTES / (frameLen * sizeof(SCOPE_DATA_TYPE)));
+    for (k = MIN(kMax, nFrames); nFrames % k; k--) ;
+    wavFile->chunkLen = k * frameLen;
+    return 0;
+}
+
 int HDF5IO(write_waveform_attribute_in_file_header)(
     struct HDF5IO(waveform_file) *wavFile,
     struct waveform_attribute *wavAttr)
@@ -140,6 +482,8 @@ int HDF5IO(write_waveform_attribute_in_file_header)(
     H5Gclose(rootGid);
 
     wavFile->nPt = wavAttr->nPt;
+    wavFile->chMask = wavAttr->chMask;
+    if (set_frames(wavFile, wavAttr->nFrames) < 0) return -1;
     return (int)ret;
 }
 
@@ -181,59 +525,295 @@ int HDF5IO(read_waveform_attribute_in_file_header)(
     H5Tclose(doubleArrayTid);
 
     wavFile->nPt = wavAttr->nPt;
+    wavFile->chMask = wavAttr->chMask;
+    wavFile->nFrames = wavAttr->nFrames;
+    if (wavFile->swmr) HDF5IO(refresh_file)(wavFile); /* needs nPt */
     return (int)ret;
 }
 
-int HDF5IO(write_event)(struct HDF5IO(waveform_file) *wavFile,
-                        struct HDF5IO(waveform_event) *wavEvent)
+/** Samples per HDF5 chunk along the time axis. */
+static size_t chunk_length(const struct HDF5IO(waveform_file) *wavFile)
+{
+    if (wavFile->chunkLen == 0 || wavFile->chunkLen > wavFile->nPt) return wavFile->nPt;
+    return wavFile->chunkLen;
+}
+
+/** Create /T<chunkId>, the time stamps next to /C<chunkId>. */
+static hid_t create_time_dataset(struct HDF5IO(waveform_file) *wavFile, const char *name)
+{
+    hid_t tSid, tPid, tDid;
+    hsize_t dims[1], maxDims[1], count[1];
+    const size_t nFrames = MAX(1, wavFile->nFrames);
+
+    dims[0] = wavFile->swmr ? 0 : wavFile->nWfmPerChunk * nFrames;
+    maxDims[0] = wavFile->swmr ? H5S_UNLIMITED : dims[0];
+    count[0] = nFrames;
+    tSid = H5Screate_simple(1, dims, maxDims);
+    tPid = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(tPid, 1, count);
+    H5Pset_deflate(tPid, 1);
+    tDid = H5Dcreate(wavFile->waveFid, name, H5T_NATIVE_DOUBLE, tSid,
+                     H5P_DEFAULT, tPid, H5P_DEFAULT);
+    H5Pclose(tPid);
+    H5Sclose(tSid);
+    return tDid;
+}
+
+/** SWMR datasets grow along their last (time) axis as events come in.
+ * Make it at least len long. */
+static herr_t extend_dataset(hid_t did, hsize_t len)
+{
+    hid_t sid;
+    hsize_t dims[2];
+    int rank;
+
+    sid = H5Dget_space(did);
+    rank = H5Sget_simple_extent_dims(sid, dims, NULL);
+    H5Sclose(sid);
+    if (rank < 1) return -1;
+    if (dims[rank-1] >= len) return 0;
+    dims[rank-1] = len;
+    return H5Dset_extent(did, dims);
+}
+
+/** Open the dataset holding chunkId for writing, creating it if it
+ * does not exist yet.  The handle is kept in wavFile->wrDid so that
+ * consecutive events of the same chunk do not reopen it. */
+static hid_t get_write_dataset(struct HDF5IO(waveform_file) *wavFile, size_t chunkId)
+{
+    char buf[NAME_BUF_SIZE];
+    hid_t chSid, chPid, chTid;
+    hsize_t dims[2], maxDims[2], h5chunkDims[2];
+
+    if (wavFile->wrDid >= 0) {
+        if (wavFile->wrChunkId == chunkId) return wavFile->wrDid;
+        H5Dclose(wavFile->wrDid);
+    }
+    snprintf(buf, NAME_BUF_SIZE, "/C%zd", chunkId);
+    if (H5Lexists(wavFile->waveFid, buf, H5P_DEFAULT) > 0) {
+        wavFile->wrDid = H5Dopen(wavFile->waveFid, buf, H5P_DEFAULT);
+    } else { /* need to create a new chunk */
+        dims[0] = maxDims[0] = wavFile->nCh;
+        dims[1] = maxDims[1] = wavFile->nPt * wavFile->nWfmPerChunk;
+        if (wavFile->swmr) {
+            dims[1] = 0;
+            maxDims[1] = H5S_UNLIMITED;
+        }
+        h5chunkDims[0] = 1;
+        h5chunkDims[1] = chunk_length(wavFile);
+
+        chSid = H5Screate_simple(2, dims, maxDims);
+        chPid = H5Pcreate(H5P_DATASET_CREATE);
+        if (wavFile->comp.contiguous) {
+            /* Allocated up front so that map_event() finds it at a
+             * fixed offset, and never filled since events overwrite. */
+            H5Pset_layout(chPid, H5D_CONTIGUOUS);
+            H5Pset_alloc_time(chPid, H5D_ALLOC_TIME_EARLY);
+            H5Pset_fill_time(chPid, H5D_FILL_TIME_NEVER);
+        } else {
+            H5Pset_chunk(chPid, 2, h5chunkDims);
+            set_compression(chPid, &wavFile->comp);
+        }
+
+        chTid = H5Tcopy(SCOPE_DATA_HDF5_TYPE);
+        wavFile->wrDid = H5Dcreate(wavFile->waveFid, buf, chTid, chSid,
+                                   H5P_DEFAULT, chPid, H5P_DEFAULT);
+        H5Tclose(chTid);
+        H5Pclose(chPid);
+        H5Sclose(chSid);
+        /* Every object has to exist before SWMR writing starts. */
+        if (wavFile->swmr && !wavFile->swmrStarted && wavFile->wrDid >= 0) {
+            H5Dclose(wavFile->wrDid);
+            if ((chTid = create_time_dataset(wavFile, "/T0")) >= 0) H5Dclose(chTid);
+            if (H5Fstart_swmr_write(wavFile->waveFid) < 0) {
+                error_printf("%s(): cannot start SWMR writing\n", __func__);
+            }
+            wavFile->swmrStarted = 1;
+            wavFile->wrDid = H5Dopen(wavFile->waveFid, buf, H5P_DEFAULT);
+        }
+    }
+    wavFile->wrChunkId = chunkId;
+    return wavFile->wrDid;
+}
+
+/** Store the per-frame time stamps of an event in /T<chunkId>, a 1D
+ * dataset of nWfmPerChunk * nFrames doubles next to /C<chunkId>. */
+static int write_frame_times(struct HDF5IO(waveform_file) *wavFile,
+                             const struct HDF5IO(waveform_event) *wavEvent)
 {
     char buf[NAME_BUF_SIZE];
     herr_t ret;
-    size_t chunkId, inChunkId;
-    hid_t rootGid, chSid, chPid, chTid, chDid;
-    hid_t mSid;
-    hsize_t dims[2], h5chunkDims[2], slabOff[2], mOff[2], slabDims[2];
+    hid_t tSid, tDid, mSid;
+    hsize_t off[1], count[1];
+    const size_t nFrames = MAX(1, wavFile->nFrames);
 
-    chunkId = wavEvent->eventId / wavFile->nWfmPerChunk;
-    inChunkId = wavEvent->eventId % wavFile->nWfmPerChunk;
+    snprintf(buf, NAME_BUF_SIZE, "/T%zd", wavEvent->eventId / wavFile->nWfmPerChunk);
+    if (H5Lexists(wavFile->waveFid, buf, H5P_DEFAULT) > 0) {
+        tDid = H5Dopen(wavFile->waveFid, buf, H5P_DEFAULT);
+    } else {
+        tDid = create_time_dataset(wavFile, buf);
+    }
+    if (tDid < 0) return -1;
+    off[0] = (wavEvent->eventId % wavFile->nWfmPerChunk) * nFrames;
+    if (wavFile->swmr) extend_dataset(tDid, off[0] + nFrames);
+    tSid = H5Dget_space(tDid);
+    count[0] = nFrames;
+    H5Sselect_hyperslab(tSid, H5S_SELECT_SET, off, NULL, count, NULL);
+    mSid = H5Screate_simple(1, count, NULL);
+    ret = H5Dwrite(tDid, H5T_NATIVE_DOUBLE, mSid, tSid, H5P_DEFAULT, wavEvent->frameTimes);
+    H5Sclose(mSid);
+    H5Sclose(tSid);
+    H5Dclose(tDid);
+    return (int)ret;
+}
 
-    snprintf(buf, NAME_BUF_SIZE, "C%zd", chunkId);
-    rootGid = H5Gopen(wavFile->waveFid, "/", H5P_DEFAULT);
+/** Geometry of the min/max pyramid of one event and channel row.
+ * @param[out] binLen samples per bin of each level.
+ * @param[out] nBins bins in each level.
+ * @param[out] off offset of each level in the row's block, off[nLevels]
+ *                 is the block length (two values per bin).
+ * @return number of levels.
+ */
+static size_t lod_levels(const struct HDF5IO(waveform_file) *wavFile, size_t *binLen,
+                         size_t *nBins, size_t *off)
+{
+    size_t l, b = 1;
+
+    off[0] = 0;
+    for (l=0; l<HDF5IO_LOD_MAX_LEVELS; ) {
+        b *= wavFile->lodFactor;
+        binLen[l] = b;
+        nBins[l] = (wavFile->nPt + b - 1) / b;
+        off[l+1] = off[l] + 2 * nBins[l];
+        if (nBins[l++] <= MAX(1, wavFile->lodMinBins)) break;
+    }
+    return l;
+}
+
+/** /L<chunkId>, the pyramids of the events in /C<chunkId>, laid out
+ * as nCh rows of nWfmPerChunk blocks. */
+static hid_t get_lod_dataset(struct HDF5IO(waveform_file) *wavFile, size_t chunkId, int writeQ)
+{
+    char buf[NAME_BUF_SIZE];
+    hid_t sid, pid, *did = writeQ ? &wavFile->lodWrDid : &wavFile->lodRdDid;
+    size_t *didChunkId = writeQ ? &wavFile->lodWrChunkId : &wavFile->lodRdChunkId;
+    size_t binLen[HDF5IO_LOD_MAX_LEVELS], nBins[HDF5IO_LOD_MAX_LEVELS];
+    size_t off[HDF5IO_LOD_MAX_LEVELS+1];
+    hsize_t dims[2], h5chunkDims[2];
 
-#define write_event_create_dataset                   \
-    do {                                                    \
-        dims[0] = wavFile->nCh;                             \
-        dims[1] = wavFile->nPt * wavFile->nWfmPerChunk;     \
-        h5chunkDims[0] = 1;                                 \
-        h5chunkDims[1] = wavFile->nPt;                      \
-                                                            \
-        chSid = H5Screate_simple(2, dims, NULL);            \
-        chPid = H5Pcreate(H5P_DATASET_CREATE);              \
-        H5Pset_chunk(chPid, 2, h5chunkDims);                \
-        H5Pset_deflate(chPid, 6);                           \
-                                                            \
-        chTid = H5Tcopy(SCOPE_DATA_HDF5_TYPE);              \
-        chDid = H5Dcreate(rootGid, buf, chTid, chSid,       \
-                          H5P_DEFAULT, chPid, H5P_DEFAULT); \
-                                                            \
-        H5Tclose(chTid);                                    \
-        H5Pclose(chPid);                                    \
-    } while(0)
-
-    if (inChunkId == 0) { /* need to create a new chunk */
-        write_event_create_dataset;
+    if (*did >= 0) {
+        if (*didChunkId == chunkId) return *did;
+        H5Dclose(*did);
+    }
+    snprintf(buf, NAME_BUF_SIZE, "/L%zd", chunkId);
+    if (!writeQ || H5Lexists(wavFile->waveFid, buf, H5P_DEFAULT) > 0) {
+        *did = H5Dopen(wavFile->waveFid, buf, H5P_DEFAULT);
     } else {
-        chDid = H5Dopen(rootGid, buf, H5P_DEFAULT);
-        if (chDid < 0) { /* need to create a new chunk */
-            /* This is not a neat way to do it.  One may check out
-             * H5Lexists() and try to utilize that function.  Its
-             * efficiency is not verified though. */
-            write_event_create_dataset;
-        } else {
-            chSid = H5Dget_space(chDid);
+        dims[0] = wavFile->nCh;
+        h5chunkDims[0] = 1;
+        h5chunkDims[1] = off[lod_levels(wavFile, binLen, nBins, off)];
+        dims[1] = h5chunkDims[1] * wavFile->nWfmPerChunk;
+        sid = H5Screate_simple(2, dims, NULL);
+        pid = H5Pcreate(H5P_DATASET_CREATE);
+        H5Pset_chunk(pid, 2, h5chunkDims);
+        if (!wavFile->comp.contiguous) set_compression(pid, &wavFile->comp);
+        *did = H5Dcreate(wavFile->waveFid, buf, SCOPE_DATA_HDF5_TYPE, sid,
+                         H5P_DEFAULT, pid, H5P_DEFAULT);
+        H5Pclose(pid);
+        H5Sclose(sid);
+    }
+    *didChunkId = chunkId;
+    return *did;
+}
+
+/** Build and store the pyramids of n events. */
+static int write_lods(struct HDF5IO(waveform_file) *wavFile,
+                      struct HDF5IO(waveform_event) *wavEvents, size_t n)
+{
+    size_t binLen[HDF5IO_LOD_MAX_LEVELS], nBins[HDF5IO_LOD_MAX_LEVELS];
+    size_t off[HDF5IO_LOD_MAX_LEVELS+1];
+    size_t i, l, ch, nLevels, blkLen;
+    SCOPE_DATA_TYPE *blk;
+    hid_t did, sid, mSid;
+    hsize_t fOff[2], count[2];
+    herr_t ret = 0;
+
+    if (!wavFile->lodFactor) return 0;
+    nLevels = lod_levels(wavFile, binLen, nBins, off);
+    blkLen = off[nLevels];
+    if (!wavFile->lodBuf)
+        wavFile->lodBuf = (SCOPE_DATA_TYPE*)malloc(wavFile->nCh * blkLen * sizeof(SCOPE_DATA_TYPE));
+    for (i=0; i<n && ret>=0; i++) {
+        for (ch=0; ch<wavFile->nCh; ch++) {
+            blk = wavFile->lodBuf + ch * blkLen;
+            wavproc_minmax_pairs(blk, wavEvents[i].wavBuf + ch * wavFile->nPt, wavFile->nPt,
+                                 binLen[0]);
+            for (l=1; l<nLevels; l++)
+                wavproc_minmax_reduce(blk + off[l], blk + off[l-1], nBins[l-1],
+                                      wavFile->lodFactor);
         }
+        if ((did = get_lod_dataset(wavFile, wavEvents[i].eventId / wavFile->nWfmPerChunk, 1)) < 0)
+            return -1;
+        sid = H5Dget_space(did);
+        fOff[0] = 0;
+        fOff[1] = (wavEvents[i].eventId % wavFile->nWfmPerChunk) * blkLen;
+        count[0] = wavFile->nCh;
+        count[1] = blkLen;
+        H5Sselect_hyperslab(sid, H5S_SELECT_SET, fOff, NULL, count, NULL);
+        mSid = H5Screate_simple(2, count, NULL);
+        ret = H5Dwrite(did, SCOPE_DATA_HDF5_TYPE, mSid, sid, H5P_DEFAULT, wavFile->lodBuf);
+        H5Sclose(mSid);
+        H5Sclose(sid);
+    }
+    return (int)ret;
+}
+
+int HDF5IO(set_lod)(struct HDF5IO(waveform_file) *wavFile, size_t factor)
+{
+    hid_t rootGid, attrSid, attrAid;
+    hsize_t v;
+
+    if (wavFile->wrDid >= 0 || wavFile->nEvents > 0 || wavFile->swmr) {
+        error_printf("%s(): a pyramid can only be set up before the first write, "
+                     "and not for SWMR files\n", __func__);
+        return -1;
     }
-#undef write_event_create_dataset
+    wavFile->lodFactor = factor ? MAX(2, factor) : HDF5IO_LOD_FACTOR;
+    rootGid = H5Gopen(wavFile->waveFid, "/", H5P_DEFAULT);
+    attrSid = H5Screate(H5S_SCALAR);
+    H5E_BEGIN_TRY { /* called twice */
+        H5Adelete(rootGid, "lodFactor");
+        H5Adelete(rootGid, "lodMinBins");
+    } H5E_END_TRY;
+    attrAid = H5Acreate(rootGid, "lodFactor", H5T_NATIVE_HSIZE, attrSid, H5P_DEFAULT, H5P_DEFAULT);
+    v = wavFile->lodFactor;
+    H5Awrite(attrAid, H5T_NATIVE_HSIZE, &v);
+    H5Aclose(attrAid);
+    attrAid = H5Acreate(rootGid, "lodMinBins", H5T_NATIVE_HSIZE, attrSid, H5P_DEFAULT, H5P_DEFAULT);
+    v = wavFile->lodMinBins;
+    H5Awrite(attrAid, H5T_NATIVE_HSIZE, &v);
+    H5Aclose(attrAid);
+    H5Sclose(attrSid);
+    H5Gclose(rootGid);
+    return 0;
+}
+
+/** Write one event through the HDF5 filter pipeline. */
+static int write_event_pipeline(struct HDF5IO(waveform_file) *wavFile,
+                                struct HDF5IO(waveform_event) *wavEvent)
+{
+    herr_t ret;
+    size_t chunkId, inChunkId;
+    hid_t chSid, chDid;
+    hid_t mSid;
+    hsize_t slabOff[2], mOff[2], slabDims[2];
+
+    chunkId = wavEvent->eventId / wavFile->nWfmPerChunk;
+    inChunkId = wavEvent->eventId % wavFile->nWfmPerChunk;
+
+    if ((chDid = get_write_dataset(wavFile, chunkId)) < 0) return -1;
+    if (wavFile->swmr && extend_dataset(chDid, (inChunkId + 1) * wavFile->nPt) < 0) return -1;
+    chSid = H5Dget_space(chDid);
 
     slabOff[0] = 0;
     slabOff[1] = inChunkId * wavFile->nPt;
@@ -248,20 +828,288 @@ int HDF5IO(write_event)(struct HDF5IO(waveform_file) *wavFile,
 
     ret = H5Dwrite(chDid, SCOPE_DATA_HDF5_TYPE, mSid, chSid, H5P_DEFAULT,
                    wavEvent->wavBuf);
+    if (ret >= 0 && wavEvent->frameTimes) ret = write_frame_times(wavFile, wavEvent);
+    if (ret >= 0) ret = write_lods(wavFile, wavEvent, 1);
 
     wavFile->nEvents++;
 
     H5Sclose(mSid);
     H5Sclose(chSid);
-    H5Dclose(chDid);
-    H5Gclose(rootGid);
     return (int)ret;
 }
 
+/** Write n events with consecutive eventIds, all in one dataset, whose
+ * buffers follow each other in memory.  Takes one H5Dwrite per channel
+ * row instead of one per event. */
+static int write_run_pipeline(struct HDF5IO(waveform_file) *wavFile,
+                              struct HDF5IO(waveform_event) *wavEvents, size_t n)
+{
+    herr_t ret = 0;
+    size_t i, ch, inChunkId;
+    hid_t chSid, chDid, mSid;
+    hsize_t fOff[2], fCount[2], mDims[1], mOff[1], mStride[1], mCount[1], mBlock[1];
+    const size_t evtLen = wavFile->nCh * wavFile->nPt;
+
+    if (n == 1) return write_event_pipeline(wavFile, wavEvents);
+    inChunkId = wavEvents[0].eventId % wavFile->nWfmPerChunk;
+    if ((chDid = get_write_dataset(wavFile, wavEvents[0].eventId / wavFile->nWfmPerChunk)) < 0)
+        return -1;
+    if (wavFile->swmr && extend_dataset(chDid, (inChunkId + n) * wavFile->nPt) < 0) return -1;
+    chSid = H5Dget_space(chDid);
+
+    /* file: one row of n events; memory: the same row in each of the n buffers */
+    fCount[0] = 1;
+    fCount[1] = n * wavFile->nPt;
+    mDims[0] = n * evtLen;
+    mStride[0] = evtLen;
+    mCount[0] = n;
+    mBlock[0] = wavFile->nPt;
+    mSid = H5Screate_simple(1, mDims, NULL);
+    for (ch=0; ch<wavFile->nCh && ret>=0; ch++) {
+        fOff[0] = ch;
+        fOff[1] = inChunkId * wavFile->nPt;
+        H5Sselect_hyperslab(chSid, H5S_SELECT_SET, fOff, NULL, fCount, NULL);
+        mOff[0] = ch * wavFile->nPt;
+        H5Sselect_hyperslab(mSid, H5S_SELECT_SET, mOff, mStride, mCount, mBlock);
+        ret = H5Dwrite(chDid, SCOPE_DATA_HDF5_TYPE, mSid, chSid, H5P_DEFAULT,
+                       wavEvents[0].wavBuf);
+    }
+    H5Sclose(mSid);
+    H5Sclose(chSid);
+    for (i=0; i<n && ret>=0; i++) {
+        if (wavEvents[i].frameTimes) ret = write_frame_times(wavFile, &wavEvents[i]);
+    }
+    if (ret >= 0) ret = write_lods(wavFile, wavEvents, n);
+    wavFile->nEvents += n;
+    return (int)ret;
+}
+
+int HDF5IO(write_event)(struct HDF5IO(waveform_file) *wavFile,
+                        struct HDF5IO(waveform_event) *wavEvent)
+{
+    if (wavFile->chunkWriter)
+        return HDF5IO(write_events)(wavFile, wavEvent, 1);
+    return write_event_pipeline(wavFile, wavEvent);
+}
+
+/* Direct chunk writes.  Each (event, channel) pair is split into
+ * nPt / chunkLen HDF5 chunks of 1 x chunkLen.  Chunks are compressed on a thread pool with zlib,
+ * the same codec the deflate filter uses, and then committed from the
+ * calling thread with H5Dwrite_chunk, so the filter pipeline stored
+ * in the dataset still decodes them. */
+struct HDF5IO(chunk_writer)
+{
+    thpool_t *pool;
+    size_t nBuf;           /* chunks compressed per round */
+    size_t bufSz;          /* capacity of each zBuf and sBuf */
+    unsigned char **zBuf;  /* compressed chunks */
+    unsigned char **sBuf;  /* shuffled chunks, multi-byte samples only */
+    const void **out;      /* what to write: zBuf, sBuf or the caller's samples */
+    size_t *outLen;
+    uint32_t *mask;        /* H5Dwrite_chunk filter mask */
+    /* current round */
+    struct HDF5IO(waveform_file) *wavFile;
+    struct HDF5IO(waveform_event) *evts;
+    size_t first;          /* (event, channel, part) index of out[0] */
+};
+
+/** HDF5 shuffle filter: byte k of every element goes to plane k. */
+static void shuffle_bytes(unsigned char *dst, const unsigned char *src,
+                          size_t nElem, size_t elemSize)
+{
+    size_t i, k;
+    for (k=0; k<elemSize; k++)
+        for (i=0; i<nElem; i++)
+            dst[k*nElem + i] = src[i*elemSize + k];
+}
+
+static void compress_chunk(void *arg, size_t i)
+{
+    struct HDF5IO(chunk_writer) *cw = (struct HDF5IO(chunk_writer)*)arg;
+    struct HDF5IO(waveform_file) *wavFile = cw->wavFile;
+    const size_t elemSize = sizeof(SCOPE_DATA_TYPE);
+    const size_t chunkLen = chunk_length(wavFile);
+    const size_t len = chunkLen * elemSize;
+    const size_t nPart = wavFile->nPt / chunkLen;
+    const unsigned deflateIdx = wavFile->comp.shuffle ? 1 : 0; /* in the pipeline */
+    size_t p = cw->first + i;
+    const unsigned char *src;
+    uLongf zLen = cw->bufSz;
+
+    src = (const unsigned char*)(cw->evts[p / (wavFile->nCh * nPart)].wavBuf
+                                 + (p / nPart % wavFile->nCh) * wavFile->nPt
+                                 + (p % nPart) * chunkLen);
+    if (wavFile->comp.shuffle && elemSize > 1) {
+        shuffle_bytes(cw->sBuf[i], src, chunkLen, elemSize);
+        src = cw->sBuf[i];
+    }
+    if (compress2(cw->zBuf[i], &zLen, src, len, wavFile->comp.level) == Z_OK && zLen < len) {
+        cw->out[i] = cw->zBuf[i];
+        cw->outLen[i] = zLen;
+        cw->mask[i] = 0;
+    } else { /* incompressible, skip the (optional) deflate filter */
+        cw->out[i] = src;
+        cw->outLen[i] = len;
+        cw->mask[i] = 1U << deflateIdx;
+    }
+}
+
+static void chunk_writer_free(struct HDF5IO(chunk_writer) *cw)
+{
+    size_t i;
+    if (!cw) return;
+    thpool_destroy(cw->pool);
+    for (i=0; i<cw->nBuf; i++) {
+        if (cw->zBuf) free(cw->zBuf[i]);
+        if (cw->sBuf) free(cw->sBuf[i]);
+    }
+    free(cw->zBuf);
+    free(cw->sBuf);
+    free(cw->out);
+    free(cw->outLen);
+    free(cw->mask);
+    free(cw);
+}
+
+int HDF5IO(set_write_threads)(struct HDF5IO(waveform_file) *wavFile, size_t nThreads)
+{
+    struct HDF5IO(chunk_writer) *cw;
+
+    chunk_writer_free(wavFile->chunkWriter);
+    wavFile->chunkWriter = NULL;
+    if (nThreads == 0) return 0;
+    if (wavFile->comp.filter != HDF5IO(FILTER_DEFLATE)) {
+        error_printf("%s(): only deflate can be compressed in parallel, "
+                     "keeping the filter pipeline\n", __func__);
+        return -1;
+    }
+    /* Chunks cached by earlier pipeline writes must reach the file
+     * before chunks start bypassing the cache. */
+    if (wavFile->wrDid >= 0) {
+        H5Dclose(wavFile->wrDid);
+        wavFile->wrDid = -1;
+    }
+    cw = (struct HDF5IO(chunk_writer)*)calloc(1, sizeof(struct HDF5IO(chunk_writer)));
+    if (cw == NULL || (cw->pool = thpool_create(nThreads)) == NULL) {
+        error_printf("%s(): cannot start %zd compression threads.\n", __func__, nThreads);
+        free(cw);
+        return -1;
+    }
+    cw->nBuf    = 2 * thpool_nthreads(cw->pool);
+    cw->zBuf    = (unsigned char**)calloc(cw->nBuf, sizeof(unsigned char*));
+    cw->sBuf    = (unsigned char**)calloc(cw->nBuf, sizeof(unsigned char*));
+    cw->out     = (const void**)calloc(cw->nBuf, sizeof(void*));
+    cw->outLen  = (size_t*)calloc(cw->nBuf, sizeof(size_t));
+    cw->mask    = (uint32_t*)calloc(cw->nBuf, sizeof(uint32_t));
+    if (!cw->zBuf || !cw->sBuf || !cw->out || !cw->outLen || !cw->mask) {
+        error_printf("%s(): buffer allocation failure.\n", __func__);
+        chunk_writer_free(cw);
+        return -1;
+    }
+    cw->wavFile = wavFile;
+    wavFile->chunkWriter = cw;
+    return 0;
+}
+
+int HDF5IO(write_events)(struct HDF5IO(waveform_file) *wavFile,
+                         struct HDF5IO(waveform_event) *wavEvents, size_t n)
+{
+    struct HDF5IO(chunk_writer) *cw = wavFile->chunkWriter;
+    const size_t chunkLen = chunk_length(wavFile);
+    const size_t len = chunkLen * sizeof(SCOPE_DATA_TYPE);
+    const size_t nPart = wavFile->nPt / chunkLen;
+    size_t i, k, m, p, q, nChunks, eventId;
+    hid_t chDid;
+    hsize_t off[2];
+    herr_t ret = 0;
+
+    /* Chunks straddling events cannot be compressed independently. */
+    if (cw && wavFile->nPt % chunkLen) {
+        error_printf("%s(): nPt %zd is not a multiple of the chunk length %zd, "
+                     "using the filter pipeline\n", __func__, wavFile->nPt, chunkLen);
+        chunk_writer_free(cw);
+        wavFile->chunkWriter = cw = NULL;
+    }
+    if (!cw) {
+        for (i=0; i<n; i++) {
+            if ((ret = write_event_pipeline(wavFile, &wavEvents[i])) < 0) return (int)ret;
+        }
+        return 0;
+    }
+    /* (Re)size per round buffers for the current chunk size. */
+    if (cw->bufSz < compressBound(len)) {
+        cw->bufSz = compressBound(len);
+        for (k=0; k<cw->nBuf; k++) {
+            free(cw->zBuf[k]);
+            free(cw->sBuf[k]);
+            cw->zBuf[k] = (unsigned char*)malloc(cw->bufSz);
+            cw->sBuf[k] = sizeof(SCOPE_DATA_TYPE) > 1 ? (unsigned char*)malloc(cw->bufSz) : NULL;
+        }
+    }
+    cw->evts = wavEvents;
+    nChunks = n * wavFile->nCh * nPart;
+    for (p=0; p<nChunks; p+=m) {
+        m = MIN(cw->nBuf, nChunks - p);
+        cw->first = p;
+        thpool_run(cw->pool, compress_chunk, cw, m);
+        for (k=0; k<m; k++) {
+            q = p + k;
+            eventId = wavEvents[q / (wavFile->nCh * nPart)].eventId;
+            if ((chDid = get_write_dataset(wavFile, eventId / wavFile->nWfmPerChunk)) < 0)
+                return -1;
+            off[0] = q / nPart % wavFile->nCh;
+            off[1] = (eventId % wavFile->nWfmPerChunk) * wavFile->nPt + (q % nPart) * chunkLen;
+            if (wavFile->swmr && extend_dataset(chDid, off[1] + chunkLen) < 0) return -1;
+            ret = H5Dwrite_chunk(chDid, H5P_DEFAULT, cw->mask[k], off,
+                                 cw->outLen[k], cw->out[k]);
+            if (ret < 0) return (int)ret;
+        }
+    }
+    for (i=0; i<n; i++) {
+        if (wavEvents[i].frameTimes && write_frame_times(wavFile, &wavEvents[i]) < 0)
+            return -1;
+    }
+    if (write_lods(wavFile, wavEvents, n) < 0) return -1;
+    wavFile->nEvents += n;
+    return 0;
+}
+
+int HDF5IO(set_chunk_length)(struct HDF5IO(waveform_file) *wavFile, size_t chunkLen)
+{
+    if (wavFile->wrDid >= 0 || wavFile->nEvents > 0) {
+        error_printf("%s(): chunk shape cannot change after the first write\n", __func__);
+        return -1;
+    }
+    wavFile->chunkLen = chunkLen;
+    return 0;
+}
+
+/** Open the dataset holding chunkId for reading.  The handle is kept
+ * in wavFile->rdDid, together with a chunk cache large enough for one
+ * event, so that sequential reads neither reopen the dataset nor
+ * decompress the same chunk twice. */
+static hid_t get_read_dataset(struct HDF5IO(waveform_file) *wavFile, size_t chunkId)
+{
+    char buf[NAME_BUF_SIZE];
+    hid_t dapl;
+
+    if (wavFile->rdDid >= 0) {
+        if (wavFile->rdChunkId == chunkId) return wavFile->rdDid;
+        H5Dclose(wavFile->rdDid);
+    }
+    snprintf(buf, NAME_BUF_SIZE, "/C%zd", chunkId);
+    dapl = H5Pcreate(H5P_DATASET_ACCESS);
+    H5Pset_chunk_cache(dapl, 521, 2 * wavFile->nCh * wavFile->nPt * sizeof(SCOPE_DATA_TYPE),
+                       1.0);
+    wavFile->rdDid = H5Dopen(wavFile->waveFid, buf, dapl);
+    wavFile->rdChunkId = chunkId;
+    H5Pclose(dapl);
+    return wavFile->rdDid;
+}
+
 int HDF5IO(read_event)(struct HDF5IO(waveform_file) *wavFile,
                        struct HDF5IO(waveform_event) *wavEvent)
 {
-    char buf[NAME_BUF_SIZE];
     herr_t ret;
     size_t chunkId, inChunkId;
     hid_t chSid, chDid;
@@ -271,8 +1119,7 @@ int HDF5IO(read_event)(struct HDF5IO(waveform_file) *wavFile,
     chunkId = wavEvent->eventId / wavFile->nWfmPerChunk;
     inChunkId = wavEvent->eventId % wavFile->nWfmPerChunk;
 
-    snprintf(buf, NAME_BUF_SIZE, "/C%zd", chunkId);
-    chDid = H5Dopen(wavFile->waveFid, buf, H5P_DEFAULT);
+    if ((chDid = get_read_dataset(wavFile, chunkId)) < 0) return -1;
     chSid = H5Dget_space(chDid);
 
     slabOff[0] = 0;
@@ -291,7 +1138,243 @@ int HDF5IO(read_event)(struct HDF5IO(waveform_file) *wavFile,
 
     H5Sclose(mSid);
     H5Sclose(chSid);
-    H5Dclose(chDid);
+    return (int)ret;
+}
+
+int HDF5IO(read_envelope)(struct HDF5IO(waveform_file) *wavFile, size_t eventId, unsigned ch,
+                          size_t tStart, size_t tEnd, size_t width,
+                          SCOPE_DATA_TYPE *mn, SCOPE_DATA_TYPE *mx)
+{
+    size_t binLen[HDF5IO_LOD_MAX_LEVELS], nBins[HDF5IO_LOD_MAX_LEVELS];
+    size_t off[HDF5IO_LOD_MAX_LEVELS+1];
+    size_t nLevels = 0, l, p, b, b0, b1, bs, be, len, row;
+    struct HDF5IO(waveform_event) evt;
+    SCOPE_DATA_TYPE *buf;
+    hid_t did, sid, mSid;
+    hsize_t fOff[2], count[2];
+    herr_t ret;
+
+    if (ch >= bitsof(wavFile->chMask) || !(wavFile->chMask & (1U << ch))
+        || tStart >= tEnd || tEnd > wavFile->nPt || width == 0)
+        return -1;
+    len = tEnd - tStart;
+    if (wavFile->lodFactor) nLevels = lod_levels(wavFile, binLen, nBins, off);
+    for (l=nLevels; l>0 && binLen[l-1] > len / width; l--) ;
+    if (l == 0) { /* zoomed in below the finest level */
+        evt.eventId = eventId;
+        evt.wavBuf = buf = (SCOPE_DATA_TYPE*)malloc(len * sizeof(SCOPE_DATA_TYPE));
+        evt.frameTimes = NULL;
+        ret = HDF5IO(read_event_partial)(wavFile, &evt, 1U << ch, tStart, tEnd);
+        if (ret >= 0) wavproc_minmax(mn, mx, buf, len, width);
+        free(buf);
+        return ret < 0 ? -1 : 0;
+    }
+    l--;
+    for (row=0, p=0; p<ch; p++) row += (wavFile->chMask >> p) & 1;
+    b0 = tStart / binLen[l];
+    b1 = (tEnd - 1) / binLen[l] + 1;
+    if ((did = get_lod_dataset(wavFile, eventId / wavFile->nWfmPerChunk, 0)) < 0) return -1;
+    sid = H5Dget_space(did);
+    fOff[0] = row;
+    fOff[1] = (eventId % wavFile->nWfmPerChunk) * off[nLevels] + off[l] + 2 * b0;
+    count[0] = 1;
+    count[1] = 2 * (b1 - b0);
+    H5Sselect_hyperslab(sid, H5S_SELECT_SET, fOff, NULL, count, NULL);
+    mSid = H5Screate_simple(2, count, NULL);
+    buf = (SCOPE_DATA_TYPE*)malloc(count[1] * sizeof(SCOPE_DATA_TYPE));
+    ret = H5Dread(did, SCOPE_DATA_HDF5_TYPE, mSid, sid, H5P_DEFAULT, buf);
+    H5Sclose(mSid);
+    H5Sclose(sid);
+    if (ret >= 0) {
+        /* Pixel p covers samples [tStart + p*len/width, tStart + (p+1)*len/width). */
+        for (p=0; p<width; p++) {
+            bs = (tStart + p * len / width) / binLen[l] - b0;
+            be = (tStart + (p+1) * len / width - 1) / binLen[l] - b0;
+            mn[p] = buf[2*bs];
+            mx[p] = buf[2*bs+1];
+            for (b=bs+1; b<=be; b++) {
+                mn[p] = MIN(mn[p], buf[2*b]);
+                mx[p] = MAX(mx[p], buf[2*b+1]);
+            }
+        }
+    }
+    free(buf);
+    return ret < 0 ? -1 : (int)l + 1;
+}
+
+int HDF5IO(read_event_partial)(struct HDF5IO(waveform_file) *wavFile,
+                               struct HDF5IO(waveform_event) *wavEvent,
+                               uint32_t chMask, size_t tStart, size_t tEnd)
+{
+    herr_t ret;
+    size_t chunkId, inChunkId, ch, row, nRow;
+    hid_t chSid, chDid;
+    hid_t mSid;
+    hsize_t slabOff[2], slabDims[2];
+    H5S_seloper_t op = H5S_SELECT_SET;
+
+    tEnd = MIN(tEnd, wavFile->nPt);
+    if (chMask & ~wavFile->chMask) {
+        error_printf("%s(): channels 0x%x are not in the file (chMask 0x%x)\n", __func__,
+                     chMask & ~wavFile->chMask, wavFile->chMask);
+        return -1;
+    }
+    if (!chMask || tStart >= tEnd) return -1;
+
+    chunkId = wavEvent->eventId / wavFile->nWfmPerChunk;
+    inChunkId = wavEvent->eventId % wavFile->nWfmPerChunk;
+
+    if ((chDid = get_read_dataset(wavFile, chunkId)) < 0) return -1;
+    chSid = H5Dget_space(chDid);
+
+    /* Rows hold the channels set in the file chMask, in order. */
+    slabOff[1] = inChunkId * wavFile->nPt + tStart;
+    slabDims[0] = 1;
+    slabDims[1] = tEnd - tStart;
+    for (ch=0, row=0, nRow=0; ch<bitsof(chMask); ch++) {
+        if (!(wavFile->chMask & (1U << ch))) continue;
+        if (chMask & (1U << ch)) {
+            slabOff[0] = row;
+            H5Sselect_hyperslab(chSid, op, slabOff, NULL, slabDims, NULL);
+            op = H5S_SELECT_OR;
+            nRow++;
+        }
+        row++;
+    }
+    slabDims[0] = nRow;
+    mSid = H5Screate_simple(2, slabDims, NULL);
+
+    ret = H5Dread(chDid, SCOPE_DATA_HDF5_TYPE, mSid, chSid, H5P_DEFAULT,
+                  wavEvent->wavBuf);
+
+    H5Sclose(mSid);
+    H5Sclose(chSid);
+    return (int)ret;
+}
+
+int HDF5IO(read_frames)(struct HDF5IO(waveform_file) *wavFile, size_t eventId,
+                        size_t frameStart, size_t frameEnd, uint32_t chMask,
+                        SCOPE_DATA_TYPE *wavBuf, double *frameTimes)
+{
+    char buf[NAME_BUF_SIZE];
+    herr_t ret;
+    size_t i, frameLen;
+    hid_t tDid, tSid, mSid;
+    hsize_t off[1], count[1];
+    struct HDF5IO(waveform_event) evt = {.eventId = eventId, .wavBuf = wavBuf};
+
+    if (wavFile->nFrames == 0 || frameStart >= frameEnd || frameEnd > wavFile->nFrames)
+        return -1;
+    frameLen = wavFile->nPt / wavFile->nFrames;
+    ret = HDF5IO(read_event_partial)(wavFile, &evt, chMask, frameStart * frameLen,
+                                     frameEnd * frameLen);
+    if (ret < 0 || !frameTimes) return (int)ret;
+
+    snprintf(buf, NAME_BUF_SIZE, "/T%zd", eventId / wavFile->nWfmPerChunk);
+    if (H5Lexists(wavFile->waveFid, buf, H5P_DEFAULT) <= 0) {
+        for (i=0; i<frameEnd-frameStart; i++) frameTimes[i] = NAN;
+        return 0;
+    }
+    tDid = H5Dopen(wavFile->waveFid, buf, H5P_DEFAULT);
+    tSid = H5Dget_space(tDid);
+    off[0] = (eventId % wavFile->nWfmPerChunk) * wavFile->nFrames + frameStart;
+    count[0] = frameEnd - frameStart;
+    H5Sselect_hyperslab(tSid, H5S_SELECT_SET, off, NULL, count, NULL);
+    mSid = H5Screate_simple(1, count, NULL);
+    ret = H5Dread(tDid, H5T_NATIVE_DOUBLE, mSid, tSid, H5P_DEFAULT, frameTimes);
+    H5Sclose(mSid);
+    H5Sclose(tSid);
+    H5Dclose(tDid);
+    return (int)ret;
+}
+
+const SCOPE_DATA_TYPE *HDF5IO(map_event)(struct HDF5IO(waveform_file) *wavFile,
+                                         size_t eventId, size_t *stride)
+{
+    char fname[NAME_BUF_SIZE];
+    size_t chunkId, inChunkId, len;
+    hid_t chDid, chPid;
+    haddr_t off;
+    H5D_layout_t layout;
+    struct stat sb;
+
+    chunkId = eventId / wavFile->nWfmPerChunk;
+    inChunkId = eventId % wavFile->nWfmPerChunk;
+
+    if ((chDid = get_read_dataset(wavFile, chunkId)) < 0) return NULL;
+    chPid = H5Dget_create_plist(chDid);
+    layout = H5Pget_layout(chPid);
+    H5Pclose(chPid);
+    if (layout != H5D_CONTIGUOUS || (off = H5Dget_offset(chDid)) == HADDR_UNDEF) {
+        error_printf("%s(): /C%zd is not contiguous and allocated\n", __func__, chunkId);
+        return NULL;
+    }
+    len = wavFile->nCh * wavFile->nWfmPerChunk * wavFile->nPt * sizeof(SCOPE_DATA_TYPE);
+    /* (Re)map the whole file when the dataset lies beyond the current
+     * mapping, e.g. because it is still being written. */
+    if (off + len > wavFile->mapLen) {
+        if (wavFile->mapFd < 0) {
+            H5Fget_name(wavFile->waveFid, fname, NAME_BUF_SIZE);
+            if ((wavFile->mapFd = open(fname, O_RDONLY)) < 0) {
+                error_printf("%s(): cannot open \"%s\"\n", __func__, fname);
+                return NULL;
+            }
+        }
+        if (wavFile->mapBase) munmap(wavFile->mapBase, wavFile->mapLen);
+        wavFile->mapBase = NULL;
+        wavFile->mapLen = 0;
+        fstat(wavFile->mapFd, &sb);
+        if (off + len > (size_t)sb.st_size) return NULL;
+        wavFile->mapBase = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, wavFile->mapFd, 0);
+        if (wavFile->mapBase == MAP_FAILED) {
+            wavFile->mapBase = NULL;
+            perror("mmap");
+            return NULL;
+        }
+        wavFile->mapLen = sb.st_size;
+    }
+    *stride = wavFile->nWfmPerChunk * wavFile->nPt;
+    return (const SCOPE_DATA_TYPE*)((const char*)wavFile->mapBase + off) + inChunkId * wavFile->nPt;
+}
+
+int HDF5IO(read_events)(struct HDF5IO(waveform_file) *wavFile,
+                        size_t eventId, size_t n, SCOPE_DATA_TYPE *buf)
+{
+    herr_t ret = 0;
+    size_t done, m, chunkId, inChunkId;
+    hid_t chSid, chDid;
+    hid_t mSid;
+    hsize_t slabOff[2], mOff[2], slabDims[2], mDims[2];
+
+    mDims[0] = wavFile->nCh;
+    mDims[1] = n * wavFile->nPt;
+    mSid = H5Screate_simple(2, mDims, NULL);
+    /* One H5Dread per dataset touched; the memory layout [nCh][n*nPt]
+     * is the file layout, so each read is a single hyperslab. */
+    for (done=0; done<n; done+=m) {
+        chunkId = (eventId + done) / wavFile->nWfmPerChunk;
+        inChunkId = (eventId + done) % wavFile->nWfmPerChunk;
+        m = MIN(n - done, wavFile->nWfmPerChunk - inChunkId);
+
+        if ((chDid = get_read_dataset(wavFile, chunkId)) < 0) {
+            ret = -1;
+            break;
+        }
+        chSid = H5Dget_space(chDid);
+        slabOff[0] = 0;
+        slabOff[1] = inChunkId * wavFile->nPt;
+        slabDims[0] = wavFile->nCh;
+        slabDims[1] = m * wavFile->nPt;
+        H5Sselect_hyperslab(chSid, H5S_SELECT_SET, slabOff, NULL, slabDims, NULL);
+        mOff[0] = 0;
+        mOff[1] = done * wavFile->nPt;
+        H5Sselect_hyperslab(mSid, H5S_SELECT_SET, mOff, NULL, slabDims, NULL);
+
+        ret = H5Dread(chDid, SCOPE_DATA_HDF5_TYPE, mSid, chSid, H5P_DEFAULT, buf);
+        H5Sclose(chSid);
+        if (ret < 0) break;
+    }
+    H5Sclose(mSid);
     return (int)ret;
 }
 
@@ -313,6 +1396,408 @@ size_t HDF5IO(get_number_of_events)(struct HDF5IO(waveform_file) *wavFile)
     return wavFile->nEvents;
 }
 
+/** Map dataset srcName of srcFname, as a whole, to a new virtual
+ * dataset name of the same shape in wavFile. */
+static int link_dataset(struct HDF5IO(waveform_file) *wavFile, hid_t srcDid,
+                        const char *srcFname, const char *srcName, const char *name)
+{
+    hid_t sid, tid, pid, did;
+
+    sid = H5Dget_space(srcDid);
+    tid = H5Dget_type(srcDid);
+    pid = H5Pcreate(H5P_DATASET_CREATE);
+    H5Sselect_all(sid);
+    H5Pset_virtual(pid, sid, srcFname, srcName, sid);
+    did = H5Dcreate(wavFile->waveFid, name, tid, sid, H5P_DEFAULT, pid, H5P_DEFAULT);
+    H5Pclose(pid);
+    H5Tclose(tid);
+    H5Sclose(sid);
+    if (did < 0) return -1;
+    H5Dclose(did);
+    return 0;
+}
+
+int HDF5IO(link_file)(struct HDF5IO(waveform_file) *wavFile, const char *fname,
+                      const char *srcFname, size_t eventId)
+{
+    struct HDF5IO(waveform_file) *src;
+    struct waveform_attribute wavAttr;
+    char srcName[NAME_BUF_SIZE], name[NAME_BUF_SIZE];
+    size_t c, k, nChunks, chunkOff;
+    hid_t did;
+    int ret = 0;
+
+    if (eventId % wavFile->nWfmPerChunk) {
+        error_printf("%s(): eventId %zd is not at a dataset boundary\n", __func__, eventId);
+        return -1;
+    }
+    if ((src = HDF5IO(open_file_for_read)(fname)) == NULL) return -1;
+    HDF5IO(read_waveform_attribute_in_file_header)(src, &wavAttr);
+    if (src->nWfmPerChunk != wavFile->nWfmPerChunk || src->nCh != wavFile->nCh || src->swmr) {
+        error_printf("%s(): %s does not match the layout of this file\n", __func__, fname);
+        HDF5IO(close_file)(src);
+        return -1;
+    }
+    chunkOff = eventId / wavFile->nWfmPerChunk;
+    nChunks = (src->nEvents + src->nWfmPerChunk - 1) / src->nWfmPerChunk;
+    for (c=0; c<nChunks && ret==0; c++) {
+        snprintf(srcName, NAME_BUF_SIZE, "/C%zd", c);
+        snprintf(name, NAME_BUF_SIZE, "/C%zd", chunkOff + c);
+        if ((did = H5Dopen(src->waveFid, srcName, H5P_DEFAULT)) < 0) {
+            ret = -1;
+            break;
+        }
+        ret = link_dataset(wavFile, did, srcFname, srcName, name);
+        H5Dclose(did);
+        for (k=0; k<2; k++) { /* time stamps and pyramids, if any */
+            srcName[1] = name[1] = "TL"[k];
+            if (ret == 0 && H5Lexists(src->waveFid, srcName, H5P_DEFAULT) > 0) {
+                did = H5Dopen(src->waveFid, srcName, H5P_DEFAULT);
+                ret = link_dataset(wavFile, did, srcFname, srcName, name);
+                H5Dclose(did);
+            }
+        }
+    }
+    if (ret == 0) wavFile->nEvents = MAX(wavFile->nEvents, eventId + src->nEvents);
+    HDF5IO(close_file)(src);
+    return ret;
+}
+
+size_t HDF5IO(refresh_file)(struct HDF5IO(waveform_file) *wavFile)
+{
+    hid_t chDid, chSid;
+    hsize_t dims[2];
+
+    if (!wavFile->swmr || wavFile->swmrStarted) return wavFile->nEvents;
+    H5E_BEGIN_TRY { /* /C0 appears with the first event */
+        chDid = get_read_dataset(wavFile, 0);
+    } H5E_END_TRY;
+    if (chDid < 0) {
+        wavFile->rdDid = -1;
+        return wavFile->nEvents;
+    }
+    H5Drefresh(chDid);
+    chSid = H5Dget_space(chDid);
+    H5Sget_simple_extent_dims(chSid, dims, NULL);
+    H5Sclose(chSid);
+    wavFile->nEvents = dims[1] / wavFile->nPt;
+    return wavFile->nEvents;
+}
+
+/* Prefetching iterator.  A background thread reads batches with
+ * read_events() into a ring of nBuf aligned buffers while the caller
+ * works on the previous one.  Only the prefetch thread calls HDF5. */
+struct HDF5IO(event_iterator)
+{
+    struct HDF5IO(waveform_file) *wavFile;
+    size_t next, end;          /* next event to prefetch, one past the last */
+    size_t batchSize;
+    size_t nBuf;
+    struct HDF5IO(event_batch) *batches;
+    size_t iRd, iWr;           /* ring positions, monotonic */
+    int held;                  /* caller holds batches[(iRd-1) % nBuf] */
+    int eof, stopQ, started;
+    pthread_t tid;
+    pthread_mutex_t mtx;
+    pthread_cond_t filled;     /* a batch became ready, or eof */
+    pthread_cond_t freed;      /* a buffer was returned, or stop */
+};
+
+static void *iterator_prefetch(void *arg)
+{
+    struct HDF5IO(event_iterator) *it = (struct HDF5IO(event_iterator)*)arg;
+    struct HDF5IO(event_batch) *b;
+    size_t n;
+
+    for (;;) {
+        pthread_mutex_lock(&it->mtx);
+        while (!it->stopQ && it->iWr - it->iRd + it->held >= it->nBuf)
+            pthread_cond_wait(&it->freed, &it->mtx);
+        if (it->stopQ || it->next >= it->end) {
+            it->eof = 1;
+            pthread_cond_signal(&it->filled);
+            pthread_mutex_unlock(&it->mtx);
+            break;
+        }
+        b = &it->batches[it->iWr % it->nBuf];
+        pthread_mutex_unlock(&it->mtx);
+
+        n = MIN(it->batchSize, it->end - it->next);
+        b->eventId = it->next;
+        b->n = n;
+        b->stride = n * it->wavFile->nPt;
+        if (HDF5IO(read_events)(it->wavFile, it->next, n, b->buf) < 0) {
+            error_printf("%s(): read of events %zd..%zd failed\n", __func__,
+                         it->next, it->next + n - 1);
+            it->end = it->next; /* stop at what was read so far */
+            continue;
+        }
+        it->next += n;
+
+        pthread_mutex_lock(&it->mtx);
+        it->iWr++;
+        pthread_cond_signal(&it->filled);
+        pthread_mutex_unlock(&it->mtx);
+    }
+    return NULL;
+}
+
+struct HDF5IO(event_iterator) *HDF5IO(iterator_open)(
+    struct HDF5IO(waveform_file) *wavFile, size_t eventId, size_t n,
+    size_t batchSize, size_t nBuf)
+{
+    struct HDF5IO(event_iterator) *it;
+    size_t i, bufSz;
+    void *p;
+
+    it = (struct HDF5IO(event_iterator)*)calloc(1, sizeof(struct HDF5IO(event_iterator)));
+    it->wavFile   = wavFile;
+    it->next      = eventId;
+    it->end       = n ? eventId + n : wavFile->nEvents;
+    it->batchSize = batchSize ? batchSize : wavFile->nWfmPerChunk;
+    it->nBuf      = MAX(2, nBuf);
+    it->batches   = (struct HDF5IO(event_batch)*)calloc(it->nBuf, sizeof(struct HDF5IO(event_batch)));
+    pthread_mutex_init(&it->mtx, NULL);
+    pthread_cond_init(&it->filled, NULL);
+    pthread_cond_init(&it->freed, NULL);
+    bufSz = wavFile->nCh * it->batchSize * wavFile->nPt * sizeof(SCOPE_DATA_TYPE);
+    for (i=0; i<it->nBuf; i++) {
+        if (posix_memalign(&p, HDF5IO_BUF_ALIGN, bufSz) != 0) {
+            error_printf("%s(): buffer allocation failure.\n", __func__);
+            it->nBuf = i;
+            HDF5IO(iterator_close)(it);
+            return NULL;
+        }
+        it->batches[i].buf = (SCOPE_DATA_TYPE*)p;
+    }
+    if (pthread_create(&it->tid, NULL, iterator_prefetch, it) != 0) {
+        error_printf("%s(): cannot start prefetch thread.\n", __func__);
+        HDF5IO(iterator_close)(it);
+        return NULL;
+    }
+    it->started = 1;
+    return it;
+}
+
+const struct HDF5IO(event_batch) *HDF5IO(iterator_next)(struct HDF5IO(event_iterator) *it)
+{
+    const struct HDF5IO(event_batch) *b = NULL;
+
+    pthread_mutex_lock(&it->mtx);
+    if (it->held) { /* give the previous batch back */
+        it->held = 0;
+        pthread_cond_signal(&it->freed);
+    }
+    while (it->iRd == it->iWr && !it->eof)
+        pthread_cond_wait(&it->filled, &it->mtx);
+    if (it->iRd < it->iWr) {
+        b = &it->batches[it->iRd % it->nBuf];
+        it->iRd++;
+        it->held = 1;
+    }
+    pthread_mutex_unlock(&it->mtx);
+    return b;
+}
+
+void HDF5IO(iterator_close)(struct HDF5IO(event_iterator) *it)
+{
+    size_t i;
+    if (!it) return;
+    if (it->started) {
+        pthread_mutex_lock(&it->mtx);
+        it->stopQ = 1;
+        pthread_cond_signal(&it->freed);
+        pthread_mutex_unlock(&it->mtx);
+        pthread_join(it->tid, NULL);
+    }
+    pthread_cond_destroy(&it->freed);
+    pthread_cond_destroy(&it->filled);
+    pthread_mutex_destroy(&it->mtx);
+    for (i=0; i<it->nBuf; i++) free(it->batches[i].buf);
+    free(it->batches);
+    free(it);
+}
+
+/* Asynchronous writer.  Event buffers come from a ring of nBuf slots
+ * carved out of one aligned slab, so events handed out back to back
+ * are adjacent in memory.  The writer thread takes every queued run of
+ * consecutive events (up to maxBatch, same dataset, no wrap) and writes
+ * it at once.  Only the writer thread calls HDF5 while it runs. */
+struct HDF5IO(async_writer)
+{
+    struct HDF5IO(waveform_file) *wavFile;
+    size_t nBuf, maxBatch;
+    SCOPE_DATA_TYPE *slab;
+    double *frameTimes;
+    struct HDF5IO(waveform_event) *evts;
+    size_t iGet, iSub, iDone;  /* handed out, submitted, written; monotonic */
+    int err, stopQ, started;
+    pthread_t tid;
+    pthread_mutex_t mtx;
+    pthread_cond_t submitted;  /* an event was queued, or stop */
+    pthread_cond_t written;    /* a run was written */
+};
+
+static void *async_write(void *arg)
+{
+    struct HDF5IO(async_writer) *aw = (struct HDF5IO(async_writer)*)arg;
+    struct HDF5IO(waveform_file) *wavFile = aw->wavFile;
+    struct HDF5IO(waveform_event) *e;
+    size_t i, n;
+    int ret;
+
+    for (;;) {
+        pthread_mutex_lock(&aw->mtx);
+        while (aw->iSub == aw->iDone && !aw->stopQ)
+            pthread_cond_wait(&aw->submitted, &aw->mtx);
+        if (aw->iSub == aw->iDone) { /* stopped and drained */
+            pthread_mutex_unlock(&aw->mtx);
+            break;
+        }
+        i = aw->iDone % aw->nBuf;
+        e = &aw->evts[i];
+        for (n=1; n < aw->iSub - aw->iDone && n < aw->maxBatch && i+n < aw->nBuf; n++) {
+            if (e[n].eventId != e[n-1].eventId + 1
+                || e[n].eventId / wavFile->nWfmPerChunk != e[0].eventId / wavFile->nWfmPerChunk)
+                break;
+        }
+        pthread_mutex_unlock(&aw->mtx);
+
+        if (aw->err) ret = -1; /* keep draining so producers never block */
+        else if (wavFile->chunkWriter) ret = HDF5IO(write_events)(wavFile, e, n);
+        else ret = write_run_pipeline(wavFile, e, n);
+        if (ret < 0 && !aw->err) {
+            error_printf("%s(): write of events %zd..%zd failed\n", __func__,
+                         e[0].eventId, e[n-1].eventId);
+        }
+
+        pthread_mutex_lock(&aw->mtx);
+        if (ret < 0) aw->err = 1;
+        aw->iDone += n;
+        pthread_cond_broadcast(&aw->written);
+        pthread_mutex_unlock(&aw->mtx);
+    }
+    return NULL;
+}
+
+struct HDF5IO(async_writer) *HDF5IO(async_open)(struct HDF5IO(waveform_file) *wavFile,
+                                                size_t nBuf, size_t maxBatch)
+{
+    struct HDF5IO(async_writer) *aw;
+    const size_t evtLen = wavFile->nCh * wavFile->nPt;
+    size_t i;
+    void *p;
+
+    aw = (struct HDF5IO(async_writer)*)calloc(1, sizeof(struct HDF5IO(async_writer)));
+    aw->wavFile  = wavFile;
+    aw->nBuf     = MAX(2, nBuf);
+    aw->maxBatch = maxBatch ? maxBatch : wavFile->nWfmPerChunk;
+    aw->evts     = (struct HDF5IO(waveform_event)*)calloc(aw->nBuf, sizeof(struct HDF5IO(waveform_event)));
+    pthread_mutex_init(&aw->mtx, NULL);
+    pthread_cond_init(&aw->submitted, NULL);
+    pthread_cond_init(&aw->written, NULL);
+    if (posix_memalign(&p, HDF5IO_BUF_ALIGN, aw->nBuf * evtLen * sizeof(SCOPE_DATA_TYPE)) != 0) {
+        error_printf("%s(): buffer allocation failure.\n", __func__);
+        HDF5IO(async_close)(aw);
+        return NULL;
+    }
+    aw->slab = (SCOPE_DATA_TYPE*)p;
+    if (wavFile->nFrames)
+        aw->frameTimes = (double*)calloc(aw->nBuf * wavFile->nFrames, sizeof(double));
+    for (i=0; i<aw->nBuf; i++) {
+        aw->evts[i].wavBuf = aw->slab + i * evtLen;
+        aw->evts[i].frameTimes = aw->frameTimes ? aw->frameTimes + i * wavFile->nFrames : NULL;
+    }
+    if (pthread_create(&aw->tid, NULL, async_write, aw) != 0) {
+        error_printf("%s(): cannot start writer thread.\n", __func__);
+        HDF5IO(async_close)(aw);
+        return NULL;
+    }
+    aw->started = 1;
+    return aw;
+}
+
+struct HDF5IO(waveform_event) *HDF5IO(async_get_event)(struct HDF5IO(async_writer) *aw,
+                                                       int waitQ)
+{
+    struct HDF5IO(waveform_event) *e = NULL;
+
+    pthread_mutex_lock(&aw->mtx);
+    while (waitQ && aw->iGet - aw->iDone >= aw->nBuf)
+        pthread_cond_wait(&aw->written, &aw->mtx);
+    if (aw->iGet - aw->iDone < aw->nBuf) {
+        e = &aw->evts[aw->iGet % aw->nBuf];
+        aw->iGet++;
+    }
+    pthread_mutex_unlock(&aw->mtx);
+    return e;
+}
+
+int HDF5IO(async_submit)(struct HDF5IO(async_writer) *aw, struct HDF5IO(waveform_event) *wavEvent)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&aw->mtx);
+    if (aw->iSub == aw->iGet || wavEvent != &aw->evts[aw->iSub % aw->nBuf]) {
+        error_printf("%s(): events must be submitted in the order they were obtained\n",
+                     __func__);
+        ret = -1;
+    } else {
+        aw->iSub++;
+        pthread_cond_signal(&aw->submitted);
+        if (aw->err) ret = -1;
+    }
+    pthread_mutex_unlock(&aw->mtx);
+    return ret;
+}
+
+int HDF5IO(async_flush)(struct HDF5IO(async_writer) *aw)
+{
+    int ret;
+
+    pthread_mutex_lock(&aw->mtx);
+    while (aw->iDone < aw->iSub)
+        pthread_cond_wait(&aw->written, &aw->mtx);
+    /* The writer thread is idle until the next submit, which cannot
+     * come before we unlock. */
+    ret = aw->err ? -1 : HDF5IO(flush_file)(aw->wavFile);
+    pthread_mutex_unlock(&aw->mtx);
+    return ret;
+}
+
+size_t HDF5IO(async_written)(struct HDF5IO(async_writer) *aw)
+{
+    size_t n;
+
+    pthread_mutex_lock(&aw->mtx);
+    n = aw->iDone;
+    pthread_mutex_unlock(&aw->mtx);
+    return n;
+}
+
+int HDF5IO(async_close)(struct HDF5IO(async_writer) *aw)
+{
+    int ret;
+
+    if (!aw) return 0;
+    if (aw->started) {
+        pthread_mutex_lock(&aw->mtx);
+        aw->stopQ = 1;
+        pthread_cond_signal(&aw->submitted);
+        pthread_mutex_unlock(&aw->mtx);
+        pthread_join(aw->tid, NULL);
+    }
+    ret = aw->err ? -1 : 0;
+    pthread_cond_destroy(&aw->written);
+    pthread_cond_destroy(&aw->submitted);
+    pthread_mutex_destroy(&aw->mtx);
+    free(aw->slab);
+    free(aw->frameTimes);
+    free(aw->evts);
+    free(aw);
+    return ret;
+}
+
 #ifdef HDF5IO_DEBUG_ENABLEMAIN
 int main(int argc, char **argv)
 {
@@ -323,6 +1808,9 @@ int main(int argc, char **argv)
                                   16,17,18,19,20};
 
     struct HDF5IO(waveform_file) *wavFile;
+    struct HDF5IO(event_iterator) *it;
+    const struct HDF5IO(event_batch) *batch;
+    SCOPE_DATA_TYPE *evtsBuf;
     struct waveform_attribute wavAttr = {
         .chMask = 0x0a,
         .nPt = 10000,
@@ -338,7 +1826,8 @@ int main(int argc, char **argv)
         .wavBuf = (SCOPE_DATA_TYPE*)array
     };
 
-    wavFile = HDF5IO(open_file)("test.h5", 4, 2);
+    wavFile = HDF5IO(open_file)("test.h5", 4, 2, NULL);
+    HDF5IO(set_chunk_length)(wavFile, 2500);
     printf("wavFile->nWfmPerChunk = %zd\n", wavFile->nWfmPerChunk);
     printf("wavFile->nCh = %zd\n", wavFile->nCh);
     printf("wavFile->nPt = %zd\n", wavFile->nPt);
@@ -367,6 +1856,8 @@ int main(int argc, char **argv)
     printf("wavFile->nPt = %zd\n", wavFile->nPt);
     printf("number of events: %zd\n", HDF5IO(get_number_of_events)(wavFile));
     printf("%zd, %g, %g\n", wavAttr.nPt, wavAttr.dt, wavAttr.t0);
+    printf("compression: filter %d, level %d, shuffle %d\n",
+           wavFile->comp.filter, wavFile->comp.level, wavFile->comp.shuffle);
 
     for (i=0; i < wavFile->nCh * wavFile->nPt; i++) {
         evt.wavBuf[i] = 0;
@@ -378,6 +1869,26 @@ int main(int argc, char **argv)
     }
     printf("\n");
 
+    /* samples 3..5 of channel 1 (first row) of event 1 */
+    HDF5IO(read_event_partial)(wavFile, &evt, 0x02, 3, 6);
+    printf("read_event_partial: %d %d %d\n", evt.wavBuf[0], evt.wavBuf[1], evt.wavBuf[2]);
+
+    /* events 8 and 9 in one go, channel-major */
+    evtsBuf = (SCOPE_DATA_TYPE*)malloc(2 * wavFile->nCh * wavFile->nPt);
+    HDF5IO(read_events)(wavFile, 8, 2, evtsBuf);
+    printf("read_events: %d %d %d\n", evtsBuf[0], evtsBuf[wavFile->nPt], evtsBuf[2*wavFile->nPt]);
+    free(evtsBuf);
+
+    wavFile->nEvents = 10; /* events 2, 3, 5, 6 and 7 read as fill values */
+    it = HDF5IO(iterator_open)(wavFile, 0, 0, 3, 2);
+    while ((batch = HDF5IO(iterator_next)(it))) {
+        for (i=0; i < batch->n; i++) {
+            printf("event %zd: %d\n", batch->eventId + i,
+                   *HDF5IO_BATCH_WAVEFORM(batch, wavFile, i, 0));
+        }
+    }
+    HDF5IO(iterator_close)(it);
+
     HDF5IO(close_file)(wavFile);
 
     return EXIT_SUCCESS;
@@ -1,10 +1,49 @@
 #ifndef __HDF5IO_H__
 #define __HDF5IO_H__
 
+#include <stdint.h>
 #include <hdf5.h>
 
 #define NAME_BUF_SIZE 256
 
+/* Registered ids of the HDF5 filter plugins we know how to configure.
+ * The plugins are loaded by HDF5 from HDF5_PLUGIN_PATH. */
+#ifndef H5Z_FILTER_BLOSC
+#define H5Z_FILTER_BLOSC 32001
+#endif
+#ifndef H5Z_FILTER_LZ4
+#define H5Z_FILTER_LZ4 32004
+#endif
+#ifndef H5Z_FILTER_ZSTD
+#define H5Z_FILTER_ZSTD 32015
+#endif
+
+enum HDF5IO(filter)
+{
+    HDF5IO(FILTER_NONE) = 0,
+    HDF5IO(FILTER_DEFLATE),
+    HDF5IO(FILTER_LZ4),
+    HDF5IO(FILTER_ZSTD),
+    HDF5IO(FILTER_BLOSC)
+};
+
+/* Compression applied to the waveform datasets.  It is written to
+ * the file as the string attribute "compression", e.g. "deflate:6"
+ * or "shuffle,zstd:3", so that readers know which filter was used.
+ * "contiguous" stores uncompressed, unchunked datasets that can be
+ * read without copying through map_event(). */
+struct HDF5IO(compression)
+{
+    enum HDF5IO(filter) filter;
+    int level;      /* filter specific, ignored by lz4 */
+    int shuffle;    /* byte shuffle before compression */
+    int contiguous; /* contiguous layout, filter must be none */
+};
+/* What files were written with before compression became selectable. */
+#define HDF5IO_COMPRESSION_DEFAULT "deflate:6"
+
+struct HDF5IO(chunk_writer);
+
 struct HDF5IO(waveform_file)
 {
     hid_t waveFid;
@@ -12,8 +51,42 @@ struct HDF5IO(waveform_file)
     size_t nCh;
     size_t nWfmPerChunk;
     size_t nEvents;
+    struct HDF5IO(compression) comp;
+    size_t chunkLen;  /* samples per HDF5 chunk along time, 0: nPt */
+    uint32_t chMask;  /* channels stored as rows, from waveform_attribute */
+    size_t nFrames;   /* FastFrame frames per event, 0: off */
+    hid_t wrDid;      /* dataset of wrChunkId, kept open between writes */
+    size_t wrChunkId;
+    hid_t rdDid;      /* dataset of rdChunkId, kept open between reads */
+    size_t rdChunkId;
+    struct HDF5IO(chunk_writer) *chunkWriter; /* NULL: filter pipeline */
+    int swmr;         /* single extendible dataset, SWMR writer or reader */
+    int swmrStarted;  /* writer: H5Fstart_swmr_write() done */
+    int mapFd;        /* read-only mapping for map_event() */
+    void *mapBase;
+    size_t mapLen;
+    size_t lodFactor; /* min/max pyramid /L<chunkId>, 0: none */
+    size_t lodMinBins;
+    hid_t lodWrDid;   /* like wrDid and rdDid, for /L<chunkId> */
+    size_t lodWrChunkId;
+    hid_t lodRdDid;
+    size_t lodRdChunkId;
+    SCOPE_DATA_TYPE *lodBuf;
 };
 
+/* nWfmPerChunk of SWMR files: all events live in one extendible /C0. */
+#define HDF5IO_NWFM_UNLIMITED ((size_t)1 << 32)
+/* Target size of a FastFrame chunk, which holds whole frames. */
+#define HDF5IO_FRAME_CHUNK_BYTES 65536
+/* Min/max pyramid: level l holds pairs over bins of lodFactor^(l+1)
+ * samples; levels are added until one has at most HDF5IO_LOD_MIN_BINS
+ * bins. */
+#define HDF5IO_LOD_FACTOR 16
+#define HDF5IO_LOD_MIN_BINS 512
+#define HDF5IO_LOD_MAX_LEVELS 16
+/* Buffers handed out by the event iterator are aligned to this. */
+#define HDF5IO_BUF_ALIGN 4096
+
 struct HDF5IO(waveform_event)
 {
     size_t eventId;
@@ -21,19 +94,60 @@ struct HDF5IO(waveform_event)
      * ch1..ch2..ch3..ch4 (row-major).  Omitting one or more ch? is
      * allowed in accordance with chMask.*/
     SCOPE_DATA_TYPE *wavBuf;
+    /* FastFrame: nFrames time stamps, one per frame (or one per event
+     * when nFrames is 0), stored in /T<chunk>.  NULL writes none. */
+    double *frameTimes;
 };
 
+/* Parse a compression spec of the form "[shuffle,]filter[:level]",
+ * where filter is one of none, deflate, lz4, zstd or blosc, or the
+ * spec "contiguous".  Levels are 0-9 for deflate and blosc, 1-22 for
+ * zstd; lz4 takes none.
+ * Returns 0 on success, -1 if spec is malformed. */
+int HDF5IO(parse_compression)(const char *spec,
+                              struct HDF5IO(compression) *comp);
+/* Inverse of parse_compression().  Returns the snprintf() count. */
+int HDF5IO(format_compression)(const struct HDF5IO(compression) *comp,
+                               char *buf, size_t n);
+/* 1 if HDF5 can write with comp (plugin found), 0 otherwise. */
+int HDF5IO(compression_available)(const struct HDF5IO(compression) *comp);
+
 /* nWfmPerChunk: waveforms are stored in 2D arrays.  To optimize
  * performance, n waveforms are grouped together to be put in the same
  * array, then the (n+1)th waveform is put into the next grouped
- * array, and so forth. */
+ * array, and so forth.
+ * comp: NULL selects HDF5IO_COMPRESSION_DEFAULT.  Returns NULL if the
+ * file cannot be created or the filter is not available. */
 struct HDF5IO(waveform_file) *HDF5IO(open_file)(
     const char *fname, size_t nWfmPerChunk,
-    size_t nCh);
+    size_t nCh, const struct HDF5IO(compression) *comp);
+/* Single-writer/multiple-reader file: events are appended to one
+ * extendible dataset, /C0 (and /T0 for time stamps).  SWMR writing
+ * starts with the first write_event(), so the waveform attributes
+ * must be written before it; attributes are frozen from then on. */
+struct HDF5IO(waveform_file) *HDF5IO(open_file_swmr)(const char *fname, size_t nCh,
+                                                     const struct HDF5IO(compression) *comp);
+/* Opens SWMR files in SWMR read mode, other files normally. */
 struct HDF5IO(waveform_file) *HDF5IO(open_file_for_read)(const char *fname);
 int HDF5IO(close_file)(struct HDF5IO(waveform_file) *wavFile);
-/* flush also writes nEvents to the file */
+/* flush also writes nEvents to the file.  For a SWMR writer it only
+ * flushes the datasets, which publishes new events to readers. */
 int HDF5IO(flush_file)(struct HDF5IO(waveform_file) *wavFile);
+/* Store count as the root attribute name, e.g. the bytes a trigger
+ * stage dropped; an existing one is overwritten.  Not for SWMR files
+ * once writing has started. */
+int HDF5IO(write_count)(struct HDF5IO(waveform_file) *wavFile, const char *name, size_t count);
+/* Make the events of the finished file fname appear in wavFile from
+ * eventId on, through virtual datasets.  eventId must be a multiple of
+ * nWfmPerChunk and both files must share nCh and nWfmPerChunk.
+ * srcFname is the name stored in wavFile; a relative name is looked up
+ * next to wavFile when it is read.  flush_file() records the new
+ * nEvents. */
+int HDF5IO(link_file)(struct HDF5IO(waveform_file) *wavFile, const char *fname,
+                      const char *srcFname, size_t eventId);
+/* SWMR reader: pick up events published since the last call.
+ * Returns the updated number of events. */
+size_t HDF5IO(refresh_file)(struct HDF5IO(waveform_file) *wavFile);
 
 int HDF5IO(write_waveform_attribute_in_file_header)(
     struct HDF5IO(waveform_file) *wavFile,
@@ -43,8 +157,115 @@ int HDF5IO(read_waveform_attribute_in_file_header)(
     struct waveform_attribute *wavAttr);
 int HDF5IO(write_event)(struct HDF5IO(waveform_file) *wavFile,
                         struct HDF5IO(waveform_event) *wavEvent);
+/* Store waveforms in HDF5 chunks of 1 x chunkLen samples instead of
+ * 1 x nPt, so that read_event_partial() only decompresses the chunks
+ * it touches.  Must be called before the first write; chunkLen should
+ * divide nPt for set_write_threads() to apply.  0 restores 1 x nPt. */
+int HDF5IO(set_chunk_length)(struct HDF5IO(waveform_file) *wavFile, size_t chunkLen);
+/* Compress chunks on nThreads threads and commit them with
+ * H5Dwrite_chunk instead of running the filter pipeline inside
+ * H5Dwrite.  All HDF5 calls stay on the calling thread.  Only deflate
+ * (with or without shuffle) is supported, -1 is returned and the
+ * filter pipeline kept otherwise.  nThreads = 0 goes back to the
+ * filter pipeline. */
+int HDF5IO(set_write_threads)(struct HDF5IO(waveform_file) *wavFile, size_t nThreads);
+/* Also store a min/max pyramid of every event and channel, so that
+ * read_envelope() does not have to read whole records.  factor 0
+ * selects HDF5IO_LOD_FACTOR.  Call before the first write; not
+ * available for SWMR files. */
+int HDF5IO(set_lod)(struct HDF5IO(waveform_file) *wavFile, size_t factor);
+/* Write n events.  With write threads set, the nCh chunks of all n
+ * events are compressed in parallel, so larger batches scale better. */
+int HDF5IO(write_events)(struct HDF5IO(waveform_file) *wavFile,
+                         struct HDF5IO(waveform_event) *wavEvents, size_t n);
 int HDF5IO(read_event)(struct HDF5IO(waveform_file) *wavFile,
                        struct HDF5IO(waveform_event) *wavEvent);
+/* Min/max envelope of samples [tStart, tEnd) of scope channel ch,
+ * reduced to width pixels, into mn and mx.  Uses the coarsest pyramid
+ * level whose bins are not wider than a pixel, or the samples when
+ * there is none.  Returns the level used, counted from 1, 0 for the
+ * samples, or -1 on error. */
+int HDF5IO(read_envelope)(struct HDF5IO(waveform_file) *wavFile, size_t eventId, unsigned ch,
+                          size_t tStart, size_t tEnd, size_t width,
+                          SCOPE_DATA_TYPE *mn, SCOPE_DATA_TYPE *mx);
+/* Read samples [tStart, tEnd) of the channels in chMask (scope
+ * channel bits, a subset of waveform_attribute.chMask) into wavBuf,
+ * as popcount(chMask) rows of tEnd - tStart samples in channel order. */
+int HDF5IO(read_event_partial)(struct HDF5IO(waveform_file) *wavFile,
+                               struct HDF5IO(waveform_event) *wavEvent,
+                               uint32_t chMask, size_t tStart, size_t tEnd);
+/* FastFrame (waveform_attribute.nFrames > 0): the nPt samples of an
+ * event are nFrames frames of nPt / nFrames samples laid end to end,
+ * and chunks are frame aligned.  Read frames [frameStart, frameEnd)
+ * of the channels in chMask into wavBuf, laid out as in
+ * read_event_partial(), and their time stamps into frameTimes (NAN if
+ * none were written) unless it is NULL. */
+int HDF5IO(read_frames)(struct HDF5IO(waveform_file) *wavFile, size_t eventId,
+                        size_t frameStart, size_t frameEnd, uint32_t chMask,
+                        SCOPE_DATA_TYPE *wavBuf, double *frameTimes);
+/* Zero-copy read of an event in a "contiguous" file: returns a
+ * read-only pointer into an mmap of the file, where channel row r
+ * starts at ptr + r * *stride.  The pointer stays valid until
+ * close_file() or until a map_event() on a grown file remaps it.
+ * Returns NULL for chunked datasets. */
+const SCOPE_DATA_TYPE *HDF5IO(map_event)(struct HDF5IO(waveform_file) *wavFile,
+                                         size_t eventId, size_t *stride);
+/* Read n consecutive events starting at eventId with one H5Dread per
+ * dataset touched.  buf (nCh * n * nPt samples) receives the file
+ * layout, i.e. channel-major: see HDF5IO_BATCH_WAVEFORM(). */
+int HDF5IO(read_events)(struct HDF5IO(waveform_file) *wavFile,
+                        size_t eventId, size_t n, SCOPE_DATA_TYPE *buf);
 size_t HDF5IO(get_number_of_events)(struct HDF5IO(waveform_file) *wavFile);
 
+/* A range of consecutive events as read by read_events(). */
+struct HDF5IO(event_batch)
+{
+    size_t eventId;  /* first event in buf */
+    size_t n;        /* number of events in buf */
+    size_t stride;   /* samples between channels, n * nPt */
+    SCOPE_DATA_TYPE *buf;
+};
+/* Samples of channel row ch of the kth event in a batch. */
+#define HDF5IO_BATCH_WAVEFORM(batch, wavFile, k, ch) \
+    ((batch)->buf + (ch) * (batch)->stride + (k) * (wavFile)->nPt)
+
+struct HDF5IO(event_iterator);
+/* Iterate over n events from eventId (n = 0: to the end of the file)
+ * in batches of batchSize (0: nWfmPerChunk).  A background thread
+ * prefetches up to nBuf batches ahead into a reusable pool of aligned
+ * buffers.  wavFile must not be used by anyone else while the
+ * iterator is open. */
+struct HDF5IO(event_iterator) *HDF5IO(iterator_open)(
+    struct HDF5IO(waveform_file) *wavFile, size_t eventId, size_t n,
+    size_t batchSize, size_t nBuf);
+/* Next batch, or NULL at the end.  The batch stays valid until the
+ * next call, which returns its buffer to the pool. */
+const struct HDF5IO(event_batch) *HDF5IO(iterator_next)(struct HDF5IO(event_iterator) *it);
+void HDF5IO(iterator_close)(struct HDF5IO(event_iterator) *it);
+
+struct HDF5IO(async_writer);
+/* Write events on a background thread.  nBuf event buffers, with
+ * room for nCh x nPt samples and nFrames time stamps each, are
+ * allocated up front; runs of up to maxBatch (0: nWfmPerChunk)
+ * consecutive events are written together.  The waveform attributes
+ * must be in the file already, and wavFile must not be used by anyone
+ * else until async_close(). */
+struct HDF5IO(async_writer) *HDF5IO(async_open)(struct HDF5IO(waveform_file) *wavFile,
+                                                size_t nBuf, size_t maxBatch);
+/* A free event from the pool.  When all nBuf are in flight, wait for
+ * one if waitQ, otherwise return NULL.  Fill in eventId, wavBuf and
+ * frameTimes (NULL when nFrames is 0), then pass it to async_submit(). */
+struct HDF5IO(waveform_event) *HDF5IO(async_get_event)(struct HDF5IO(async_writer) *aw,
+                                                       int waitQ);
+/* Queue an event for writing.  Events are submitted in the order they
+ * were obtained.  Returns -1 once a write has failed. */
+int HDF5IO(async_submit)(struct HDF5IO(async_writer) *aw, struct HDF5IO(waveform_event) *wavEvent);
+/* Wait until everything submitted is written, then flush_file(). */
+int HDF5IO(async_flush)(struct HDF5IO(async_writer) *aw);
+/* Number of events written so far. */
+size_t HDF5IO(async_written)(struct HDF5IO(async_writer) *aw);
+/* Write what is queued, stop the thread and free the pool.  The file
+ * stays open.  Returns -1 if any write failed. */
+int HDF5IO(async_close)(struct HDF5IO(async_writer) *aw);
+
 #endif /* __HDF5IO_H__ */
@@ -0,0 +1,180 @@
+/** \file
+ * Write throughput and compression ratio of hdf5rawWaveformIo for a
+ * matrix of compression filter x level x nPt.
+ */
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "utils.h"
+#include "hdf5rawWaveformIo.h"
+
+#define BENCH_MAX_CASES 32
+
+/** Parameters settable from commandline */
+typedef struct param
+{
+    char   *fname;                         //!< scratch output file.
+    size_t  nCh;                           //!< number of channels.
+    size_t  nWfmPerChunk;                  //!< waveforms per HDF5 dataset.
+    size_t  mibPerCase;                    //!< MiB of raw data written per case.
+    size_t  nThreads;                      //!< compression threads, 0: filter pipeline.
+    size_t  nBatch;                        //!< events per write_events() call.
+    size_t  nSpecs;
+    const char *specs[BENCH_MAX_CASES];    //!< compression specs.
+    size_t  nNPt;
+    size_t  nPts[BENCH_MAX_CASES];         //!< points per waveform.
+} param_t;
+
+param_t paramDefault = {
+    .fname        = "hdf5bench.h5",
+    .nCh          = SCOPE_NCH,
+    .nWfmPerChunk = 16,
+    .mibPerCase   = 256,
+    .nThreads     = 0,
+    .nBatch       = 1,
+    .nSpecs       = 8,
+    .specs        = {"none", "deflate:1", "deflate:6", "shuffle,deflate:1",
+                     "lz4", "zstd:1", "zstd:5", "blosc:5"},
+    .nNPt         = 3,
+    .nPts         = {10000, 1000000, SCOPE_MEM_LENGTH_MAX},
+};
+
+static void print_usage(const param_t *pm, FILE *s)
+{
+    size_t i;
+    fprintf(s, "Usage:\n");
+    fprintf(s, "      -b nBatch [%zd]: Events per write_events() call.\n", pm->nBatch);
+    fprintf(s, "      -c nCh [%zd]: Number of channels.\n", pm->nCh);
+    fprintf(s, "      -m mibPerCase [%zd]: MiB of raw data written per case.\n", pm->mibPerCase);
+    fprintf(s, "      -o fname [\"%s\"]: Scratch output file.\n", pm->fname);
+    fprintf(s, "      -p nPt [");
+    for (i=0; i<pm->nNPt; i++) fprintf(s, "%s%zd", i ? "," : "", pm->nPts[i]);
+    fprintf(s, "]: Points per waveform, repeatable.\n");
+    fprintf(s, "      -t nThreads [%zd]: Parallel compression threads, 0: filter pipeline.\n",
+            pm->nThreads);
+    fprintf(s, "      -w nWfmPerChunk [%zd]: Waveforms per HDF5 dataset.\n", pm->nWfmPerChunk);
+    fprintf(s, "      -z spec [");
+    for (i=0; i<pm->nSpecs; i++) fprintf(s, "%s%s", i ? " " : "", pm->specs[i]);
+    fprintf(s, "]: Compression spec, repeatable.\n");
+}
+
+/** Baseline noise with sparse exponential pulses, roughly what a
+ * digitizer records. */
+static void fill_waveforms(SCOPE_DATA_TYPE *buf, size_t nCh, size_t nPt)
+{
+    size_t i, j, t;
+    double v;
+    for (i=0; i<nCh; i++) {
+        for (j=0; j<nPt; j++) {
+            v = 2.0 * rand_gauss();
+            buf[i*nPt + j] = (SCOPE_DATA_TYPE)lrint(v);
+        }
+        for (t = (size_t)rand_exp(1e-3); t < nPt; t += 1 + (size_t)rand_exp(1e-3)) {
+            v = -100.0 * rand0_1();
+            for (j=t; j<nPt && j<t+200; j++) {
+                buf[i*nPt + j] = (SCOPE_DATA_TYPE)MAX(-128, buf[i*nPt + j] + lrint(v));
+                v *= 0.97;
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    param_t pm;
+    int optC = 0, userSpecs = 0, userNPts = 0;
+    size_t i, j, k, m, nEvents, rawBytes;
+    double t0, t1;
+    struct stat sb;
+    struct HDF5IO(compression) comp;
+    struct HDF5IO(waveform_file) *wavFile;
+    struct HDF5IO(waveform_event) *evts;
+    struct waveform_attribute wavAttr = {0};
+    SCOPE_DATA_TYPE *buf;
+
+    memcpy(&pm, &paramDefault, sizeof(pm));
+    while ((optC = getopt(argc, argv, "b:c:m:o:p:t:w:z:")) != -1) {
+        switch (optC) {
+        case 'b':
+            pm.nBatch = MAX(1, strtoull(optarg, NULL, 10));
+            break;
+        case 'c':
+            pm.nCh = strtoull(optarg, NULL, 10);
+            break;
+        case 'm':
+            pm.mibPerCase = strtoull(optarg, NULL, 10);
+            break;
+        case 'o':
+            pm.fname = optarg;
+            break;
+        case 'p':
+            if (!userNPts++) pm.nNPt = 0;
+            if (pm.nNPt < BENCH_MAX_CASES) pm.nPts[pm.nNPt++] = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            pm.nThreads = strtoull(optarg, NULL, 10);
+            break;
+        case 'w':
+            pm.nWfmPerChunk = strtoull(optarg, NULL, 10);
+            break;
+        case 'z':
+            if (!userSpecs++) pm.nSpecs = 0;
+            if (pm.nSpecs < BENCH_MAX_CASES) pm.specs[pm.nSpecs++] = optarg;
+            break;
+        default:
+            print_usage(&pm, stderr);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+
+    rand_init(1237026722LL);
+    evts = (struct HDF5IO(waveform_event)*)calloc(pm.nBatch, sizeof(*evts));
+    printf("%-20s %10s %8s %10s %8s\n", "compression", "nPt", "nEvents", "MB/s", "ratio");
+    for (j=0; j<pm.nNPt; j++) {
+        buf = (SCOPE_DATA_TYPE*)malloc(pm.nCh * pm.nPts[j] * sizeof(SCOPE_DATA_TYPE));
+        fill_waveforms(buf, pm.nCh, pm.nPts[j]);
+        nEvents = MAX(1, (pm.mibPerCase << 20) / (pm.nCh * pm.nPts[j] * sizeof(SCOPE_DATA_TYPE)));
+        rawBytes = nEvents * pm.nCh * pm.nPts[j] * sizeof(SCOPE_DATA_TYPE);
+        for (i=0; i<pm.nSpecs; i++) {
+            if (HDF5IO(parse_compression)(pm.specs[i], &comp) < 0) continue;
+            if (!HDF5IO(compression_available)(&comp)) {
+                printf("%-20s %10zd %8s %10s %8s\n", pm.specs[i], pm.nPts[j], "-", "n/a", "n/a");
+                continue;
+            }
+            t0 = time_now();
+            wavFile = HDF5IO(open_file)(pm.fname, pm.nWfmPerChunk, pm.nCh, &comp);
+            if (!wavFile) return EXIT_FAILURE;
+            wavAttr.chMask = (1U << pm.nCh) - 1;
+            wavAttr.nPt = pm.nPts[j];
+            HDF5IO(write_waveform_attribute_in_file_header)(wavFile, &wavAttr);
+            if (pm.nThreads) HDF5IO(set_write_threads)(wavFile, pm.nThreads);
+            for (k=0; k<nEvents; k+=m) {
+                for (m=0; m<pm.nBatch && k+m<nEvents; m++) {
+                    evts[m].eventId = k+m;
+                    evts[m].wavBuf = buf;
+                }
+                HDF5IO(write_events)(wavFile, evts, m);
+            }
+            HDF5IO(flush_file)(wavFile);
+            HDF5IO(close_file)(wavFile);
+            t1 = time_now();
+            stat(pm.fname, &sb);
+            printf("%-20s %10zd %8zd %10.1f %8.2f\n", pm.specs[i], pm.nPts[j], nEvents,
+                   rawBytes / (t1 - t0) / 1e6, (double)rawBytes / sb.st_size);
+            fflush(stdout);
+        }
+        free(buf);
+    }
+    free(evts);
+    unlink(pm.fname);
+    return EXIT_SUCCESS;
+}
@@ -1,11 +1,15 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "utils.h"
 #include "ipc.h"
 
 /** System page size in bytes. */
@@ -24,7 +28,8 @@ int shm_create(const char *name, void **p, size_t *size, shm_sync_t **ssv, int r
     uint8_t *p1;
     atomic_flag flag = ATOMIC_FLAG_INIT;
 
-    assert(sizeof(shm_sync_t) <= get_system_pagesize());
+    _Static_assert(sizeof(shm_sync_t) <= SHM_TELEM_OFFSET, "telemetry overlaps shm_sync_t");
+    assert(SHM_TELEM_OFFSET + sizeof(shm_telem_t) <= SHM_SYNC_NPAGE*get_system_pagesize());
     // Enlarged size.  Last page is for sync variables.
     esz = *size + SHM_SYNC_NPAGE*get_system_pagesize();
 
@@ -65,7 +70,7 @@ int shm_connect(const char *name, void **p, size_t *size, shm_sync_t **ssv)
     struct stat sb;
     uint8_t *p1;
 
-    assert(sizeof(shm_sync_t) <= get_system_pagesize());
+    assert(SHM_TELEM_OFFSET + sizeof(shm_telem_t) <= SHM_SYNC_NPAGE*get_system_pagesize());
 
     if ((shmfd = shm_open(name, O_RDWR, mode))<0) {
         fprintf(stderr, "Error in shm_open(\"%s\", ...): ", name);
@@ -84,6 +89,64 @@ int shm_connect(const char *name, void **p, size_t *size, shm_sync_t **ssv)
     if (ssv) { *ssv = (shm_sync_t*)(p1 + sb.st_size - SHM_SYNC_NPAGE*get_system_pagesize()); }
     return shmfd;
 }
+/** Map only the sync pages, read-only. */
+const shm_sync_t *shm_sync_open(const char *name)
+{
+    int shmfd;
+    struct stat sb;
+    void *p;
+    const size_t sz = SHM_SYNC_NPAGE*get_system_pagesize();
+
+    if ((shmfd = shm_open(name, O_RDONLY, 0))<0) {
+        fprintf(stderr, "Error in shm_open(\"%s\", ...): ", name);
+        perror(NULL);
+        return NULL;
+    }
+    if (fstat(shmfd, &sb) < 0 || (size_t)sb.st_size < sz) {
+        fprintf(stderr, "shm \"%s\" is too small to have sync pages.\n", name);
+        close(shmfd);
+        return NULL;
+    }
+    p = mmap(NULL, sz, PROT_READ, MAP_SHARED, shmfd, sb.st_size - sz);
+    close(shmfd);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    return (const shm_sync_t*)p;
+}
+void shm_sync_close(const shm_sync_t *ssv)
+{
+    if (ssv) munmap((void*)ssv, SHM_SYNC_NPAGE*get_system_pagesize());
+}
+/* Telemetry counters have a single writer each, so a relaxed load and
+ * store is enough and costs no locked instruction. */
+static void telem_add(atomic_uint_fast64_t *c, uint64_t inc)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + inc,
+                          memory_order_relaxed);
+}
+static size_t telem_bucket(uint64_t ns)
+{
+    const size_t k = ns ? 63 - (size_t)__builtin_clzll(ns) : 0;
+    return MIN(k, SHM_TELEM_NBUCKET - 1);
+}
+/* The producer laps iRd whether or not anyone reads; only count it
+ * while a consumer is attached. */
+static void count_overrun(shm_sync_t *ssv)
+{
+    shm_telem_t *t = shm_telemetry(ssv);
+    size_t i;
+
+    if (atomic_load_explicit(&t->magic, memory_order_acquire) != SHM_TELEM_MAGIC) return;
+    for (i=0; i<SHM_TELEM_NSLOT; i++) {
+        if (atomic_load_explicit(&t->slot[i].pid, memory_order_relaxed)
+            && t->slot[i].role == SHM_TELEM_CONSUMER) {
+            telem_add(&t->overruns, 1);
+            return;
+        }
+    }
+}
 /** Acquire next segment for read/write, guarantee synchronicity. */
 SHM_ELEM_TYPE *shm_acquire_next_segment_sync(const void *p, shm_sync_t *ssv, shm_seg_mode_t mode)
 {
@@ -121,6 +184,7 @@ SHM_ELEM_TYPE *shm_acquire_next_segment_sync(const void *p, shm_sync_t *ssv, shm
             if (!atomic_flag_test_and_set(&ssv->ovRun)) { // Edge trigger.
                 fprintf(stderr, "Data overrun.\n");
             }
+            count_overrun(ssv);
         }
         /* Update rp and ssv->iWr. */
         nSeg = ssv->nSeg-1;
@@ -169,3 +233,248 @@ size_t shm_get_write_count(shm_sync_t *ssv, size_t *byte, size_t *seg)
     if (seg) { *seg = s; }
     return b;
 }
+/** Offset of the first whole record in a segment. */
+size_t shm_record_offset(const shm_sync_t *ssv, size_t seg, size_t recBytes)
+{
+    const size_t segBytes = ssv->segLen * ssv->elemSize;
+    return (recBytes - (seg * segBytes) % recBytes) % recBytes;
+}
+/** Most recent sequence number that lives at index idx. */
+size_t shm_segment_seq(const shm_sync_t *ssv, intptr_t idx)
+{
+    size_t nSegs = atomic_load(&((shm_sync_t*)ssv)->wrSegs);
+    if (nSegs == 0) return 0;
+    return nSegs - 1 - (nSegs - 1 + ssv->nSeg - (size_t)idx) % ssv->nSeg;
+}
+/** Create or connect to a statistics page. */
+shm_stats_t *shm_stats_open(const char *name, int createQ)
+{
+    int shmfd;
+    void *p;
+    const mode_t mode = 0644; // rw-r--r--, anyone may watch
+
+    if ((shmfd = shm_open(name, createQ ? (O_CREAT | O_RDWR) : O_RDONLY, mode)) < 0) {
+        fprintf(stderr, "Error in shm_open(\"%s\", ...): ", name);
+        perror(NULL);
+        return NULL;
+    }
+    if (createQ && ftruncate(shmfd, sizeof(shm_stats_t)) < 0) {
+        fprintf(stderr, "Error in ftruncate() shm \"%s\": ", name);
+        perror(NULL);
+        close(shmfd);
+        return NULL;
+    }
+    p = mmap(NULL, sizeof(shm_stats_t), createQ ? (PROT_READ|PROT_WRITE) : PROT_READ,
+             MAP_SHARED, shmfd, 0);
+    close(shmfd);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    return (shm_stats_t*)p;
+}
+/** Unmap a statistics page. */
+void shm_stats_close(shm_stats_t *st)
+{
+    if (st) munmap(st, sizeof(shm_stats_t));
+}
+/** Writer: mark the page as being updated. */
+void shm_stats_write_begin(shm_stats_t *st)
+{
+    atomic_fetch_add(&st->seq, 1);
+}
+/** Writer: publish the update. */
+void shm_stats_write_end(shm_stats_t *st)
+{
+    atomic_fetch_add(&st->seq, 1);
+}
+/** Reader: retry until the copy is not torn by a concurrent update. */
+int shm_stats_read(const shm_stats_t *st, shm_stats_t *copy)
+{
+    uint_fast64_t s0, s1;
+    int i;
+
+    for (i=0; i<1000000; i++) { /* updates take microseconds */
+        s0 = atomic_load((atomic_uint_fast64_t*)&st->seq);
+        if (s0 & 1) continue;
+        memcpy((char*)copy + sizeof(copy->seq), (const char*)st + sizeof(st->seq),
+               sizeof(shm_stats_t) - sizeof(st->seq));
+        atomic_thread_fence(memory_order_acquire);
+        s1 = atomic_load((atomic_uint_fast64_t*)&st->seq);
+        if (s0 == s1) {
+            atomic_init(&copy->seq, s0);
+            return 0;
+        }
+    }
+    return -1;
+}
+/** Telemetry area of a shm. */
+shm_telem_t *shm_telemetry(const shm_sync_t *ssv)
+{
+    return (shm_telem_t*)((char*)ssv + SHM_TELEM_OFFSET);
+}
+/** Reset the telemetry area, publishing it last. */
+void shm_telem_init(shm_sync_t *ssv)
+{
+    shm_telem_t *t = shm_telemetry(ssv);
+
+    atomic_store(&t->magic, 0);
+    memset((char*)t + sizeof(t->magic), 0, sizeof(shm_telem_t) - sizeof(t->magic));
+    t->version = SHM_TELEM_VERSION;
+    t->nSlot = SHM_TELEM_NSLOT;
+    t->nBucket = SHM_TELEM_NBUCKET;
+    atomic_store_explicit(&t->magic, SHM_TELEM_MAGIC, memory_order_release);
+}
+/** Claim a slot with a compare-exchange on its pid. */
+shm_telem_slot_t *shm_telem_attach(shm_sync_t *ssv, const char *name, shm_telem_role_t role)
+{
+    shm_telem_t *t = shm_telemetry(ssv);
+    shm_telem_slot_t *s;
+    const int self = (int)getpid();
+    int pid;
+    size_t i;
+
+    if (atomic_load_explicit(&t->magic, memory_order_acquire) != SHM_TELEM_MAGIC
+        || t->version != SHM_TELEM_VERSION) {
+        fprintf(stderr, "No telemetry of version %d in the shm.\n", SHM_TELEM_VERSION);
+        return NULL;
+    }
+    for (i=0; i<SHM_TELEM_NSLOT; i++) {
+        s = &t->slot[i];
+        pid = atomic_load(&s->pid);
+        if (pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH)) continue;
+        if (!atomic_compare_exchange_strong(&s->pid, &pid, self)) continue;
+        memset((char*)s + sizeof(s->pid), 0, sizeof(shm_telem_slot_t) - sizeof(s->pid));
+        s->role = role;
+        snprintf(s->name, sizeof(s->name), "%s", name);
+        return s;
+    }
+    fprintf(stderr, "All %d telemetry slots are taken.\n", SHM_TELEM_NSLOT);
+    return NULL;
+}
+void shm_telem_detach(shm_telem_slot_t *slot)
+{
+    if (slot) atomic_store(&slot->pid, 0);
+}
+uint64_t shm_telem_now(void)
+{
+    return time_now_ns();
+}
+/** Count one segment done. */
+void shm_telem_segment(shm_telem_slot_t *slot, const shm_sync_t *ssv, size_t bytes,
+                       uint64_t busyNs)
+{
+    intptr_t lag;
+
+    if (!slot) return;
+    telem_add(&slot->bytes, bytes);
+    telem_add(&slot->segs, 1);
+    telem_add(&slot->busyNs, busyNs);
+    telem_add(&slot->busyHist[telem_bucket(busyNs)], 1);
+    if (slot->role != SHM_TELEM_CONSUMER) return;
+    lag = (atomic_load_explicit(&ssv->iWr, memory_order_relaxed)
+           - atomic_load_explicit(&ssv->iRd, memory_order_relaxed) + (intptr_t)ssv->nSeg)
+        % (intptr_t)ssv->nSeg;
+    atomic_store_explicit(&slot->lag, (uint64_t)lag, memory_order_relaxed);
+    if ((uint64_t)lag > atomic_load_explicit(&slot->lagMax, memory_order_relaxed))
+        atomic_store_explicit(&slot->lagMax, (uint64_t)lag, memory_order_relaxed);
+}
+/** Count one acquire that waited. */
+void shm_telem_wait(shm_telem_slot_t *slot, uint64_t waitNs)
+{
+    if (!slot) return;
+    telem_add(&slot->waitNs, waitNs);
+    telem_add(&slot->nWait, 1);
+    telem_add(&slot->waitHist[telem_bucket(waitNs)], 1);
+}
+/** Open a trace ring. */
+shm_trace_t *shm_trace_open(const char *name, shm_trace_mode_t mode)
+{
+    int shmfd, flags;
+    shm_trace_t *tr;
+    void *p;
+    const mode_t perm = 0644; // rw-r--r--, anyone may dump
+
+    flags = mode == SHM_TRACE_CREATE ? (O_CREAT | O_RDWR) : mode == SHM_TRACE_WRITE ? O_RDWR : O_RDONLY;
+    if ((shmfd = shm_open(name, flags, perm)) < 0) {
+        if (errno == ENOENT && mode != SHM_TRACE_CREATE) return NULL;
+        fprintf(stderr, "Error in shm_open(\"%s\", ...): ", name);
+        perror(NULL);
+        return NULL;
+    }
+    if (mode == SHM_TRACE_CREATE && ftruncate(shmfd, sizeof(shm_trace_t)) < 0) {
+        fprintf(stderr, "Error in ftruncate() shm \"%s\": ", name);
+        perror(NULL);
+        close(shmfd);
+        return NULL;
+    }
+    p = mmap(NULL, sizeof(shm_trace_t), mode == SHM_TRACE_READ ? PROT_READ : (PROT_READ|PROT_WRITE),
+             MAP_SHARED, shmfd, 0);
+    close(shmfd);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    tr = (shm_trace_t*)p;
+    if (mode == SHM_TRACE_CREATE) {
+        atomic_store(&tr->magic, 0);
+        memset((char*)tr + sizeof(tr->magic), 0, sizeof(shm_trace_t) - sizeof(tr->magic));
+        tr->version = SHM_TRACE_VERSION;
+        tr->nRec = SHM_TRACE_NREC;
+        atomic_store_explicit(&tr->magic, SHM_TRACE_MAGIC, memory_order_release);
+    } else if (atomic_load_explicit(&tr->magic, memory_order_acquire) != SHM_TRACE_MAGIC
+               || tr->version != SHM_TRACE_VERSION) {
+        fprintf(stderr, "\"%s\" is not a trace ring of version %d.\n", name, SHM_TRACE_VERSION);
+        munmap(p, sizeof(shm_trace_t));
+        return NULL;
+    }
+    return tr;
+}
+void shm_trace_close(shm_trace_t *tr)
+{
+    if (tr) munmap(tr, sizeof(shm_trace_t));
+}
+/** Claim a record with one relaxed fetch-add, shared by all writers. */
+void shm_trace_event(shm_trace_t *tr, shm_trace_kind_t kind, uint64_t seg)
+{
+    static int32_t pid;
+    shm_trace_rec_t *r;
+    uint64_t i;
+
+    if (!tr) return;
+    if (!pid) pid = (int32_t)getpid();
+    i = atomic_fetch_add_explicit(&tr->head, 1, memory_order_relaxed);
+    r = &tr->rec[i & (SHM_TRACE_NREC - 1)];
+    atomic_store_explicit(&r->pos, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    r->tNs = shm_telem_now();
+    r->seg = seg;
+    r->kind = kind;
+    r->pid = pid;
+    atomic_store_explicit(&r->pos, i + 1, memory_order_release);
+}
+/** Keep a record only if pos is the same before and after the copy. */
+size_t shm_trace_read(const shm_trace_t *tr, shm_trace_rec_t *out)
+{
+    const uint64_t head = atomic_load((atomic_uint_fast64_t*)&tr->head);
+    const uint64_t i0 = head > SHM_TRACE_NREC ? head - SHM_TRACE_NREC : 0;
+    const shm_trace_rec_t *r;
+    uint64_t i, pos;
+    size_t n = 0;
+
+    for (i=i0; i<head; i++) {
+        r = &tr->rec[i & (SHM_TRACE_NREC - 1)];
+        pos = atomic_load_explicit((atomic_uint_fast64_t*)&r->pos, memory_order_acquire);
+        if (pos != i + 1) continue;
+        out[n].tNs = r->tNs;
+        out[n].seg = r->seg;
+        out[n].kind = r->kind;
+        out[n].pid = r->pid;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit((atomic_uint_fast64_t*)&r->pos, memory_order_relaxed) != pos)
+            continue;
+        atomic_init(&out[n].pos, pos);
+        n++;
+    }
+    return n;
+}
@@ -8,8 +8,8 @@
 #include <stdint.h>
 #include "common.h"
 
-/** Number of pages for synchronization variables. */
-#define SHM_SYNC_NPAGE 1
+/** Number of pages for synchronization variables and telemetry. */
+#define SHM_SYNC_NPAGE 2
 /** Shared memory segment access modes. */
 typedef enum shm_seg_mode {
     SHM_SEG_READ  = 0,
@@ -38,7 +38,72 @@ typedef struct shm_sync
         atomic_flag_test_and_set(&v->ovRun);    \
         atomic_init(&v->wrBytes, 0);            \
         atomic_init(&v->wrSegs,  0);            \
+        shm_telem_init(v);                      \
     } while(0)
+
+/** Telemetry follows shm_sync_t in the sync pages, at this offset. */
+#define SHM_TELEM_OFFSET 256
+#define SHM_TELEM_MAGIC 0x4d54444eU   /* "NDTM" */
+/** Bumped whenever the layout below changes. */
+#define SHM_TELEM_VERSION 1
+/** Processes that can report at once. */
+#define SHM_TELEM_NSLOT 8
+/** Log2 buckets of the histograms: bucket k counts durations of
+ * [2^k, 2^(k+1)) ns, bucket 0 also 0 and the last everything above. */
+#define SHM_TELEM_NBUCKET 32
+/** What a process does with the segments. */
+typedef enum shm_telem_role {
+    SHM_TELEM_PRODUCER  = 1,    //!< fills segments, e.g. ndrecv.
+    SHM_TELEM_CONSUMER  = 2,    //!< reads every segment in order, e.g. ndsave.
+    SHM_TELEM_SPECTATOR = 3     //!< samples the newest segments, e.g. ndmon.
+} shm_telem_role_t;
+/** Counters of one process, written by that process only, with relaxed
+ * atomics; cumulative from its attach.  Durations in ns. */
+typedef struct shm_telem_slot
+{
+    _Alignas(64)
+    atomic_int           pid;         //!< owner, 0: free.
+    int                  role;        //!< shm_telem_role_t.
+    char                 name[24];
+    atomic_uint_fast64_t bytes;       //!< bytes of segments done.
+    atomic_uint_fast64_t segs;        //!< segments done.
+    atomic_uint_fast64_t busyNs;      //!< time spent on the segments.
+    atomic_uint_fast64_t waitNs;      //!< time spent waiting to acquire a segment.
+    atomic_uint_fast64_t nWait;       //!< acquires that had to wait.
+    atomic_uint_fast64_t lag;         //!< segments behind the producer, consumers only.
+    atomic_uint_fast64_t lagMax;
+    atomic_uint_fast64_t busyHist[SHM_TELEM_NBUCKET];  //!< time per segment.
+    atomic_uint_fast64_t waitHist[SHM_TELEM_NBUCKET];  //!< wait per acquire that waited.
+} shm_telem_slot_t;
+/** Telemetry area, set up by shm_producer_init(). */
+typedef struct shm_telem
+{
+    atomic_uint          magic;       //!< SHM_TELEM_MAGIC once initialized.
+    uint32_t             version;     //!< SHM_TELEM_VERSION.
+    uint32_t             nSlot;
+    uint32_t             nBucket;
+    atomic_uint_fast64_t overruns;    //!< segments the producer wrote over unread data.
+    shm_telem_slot_t     slot[SHM_TELEM_NSLOT];
+} shm_telem_t;
+/** Telemetry area of a shm. */
+shm_telem_t *shm_telemetry(const shm_sync_t *ssv);
+/** Reset the telemetry area.  Producer only, through shm_producer_init(). */
+void shm_telem_init(shm_sync_t *ssv);
+/** Take a free slot, or one of a process that is gone.
+ * @return NULL if the shm has no compatible telemetry or all slots are taken;
+ *         the shm_telem_*() updates accept NULL and do nothing.
+ */
+shm_telem_slot_t *shm_telem_attach(shm_sync_t *ssv, const char *name, shm_telem_role_t role);
+/** Give the slot back; its counters stay readable until it is taken again. */
+void shm_telem_detach(shm_telem_slot_t *slot);
+/** CLOCK_MONOTONIC in ns, for the durations below. */
+uint64_t shm_telem_now(void);
+/** Count one segment of bytes done in busyNs; consumers also record their lag. */
+void shm_telem_segment(shm_telem_slot_t *slot, const shm_sync_t *ssv, size_t bytes,
+                       uint64_t busyNs);
+/** Count one acquire that waited waitNs. */
+void shm_telem_wait(shm_telem_slot_t *slot, uint64_t waitNs);
+
 /** Initialize for consumer.  Data overrun check starts by this. */
 #define shm_consumer_init(v)                    \
     do {                                        \
@@ -66,6 +131,11 @@ int shm_create(const char *name, void **p, size_t *size, shm_sync_t **ssv, int r
  * @return shmfd.  Should close() after use.  -1 on failure.
  */
 int shm_connect(const char *name, void **p, size_t *size, shm_sync_t **ssv);
+/** Map only the sync pages, read-only, e.g. to watch the telemetry.
+ * @return NULL on failure.  Unmap with shm_sync_close().
+ */
+const shm_sync_t *shm_sync_open(const char *name);
+void shm_sync_close(const shm_sync_t *ssv);
 /** Acquire next segment for read/write, guarantee synchronicity.
  * Segments are supplied circularly.  It is assumed that only one producer writes to shm.
  * Read counter iRd is modified.  It is assumed that only one consumer reads synchronously.
@@ -92,4 +162,112 @@ void shm_update_write_count(shm_sync_t *ssv, size_t byteInc, size_t segInc);
  */
 size_t shm_get_write_count(shm_sync_t *ssv, size_t *byte, size_t *seg);
 
+/** Sequence number, counted from 0 as in wrSegs, of the completed
+ * segment at index idx, e.g. the one just acquired for read.
+ */
+size_t shm_segment_seq(const shm_sync_t *ssv, intptr_t idx);
+
+/** Offset of the first whole record in a segment, for a stream of
+ * back-to-back records starting at the beginning of segment 0.
+ * @param[in] seg sequence number of the segment, counted from 0 as in wrSegs.
+ * @param[in] recBytes record size in bytes.
+ * @return byte offset into the segment.
+ */
+size_t shm_record_offset(const shm_sync_t *ssv, size_t seg, size_t recBytes);
+
+/** Suffix appended to the shm name for the statistics page. */
+#define SHM_STATS_SUFFIX ".stats"
+/** Histogram bins, one per int8 value; bin 0 is -128. */
+#define SHM_STATS_NBIN 256
+/** Statistics of one channel over the last update interval. */
+typedef struct shm_stats_ch
+{
+    double   baseline;              //!< median sample value.
+    double   mean;
+    double   rms;                   //!< standard deviation around mean.
+    int32_t  min;
+    int32_t  max;
+    double   rate;                  //!< samples/s analyzed.
+    uint64_t hist[SHM_STATS_NBIN];  //!< amplitude histogram.
+} shm_stats_ch_t;
+/** Live statistics published by a spectator.  Guarded by a sequence
+ * counter: odd while being written; read with shm_stats_read(). */
+typedef struct shm_stats
+{
+    atomic_uint_fast64_t seq;
+    size_t   nCh;
+    double   tUpdate;         //!< CLOCK_MONOTONIC seconds of the last update.
+    double   interval;        //!< seconds covered by the statistics.
+    double   dataRate;        //!< bytes/s written by the producer.
+    size_t   sampledBytes;    //!< bytes analyzed, since start.
+    size_t   writtenBytes;    //!< bytes written by the producer, since start.
+    shm_stats_ch_t ch[SCOPE_NCH];
+} shm_stats_t;
+/** Create or connect to a statistics page.
+ * @param[in] name shm name, usually the data shm name + SHM_STATS_SUFFIX.
+ * @param[in] createQ create (and truncate) it for writing, otherwise open read-only.
+ * @return mapped page, NULL on failure.
+ */
+shm_stats_t *shm_stats_open(const char *name, int createQ);
+/** Unmap a statistics page. */
+void shm_stats_close(shm_stats_t *st);
+/** Writer: bracket every update of the page. */
+void shm_stats_write_begin(shm_stats_t *st);
+void shm_stats_write_end(shm_stats_t *st);
+/** Reader: take a consistent copy of the page.
+ * @return 0 on success, -1 if no consistent copy could be taken.
+ */
+int shm_stats_read(const shm_stats_t *st, shm_stats_t *copy);
+
+/** Suffix appended to the shm name for the segment trace ring. */
+#define SHM_TRACE_SUFFIX ".trace"
+#define SHM_TRACE_MAGIC 0x52544e4eU   /* "NNTR" */
+#define SHM_TRACE_VERSION 1
+/** Records in the trace ring, a power of 2; the oldest are overwritten. */
+#define SHM_TRACE_NREC 65536
+/** Points in the life of a segment. */
+typedef enum shm_trace_kind {
+    SHM_TRACE_FILL_START = 1,   //!< producer acquired it for write.
+    SHM_TRACE_FILL_DONE  = 2,   //!< producer filled it.
+    SHM_TRACE_ACQUIRE    = 3,   //!< consumer acquired it for read.
+    SHM_TRACE_PERSISTED  = 4    //!< consumer wrote all of its records to file.
+} shm_trace_kind_t;
+/** One event.  pos is stored last, as the ring position + 1, so a
+ * reader can tell a complete record from one being overwritten. */
+typedef struct shm_trace_rec
+{
+    atomic_uint_fast64_t pos;
+    uint64_t tNs;               //!< CLOCK_MONOTONIC.
+    uint64_t seg;               //!< sequence number of the segment, as in wrSegs.
+    uint32_t kind;              //!< shm_trace_kind_t.
+    int32_t  pid;
+} shm_trace_rec_t;
+typedef struct shm_trace
+{
+    atomic_uint          magic;
+    uint32_t             version;
+    uint32_t             nRec;
+    atomic_uint_fast64_t head;  //!< records ever claimed.
+    shm_trace_rec_t      rec[SHM_TRACE_NREC];
+} shm_trace_t;
+/** How to open a trace ring. */
+typedef enum shm_trace_mode {
+    SHM_TRACE_READ   = 0,       //!< read-only, to dump it.
+    SHM_TRACE_WRITE  = 1,       //!< add events to an existing ring.
+    SHM_TRACE_CREATE = 2        //!< create or reset it; the producer does.
+} shm_trace_mode_t;
+/** Open a trace ring, usually the data shm name + SHM_TRACE_SUFFIX.
+ * @return mapped ring, NULL on failure; quietly NULL if it does not
+ *         exist and mode is not SHM_TRACE_CREATE, i.e. tracing is off.
+ */
+shm_trace_t *shm_trace_open(const char *name, shm_trace_mode_t mode);
+void shm_trace_close(shm_trace_t *tr);
+/** Add an event for segment seg, stamped now.  Does nothing if tr is NULL. */
+void shm_trace_event(shm_trace_t *tr, shm_trace_kind_t kind, uint64_t seg);
+/** Copy the complete records still in the ring, oldest first.
+ * @param[out] out room for SHM_TRACE_NREC records.
+ * @return number of records copied.
+ */
+size_t shm_trace_read(const shm_trace_t *tr, shm_trace_rec_t *out);
+
 #endif /* __IPC_H__ */
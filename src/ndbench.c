@@ -0,0 +1,511 @@
+/** \file
+ * NetDAQ end-to-end loopback benchmark.
+ *
+ * Starts tcpserv, ndrecv, ndsave and optional spectators on loopback,
+ * lets a fixed volume go through the shm ring and writes a report of
+ * "key value" lines: throughput, data overruns, consumer lag, and the
+ * CPU time of every process.  Given a baseline, an earlier report, it
+ * fails if throughput, lag or CPU time regressed by more than a
+ * tolerance.
+ *
+ * Throughput and lag are sampled from the shm sync variables, the
+ * overruns read from the shm telemetry and the CPU times taken from
+ * wait4() when the processes are stopped, in the order data flows
+ * backwards: spectators, ndsave, ndrecv, tcpserv.
+ */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "utils.h"
+#include "ipc.h"
+
+#define NDBENCH_MAX_SPECTATORS 8
+#define NDBENCH_MAX_KEYS 64
+#define CMD_LEN 1024
+
+/** Parameters settable from commandline */
+typedef struct param
+{
+    char   *binDir;        //!< directory of tcpserv, ndrecv and ndsave.
+    char   *shmName;       //!< shared memory object name, system-wide.
+    size_t  shmSegLen;     //!< shm segment length, elements.
+    size_t  shmNSeg;       //!< shm number of segments.
+    char   *port;          //!< loopback port of tcpserv.
+    char   *servArgs;      //!< extra arguments of tcpserv.
+    char   *outFName;      //!< ndsave output, NULL: no ndsave.
+    char   *saveArgs;      //!< extra arguments of ndsave.
+    int     keepQ;         //!< keep the ndsave output.
+    size_t  volume;        //!< bytes to go through the ring.
+    double  timeout;       //!< seconds before giving up.
+    double  interval;      //!< seconds between samples of the ring.
+    char   *logDir;        //!< where the logs of the processes go.
+    char   *reportFName;   //!< report, NULL: stdout only.
+    char   *baseFName;     //!< baseline report, NULL: no comparison.
+    double  tolerance;     //!< relative regression allowed.
+    size_t  nSpec;
+    char   *specCmds[NDBENCH_MAX_SPECTATORS];  //!< spectator command lines.
+} param_t;
+
+param_t paramDefault = {
+    .binDir      = ".",
+    .shmName     = "/ndbench",
+    .shmSegLen   = 1024*1024,
+    .shmNSeg     = 16,
+    .port        = "9200",
+    .servArgs    = "",
+    .outFName    = "ndbench.h5",
+    .saveArgs    = "-z none",
+    .keepQ       = 0,
+    .volume      = (size_t)4096*1024*1024,
+    .timeout     = 120.0,
+    .interval    = 0.01,
+    .logDir      = "/tmp",
+    .reportFName = NULL,
+    .baseFName   = NULL,
+    .tolerance   = 0.1,
+    .nSpec       = 0,
+};
+
+static void print_usage(const param_t *pm, FILE *s)
+{
+    fprintf(s, "Usage:\n");
+    fprintf(s, "      -a cmd [none]: Start spectator cmd as well, e.g. \"./ndmon -n %s\";\n"
+               "         up to %d.\n", pm->shmName, NDBENCH_MAX_SPECTATORS);
+    fprintf(s, "      -B binDir [\"%s\"]: Directory of tcpserv, ndrecv and ndsave.\n", pm->binDir);
+    fprintf(s, "      -b baseFName [none]: Baseline report to compare with.\n");
+    fprintf(s, "      -g servArgs [\"%s\"]: Extra arguments of tcpserv, e.g. \"-m pulses\".\n",
+            pm->servArgs);
+    fprintf(s, "      -i interval [%g]: Seconds between samples of the ring.\n", pm->interval);
+    fprintf(s, "      -k : Keep the ndsave output.\n");
+    fprintf(s, "      -L logDir [\"%s\"]: Directory of the logs of the processes.\n", pm->logDir);
+    fprintf(s, "      -l shmSegLen [%zd]: Shared memory segment length.\n", pm->shmSegLen);
+    fprintf(s, "      -n shmName [\"%s\"]: Shared memory object name, system-wide.\n", pm->shmName);
+    fprintf(s, "      -o outFName [\"%s\"]: ndsave output, none: no ndsave.\n", pm->outFName);
+    fprintf(s, "      -P port [%s]: Loopback port of tcpserv.\n", pm->port);
+    fprintf(s, "      -r reportFName [stdout]: Also write the report there.\n");
+    fprintf(s, "      -s shmNSeg [%zd]: Shared memory number of segments.\n", pm->shmNSeg);
+    fprintf(s, "      -T timeout [%g]: Seconds before giving up.\n", pm->timeout);
+    fprintf(s, "      -t tolerance [%g]: Relative regression allowed against the baseline.\n",
+            pm->tolerance);
+    fprintf(s, "      -V volume [%zd]: MiB to go through the ring.\n", pm->volume >> 20);
+    fprintf(s, "      -w saveArgs [\"%s\"]: Extra arguments of ndsave, e.g. \"-z lz4\".\n",
+            pm->saveArgs);
+    fprintf(s, "  Exits with 2 if the baseline shows a regression.\n");
+}
+
+static void sleep_for(double t)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)t;
+    ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+/** A started process. */
+typedef struct proc
+{
+    char name[32];
+    char log[256];
+    pid_t pid;
+    double cpu;            //!< user + system seconds, after proc_stop().
+} proc_t;
+
+/** Run cmd through the shell, output to the log of p. */
+static int proc_start(proc_t *p, const char *name, const char *logDir, const char *cmd)
+{
+    char sh[CMD_LEN + 8];
+    int fd;
+
+    snprintf(p->name, sizeof(p->name), "%s", name);
+    snprintf(p->log, sizeof(p->log), "%s/ndbench.%s.log", logDir, name);
+    snprintf(sh, sizeof(sh), "exec %s", cmd);
+    if ((p->pid = fork()) < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (p->pid == 0) {
+        if ((fd = open(p->log, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        execl("/bin/sh", "sh", "-c", sh, (char*)NULL);
+        _exit(127);
+    }
+    fprintf(stderr, "Started %s (%d): %s\n", name, (int)p->pid, cmd);
+    return 0;
+}
+
+/** SIGINT p and reap it.
+ * @return its exit status, -1 if it had to be killed. */
+static int proc_stop(proc_t *p, double timeout)
+{
+    struct rusage ru;
+    int status = 0, sig = SIGINT;
+    double t0 = time_now();
+    pid_t r;
+
+    if (p->pid <= 0) return 0;
+    kill(p->pid, sig);
+    while ((r = wait4(p->pid, &status, WNOHANG, &ru)) == 0) {
+        if (sig == SIGINT && time_now() - t0 > timeout) {
+            fprintf(stderr, "%s does not stop, killed.\n", p->name);
+            kill(p->pid, sig = SIGKILL);
+        }
+        sleep_for(0.01);
+    }
+    p->pid = 0;
+    if (r < 0) return -1;
+    p->cpu = ru.ru_utime.tv_sec + 1e-6 * ru.ru_utime.tv_usec
+        + ru.ru_stime.tv_sec + 1e-6 * ru.ru_stime.tv_usec;
+    return sig == SIGKILL ? -1 : WIFEXITED(status) ? WEXITSTATUS(status) : 0;
+}
+
+/** Whether p has died on its own. */
+static int proc_died(proc_t *p)
+{
+    int status;
+    return p->pid > 0 && waitpid(p->pid, &status, WNOHANG) == p->pid
+        && (p->pid = 0, 1);
+}
+
+/** Lines of fname containing s. */
+static size_t count_lines(const char *fname, const char *s)
+{
+    char line[512];
+    size_t n = 0;
+    FILE *fp;
+
+    if ((fp = fopen(fname, "r")) == NULL) return 0;
+    while (fgets(line, sizeof(line), fp)) n += strstr(line, s) != NULL;
+    fclose(fp);
+    return n;
+}
+
+/** Wait until p writes s into its log. */
+static int wait_for_log(proc_t *p, const char *s, double timeout)
+{
+    const double t0 = time_now();
+    while (time_now() - t0 < timeout) {
+        if (count_lines(p->log, s)) return 0;
+        if (proc_died(p)) break;
+        sleep_for(0.05);
+    }
+    error_printf("%s did not come up, see %s\n", p->name, p->log);
+    return -1;
+}
+
+/** The report: keys in the order added. */
+typedef struct report
+{
+    size_t n;
+    char key[NDBENCH_MAX_KEYS][64];
+    double val[NDBENCH_MAX_KEYS];
+} report_t;
+
+static void report_add(report_t *rp, const char *key, double val)
+{
+    if (rp->n == NDBENCH_MAX_KEYS) return;
+    snprintf(rp->key[rp->n], sizeof(rp->key[0]), "%s", key);
+    rp->val[rp->n++] = val;
+}
+
+static int report_get(const report_t *rp, const char *key, double *val)
+{
+    size_t i;
+    for (i=0; i<rp->n; i++) {
+        if (strcmp(rp->key[i], key) == 0) {
+            *val = rp->val[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void report_write(const report_t *rp, FILE *fp)
+{
+    size_t i;
+    for (i=0; i<rp->n; i++) fprintf(fp, "%s %.6g\n", rp->key[i], rp->val[i]);
+}
+
+static int report_read(report_t *rp, const char *fname)
+{
+    char line[256], key[64];
+    double val;
+    FILE *fp;
+
+    rp->n = 0;
+    if ((fp = fopen(fname, "r")) == NULL) {
+        perror(fname);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%63s %lf", key, &val) == 2) report_add(rp, key, val);
+    }
+    fclose(fp);
+    return 0;
+}
+
+/** Compare with the baseline.  Throughput may not drop, lag and CPU
+ * time per GiB may not grow, beyond the tolerance.  Overruns vary too
+ * much between runs to gate on and are only shown.
+ * @return the number of regressions. */
+static size_t report_compare(const report_t *rp, const report_t *base, double tol)
+{
+    size_t i, nBad = 0;
+    double b, v;
+    int badQ;
+    const char *k;
+
+    for (i=0; i<rp->n; i++) {
+        k = rp->key[i];
+        v = rp->val[i];
+        if (report_get(base, k, &b) < 0) continue;
+        if (strcmp(k, "throughput_MiBps") == 0) {
+            badQ = v < b * (1 - tol);
+        } else if (strcmp(k, "overruns") == 0) {
+            /* Runs of one build on a loaded machine differ by half. */
+            printf("# %-32s %12.6g baseline %12.6g\n", k, v, b);
+            continue;
+        } else if (strcmp(k, "lag_max_segs") == 0) {
+            badQ = v > MAX(b * (1 + tol), b + 1);
+        } else if (strstr(k, "cpu_s_per_GiB")) {
+            badQ = v > b * (1 + tol);
+        } else {
+            continue;
+        }
+        printf("# %-32s %12.6g baseline %12.6g %s\n", k, v, b, badQ ? "REGRESSED" : "ok");
+        nBad += badQ;
+    }
+    return nBad;
+}
+
+static volatile sig_atomic_t stopQ = 0;
+static void signal_kill_handler(int sig)
+{
+    stopQ = 1;
+}
+
+int main(int argc, char **argv)
+{
+    param_t pm;
+    int optC = 0, ret = EXIT_SUCCESS, shmfd;
+    char cmd[CMD_LEN], key[64];
+    proc_t serv = {{0}}, recv = {{0}}, save = {{0}}, spec[NDBENCH_MAX_SPECTATORS];
+    void *shmp = NULL;
+    size_t shmSize, i, bytes = 0, b0 = 0, nSamples = 0, lag, lagMax = 0, lagSum = 0;
+    uint64_t overruns = 0;
+    shm_sync_t *ssv;
+    intptr_t iRd, iWr;
+    double t0 = 0, t1 = 0, tStart, cpuGiB;
+    report_t rp = {0}, base;
+    FILE *fp;
+
+    memcpy(&pm, &paramDefault, sizeof(pm));
+    memset(spec, 0, sizeof(spec));
+    while ((optC = getopt(argc, argv, "a:B:b:g:i:kL:l:n:o:P:r:s:T:t:V:w:")) != -1) {
+        switch (optC) {
+        case 'a':
+            if (pm.nSpec < NDBENCH_MAX_SPECTATORS) pm.specCmds[pm.nSpec++] = optarg;
+            break;
+        case 'B':
+            pm.binDir = optarg;
+            break;
+        case 'b':
+            pm.baseFName = optarg;
+            break;
+        case 'g':
+            pm.servArgs = optarg;
+            break;
+        case 'i':
+            pm.interval = MAX(1e-3, atof(optarg));
+            break;
+        case 'k':
+            pm.keepQ = 1;
+            break;
+        case 'L':
+            pm.logDir = optarg;
+            break;
+        case 'l':
+            pm.shmSegLen = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            pm.shmName = optarg;
+            break;
+        case 'o':
+            pm.outFName = strcmp(optarg, "none") ? optarg : NULL;
+            break;
+        case 'P':
+            pm.port = optarg;
+            break;
+        case 'r':
+            pm.reportFName = optarg;
+            break;
+        case 's':
+            pm.shmNSeg = strtoull(optarg, NULL, 10);
+            break;
+        case 'T':
+            pm.timeout = atof(optarg);
+            break;
+        case 't':
+            pm.tolerance = atof(optarg);
+            break;
+        case 'V':
+            pm.volume = strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'w':
+            pm.saveArgs = optarg;
+            break;
+        default:
+            print_usage(&pm, stderr);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+    signal(SIGINT, signal_kill_handler);
+    signal(SIGTERM, signal_kill_handler);
+
+    /* tcpserv first, it says when it listens. */
+    snprintf(cmd, sizeof(cmd), "%s/tcpserv %s 127.0.0.1 %s", pm.binDir, pm.servArgs, pm.port);
+    if (proc_start(&serv, "tcpserv", pm.logDir, cmd) < 0
+        || wait_for_log(&serv, "Listening", 30.0) < 0) {
+        ret = EXIT_FAILURE;
+        goto STOP;
+    }
+    snprintf(cmd, sizeof(cmd), "%s/ndrecv -d -n %s -l %zd -s %zd 127.0.0.1 %s", pm.binDir,
+             pm.shmName, pm.shmSegLen, pm.shmNSeg, pm.port);
+    if (proc_start(&recv, "ndrecv", pm.logDir, cmd) < 0) {
+        ret = EXIT_FAILURE;
+        goto STOP;
+    }
+    /* ndrecv creates the shm after it connects, and sets the geometry
+     * after it creates the shm. */
+    for (tStart=time_now(); time_now() - tStart < 10.0 && !proc_died(&recv); sleep_for(0.01)) {
+        if (!shmp) {
+            if ((shmfd = shm_open(pm.shmName, O_RDONLY, 0)) < 0) continue;
+            close(shmfd);
+            if ((shmfd = shm_connect(pm.shmName, &shmp, &shmSize, &ssv)) < 0) continue;
+            close(shmfd);
+        }
+        if (ssv->nSeg == pm.shmNSeg && ssv->segLen == pm.shmSegLen) break;
+    }
+    if (!shmp || ssv->nSeg != pm.shmNSeg) {
+        error_printf("No shm %s from ndrecv, see %s\n", pm.shmName, recv.log);
+        ret = EXIT_FAILURE;
+        goto STOP;
+    }
+    if (pm.outFName) {
+        snprintf(cmd, sizeof(cmd), "%s/ndsave -n %s -o %s %s", pm.binDir, pm.shmName,
+                 pm.outFName, pm.saveArgs);
+        if (proc_start(&save, "ndsave", pm.logDir, cmd) < 0) {
+            ret = EXIT_FAILURE;
+            goto STOP;
+        }
+    }
+    for (i=0; i<pm.nSpec; i++) {
+        snprintf(key, sizeof(key), "spectator%zd", i);
+        if (proc_start(&spec[i], key, pm.logDir, pm.specCmds[i]) < 0) {
+            ret = EXIT_FAILURE;
+            goto STOP;
+        }
+    }
+
+    /* Sample the ring until volume has gone through, from the first
+     * byte seen.  The consumer lag is the distance from iRd to iWr. */
+    tStart = time_now();
+    while (!stopQ) {
+        shm_get_write_count(ssv, &bytes, NULL);
+        if (bytes > 0 && t0 == 0) {
+            t0 = time_now();
+            b0 = bytes;
+        }
+        if (t0 > 0 && pm.outFName) {
+            iRd = atomic_load(&ssv->iRd);
+            iWr = atomic_load(&ssv->iWr);
+            lag = (size_t)((iWr - iRd + (intptr_t)ssv->nSeg) % (intptr_t)ssv->nSeg);
+            lagSum += lag;
+            lagMax = MAX(lagMax, lag);
+            nSamples++;
+        }
+        if (bytes - b0 >= pm.volume && t0 > 0) break;
+        if (time_now() - tStart > pm.timeout) {
+            error_printf("Timed out after %g s, %zd of %zd bytes.\n", pm.timeout, bytes - b0,
+                         pm.volume);
+            ret = EXIT_FAILURE;
+            break;
+        }
+        if (proc_died(&recv) || proc_died(&serv) || (pm.outFName && proc_died(&save))) {
+            error_printf("A process died, see the logs in %s\n", pm.logDir);
+            ret = EXIT_FAILURE;
+            break;
+        }
+        sleep_for(pm.interval);
+    }
+    t1 = time_now();
+
+STOP:
+    for (i=0; i<pm.nSpec; i++) proc_stop(&spec[i], 10.0);
+    proc_stop(&save, 60.0);
+    proc_stop(&recv, 10.0);
+    proc_stop(&serv, 10.0);
+    if (shmp) {
+        overruns = atomic_load(&shm_telemetry(ssv)->overruns);
+        munmap(shmp, shmSize);
+    }
+    if (pm.outFName && !pm.keepQ) unlink(pm.outFName);
+    if (ret != EXIT_SUCCESS) return ret;
+
+    report_add(&rp, "volume_MiB", (bytes - b0) / 1048576.0);
+    report_add(&rp, "seg_MiB", pm.shmSegLen * sizeof(SHM_ELEM_TYPE) / 1048576.0);
+    report_add(&rp, "n_seg", pm.shmNSeg);
+    report_add(&rp, "seconds", t1 - t0);
+    report_add(&rp, "throughput_MiBps", (bytes - b0) / 1048576.0 / (t1 - t0));
+    report_add(&rp, "overruns", overruns);
+    if (nSamples) {
+        report_add(&rp, "lag_mean_segs", (double)lagSum / nSamples);
+        report_add(&rp, "lag_max_segs", lagMax);
+    }
+    cpuGiB = (bytes - b0) / 1073741824.0;
+    for (i=0; i<3+pm.nSpec; i++) {
+        const proc_t *p = i == 0 ? &serv : i == 1 ? &recv : i == 2 ? &save : &spec[i-3];
+        if (i == 2 && !pm.outFName) continue;
+        snprintf(key, sizeof(key), "%s.cpu_s", p->name);
+        report_add(&rp, key, p->cpu);
+        snprintf(key, sizeof(key), "%s.cpu_s_per_GiB", p->name);
+        report_add(&rp, key, p->cpu / cpuGiB);
+    }
+    report_write(&rp, stdout);
+    if (pm.reportFName) {
+        if ((fp = fopen(pm.reportFName, "w")) == NULL) {
+            perror(pm.reportFName);
+        } else {
+            report_write(&rp, fp);
+            fclose(fp);
+        }
+    }
+    if (pm.baseFName) {
+        if (report_read(&base, pm.baseFName) < 0) return EXIT_FAILURE;
+        if (report_compare(&rp, &base, pm.tolerance) > 0) ret = 2;
+    }
+    return ret;
+}
@@ -0,0 +1,241 @@
+/** \file
+ * NetDAQ converting a raw event stream to HDF5 with several processes.
+ *
+ * The input is back-to-back event records of nCh x nPt samples,
+ * channel by channel, as saved from the shm stream.  It is cut into
+ * ranges of whole HDF5 datasets; each range is converted by its own
+ * process into a part file, then a master file maps all parts into
+ * one event sequence with virtual datasets.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "utils.h"
+#include "hdf5rawWaveformIo.h"
+
+/** Parameters settable from commandline */
+typedef struct param
+{
+    char   *outFName;      //!< master HDF5 file.  Parts are outFName.pNNN.
+    size_t  nCh;           //!< channels in each event record.
+    size_t  nPt;           //!< points per channel in each event record.
+    size_t  nWfmPerChunk;  //!< waveforms per HDF5 dataset.
+    size_t  nProc;         //!< converter processes, 0: online CPUs.
+    double  dt;            //!< sampling interval.
+    char   *compSpec;      //!< compression spec.
+    size_t  lodFactor;     //!< min/max pyramid reduction factor, 0: no pyramid.
+} param_t;
+
+param_t paramDefault = {
+    .outFName     = "out.h5",
+    .nCh          = SCOPE_NCH,
+    .nPt          = 1000,
+    .nWfmPerChunk = 100,
+    .nProc        = 0,
+    .dt           = 1.0,
+    .compSpec     = HDF5IO_COMPRESSION_DEFAULT,
+    .lodFactor    = 0,
+};
+
+static void print_usage(const param_t *pm, FILE *s)
+{
+    fprintf(s, "Usage: ndconv [options] raw_file\n");
+    fprintf(s, "      -c nCh [%zd]: Channels in each event record.\n", pm->nCh);
+    fprintf(s, "      -d dt [%g]: Sampling interval.\n", pm->dt);
+    fprintf(s, "      -j nProc [%zd]: Converter processes, 0: online CPUs.\n", pm->nProc);
+    fprintf(s, "      -l lodFactor [%zd]: Also store a min/max pyramid for waveview, "
+            "0: none.\n", pm->lodFactor);
+    fprintf(s, "      -o outFName [\"%s\"]: Master HDF5 file, parts go to outFName.pNNN.\n",
+            pm->outFName);
+    fprintf(s, "      -p nPt [%zd]: Points per channel in each event record.\n", pm->nPt);
+    fprintf(s, "      -w nWfmPerChunk [%zd]: Waveforms per HDF5 dataset.\n", pm->nWfmPerChunk);
+    fprintf(s, "      -z compSpec [\"%s\"]: Compression, e.g. none, deflate:6, shuffle,zstd:3.\n",
+            pm->compSpec);
+}
+
+static void set_attribute(const param_t *pm, struct waveform_attribute *wavAttr)
+{
+    size_t i;
+    memset(wavAttr, 0, sizeof(*wavAttr));
+    wavAttr->chMask = (1U << pm->nCh) - 1;
+    wavAttr->nPt = pm->nPt;
+    wavAttr->dt = pm->dt;
+    for (i=0; i<SCOPE_NCH; i++) wavAttr->ymult[i] = 1.0;
+}
+
+/** Convert events [eventId, eventId+n) of the raw file to a part file
+ * with event numbers starting from 0. */
+static int convert_range(const param_t *pm, int fd, const char *partFName,
+                         size_t eventId, size_t n)
+{
+    struct HDF5IO(compression) comp;
+    struct HDF5IO(waveform_file) *wavFile;
+    struct HDF5IO(async_writer) *aw;
+    struct HDF5IO(waveform_event) *evt;
+    struct waveform_attribute wavAttr;
+    const size_t evtBytes = pm->nCh * pm->nPt * sizeof(SCOPE_DATA_TYPE);
+    size_t i;
+    int ret = 0;
+
+    if (HDF5IO(parse_compression)(pm->compSpec, &comp) < 0) return -1;
+    if ((wavFile = HDF5IO(open_file)(partFName, pm->nWfmPerChunk, pm->nCh, &comp)) == NULL)
+        return -1;
+    if (pm->lodFactor) HDF5IO(set_lod)(wavFile, pm->lodFactor);
+    set_attribute(pm, &wavAttr);
+    HDF5IO(write_waveform_attribute_in_file_header)(wavFile, &wavAttr);
+    /* Reading the next dataset overlaps compressing the previous one. */
+    if ((aw = HDF5IO(async_open)(wavFile, 2 * pm->nWfmPerChunk, 0)) == NULL) {
+        HDF5IO(close_file)(wavFile);
+        return -1;
+    }
+    for (i=0; i<n && ret==0; i++) {
+        evt = HDF5IO(async_get_event)(aw, 1);
+        if (pread(fd, evt->wavBuf, evtBytes, (off_t)((eventId + i) * evtBytes))
+            != (ssize_t)evtBytes) {
+            error_printf("%s(): short read of event %zd\n", __func__, eventId + i);
+            ret = -1;
+            break;
+        }
+        evt->eventId = i;
+        ret = HDF5IO(async_submit)(aw, evt);
+    }
+    if (HDF5IO(async_close)(aw) < 0) ret = -1;
+    HDF5IO(flush_file)(wavFile);
+    HDF5IO(close_file)(wavFile);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    param_t pm;
+    int optC = 0, fd, status, ret = EXIT_SUCCESS;
+    size_t k, nEvents, nChunks, chunksPerProc, evtBytes, first;
+    long ncpu;
+    struct stat sb;
+    char partFName[4096];
+    const char *base;
+    pid_t pid, *pids;
+    double t0;
+    struct HDF5IO(compression) comp;
+    struct HDF5IO(waveform_file) *wavFile;
+    struct waveform_attribute wavAttr;
+
+    memcpy(&pm, &paramDefault, sizeof(pm));
+    while ((optC = getopt(argc, argv, "c:d:j:l:o:p:w:z:")) != -1) {
+        switch (optC) {
+        case 'c':
+            pm.nCh = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            pm.dt = strtod(optarg, NULL);
+            break;
+        case 'j':
+            pm.nProc = strtoull(optarg, NULL, 10);
+            break;
+        case 'l':
+            pm.lodFactor = strtoull(optarg, NULL, 10);
+            break;
+        case 'o':
+            pm.outFName = optarg;
+            break;
+        case 'p':
+            pm.nPt = strtoull(optarg, NULL, 10);
+            break;
+        case 'w':
+            pm.nWfmPerChunk = strtoull(optarg, NULL, 10);
+            break;
+        case 'z':
+            pm.compSpec = optarg;
+            break;
+        default:
+            print_usage(&pm, stderr);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1) {
+        print_usage(&pm, stderr);
+        return EXIT_FAILURE;
+    }
+    if (HDF5IO(parse_compression)(pm.compSpec, &comp) < 0) return EXIT_FAILURE;
+    if ((fd = open(argv[0], O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+        perror(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (pm.nProc == 0) {
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        pm.nProc = ncpu > 0 ? (size_t)ncpu : 1;
+    }
+    evtBytes = pm.nCh * pm.nPt * sizeof(SCOPE_DATA_TYPE);
+    nEvents = sb.st_size / evtBytes;
+    if (sb.st_size % evtBytes)
+        fprintf(stderr, "Ignoring %zd trailing bytes.\n", (size_t)(sb.st_size % evtBytes));
+    /* Ranges are whole datasets, so every master dataset maps to exactly one part. */
+    nChunks = (nEvents + pm.nWfmPerChunk - 1) / pm.nWfmPerChunk;
+    chunksPerProc = MAX(1, (nChunks + pm.nProc - 1) / pm.nProc);
+    pm.nProc = (nChunks + chunksPerProc - 1) / chunksPerProc;
+    fprintf(stderr, "%zd events, %zd datasets, %zd processes.\n", nEvents, nChunks, pm.nProc);
+
+    t0 = time_now();
+    pids = (pid_t*)calloc(pm.nProc, sizeof(pid_t));
+    for (k=0; k<pm.nProc; k++) {
+        first = k * chunksPerProc * pm.nWfmPerChunk;
+        snprintf(partFName, sizeof(partFName), "%s.p%03zd", pm.outFName, k);
+        if ((pid = fork()) < 0) {
+            perror("fork");
+            ret = EXIT_FAILURE;
+            pm.nProc = k;
+            break;
+        }
+        if (pid == 0) { /* HDF5 is only ever touched after the fork */
+            _exit(convert_range(&pm, fd, partFName, first,
+                                MIN(chunksPerProc * pm.nWfmPerChunk, nEvents - first)) < 0
+                  ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+        pids[k] = pid;
+    }
+    for (k=0; k<pm.nProc; k++) {
+        if (waitpid(pids[k], &status, 0) < 0 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            error_printf("Conversion of part %zd failed.\n", k);
+            ret = EXIT_FAILURE;
+        }
+    }
+    free(pids);
+    close(fd);
+    if (ret != EXIT_SUCCESS) return ret;
+    fprintf(stderr, "Parts converted in %.2f s.\n", time_now() - t0);
+
+    if ((wavFile = HDF5IO(open_file)(pm.outFName, pm.nWfmPerChunk, pm.nCh, &comp)) == NULL)
+        return EXIT_FAILURE;
+    if (pm.lodFactor) HDF5IO(set_lod)(wavFile, pm.lodFactor);
+    set_attribute(&pm, &wavAttr);
+    HDF5IO(write_waveform_attribute_in_file_header)(wavFile, &wavAttr);
+    /* Parts sit next to the master, so link them by their base name. */
+    for (k=0; k<pm.nProc; k++) {
+        snprintf(partFName, sizeof(partFName), "%s.p%03zd", pm.outFName, k);
+        base = strrchr(partFName, '/') ? strrchr(partFName, '/') + 1 : partFName;
+        if (HDF5IO(link_file)(wavFile, partFName, base,
+                              k * chunksPerProc * pm.nWfmPerChunk) < 0) {
+            error_printf("Linking %s failed.\n", partFName);
+            ret = EXIT_FAILURE;
+        }
+    }
+    HDF5IO(flush_file)(wavFile);
+    HDF5IO(close_file)(wavFile);
+    fprintf(stderr, "%s: %zd events in %.2f s.\n", pm.outFName, nEvents, time_now() - t0);
+    return ret;
+}
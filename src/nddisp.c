@@ -0,0 +1,239 @@
+/** \file
+ * NetDAQ live waveform display, a spectator on the shared memory.
+ *
+ * Each refresh takes one event record from the newest complete
+ * segment, reduces every channel to a min/max envelope of screen width
+ * and draws it on the terminal, or into a PPM image in headless mode.
+ * Only one record is read per refresh and the sync variables are never
+ * written, so the synchronous consumer is not disturbed.
+ */
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "ipc.h"
+#include "wavproc.h"
+
+/** Parameters settable from commandline */
+typedef struct param
+{
+    char   *shmName;     //!< shared memory object name, system-wide.
+    size_t  nCh;         //!< channels in each event record.
+    size_t  nPt;         //!< points per channel in each event record.
+    size_t  width;       //!< columns, 0: terminal width.
+    size_t  height;      //!< rows per channel.
+    char   *outFName;    //!< PPM snapshot file, NULL: draw on the terminal.
+    double  interval;    //!< seconds between refreshes.
+    size_t  nFrames;     //!< number of refreshes, 0: forever.
+} param_t;
+
+param_t paramDefault = {
+    .shmName  = SHM_NAME,
+    .nCh      = SCOPE_NCH,
+    .nPt      = 1000,
+    .width    = 0,
+    .height   = 10,
+    .outFName = NULL,
+    .interval = 0.2,
+    .nFrames  = 0,
+};
+
+static void print_usage(const param_t *pm, FILE *s)
+{
+    fprintf(s, "Usage:\n");
+    fprintf(s, "      -c nCh [%zd]: Channels in each event record.\n", pm->nCh);
+    fprintf(s, "      -f nFrames [%zd]: Number of refreshes, 0: forever.\n", pm->nFrames);
+    fprintf(s, "      -h height [%zd]: Rows per channel (pixels with -o).\n", pm->height);
+    fprintf(s, "      -i interval [%g]: Seconds between refreshes.\n", pm->interval);
+    fprintf(s, "      -n shmName [\"%s\"]: Shared memory object name, system-wide.\n", pm->shmName);
+    fprintf(s, "      -o outFName [none]: Headless, write a PPM snapshot on every refresh.\n");
+    fprintf(s, "      -p nPt [%zd]: Points per channel in each event record.\n", pm->nPt);
+    fprintf(s, "      -w width [%zd]: Columns (pixels with -o), 0: terminal width.\n", pm->width);
+}
+
+static volatile sig_atomic_t stopQ = 0;
+static void signal_kill_handler(int sig)
+{
+    stopQ = 1;
+}
+
+/** Locate the first whole event record in the newest complete segment. */
+static const SCOPE_DATA_TYPE *latest_record(const void *shmp, shm_sync_t *ssv, size_t evtBytes)
+{
+    size_t nSegs, off;
+
+    shm_get_write_count(ssv, NULL, &nSegs);
+    if (nSegs == 0) return NULL; /* nothing complete yet */
+    off = shm_record_offset(ssv, nSegs - 1, evtBytes);
+    if (off + evtBytes > ssv->segLen * ssv->elemSize) return NULL;
+    return (const SCOPE_DATA_TYPE*)((const char*)shm_acquire_oldest_segment(shmp, ssv) + off);
+}
+
+/** Row of sample value v, 0 at the top. */
+static size_t value_row(SCOPE_DATA_TYPE v, size_t height)
+{
+    return (size_t)(127 - v) * height / 256;
+}
+
+static void draw_terminal(const SCOPE_DATA_TYPE *mn, const SCOPE_DATA_TYPE *mx,
+                          size_t nCh, size_t width, size_t height, size_t frame)
+{
+    size_t ch, r, x;
+    char *line = (char*)malloc(width + 1);
+
+    printf("\033[H\033[2J"); /* home, clear */
+    printf("frame %zd\n", frame);
+    for (ch=0; ch<nCh; ch++) {
+        printf("CH%zd\n", ch+1);
+        for (r=0; r<height; r++) {
+            for (x=0; x<width; x++) {
+                line[x] = (value_row(mx[ch*width + x], height) <= r
+                           && r <= value_row(mn[ch*width + x], height)) ? '#'
+                    : (r == height/2 ? '-' : ' ');
+            }
+            line[width] = '\0';
+            puts(line);
+        }
+    }
+    fflush(stdout);
+    free(line);
+}
+
+static int write_ppm(const char *fname, const SCOPE_DATA_TYPE *mn, const SCOPE_DATA_TYPE *mx,
+                     size_t nCh, size_t width, size_t height)
+{
+    static const unsigned char colors[][3] = {
+        {255, 255, 0}, {0, 255, 255}, {255, 0, 255}, {0, 255, 0}
+    };
+    const unsigned char *c;
+    unsigned char *img;
+    size_t ch, x, r, r0, r1;
+    char tmpName[4096];
+    FILE *fp;
+
+    img = (unsigned char*)calloc(nCh * height * width, 3);
+    for (ch=0; ch<nCh; ch++) {
+        c = colors[ch % (sizeof(colors)/sizeof(colors[0]))];
+        for (x=0; x<width; x++) {
+            img[((ch*height + height/2) * width + x) * 3 + 0] = 64; /* zero line */
+            img[((ch*height + height/2) * width + x) * 3 + 1] = 64;
+            img[((ch*height + height/2) * width + x) * 3 + 2] = 64;
+            r0 = value_row(mx[ch*width + x], height);
+            r1 = value_row(mn[ch*width + x], height);
+            for (r=r0; r<=r1; r++)
+                memcpy(&img[((ch*height + r) * width + x) * 3], c, 3);
+        }
+    }
+    /* Replace the file atomically so viewers never see half an image. */
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", fname);
+    if ((fp = fopen(tmpName, "wb")) == NULL) {
+        perror(tmpName);
+        free(img);
+        return -1;
+    }
+    fprintf(fp, "P6\n%zd %zd\n255\n", width, nCh * height);
+    fwrite(img, 3, nCh * height * width, fp);
+    fclose(fp);
+    free(img);
+    return rename(tmpName, fname);
+}
+
+int main(int argc, char **argv)
+{
+    int shmfd;
+    void *shmp;
+    shm_sync_t *ssv;
+    size_t shmSize, evtBytes, ch, frame;
+    param_t pm;
+    int optC = 0;
+    struct winsize ws;
+    struct timespec ts;
+    const SCOPE_DATA_TYPE *rec;
+    SCOPE_DATA_TYPE *evt, *mn, *mx;
+
+    memcpy(&pm, &paramDefault, sizeof(pm));
+    while ((optC = getopt(argc, argv, "c:f:h:i:n:o:p:w:")) != -1) {
+        switch (optC) {
+        case 'c':
+            pm.nCh = strtoull(optarg, NULL, 10);
+            break;
+        case 'f':
+            pm.nFrames = strtoull(optarg, NULL, 10);
+            break;
+        case 'h':
+            pm.height = MAX(1, strtoull(optarg, NULL, 10));
+            break;
+        case 'i':
+            pm.interval = strtod(optarg, NULL);
+            break;
+        case 'n':
+            pm.shmName = optarg;
+            break;
+        case 'o':
+            pm.outFName = optarg;
+            break;
+        case 'p':
+            pm.nPt = strtoull(optarg, NULL, 10);
+            break;
+        case 'w':
+            pm.width = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            print_usage(&pm, stderr);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+    if (pm.width == 0) {
+        if (!pm.outFName && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+            pm.width = ws.ws_col;
+        else
+            pm.width = pm.outFName ? 1024 : 80;
+    }
+
+    shmfd = shm_connect(pm.shmName, &shmp, &shmSize, &ssv);
+    if (shmfd<0 || shmp==NULL) return EXIT_FAILURE;
+    close(shmfd);
+    evtBytes = pm.nCh * pm.nPt * sizeof(SCOPE_DATA_TYPE);
+    if (evtBytes > ssv->segLen * ssv->elemSize) {
+        error_printf("An event record (%zd bytes) does not fit in a segment (%zd bytes).\n",
+                     evtBytes, ssv->segLen * ssv->elemSize);
+        return EXIT_FAILURE;
+    }
+    signal(SIGINT,  signal_kill_handler);
+    signal(SIGTERM, signal_kill_handler);
+
+    evt = (SCOPE_DATA_TYPE*)malloc(evtBytes);
+    mn = (SCOPE_DATA_TYPE*)malloc(pm.nCh * pm.width * sizeof(SCOPE_DATA_TYPE));
+    mx = (SCOPE_DATA_TYPE*)malloc(pm.nCh * pm.width * sizeof(SCOPE_DATA_TYPE));
+    ts.tv_sec = (time_t)pm.interval;
+    ts.tv_nsec = (long)((pm.interval - ts.tv_sec) * 1e9);
+    for (frame=0; !stopQ && (pm.nFrames == 0 || frame < pm.nFrames); ) {
+        if ((rec = latest_record(shmp, ssv, evtBytes))) {
+            /* Copy first: the producer may come around to this segment. */
+            memcpy(evt, rec, evtBytes);
+            for (ch=0; ch<pm.nCh; ch++) {
+                wavproc_minmax(mn + ch * pm.width, mx + ch * pm.width,
+                               evt + ch * pm.nPt, pm.nPt, pm.width);
+            }
+            if (pm.outFName) write_ppm(pm.outFName, mn, mx, pm.nCh, pm.width, pm.height);
+            else draw_terminal(mn, mx, pm.nCh, pm.width, pm.height, frame);
+            frame++;
+        }
+        nanosleep(&ts, NULL);
+    }
+    free(evt);
+    free(mn);
+    free(mx);
+    munmap(shmp, shmSize);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,214 @@
+/** \file
+ * NetDAQ live statistics, a spectator on the shared memory.
+ *
+ * Samples event records from newly completed segments, accumulates per
+ * channel baseline, RMS, min/max and amplitude histograms, and
+ * publishes them every interval to a statistics page
+ * (shmName SHM_STATS_SUFFIX) for other tools to poll.  Only a
+ * configurable fraction of every segment is looked at.
+ */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "utils.h"
+#include "ipc.h"
+#include "wavproc.h"
+
+/** Parameters settable from commandline */
+typedef struct param
+{
+    char   *shmName;     //!< shared memory object name, system-wide.
+    size_t  nCh;         //!< channels in each event record.
+    size_t  nPt;         //!< points per channel in each event record.
+    double  fraction;    //!< fraction of each segment to analyze.
+    double  interval;    //!< seconds between updates of the stats page.
+    int     verbose;     //!< also print a summary on every update.
+} param_t;
+
+param_t paramDefault = {
+    .shmName  = SHM_NAME,
+    .nCh      = SCOPE_NCH,
+    .nPt      = 1000,
+    .fraction = 0.01,
+    .interval = 1.0,
+    .verbose  = 0,
+};
+
+static void print_usage(const param_t *pm, FILE *s)
+{
+    fprintf(s, "Usage:\n");
+    fprintf(s, "      -c nCh [%zd]: Channels in each event record.\n", pm->nCh);
+    fprintf(s, "      -f fraction [%g]: Fraction of each segment to analyze.\n", pm->fraction);
+    fprintf(s, "      -i interval [%g]: Seconds between updates of the stats page.\n",
+            pm->interval);
+    fprintf(s, "      -n shmName [\"%s\"]: Shared memory object name, system-wide.\n", pm->shmName);
+    fprintf(s, "      -p nPt [%zd]: Points per channel in each event record.\n", pm->nPt);
+    fprintf(s, "      -v : Print a summary on every update.\n");
+    fprintf(s, "  Statistics are published to shmName\"%s\".\n", SHM_STATS_SUFFIX);
+}
+
+static volatile sig_atomic_t stopQ = 0;
+static void signal_kill_handler(int sig)
+{
+    stopQ = 1;
+}
+
+/** Analyze up to the wanted fraction of records in segment number seg.
+ * @return bytes analyzed.
+ */
+static size_t sample_segment(const void *shmp, shm_sync_t *ssv, size_t seg, const param_t *pm,
+                             struct wavproc_stats *st)
+{
+    const size_t segBytes = ssv->segLen * ssv->elemSize;
+    const size_t evtBytes = pm->nCh * pm->nPt * sizeof(SCOPE_DATA_TYPE);
+    const SCOPE_DATA_TYPE *p;
+    size_t off, nRec, nWant, k, ch;
+
+    off = shm_record_offset(ssv, seg, evtBytes);
+    if (off + evtBytes > segBytes) return 0;
+    nRec = (segBytes - off) / evtBytes;
+    nWant = MIN(nRec, (size_t)ceil(pm->fraction * nRec));
+    p = (const SCOPE_DATA_TYPE*)((const char*)shm_acquire_oldest_segment(shmp, ssv) + off);
+    /* Spread the sampled records over the segment. */
+    for (k=0; k<nWant; k++) {
+        for (ch=0; ch<pm->nCh; ch++)
+            wavproc_stats_accumulate(&st[ch], p + (k * nRec / nWant) * pm->nCh * pm->nPt
+                                     + ch * pm->nPt, pm->nPt);
+    }
+    return nWant * evtBytes;
+}
+
+static void publish(shm_stats_t *sp, const struct wavproc_stats *st, const param_t *pm,
+                    double t, double dt, double dataRate, size_t sampledBytes, size_t writtenBytes)
+{
+    size_t ch;
+    double mean;
+    shm_stats_ch_t *c;
+
+    shm_stats_write_begin(sp);
+    sp->nCh = pm->nCh;
+    sp->tUpdate = t;
+    sp->interval = dt;
+    sp->dataRate = dataRate;
+    sp->sampledBytes = sampledBytes;
+    sp->writtenBytes = writtenBytes;
+    for (ch=0; ch<pm->nCh; ch++) {
+        c = &sp->ch[ch];
+        if (st[ch].n) {
+            mean = (double)st[ch].sum / st[ch].n;
+            c->baseline = wavproc_stats_median(&st[ch]);
+            c->mean = mean;
+            c->rms = sqrt(MAX(0.0, (double)st[ch].sum2 / st[ch].n - mean * mean));
+            c->min = st[ch].min;
+            c->max = st[ch].max;
+        } else {
+            c->baseline = c->mean = c->rms = NAN;
+            c->min = c->max = 0;
+        }
+        c->rate = st[ch].n / dt;
+        memcpy(c->hist, st[ch].hist, sizeof(c->hist));
+    }
+    shm_stats_write_end(sp);
+}
+
+int main(int argc, char **argv)
+{
+    int shmfd;
+    void *shmp;
+    shm_sync_t *ssv;
+    shm_telem_slot_t *slot;
+    size_t shmSize, ch, nSegs, lastSeg, wrBytes0, wrBytes, wrBytesPrev, sampled = 0, n;
+    uint64_t t0;
+    param_t pm;
+    int optC = 0;
+    double t, tLast;
+    char statsName[256];
+    shm_stats_t *sp;
+    struct wavproc_stats st[SCOPE_NCH];
+    const struct timespec nap = {0, 1000000};
+
+    memcpy(&pm, &paramDefault, sizeof(pm));
+    while ((optC = getopt(argc, argv, "c:f:i:n:p:v")) != -1) {
+        switch (optC) {
+        case 'c':
+            pm.nCh = MIN(SCOPE_NCH, strtoull(optarg, NULL, 10));
+            break;
+        case 'f':
+            pm.fraction = MIN(1.0, strtod(optarg, NULL));
+            break;
+        case 'i':
+            pm.interval = strtod(optarg, NULL);
+            break;
+        case 'n':
+            pm.shmName = optarg;
+            break;
+        case 'p':
+            pm.nPt = strtoull(optarg, NULL, 10);
+            break;
+        case 'v':
+            pm.verbose = 1;
+            break;
+        default:
+            print_usage(&pm, stderr);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+
+    shmfd = shm_connect(pm.shmName, &shmp, &shmSize, &ssv);
+    if (shmfd<0 || shmp==NULL) return EXIT_FAILURE;
+    close(shmfd);
+    snprintf(statsName, sizeof(statsName), "%s%s", pm.shmName, SHM_STATS_SUFFIX);
+    if ((sp = shm_stats_open(statsName, 1)) == NULL) return EXIT_FAILURE;
+    signal(SIGINT,  signal_kill_handler);
+    signal(SIGTERM, signal_kill_handler);
+
+    slot = shm_telem_attach(ssv, "ndmon", SHM_TELEM_SPECTATOR);
+    memset(st, 0, sizeof(st));
+    wrBytes0 = wrBytesPrev = shm_get_write_count(ssv, NULL, &lastSeg);
+    tLast = time_now();
+    while (!stopQ) {
+        shm_get_write_count(ssv, NULL, &nSegs);
+        if (nSegs > lastSeg) { /* segment nSegs-1 just completed */
+            t0 = shm_telem_now();
+            sampled += n = sample_segment(shmp, ssv, nSegs - 1, &pm, st);
+            shm_telem_segment(slot, ssv, n, shm_telem_now() - t0);
+            lastSeg = nSegs;
+        } else {
+            nanosleep(&nap, NULL);
+        }
+        if ((t = time_now()) - tLast < pm.interval) continue;
+        wrBytes = shm_get_write_count(ssv, NULL, NULL);
+        publish(sp, st, &pm, t, t - tLast, (wrBytes - wrBytesPrev) / (t - tLast),
+                sampled, wrBytes - wrBytes0);
+        if (pm.verbose) {
+            printf("%.1f MiB/s, sampled %.3g%%:", (wrBytes - wrBytesPrev) / (t - tLast) / 1048576,
+                   wrBytes > wrBytes0 ? 100.0 * sampled / (wrBytes - wrBytes0) : 0.0);
+            for (ch=0; ch<pm.nCh; ch++)
+                printf("  CH%zd %.1f+-%.2f [%d,%d]", ch+1, sp->ch[ch].baseline, sp->ch[ch].rms,
+                       sp->ch[ch].min, sp->ch[ch].max);
+            printf("\n");
+            fflush(stdout);
+        }
+        memset(st, 0, sizeof(st));
+        wrBytesPrev = wrBytes;
+        tLast = t;
+    }
+    fprintf(stderr, "Analyzed %zd of %zd bytes written.\n", sampled,
+            shm_get_write_count(ssv, NULL, NULL) - wrBytes0);
+    shm_telem_detach(slot);
+    shm_stats_close(sp);
+    shm_unlink(statsName);
+    munmap(shmp, shmSize);
+    return EXIT_SUCCESS;
+}
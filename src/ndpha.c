@@ -0,0 +1,402 @@
+/** \file
+ * NetDAQ pulse height analysis: per-pulse energy and time lists.
+ *
+ * Every channel of every event is triggered on the slope of its pulses,
+ * shaped by a pole-zero corrected trapezoid for the energy and timed
+ * by a constant-fraction discriminator (dpp.h).  Live, it is a
+ * spectator on the shared memory like ndpsd and follows every channel
+ * as one continuous stream through the completed segments, the filters
+ * carrying on across records and segments; offline (-f), it goes
+ * through the events of an hdf5rawWaveformIo file in batches spread
+ * over threads, every event or FastFrame frame filtered on its own.
+ * The list is a text file, one pulse per line.
+ */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "ipc.h"
+#include "hdf5rawWaveformIo.h"
+#include "dpp.h"
+#include "thpool.h"
+
+/** Parameters settable from commandline */
+typedef struct param
+{
+    char   *shmName;      //!< shared memory object name, system-wide.
+    char   *inFName;      //!< HDF5 input file, NULL: live from shm.
+    char   *outFName;     //!< pulse list, text.
+    size_t  nCh;          //!< channels in each event record, live only.
+    size_t  nPt;          //!< points per channel in each event record, live only.
+    double  dt;           //!< sampling interval, live only.
+    size_t  nBatch;       //!< events processed together, file only.
+    size_t  nThreads;     //!< threads, 0: online CPUs.
+    struct dpp_param dp;
+} param_t;
+
+param_t paramDefault = {
+    .shmName  = SHM_NAME,
+    .inFName  = NULL,
+    .outFName = "pulses.txt",
+    .nCh      = SCOPE_NCH,
+    .nPt      = 1000,
+    .dt       = 1.0,
+    .nBatch   = 256,
+    .nThreads = 0,
+    .dp       = {
+        .polarity    = 1,
+        .nBase       = 100,
+        .baseMedian  = 0,
+        .threshold   = 20,
+        .holdoff     = 0,
+        .rise        = 20,
+        .gap         = 10,
+        .tau         = 0.0,
+        .peakDelay   = 0,
+        .nPeak       = 0,
+        .cfdFraction = 0.3,
+        .cfdDelay    = 4,
+    },
+};
+
+static void print_usage(const param_t *pm, FILE *s)
+{
+    fprintf(s, "Usage:\n");
+    fprintf(s, "      -B nBase [%zd]: Leading samples averaged for the baseline;\n"
+               "         live, the median of the last nBase samples follows it.\n",
+            pm->dp.nBase);
+    fprintf(s, "      -b nBatch [%zd]: Events processed together (file).\n", pm->nBatch);
+    fprintf(s, "      -c nCh [%zd]: Channels in each event record (live).\n", pm->nCh);
+    fprintf(s, "      -D cfdDelay [%zd]: CFD delay, about the rise of the pulses.\n",
+            pm->dp.cfdDelay);
+    fprintf(s, "      -d dt [%g]: Sampling interval (live).\n", pm->dt);
+    fprintf(s, "      -F cfdFraction [%g]: CFD fraction.\n", pm->dp.cfdFraction);
+    fprintf(s, "      -f inFName [none]: Pulses of the events of an HDF5 file instead of shm.\n");
+    fprintf(s, "      -g gap [%zd]: Flat top of the trapezoid, 0: triangle.\n", pm->dp.gap);
+    fprintf(s, "      -h holdoff [%zd]: Samples after a trigger without a new one, "
+            "0: 2 rise + gap.\n", pm->dp.holdoff);
+    fprintf(s, "      -j nThreads [%zd]: Threads, 0: online CPUs.\n", pm->nThreads);
+    fprintf(s, "      -k rise [%zd]: Rise time of the trapezoid.\n", pm->dp.rise);
+    fprintf(s, "      -M : Baseline from the median of the nBase samples, not their mean.\n");
+    fprintf(s, "      -m nPeak [%zd]: Trapezoid samples averaged, 0: gap / 2.\n", pm->dp.nPeak);
+    fprintf(s, "      -N : Negative pulses.\n");
+    fprintf(s, "      -n shmName [\"%s\"]: Shared memory object name, system-wide.\n", pm->shmName);
+    fprintf(s, "      -o outFName [\"%s\"]: Pulse list.\n", pm->outFName);
+    fprintf(s, "      -P peakDelay [%zd]: Trapezoid read this long after the trigger, "
+            "0: rise + gap / 4.\n", pm->dp.peakDelay);
+    fprintf(s, "      -p nPt [%zd]: Points per channel in each event record (live).\n", pm->nPt);
+    fprintf(s, "      -T tau [%g]: Decay time of the pulses for the pole-zero correction,\n"
+               "         0: step pulses.\n", pm->dp.tau);
+    fprintf(s, "      -t threshold [%d]: Trigger on a rise by threshold ADC counts within\n"
+               "         cfdDelay samples.\n",
+            pm->dp.threshold);
+    fprintf(s, "  Live lists are in ADC counts and seconds from\n"
+               "  the start of the stream, those of files in V and in the time of the event.\n");
+    fprintf(s, "  Live, every channel is one stream: the filters carry on across records\n"
+               "  and segments and pulses at the end of one are measured in the next.\n"
+               "  Falling more than half the ring behind skips to the newest segment and\n"
+               "  starts over from rest.  Every event or frame of a file is filtered on\n"
+               "  its own, from rest after its baseline.\n");
+}
+
+static volatile sig_atomic_t stopQ = 0;
+static void signal_kill_handler(int sig)
+{
+    stopQ = 1;
+}
+
+static int pulses_of_file(const param_t *pm, thpool_t *pool, FILE *fp)
+{
+    struct HDF5IO(waveform_file) *wavFile;
+    struct HDF5IO(waveform_event) evt;
+    struct waveform_attribute wavAttr;
+    struct dpp_pulse *pulses;
+    double gain[SCOPE_NCH], *frameTimes, tFrame;
+    unsigned chNum[SCOPE_NCH];
+    size_t nCh = 0, ch, nFr, frameLen, evtLen, nEvt, nRows, maxPulses, nPulses, k, e, ev0;
+    SCOPE_DATA_TYPE *buf;
+    int ret = 0;
+
+    if ((wavFile = HDF5IO(open_file_for_read)(pm->inFName)) == NULL) {
+        error_printf("Cannot open %s.\n", pm->inFName);
+        return -1;
+    }
+    HDF5IO(read_waveform_attribute_in_file_header)(wavFile, &wavAttr);
+    for (ch=0; ch<SCOPE_NCH; ch++) {
+        if (wavAttr.chMask & (1U << ch)) {
+            gain[nCh] = wavAttr.ymult[ch];
+            chNum[nCh++] = ch + 1;
+        }
+    }
+    /* FastFrame: every frame is a waveform of its own. */
+    nFr = MAX(1, wavAttr.nFrames);
+    frameLen = wavAttr.nPt / nFr;
+    evtLen = nCh * wavAttr.nPt;
+    buf = (SCOPE_DATA_TYPE*)malloc(pm->nBatch * evtLen * sizeof(SCOPE_DATA_TYPE));
+    frameTimes = (double*)malloc(pm->nBatch * nFr * sizeof(double));
+    maxPulses = pm->nBatch * nCh * nFr * (frameLen / (pm->dp.holdoff + 1) + 1);
+    pulses = (struct dpp_pulse*)malloc(maxPulses * sizeof(struct dpp_pulse));
+
+    fprintf(fp, "# event ch time energy\n");
+    for (ev0=0; ev0<wavFile->nEvents && !stopQ && ret == 0; ev0+=nEvt) {
+        nEvt = MIN(pm->nBatch, wavFile->nEvents - ev0);
+        for (e=0; e<nEvt; e++) {
+            evt.eventId = ev0 + e;
+            evt.wavBuf = buf + e * evtLen;
+            evt.frameTimes = NULL;
+            frameTimes[e * nFr] = NAN;
+            /* Only FastFrame files (ndtrig's among them) have time stamps. */
+            if ((wavAttr.nFrames ? HDF5IO(read_frames)(wavFile, evt.eventId, 0, nFr, wavAttr.chMask,
+                                                       evt.wavBuf, frameTimes + e * nFr)
+                                 : HDF5IO(read_event)(wavFile, &evt)) < 0) {
+                ret = -1;
+                break;
+            }
+        }
+        nRows = e * nCh * nFr;
+        nPulses = dpp_process(pulses, maxPulses, buf, nRows, frameLen, frameLen, &pm->dp, pool);
+        for (k=0; k<nPulses; k++) {
+            /* row = (event * nCh + ch) * nFr + frame */
+            e = pulses[k].wfm / (nCh * nFr);
+            ch = pulses[k].wfm / nFr % nCh;
+            tFrame = frameTimes[e * nFr + pulses[k].wfm % nFr];
+            fprintf(fp, "%zd %u %.9g %.6g\n", ev0 + e, chNum[ch],
+                    (isfinite(tFrame) ? tFrame : 0.0) + wavAttr.t0 + pulses[k].time * wavAttr.dt,
+                    pulses[k].energy * gain[ch]);
+        }
+    }
+    free(pulses);
+    free(frameTimes);
+    free(buf);
+    HDF5IO(close_file)(wavFile);
+    return ret;
+}
+
+/** A channel stream through the segments of the shm. */
+typedef struct live
+{
+    struct dpp_stream *ds;
+    size_t evtBytes;
+    size_t nextSeg;           //!< segment expected next, to tell gaps.
+    size_t recIdx;            //!< record the next sample fed belongs to.
+    SCOPE_DATA_TYPE *carry;   //!< record straddling segments, so far.
+    size_t nCarry;            //!< its bytes.
+    struct dpp_pulse *pulses;
+    size_t maxPulses;
+} live_t;
+
+/** Feed nRec records to the streams and list the pulses they complete. */
+static void pulses_of_records(live_t *lv, const param_t *pm, const SCOPE_DATA_TYPE *rec,
+                              size_t nRec, FILE *fp)
+{
+    size_t nPulses, k;
+    double t;
+
+    if (nRec == 0) return;
+    nPulses = dpp_stream_process(lv->pulses, lv->maxPulses, lv->ds, rec, nRec, pm->nPt);
+    for (k=0; k<nPulses; k++) {
+        /* Samples from the start of the stream; negative times are of
+         * pulses triggered in earlier records. */
+        t = (double)lv->recIdx * pm->nPt + lv->pulses[k].time;
+        fprintf(fp, "%zd %zd %.9g %.6g\n", t > 0 ? (size_t)(t / pm->nPt) : 0,
+                lv->pulses[k].wfm + 1, t * pm->dt, lv->pulses[k].energy);
+    }
+    lv->recIdx += nRec;
+}
+
+/** List the pulses completed by segment number seg. */
+static void pulses_of_segment(const void *shmp, shm_sync_t *ssv, size_t seg, const param_t *pm,
+                              live_t *lv, FILE *fp)
+{
+    const size_t segBytes = ssv->segLen * ssv->elemSize;
+    const uint8_t *p;
+    size_t off, c, nRec;
+
+    p = (const uint8_t*)((const SHM_ELEM_TYPE*)shmp + ssv->segLen * (seg % ssv->nSeg));
+    if (seg != lv->nextSeg) { /* a gap: start over at the first whole record */
+        dpp_stream_reset(lv->ds);
+        lv->nCarry = 0;
+        off = shm_record_offset(ssv, seg, lv->evtBytes);
+        if (off >= segBytes) { /* none starts in this segment */
+            lv->nextSeg = SIZE_MAX;
+            return;
+        }
+        lv->recIdx = (seg * segBytes + off) / lv->evtBytes;
+    } else if (lv->nCarry) { /* complete the record begun before */
+        off = MIN(segBytes, lv->evtBytes - lv->nCarry);
+        memcpy((uint8_t*)lv->carry + lv->nCarry, p, off);
+        lv->nCarry += off;
+        if (lv->nCarry == lv->evtBytes) {
+            pulses_of_records(lv, pm, lv->carry, 1, fp);
+            lv->nCarry = 0;
+        }
+    } else {
+        off = 0;
+    }
+    nRec = (segBytes - off) / lv->evtBytes;
+    pulses_of_records(lv, pm, (const SCOPE_DATA_TYPE*)(p + off), nRec, fp);
+    c = segBytes - off - nRec * lv->evtBytes;
+    memcpy((uint8_t*)lv->carry + lv->nCarry, p + off + nRec * lv->evtBytes, c);
+    lv->nCarry += c;
+    lv->nextSeg = seg + 1;
+    fflush(fp);
+}
+
+static int pulses_of_shm(const param_t *pm, FILE *fp)
+{
+    int shmfd, ret = 0;
+    void *shmp;
+    shm_sync_t *ssv;
+    size_t shmSize, nSegs, lastSeg, seg;
+    const struct timespec nap = {0, 1000000};
+    live_t lv = {0};
+
+    shmfd = shm_connect(pm->shmName, &shmp, &shmSize, &ssv);
+    if (shmfd<0 || shmp==NULL) return -1;
+    close(shmfd);
+    lv.evtBytes = pm->nCh * pm->nPt * sizeof(SCOPE_DATA_TYPE);
+    lv.ds = dpp_stream_create(&pm->dp, pm->nCh);
+    lv.carry = (SCOPE_DATA_TYPE*)malloc(lv.evtBytes);
+    if (lv.ds) {
+        /* A call gets at most a segment of records and the pulses left
+         * pending by the one before. */
+        lv.maxPulses = pm->nCh * ((ssv->segLen * ssv->elemSize / lv.evtBytes + 1) * pm->nPt
+                                  / (pm->dp.holdoff + 1) + 1 + lv.ds->maxPend);
+        lv.pulses = (struct dpp_pulse*)malloc(lv.maxPulses * sizeof(struct dpp_pulse));
+    }
+    if (lv.ds == NULL || lv.carry == NULL || lv.pulses == NULL) {
+        error_printf("%s(): allocation failure.\n", __func__);
+        ret = -1;
+        goto out;
+    }
+    fprintf(fp, "# record ch time energy\n");
+    shm_get_write_count(ssv, NULL, &lastSeg);
+    lv.nextSeg = SIZE_MAX;
+    while (!stopQ) {
+        shm_get_write_count(ssv, NULL, &nSegs);
+        if (nSegs > lastSeg) {
+            /* Segments soon to be written over are given up on. */
+            seg = nSegs - lastSeg > ssv->nSeg / 2 ? nSegs - 1 : lastSeg;
+            for (; seg<nSegs && !stopQ; seg++)
+                pulses_of_segment(shmp, ssv, seg, pm, &lv, fp);
+            lastSeg = nSegs;
+        } else {
+            nanosleep(&nap, NULL);
+        }
+    }
+out:
+    free(lv.pulses);
+    free(lv.carry);
+    dpp_stream_destroy(lv.ds);
+    munmap(shmp, shmSize);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    param_t pm;
+    int optC = 0, ret;
+    thpool_t *pool;
+    FILE *fp;
+
+    memcpy(&pm, &paramDefault, sizeof(pm));
+    while ((optC = getopt(argc, argv, "B:b:c:D:d:F:f:g:h:j:k:Mm:Nn:o:P:p:T:t:")) != -1) {
+        switch (optC) {
+        case 'B':
+            pm.dp.nBase = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            pm.nBatch = MAX(1, strtoull(optarg, NULL, 10));
+            break;
+        case 'c':
+            pm.nCh = MIN(SCOPE_NCH, strtoull(optarg, NULL, 10));
+            break;
+        case 'D':
+            pm.dp.cfdDelay = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            pm.dt = strtod(optarg, NULL);
+            break;
+        case 'F':
+            pm.dp.cfdFraction = strtod(optarg, NULL);
+            break;
+        case 'f':
+            pm.inFName = optarg;
+            break;
+        case 'g':
+            pm.dp.gap = strtoull(optarg, NULL, 10);
+            break;
+        case 'h':
+            pm.dp.holdoff = strtoull(optarg, NULL, 10);
+            break;
+        case 'j':
+            pm.nThreads = strtoull(optarg, NULL, 10);
+            break;
+        case 'k':
+            pm.dp.rise = MAX(1, strtoull(optarg, NULL, 10));
+            break;
+        case 'M':
+            pm.dp.baseMedian = 1;
+            break;
+        case 'm':
+            pm.dp.nPeak = strtoull(optarg, NULL, 10);
+            break;
+        case 'N':
+            pm.dp.polarity = -1;
+            break;
+        case 'n':
+            pm.shmName = optarg;
+            break;
+        case 'o':
+            pm.outFName = optarg;
+            break;
+        case 'P':
+            pm.dp.peakDelay = strtoull(optarg, NULL, 10);
+            break;
+        case 'p':
+            pm.nPt = strtoull(optarg, NULL, 10);
+            break;
+        case 'T':
+            pm.dp.tau = strtod(optarg, NULL);
+            break;
+        case 't':
+            pm.dp.threshold = (int)strtol(optarg, NULL, 10);
+            break;
+        default:
+            print_usage(&pm, stderr);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+    if (pm.dp.holdoff == 0) pm.dp.holdoff = 2 * pm.dp.rise + pm.dp.gap;
+    if (pm.dp.peakDelay == 0) pm.dp.peakDelay = pm.dp.rise + pm.dp.gap / 4;
+    if (pm.dp.nPeak == 0) pm.dp.nPeak = MAX(1, pm.dp.gap / 2);
+    if (pm.dp.cfdFraction <= 0 || pm.dp.cfdFraction >= 1) {
+        error_printf("CFD fraction %g is not between 0 and 1.\n", pm.dp.cfdFraction);
+        return EXIT_FAILURE;
+    }
+
+    if ((fp = fopen(pm.outFName, "w")) == NULL) {
+        perror(pm.outFName);
+        return EXIT_FAILURE;
+    }
+    if ((pool = thpool_create(pm.nThreads)) == NULL) {
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+    signal(SIGINT,  signal_kill_handler);
+    signal(SIGTERM, signal_kill_handler);
+    ret = pm.inFName ? pulses_of_file(&pm, pool, fp) : pulses_of_shm(&pm, fp);
+    thpool_destroy(pool);
+    fclose(fp);
+    return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,278 @@
+/** \file
+ * NetDAQ noise spectra: averaged power spectral density per channel.
+ *
+ * Live, it is a spectator on the shared memory like ndmon: the event
+ * records of every newly completed segment are transformed while the
+ * consumer is not disturbed.  Offline (-f), it goes through the events
+ * of an hdf5rawWaveformIo file.  The spectra are written as columns of
+ * a text file, replaced atomically every interval.
+ */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "utils.h"
+#include "ipc.h"
+#include "hdf5rawWaveformIo.h"
+#include "psd.h"
+
+/** Parameters settable from commandline */
+typedef struct param
+{
+    char   *shmName;      //!< shared memory object name, system-wide.
+    char   *inFName;      //!< HDF5 input file, NULL: live from shm.
+    char   *outFName;     //!< spectra, text.
+    char   *wisdomFName;  //!< FFTW wisdom kept across runs, NULL: none.
+    size_t  nCh;          //!< channels in each event record.
+    size_t  nPt;          //!< points per channel in each event record.
+    size_t  nFft;         //!< FFT length.
+    size_t  nBatch;       //!< blocks per FFTW call.
+    size_t  nThreads;     //!< FFTW threads, 0: online CPUs.
+    double  dt;           //!< sampling interval, live only.
+    double  interval;     //!< seconds between writes of the spectra, live only.
+    int     verbose;      //!< print the RMS of every channel on every write.
+} param_t;
+
+param_t paramDefault = {
+    .shmName     = SHM_NAME,
+    .inFName     = NULL,
+    .outFName    = "psd.txt",
+    .wisdomFName = "ndpsd.wisdom",
+    .nCh         = SCOPE_NCH,
+    .nPt         = 1000,
+    .nFft        = 1000,
+    .nBatch      = 64,
+    .nThreads    = 0,
+    .dt          = 1.0,
+    .interval    = 1.0,
+    .verbose     = 0,
+};
+
+static void print_usage(const param_t *pm, FILE *s)
+{
+    fprintf(s, "Usage:\n");
+    fprintf(s, "      -b nBatch [%zd]: Blocks per FFTW call.\n", pm->nBatch);
+    fprintf(s, "      -c nCh [%zd]: Channels in each event record (live).\n", pm->nCh);
+    fprintf(s, "      -d dt [%g]: Sampling interval (live).\n", pm->dt);
+    fprintf(s, "      -f inFName [none]: Spectra of the events of an HDF5 file instead of shm.\n");
+    fprintf(s, "      -i interval [%g]: Seconds between writes of the spectra (live).\n",
+            pm->interval);
+    fprintf(s, "      -j nThreads [%zd]: FFTW threads, 0: online CPUs.\n", pm->nThreads);
+    fprintf(s, "      -k wisdomFName [\"%s\"]: FFTW wisdom kept across runs, \"\": none.\n",
+            pm->wisdomFName);
+    fprintf(s, "      -N nFft [%zd]: FFT length, at most nPt.\n", pm->nFft);
+    fprintf(s, "      -n shmName [\"%s\"]: Shared memory object name, system-wide.\n", pm->shmName);
+    fprintf(s, "      -o outFName [\"%s\"]: Spectra, columns f and one PSD per channel.\n",
+            pm->outFName);
+    fprintf(s, "      -p nPt [%zd]: Points per channel in each event record (live).\n", pm->nPt);
+    fprintf(s, "      -v : Print the RMS of every channel on every write.\n");
+    fprintf(s, "  Live spectra are in ADC counts^2/Hz, those of files in V^2/Hz.\n");
+}
+
+static volatile sig_atomic_t stopQ = 0;
+static void signal_kill_handler(int sig)
+{
+    stopQ = 1;
+}
+
+/** Write the spectra of nCh channels, each scaled by gain[ch]^2, and
+ * replace fname atomically. */
+static int write_spectra(const char *fname, psd_t *p, size_t nCh, const double *gain, double fs,
+                         int verbose)
+{
+    const size_t nBins = psd_nbins(p);
+    double *s = (double*)malloc(nCh * nBins * sizeof(double)), rms;
+    size_t ch, k, nAvg = 0;
+    char tmpName[4096];
+    FILE *fp;
+
+    psd_flush(p);
+    for (ch=0; ch<nCh; ch++) {
+        nAvg = MAX(nAvg, psd_result(p, ch, s + ch * nBins, fs));
+        for (k=0; k<nBins; k++) s[ch * nBins + k] *= gain[ch] * gain[ch];
+    }
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", fname);
+    if ((fp = fopen(tmpName, "w")) == NULL) {
+        perror(tmpName);
+        free(s);
+        return -1;
+    }
+    fprintf(fp, "# %zd blocks of %zd averaged\n# f", nAvg, 2 * (nBins - 1));
+    for (ch=0; ch<nCh; ch++) fprintf(fp, " CH%zd", ch+1);
+    fprintf(fp, "\n");
+    for (k=0; k<nBins; k++) {
+        fprintf(fp, "%.9g", k * fs / (2 * (nBins - 1)));
+        for (ch=0; ch<nCh; ch++) fprintf(fp, " %.6g", s[ch * nBins + k]);
+        fprintf(fp, "\n");
+    }
+    fclose(fp);
+    if (verbose) {
+        /* Parseval, without DC: the noise RMS. */
+        printf("%zd blocks:", nAvg);
+        for (ch=0; ch<nCh; ch++) {
+            for (k=1, rms=0; k<nBins; k++) rms += s[ch * nBins + k];
+            printf("  CH%zd %.4g", ch+1, sqrt(rms * fs / (2 * (nBins - 1))));
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+    free(s);
+    return rename(tmpName, fname);
+}
+
+static int spectra_of_file(const param_t *pm)
+{
+    struct HDF5IO(waveform_file) *wavFile;
+    struct HDF5IO(waveform_event) evt;
+    struct waveform_attribute wavAttr;
+    double gain[SCOPE_NCH];
+    size_t nCh = 0, ch;
+    psd_t *p;
+    int ret;
+
+    if ((wavFile = HDF5IO(open_file_for_read)(pm->inFName)) == NULL) {
+        error_printf("Cannot open %s.\n", pm->inFName);
+        return -1;
+    }
+    HDF5IO(read_waveform_attribute_in_file_header)(wavFile, &wavAttr);
+    for (ch=0; ch<SCOPE_NCH; ch++) {
+        if (wavAttr.chMask & (1U << ch)) gain[nCh++] = wavAttr.ymult[ch];
+    }
+    if ((p = psd_create(MIN(pm->nFft, wavAttr.nPt), pm->nBatch, nCh, pm->nThreads)) == NULL) {
+        HDF5IO(close_file)(wavFile);
+        return -1;
+    }
+    evt.wavBuf = (SCOPE_DATA_TYPE*)malloc(nCh * wavAttr.nPt * sizeof(SCOPE_DATA_TYPE));
+    evt.frameTimes = NULL;
+    for (evt.eventId=0; evt.eventId<wavFile->nEvents && !stopQ; evt.eventId++) {
+        if (HDF5IO(read_event)(wavFile, &evt) < 0) break;
+        for (ch=0; ch<nCh; ch++)
+            psd_accumulate(p, ch, evt.wavBuf + ch * wavAttr.nPt, wavAttr.nPt);
+    }
+    ret = write_spectra(pm->outFName, p, nCh, gain, 1.0 / wavAttr.dt, 1);
+    free(evt.wavBuf);
+    psd_destroy(p);
+    HDF5IO(close_file)(wavFile);
+    return ret;
+}
+
+/** Transform the whole records of segment number seg. */
+static void spectra_of_segment(const void *shmp, shm_sync_t *ssv, size_t seg, const param_t *pm,
+                               psd_t *p)
+{
+    const size_t segBytes = ssv->segLen * ssv->elemSize;
+    const size_t evtBytes = pm->nCh * pm->nPt * sizeof(SCOPE_DATA_TYPE);
+    const SCOPE_DATA_TYPE *rec;
+    size_t off, ch;
+
+    rec = (const SCOPE_DATA_TYPE*)shm_acquire_oldest_segment(shmp, ssv);
+    for (off=shm_record_offset(ssv, seg, evtBytes); off+evtBytes<=segBytes; off+=evtBytes) {
+        for (ch=0; ch<pm->nCh; ch++)
+            psd_accumulate(p, ch, rec + off + ch * pm->nPt, pm->nPt);
+    }
+}
+
+static int spectra_of_shm(const param_t *pm)
+{
+    int shmfd;
+    void *shmp;
+    shm_sync_t *ssv;
+    size_t shmSize, nSegs, lastSeg, ch;
+    double gain[SCOPE_NCH], t, tLast;
+    const struct timespec nap = {0, 1000000};
+    psd_t *p;
+
+    shmfd = shm_connect(pm->shmName, &shmp, &shmSize, &ssv);
+    if (shmfd<0 || shmp==NULL) return -1;
+    close(shmfd);
+    if ((p = psd_create(MIN(pm->nFft, pm->nPt), pm->nBatch, pm->nCh, pm->nThreads)) == NULL) {
+        munmap(shmp, shmSize);
+        return -1;
+    }
+    for (ch=0; ch<SCOPE_NCH; ch++) gain[ch] = 1.0;
+    shm_get_write_count(ssv, NULL, &lastSeg);
+    tLast = time_now();
+    while (!stopQ) {
+        shm_get_write_count(ssv, NULL, &nSegs);
+        if (nSegs > lastSeg) { /* segment nSegs-1 just completed */
+            spectra_of_segment(shmp, ssv, nSegs - 1, pm, p);
+            lastSeg = nSegs;
+        } else {
+            nanosleep(&nap, NULL);
+        }
+        if ((t = time_now()) - tLast < pm->interval) continue;
+        write_spectra(pm->outFName, p, pm->nCh, gain, 1.0 / pm->dt, pm->verbose);
+        psd_reset(p);
+        tLast = t;
+    }
+    psd_destroy(p);
+    munmap(shmp, shmSize);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    param_t pm;
+    int optC = 0, ret;
+
+    memcpy(&pm, &paramDefault, sizeof(pm));
+    while ((optC = getopt(argc, argv, "b:c:d:f:i:j:k:N:n:o:p:v")) != -1) {
+        switch (optC) {
+        case 'b':
+            pm.nBatch = MAX(1, strtoull(optarg, NULL, 10));
+            break;
+        case 'c':
+            pm.nCh = MIN(SCOPE_NCH, strtoull(optarg, NULL, 10));
+            break;
+        case 'd':
+            pm.dt = strtod(optarg, NULL);
+            break;
+        case 'f':
+            pm.inFName = optarg;
+            break;
+        case 'i':
+            pm.interval = strtod(optarg, NULL);
+            break;
+        case 'j':
+            pm.nThreads = strtoull(optarg, NULL, 10);
+            break;
+        case 'k':
+            pm.wisdomFName = optarg[0] ? optarg : NULL;
+            break;
+        case 'N':
+            pm.nFft = MAX(2, strtoull(optarg, NULL, 10));
+            break;
+        case 'n':
+            pm.shmName = optarg;
+            break;
+        case 'o':
+            pm.outFName = optarg;
+            break;
+        case 'p':
+            pm.nPt = strtoull(optarg, NULL, 10);
+            break;
+        case 'v':
+            pm.verbose = 1;
+            break;
+        default:
+            print_usage(&pm, stderr);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+    if (psd_init(pm.wisdomFName) < 0) return EXIT_FAILURE;
+    signal(SIGINT,  signal_kill_handler);
+    signal(SIGTERM, signal_kill_handler);
+    ret = pm.inFName ? spectra_of_file(&pm) : spectra_of_shm(&pm);
+    psd_cleanup(pm.wisdomFName);
+    return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -47,13 +47,15 @@ typedef struct param
     size_t  shmSegLen;          //!< shared memory segment length.
     size_t  shmNSeg;            //!< shared memory number of segments.
     int     shmRmQ;             //!< remove shared memory if already exist.
+    int     traceQ;             //!< record segment events in shmName SHM_TRACE_SUFFIX.
 } param_t;
 
 param_t paramDefault = {
     .shmName   = SHM_NAME,
     .shmSegLen = SHM_SEG_LEN,
     .shmNSeg   = SHM_NSEG,
-    .shmRmQ    = 0
+    .shmRmQ    = 0,
+    .traceQ    = 0
 };
 
 static param_t pm;
@@ -64,6 +66,8 @@ static void print_usage(const param_t *pm, FILE *s)
     fprintf(s, "      -l shmSegLen [%zd]: Shared memory segment length.\n", pm->shmSegLen);
     fprintf(s, "      -n shmName [\"%s\"]: Shared memory object name, system-wide.\n", pm->shmName);
     fprintf(s, "      -s shmNSeg [%zd]: Shared memory number of segments.\n", pm->shmNSeg);
+    fprintf(s, "      -t : Trace segments into shmName\"%s\", for ndtrace; it is kept after exit.\n",
+            SHM_TRACE_SUFFIX);
     fprintf(s, "      host port : TCP host:port to get data from.\n");
 }
 
@@ -79,6 +83,8 @@ static void atexit_shm_cleanup(void)
 }
 
 static int nsfd=0; /**< network socket fd. */
+static volatile sig_atomic_t stopQ = 0;
+static const unsigned int wrCountInterval=1; /**< seconds between write rate reports. */
 static int sock_connect_retry(int sockfd, const struct sockaddr *addr, socklen_t alen)
 {
     const int MAXSLEEP=2;
@@ -152,8 +158,8 @@ static void sock_close(int sockfd)
  * @param[in] qmsg query message to be sent to peer to ask for more data.
  * @param[in] dblksz expected datablock size sent by peer after each query.
  */
-static int sock_recv_data(int sockfd, void *p, shm_sync_t *ssv,
-                          const char *qmsg, size_t qmlen, size_t dblksz)
+static int sock_recv_data(int sockfd, void *p, shm_sync_t *ssv, shm_telem_slot_t *slot,
+                          shm_trace_t *tr, const char *qmsg, size_t qmlen, size_t dblksz)
 {
     if (sockfd<0) return -1;
 
@@ -178,14 +184,21 @@ static int sock_recv_data(int sockfd, void *p, shm_sync_t *ssv,
     const size_t bufsz = ssv->segLen * ssv->elemSize;
     ssize_t rem, dblki=0;
     int qmsent = 0;
+    uint64_t t0, t1, tReport = shm_telem_now();
+    size_t b, s, seg, bReport = 0, sReport = 0;
 
     while (1) {
         do {buf = (char*)shm_acquire_next_segment_sync(p, ssv, SHM_SEG_WRITE);
-        } while (buf == NULL);
+        } while (buf == NULL && !stopQ);
+        if (stopQ) return 0;
+        t0 = shm_telem_now();
+        shm_get_write_count(ssv, NULL, &seg);
+        shm_trace_event(tr, SHM_TRACE_FILL_START, seg);
 
         bufp = buf;
         rem  = bufsz;
         for (;;) {
+            if (stopQ) return 0;
             FD_ZERO(&rfd);
             FD_SET(sockfd, &rfd);
             maxfd = sockfd;
@@ -229,43 +242,29 @@ static int sock_recv_data(int sockfd, void *p, shm_sync_t *ssv,
             }
         }
         shm_update_write_count(ssv, bufsz, 1);
+        shm_trace_event(tr, SHM_TRACE_FILL_DONE, seg);
+        t1 = shm_telem_now();
+        shm_telem_segment(slot, ssv, bufsz, t1 - t0);
+        if (t1 - tReport >= wrCountInterval * 1000000000ULL) {
+            shm_get_write_count(ssv, &b, &s);
+            printf("Bytes wr: %15zd, rate: %7.1f MiB/s; ",
+                   b, (b-bReport) * 1e9 / ((t1 - tReport) * 1024 * 1024.0));
+            printf("Segs wr: %8zd, rate: %5.0f/s\n", s, (s-sReport) * 1e9 / (t1 - tReport));
+            bReport = b;
+            sReport = s;
+            tReport = t1;
+        }
     }
 
     return 0;
 }
 
 static struct timespec startTime, stopTime;
+static shm_telem_slot_t *slot;
+static shm_trace_t *trace;
 static void signal_kill_handler(int sig)
 {
-    clock_gettime(CLOCK_MONOTONIC, &stopTime);
-    printf("\nStart time = %zd.%09zd\n", startTime.tv_sec, startTime.tv_nsec);
-    printf(  "Stop time  = %zd.%09zd\n", stopTime.tv_sec, stopTime.tv_nsec);
-    fflush(stdout);
-
-    fprintf(stderr, "Killed, cleaning up...\n");
-    alarm(0);
-    sock_close(nsfd);
-    atexit(atexit_shm_cleanup);
-    exit(EXIT_SUCCESS);
-}
-
-static size_t wrBytes=0, wrSegs=0;
-static unsigned int wrCountInterval=1;
-static void signal_alarm_handler(int sig)
-{
-    size_t b, s;
-
-    signal(SIGALRM, SIG_IGN);
-    if (ssv) {
-        shm_get_write_count(ssv, &b, &s);
-        printf("Bytes wr: %15zd, rate: %7.1f MiB/s; ",
-               b, (b-wrBytes)/(wrCountInterval * 1024 * 1024.0));
-        printf("Segs wr: %8zd, rate: %5zd/s\n", s, s-wrSegs);
-        wrBytes = b;
-        wrSegs  = s;
-    }
-    signal(SIGALRM, signal_alarm_handler);
-    alarm(wrCountInterval);
+    stopQ = 1;
 }
 
 int main(int argc, char **argv)
@@ -273,11 +272,11 @@ int main(int argc, char **argv)
     int shmfd;
     size_t pageSize, sz=0;
     int optC = 0;
-    char *host, *port;
+    char *host, *port, traceName[256];
 
     // parse switches
     memcpy(&pm, &paramDefault, sizeof(pm));
-    while ((optC = getopt(argc, argv, "dl:n:s:")) != -1) {
+    while ((optC = getopt(argc, argv, "dl:n:s:t")) != -1) {
         switch (optC) {
         case 'd':
             pm.shmRmQ = 1;
@@ -291,6 +290,9 @@ int main(int argc, char **argv)
         case 's':
             pm.shmNSeg = strtoull(optarg, NULL, 10);
             break;
+        case 't':
+            pm.traceQ = 1;
+            break;
         default:
             print_usage(&pm, stderr);
             return EXIT_FAILURE;
@@ -333,15 +335,17 @@ int main(int argc, char **argv)
     clock_gettime(CLOCK_MONOTONIC, &startTime);
     printf("Start time = %zd.%09zd\n", startTime.tv_sec, startTime.tv_nsec);
     /* Register for clean up. */
-    signal(SIGKILL, signal_kill_handler);
     signal(SIGINT,  signal_kill_handler);
+    signal(SIGTERM, signal_kill_handler);
     /* Initialize shm */
     shm_producer_init(ssv);
     ssv->segLen = pm.shmSegLen;
     ssv->nSeg   = pm.shmNSeg;
-    /* For write count */
-    signal(SIGALRM, signal_alarm_handler);
-    alarm(wrCountInterval);
+    slot = shm_telem_attach(ssv, "ndrecv", SHM_TELEM_PRODUCER);
+    if (pm.traceQ) {
+        snprintf(traceName, sizeof(traceName), "%s%s", pm.shmName, SHM_TRACE_SUFFIX);
+        if ((trace = shm_trace_open(traceName, SHM_TRACE_CREATE)) == NULL) return EXIT_FAILURE;
+    }
 
     /*
     SHM_ELEM_TYPE *p;
@@ -355,10 +359,14 @@ int main(int argc, char **argv)
         shm_update_write_count(ssv, ssv->segLen * ssv->elemSize, 1);
     }
     */
-    sock_recv_data(nsfd, shmp, ssv, "a\n", 2, 64*1024*1024);
+    sock_recv_data(nsfd, shmp, ssv, slot, trace, "a\n", 2, 64*1024*1024);
 
     /* Stop. */
-    alarm(0);
+    clock_gettime(CLOCK_MONOTONIC, &stopTime);
+    printf("Stop time  = %zd.%09zd\n", stopTime.tv_sec, stopTime.tv_nsec);
+    if (stopQ) fprintf(stderr, "Killed, cleaning up...\n");
+    shm_trace_close(trace);
+    shm_telem_detach(slot);
     sock_close(nsfd);
     atexit_shm_cleanup();
     return EXIT_SUCCESS;
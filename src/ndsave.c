@@ -1,6 +1,7 @@
 /** \file
  * NetDAQ saving data to file from shared memory.
  */
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,21 +11,138 @@
 
 #include "common.h"
 #include "ipc.h"
+#include "hdf5rawWaveformIo.h"
 
 /** Parameters settable from commandline */
 typedef struct param
 {
-    char *shmName;   //!< shared memory object name, system-wide.
+    char   *shmName;       //!< shared memory object name, system-wide.
+    char   *outFName;      //!< HDF5 output file, NULL: print segments only.
+    size_t  nCh;           //!< channels in each event record.
+    size_t  nPt;           //!< points per channel in each event record.
+    size_t  nWfmPerChunk;  //!< waveforms per HDF5 dataset.
+    size_t  nBuf;          //!< events buffered for the writer thread.
+    char   *compSpec;      //!< compression spec.
 } param_t;
 
 param_t paramDefault = {
-    .shmName = SHM_NAME,
+    .shmName      = SHM_NAME,
+    .outFName     = NULL,
+    .nCh          = SCOPE_NCH,
+    .nPt          = 1000,
+    .nWfmPerChunk = 100,
+    .nBuf         = 256,
+    .compSpec     = HDF5IO_COMPRESSION_DEFAULT,
 };
 
 void print_usage(const param_t *pm, FILE *s)
 {
     fprintf(s, "Usage:\n");
+    fprintf(s, "      -b nBuf [%zd]: Events buffered for the writer thread.\n", pm->nBuf);
+    fprintf(s, "      -c nCh [%zd]: Channels in each event record.\n", pm->nCh);
     fprintf(s, "      -n shmName [\"%s\"]: Shared memory object name, system-wide.\n", pm->shmName);
+    fprintf(s, "      -o outFName [none]: HDF5 output file.  Without it segments are only printed.\n");
+    fprintf(s, "      -p nPt [%zd]: Points per channel in each event record.\n", pm->nPt);
+    fprintf(s, "      -w nWfmPerChunk [%zd]: Waveforms per HDF5 dataset.\n", pm->nWfmPerChunk);
+    fprintf(s, "      -z compSpec [\"%s\"]: Compression, e.g. none, deflate:6, shuffle,zstd:3.\n",
+            pm->compSpec);
+    fprintf(s, "  The shm stream is taken as back-to-back event records of\n"
+               "  nCh x nPt samples, channel by channel.\n");
+}
+
+static volatile sig_atomic_t stopQ = 0;
+static void signal_kill_handler(int sig)
+{
+    stopQ = 1;
+}
+
+/** Segments not yet all written to file, for the trace, oldest first. */
+#define NDSAVE_NPEND 1024
+typedef struct pending
+{
+    uint64_t seg[NDSAVE_NPEND];
+    size_t   nEvt[NDSAVE_NPEND];   //!< events up to the last one holding bytes of seg.
+    size_t   head, tail;
+} pending_t;
+
+/** Trace the pending segments whose events are all written. */
+static void trace_persisted(shm_trace_t *tr, pending_t *pd, size_t nWritten)
+{
+    while (pd->head != pd->tail && pd->nEvt[pd->head % NDSAVE_NPEND] <= nWritten) {
+        shm_trace_event(tr, SHM_TRACE_PERSISTED, pd->seg[pd->head % NDSAVE_NPEND]);
+        pd->head++;
+    }
+}
+
+/** Cut the shm byte stream into event records and queue them on the
+ * async writer.  Records may straddle segments. */
+static int save_events(void *shmp, shm_sync_t *ssv, shm_telem_slot_t *slot, shm_trace_t *tr,
+                       const param_t *pm)
+{
+    struct HDF5IO(compression) comp;
+    struct HDF5IO(waveform_file) *wavFile;
+    struct HDF5IO(async_writer) *aw;
+    struct HDF5IO(waveform_event) *evt = NULL;
+    struct waveform_attribute wavAttr = {0};
+    const size_t evtBytes = pm->nCh * pm->nPt * sizeof(SCOPE_DATA_TYPE);
+    const size_t segBytes = ssv->segLen * ssv->elemSize;
+    size_t fill = 0, off, n, eventId = 0;
+    SHM_ELEM_TYPE *p;
+    uint64_t t0, tWait = 0, seg = 0;
+    pending_t pd = {.head = 0, .tail = 0};
+    int ret;
+
+    if (HDF5IO(parse_compression)(pm->compSpec, &comp) < 0) return -1;
+    if ((wavFile = HDF5IO(open_file)(pm->outFName, pm->nWfmPerChunk, pm->nCh, &comp)) == NULL)
+        return -1;
+    wavAttr.chMask = (1U << pm->nCh) - 1;
+    wavAttr.nPt = pm->nPt;
+    HDF5IO(write_waveform_attribute_in_file_header)(wavFile, &wavAttr);
+    if ((aw = HDF5IO(async_open)(wavFile, pm->nBuf, 0)) == NULL) {
+        HDF5IO(close_file)(wavFile);
+        return -1;
+    }
+    while (!stopQ) {
+        if ((p = shm_acquire_next_segment_sync(shmp, ssv, SHM_SEG_READ)) == NULL) {
+            if (!tWait) tWait = shm_telem_now();
+            continue;
+        }
+        t0 = shm_telem_now();
+        if (tWait) {
+            shm_telem_wait(slot, t0 - tWait);
+            tWait = 0;
+        }
+        if (tr) {
+            seg = shm_segment_seq(ssv, atomic_load(&ssv->iRd));
+            shm_trace_event(tr, SHM_TRACE_ACQUIRE, seg);
+        }
+        for (off = 0; off < segBytes; off += n) {
+            if (!evt) evt = HDF5IO(async_get_event)(aw, 1);
+            n = MIN(evtBytes - fill, segBytes - off);
+            memcpy((char*)evt->wavBuf + fill, (char*)p + off, n);
+            if ((fill += n) == evtBytes) {
+                evt->eventId = eventId++;
+                if (HDF5IO(async_submit)(aw, evt) < 0) stopQ = 1;
+                evt = NULL;
+                fill = 0;
+            }
+        }
+        shm_telem_segment(slot, ssv, segBytes, shm_telem_now() - t0);
+        if (tr) {
+            if (pd.tail - pd.head == NDSAVE_NPEND) pd.head++; /* too far behind, drop one */
+            pd.seg[pd.tail % NDSAVE_NPEND] = seg;
+            pd.nEvt[pd.tail % NDSAVE_NPEND] = eventId + (fill > 0);
+            pd.tail++;
+            trace_persisted(tr, &pd, HDF5IO(async_written)(aw));
+        }
+    }
+    /* A partial record at the end is dropped. */
+    ret = HDF5IO(async_close)(aw);
+    trace_persisted(tr, &pd, eventId);
+    fprintf(stderr, "%zd events written to %s.\n", eventId, pm->outFName);
+    HDF5IO(flush_file)(wavFile);
+    HDF5IO(close_file)(wavFile);
+    return ret;
 }
 
 int main(int argc, char **argv)
@@ -32,17 +150,38 @@ int main(int argc, char **argv)
     int shmfd;
     void *shmp;
     shm_sync_t *ssv;
+    shm_telem_slot_t *slot;
+    shm_trace_t *tr;
     size_t pageSize, shmSize;
     param_t pm;
-    int optC = 0;
+    int optC = 0, ret;
+    char traceName[256];
 
     // parse switches
     memcpy(&pm, &paramDefault, sizeof(pm));
-    while ((optC = getopt(argc, argv, "n:")) != -1) {
+    while ((optC = getopt(argc, argv, "b:c:n:o:p:w:z:")) != -1) {
         switch (optC) {
+        case 'b':
+            pm.nBuf = strtoull(optarg, NULL, 10);
+            break;
+        case 'c':
+            pm.nCh = strtoull(optarg, NULL, 10);
+            break;
         case 'n':
             pm.shmName = optarg;
             break;
+        case 'o':
+            pm.outFName = optarg;
+            break;
+        case 'p':
+            pm.nPt = strtoull(optarg, NULL, 10);
+            break;
+        case 'w':
+            pm.nWfmPerChunk = strtoull(optarg, NULL, 10);
+            break;
+        case 'z':
+            pm.compSpec = optarg;
+            break;
         default:
             print_usage(&pm, stderr);
             return EXIT_FAILURE;
@@ -60,9 +199,20 @@ int main(int argc, char **argv)
     fprintf(stderr, "Shared memory element size: %zd bytes.\n", ssv->elemSize);
     fprintf(stderr, "Shared memory SegLen: %zd, nSeg: %zd, total size: %zd bytes.\n",
             ssv->segLen, ssv->nSeg, shmSize);
-    fprintf(stderr, "Shared memory sync variables in the last %d page.\n", SHM_SYNC_NPAGE);
+    fprintf(stderr, "Shared memory sync variables in the last %d pages.\n", SHM_SYNC_NPAGE);
 
     shm_consumer_init(ssv);
+    if (pm.outFName) {
+        signal(SIGINT,  signal_kill_handler);
+        signal(SIGTERM, signal_kill_handler);
+        slot = shm_telem_attach(ssv, "ndsave", SHM_TELEM_CONSUMER);
+        snprintf(traceName, sizeof(traceName), "%s%s", pm.shmName, SHM_TRACE_SUFFIX);
+        tr = shm_trace_open(traceName, SHM_TRACE_WRITE);
+        ret = save_events(shmp, ssv, slot, tr, &pm);
+        shm_trace_close(tr);
+        shm_telem_detach(slot);
+        return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
     SHM_ELEM_TYPE *p;
     for (int i=0;;i++) {
         if ((p = shm_acquire_next_segment_sync(shmp, ssv, SHM_SEG_READ))) {
@@ -0,0 +1,337 @@
+/** \file
+ * NetDAQ telemetry, read from the sync pages of the shared memory.
+ *
+ * Attaches read-only, maps nothing but the sync pages and prints every
+ * interval the rates of the producer and of each process that reports
+ * to the telemetry slots, or writes them as a Prometheus text file,
+ * e.g. for the textfile collector of node_exporter.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "ipc.h"
+
+/** Parameters settable from commandline */
+typedef struct param
+{
+    char   *shmName;     //!< shared memory object name, system-wide.
+    double  interval;    //!< seconds between reports.
+    size_t  count;       //!< reports before exiting, 0: until interrupted.
+    char   *promFName;   //!< Prometheus text file, NULL: none.
+    int     quiet;       //!< no rates on stdout.
+} param_t;
+
+param_t paramDefault = {
+    .shmName   = SHM_NAME,
+    .interval  = 1.0,
+    .count     = 0,
+    .promFName = NULL,
+    .quiet     = 0,
+};
+
+static void print_usage(const param_t *pm, FILE *s)
+{
+    fprintf(s, "Usage:\n");
+    fprintf(s, "      -c count [%zd]: Reports before exiting, 0: until interrupted.\n", pm->count);
+    fprintf(s, "      -i interval [%g]: Seconds between reports.\n", pm->interval);
+    fprintf(s, "      -n shmName [\"%s\"]: Shared memory object name, system-wide.\n", pm->shmName);
+    fprintf(s, "      -p promFName [none]: Write the counters as a Prometheus text file,\n"
+               "         replaced atomically on every report.\n");
+    fprintf(s, "      -q : Do not print rates.\n");
+}
+
+static volatile sig_atomic_t stopQ = 0;
+static void signal_kill_handler(int sig)
+{
+    stopQ = 1;
+}
+
+static const char *role_name(int role)
+{
+    switch (role) {
+    case SHM_TELEM_PRODUCER:  return "producer";
+    case SHM_TELEM_CONSUMER:  return "consumer";
+    case SHM_TELEM_SPECTATOR: return "spectator";
+    default:                  return "unknown";
+    }
+}
+
+/** Plain copy of a slot. */
+typedef struct slot_snap
+{
+    int      pid;
+    int      role;
+    char     name[24];
+    uint64_t bytes, segs, busyNs, waitNs, nWait, lag, lagMax;
+    uint64_t busyHist[SHM_TELEM_NBUCKET];
+    uint64_t waitHist[SHM_TELEM_NBUCKET];
+} slot_snap_t;
+
+/** Plain copy of the sync variables and the telemetry. */
+typedef struct snap
+{
+    uint64_t    tNs;
+    size_t      nSeg;
+    size_t      wrBytes, wrSegs;
+    size_t      ringLag;         //!< segments between iRd and iWr.
+    uint64_t    overruns;
+    slot_snap_t slot[SHM_TELEM_NSLOT];
+} snap_t;
+
+static uint64_t load(const atomic_uint_fast64_t *c)
+{
+    return atomic_load_explicit((atomic_uint_fast64_t*)c, memory_order_relaxed);
+}
+
+/** Counters are independent, so a snapshot is only as consistent as
+ * relaxed loads make it; rates over an interval are not affected. */
+static void take_snap(const shm_sync_t *ssv, snap_t *sn)
+{
+    const shm_telem_t *t = shm_telemetry(ssv);
+    const shm_telem_slot_t *s;
+    slot_snap_t *d;
+    intptr_t iRd, iWr;
+    size_t i, k;
+
+    memset(sn, 0, sizeof(*sn));
+    sn->tNs = shm_telem_now();
+    sn->nSeg = ssv->nSeg;
+    shm_get_write_count((shm_sync_t*)ssv, &sn->wrBytes, &sn->wrSegs);
+    iRd = atomic_load((atomic_intptr_t*)&ssv->iRd);
+    iWr = atomic_load((atomic_intptr_t*)&ssv->iWr);
+    if (sn->nSeg) sn->ringLag = (size_t)((iWr - iRd + (intptr_t)sn->nSeg) % (intptr_t)sn->nSeg);
+    sn->overruns = load(&t->overruns);
+    for (i=0; i<SHM_TELEM_NSLOT; i++) {
+        s = &t->slot[i];
+        d = &sn->slot[i];
+        d->pid = atomic_load((atomic_int*)&s->pid);
+        /* A slot left behind by a process that died. */
+        if (d->pid && kill(d->pid, 0) < 0 && errno == ESRCH) d->pid = 0;
+        if (!d->pid) continue;
+        d->role = s->role;
+        memcpy(d->name, s->name, sizeof(d->name));
+        d->name[sizeof(d->name) - 1] = '\0';
+        d->bytes = load(&s->bytes);
+        d->segs = load(&s->segs);
+        d->busyNs = load(&s->busyNs);
+        d->waitNs = load(&s->waitNs);
+        d->nWait = load(&s->nWait);
+        d->lag = load(&s->lag);
+        d->lagMax = load(&s->lagMax);
+        for (k=0; k<SHM_TELEM_NBUCKET; k++) {
+            d->busyHist[k] = load(&s->busyHist[k]);
+            d->waitHist[k] = load(&s->waitHist[k]);
+        }
+    }
+}
+
+/** Upper bound in seconds of the bucket holding quantile q of the
+ * counts h1 - h0, 0 if there are none. */
+static double hist_quantile(const uint64_t *h1, const uint64_t *h0, double q)
+{
+    uint64_t n = 0, c = 0;
+    size_t k;
+
+    for (k=0; k<SHM_TELEM_NBUCKET; k++) n += h1[k] - h0[k];
+    if (n == 0) return 0.0;
+    for (k=0; k<SHM_TELEM_NBUCKET; k++) {
+        c += h1[k] - h0[k];
+        if (c >= q * n) break;
+    }
+    return (double)(2ULL << MIN(k, SHM_TELEM_NBUCKET - 1)) * 1e-9;
+}
+
+static void print_rates(const snap_t *s1, const snap_t *s0)
+{
+    const double dt = (s1->tNs - s0->tNs) * 1e-9;
+    const slot_snap_t *a, *b;
+    size_t i;
+
+    printf("written %8.1f MiB/s %7.1f seg/s  ring lag %zd/%zd  overruns %" PRIu64 " (+%" PRIu64 ")\n",
+           (s1->wrBytes - s0->wrBytes) / 1048576.0 / dt, (s1->wrSegs - s0->wrSegs) / dt,
+           s1->ringLag, s1->nSeg, s1->overruns, s1->overruns - s0->overruns);
+    for (i=0; i<SHM_TELEM_NSLOT; i++) {
+        a = &s1->slot[i];
+        b = &s0->slot[i];
+        if (!a->pid) continue;
+        printf("  %-10s %7d %-9s", a->name, a->pid, role_name(a->role));
+        if (a->pid != b->pid) { /* attached during the interval */
+            printf("  attached\n");
+            continue;
+        }
+        printf(" %8.1f MiB/s %7.1f seg/s  busy %5.1f%% wait %5.1f%%",
+               (a->bytes - b->bytes) / 1048576.0 / dt, (a->segs - b->segs) / dt,
+               100.0 * (a->busyNs - b->busyNs) * 1e-9 / dt,
+               100.0 * (a->waitNs - b->waitNs) * 1e-9 / dt);
+        printf("  seg p50 %.3g s p99 %.3g s", hist_quantile(a->busyHist, b->busyHist, 0.5),
+               hist_quantile(a->busyHist, b->busyHist, 0.99));
+        if (a->role == SHM_TELEM_CONSUMER)
+            printf("  lag %" PRIu64 " max %" PRIu64, a->lag, a->lagMax);
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+static void prom_header(FILE *fp, const char *metric, const char *type, const char *help)
+{
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", metric, help, metric, type);
+}
+
+/** Cumulative log2 buckets; bucket k ends at 2^(k+1) ns, the last is open. */
+static void prom_histogram(FILE *fp, const char *metric, const char *labels, const uint64_t *h,
+                           uint64_t sumNs)
+{
+    uint64_t c = 0;
+    size_t k;
+
+    for (k=0; k<SHM_TELEM_NBUCKET; k++) {
+        c += h[k];
+        if (k + 1 < SHM_TELEM_NBUCKET)
+            fprintf(fp, "%s_bucket{%s,le=\"%.9g\"} %" PRIu64 "\n", metric, labels,
+                    (double)(2ULL << k) * 1e-9, c);
+        else
+            fprintf(fp, "%s_bucket{%s,le=\"+Inf\"} %" PRIu64 "\n", metric, labels, c);
+    }
+    fprintf(fp, "%s_sum{%s} %.9g\n", metric, labels, sumNs * 1e-9);
+    fprintf(fp, "%s_count{%s} %" PRIu64 "\n", metric, labels, c);
+}
+
+#define PROM_SLOTS(metric, type, help, fmt, field)                      \
+    do {                                                                \
+        prom_header(fp, metric, type, help);                            \
+        for (i=0; i<SHM_TELEM_NSLOT; i++) {                             \
+            if (!sn->slot[i].pid) continue;                             \
+            fprintf(fp, "%s{%s} " fmt "\n", metric, labels[i], sn->slot[i].field); \
+        }                                                               \
+    } while (0)
+
+/** Write to a temporary file and rename it over fname, so a scraper
+ * never reads half a file. */
+static int write_prom(const char *fname, const char *shmName, const snap_t *sn)
+{
+    char tmp[1024], labels[SHM_TELEM_NSLOT][256], shmLabel[128];
+    FILE *fp;
+    size_t i;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        perror(tmp);
+        return -1;
+    }
+    snprintf(shmLabel, sizeof(shmLabel), "shm=\"%s\"", shmName);
+    for (i=0; i<SHM_TELEM_NSLOT; i++)
+        snprintf(labels[i], sizeof(labels[i]), "%s,name=\"%s\",pid=\"%d\",role=\"%s\"", shmLabel,
+                 sn->slot[i].name, sn->slot[i].pid, role_name(sn->slot[i].role));
+
+    prom_header(fp, "ndaq_shm_written_bytes_total", "counter", "Bytes written to the ring.");
+    fprintf(fp, "ndaq_shm_written_bytes_total{%s} %zd\n", shmLabel, sn->wrBytes);
+    prom_header(fp, "ndaq_shm_written_segments_total", "counter", "Segments written to the ring.");
+    fprintf(fp, "ndaq_shm_written_segments_total{%s} %zd\n", shmLabel, sn->wrSegs);
+    prom_header(fp, "ndaq_shm_overruns_total", "counter",
+                "Segments written over unread data while a consumer was attached.");
+    fprintf(fp, "ndaq_shm_overruns_total{%s} %" PRIu64 "\n", shmLabel, sn->overruns);
+    prom_header(fp, "ndaq_shm_segments", "gauge", "Segments in the ring.");
+    fprintf(fp, "ndaq_shm_segments{%s} %zd\n", shmLabel, sn->nSeg);
+    prom_header(fp, "ndaq_shm_ring_lag_segments", "gauge", "Segments between reader and writer.");
+    fprintf(fp, "ndaq_shm_ring_lag_segments{%s} %zd\n", shmLabel, sn->ringLag);
+
+    PROM_SLOTS("ndaq_bytes_total", "counter", "Bytes of segments done by the process.",
+               "%" PRIu64, bytes);
+    PROM_SLOTS("ndaq_segments_total", "counter", "Segments done by the process.",
+               "%" PRIu64, segs);
+    PROM_SLOTS("ndaq_waits_total", "counter", "Segment acquires that had to wait.",
+               "%" PRIu64, nWait);
+    PROM_SLOTS("ndaq_lag_segments", "gauge", "Segments a consumer is behind the producer.",
+               "%" PRIu64, lag);
+    PROM_SLOTS("ndaq_lag_max_segments", "gauge", "Largest lag of a consumer.",
+               "%" PRIu64, lagMax);
+    prom_header(fp, "ndaq_segment_seconds", "histogram", "Time spent on one segment.");
+    for (i=0; i<SHM_TELEM_NSLOT; i++) {
+        if (!sn->slot[i].pid) continue;
+        prom_histogram(fp, "ndaq_segment_seconds", labels[i], sn->slot[i].busyHist,
+                       sn->slot[i].busyNs);
+    }
+    prom_header(fp, "ndaq_acquire_wait_seconds", "histogram",
+                "Time waited for a segment, per acquire that waited.");
+    for (i=0; i<SHM_TELEM_NSLOT; i++) {
+        if (!sn->slot[i].pid) continue;
+        prom_histogram(fp, "ndaq_acquire_wait_seconds", labels[i], sn->slot[i].waitHist,
+                       sn->slot[i].waitNs);
+    }
+    if (fclose(fp) != 0 || rename(tmp, fname) < 0) {
+        perror(fname);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    param_t pm;
+    int optC = 0;
+    const shm_sync_t *ssv;
+    const shm_telem_t *t;
+    snap_t s0, s1;
+    struct timespec nap;
+    size_t n = 0;
+
+    memcpy(&pm, &paramDefault, sizeof(pm));
+    while ((optC = getopt(argc, argv, "c:i:n:p:q")) != -1) {
+        switch (optC) {
+        case 'c':
+            pm.count = strtoull(optarg, NULL, 10);
+            break;
+        case 'i':
+            pm.interval = MAX(1e-3, strtod(optarg, NULL));
+            break;
+        case 'n':
+            pm.shmName = optarg;
+            break;
+        case 'p':
+            pm.promFName = optarg;
+            break;
+        case 'q':
+            pm.quiet = 1;
+            break;
+        default:
+            print_usage(&pm, stderr);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+
+    if ((ssv = shm_sync_open(pm.shmName)) == NULL) return EXIT_FAILURE;
+    t = shm_telemetry(ssv);
+    if (atomic_load((atomic_uint*)&t->magic) != SHM_TELEM_MAGIC || t->version != SHM_TELEM_VERSION) {
+        error_printf("%s has no telemetry of version %d.\n", pm.shmName, SHM_TELEM_VERSION);
+        shm_sync_close(ssv);
+        return EXIT_FAILURE;
+    }
+    signal(SIGINT,  signal_kill_handler);
+    signal(SIGTERM, signal_kill_handler);
+
+    nap.tv_sec = (time_t)pm.interval;
+    nap.tv_nsec = (long)((pm.interval - nap.tv_sec) * 1e9);
+    take_snap(ssv, &s0);
+    while (!stopQ && (pm.count == 0 || n < pm.count)) {
+        nanosleep(&nap, NULL);
+        take_snap(ssv, &s1);
+        if (!pm.quiet) print_rates(&s1, &s0);
+        if (pm.promFName) write_prom(pm.promFName, pm.shmName, &s1);
+        s0 = s1;
+        n++;
+    }
+    shm_sync_close(ssv);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,207 @@
+/** \file
+ * NetDAQ segment trace dump, as Chrome trace / Perfetto JSON.
+ *
+ * Reads the trace ring (shmName SHM_TRACE_SUFFIX) that ndrecv -t keeps
+ * and ndsave adds to, pairs up the events of each segment and writes
+ * them in the Trace Event Format, to load into ui.perfetto.dev or
+ * chrome://tracing:
+ *   - the producer track has a "fill" slice per segment, from acquire
+ *     for write to completion; gaps between them are pipeline stalls;
+ *   - the consumer track has a "ring" span per segment from fill
+ *     completion to acquire for read, a "save" span from there until
+ *     its records are written, and a counter of the segments filled
+ *     but not yet read, its lag.
+ */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "ipc.h"
+
+/** Parameters settable from commandline */
+typedef struct param
+{
+    char   *shmName;     //!< shared memory object name, system-wide.
+    char   *outFName;    //!< JSON output, NULL: stdout.
+    int     unlinkQ;     //!< remove the trace ring after dumping.
+} param_t;
+
+param_t paramDefault = {
+    .shmName  = SHM_NAME,
+    .outFName = NULL,
+    .unlinkQ  = 0,
+};
+
+static void print_usage(const param_t *pm, FILE *s)
+{
+    fprintf(s, "Usage:\n");
+    fprintf(s, "      -n shmName [\"%s\"]: Shared memory object name, system-wide.\n", pm->shmName);
+    fprintf(s, "      -o outFName [stdout]: JSON output.\n");
+    fprintf(s, "      -u : Remove the trace ring after dumping.\n");
+    fprintf(s, "  The trace ring is shmName\"%s\", written by ndrecv -t.\n", SHM_TRACE_SUFFIX);
+}
+
+/** Times of one segment, 0 if not in the ring. */
+typedef struct seg_times
+{
+    uint64_t fillStart, fillDone, acquire, persisted;
+    int32_t  prodPid, consPid;
+} seg_times_t;
+
+static int cmp_rec_time(const void *a, const void *b)
+{
+    const shm_trace_rec_t *x = (const shm_trace_rec_t*)a, *y = (const shm_trace_rec_t*)b;
+    return x->tNs < y->tNs ? -1 : x->tNs > y->tNs;
+}
+
+/** Microseconds since t0, as the format wants. */
+static double us(uint64_t t, uint64_t t0)
+{
+    return (t - t0) * 1e-3;
+}
+
+static void write_json(FILE *fp, const shm_trace_rec_t *rec, size_t n)
+{
+    const uint64_t t0 = rec[0].tNs;
+    uint64_t segMin = rec[0].seg, segMax = rec[0].seg, s, k = 0;
+    seg_times_t *st, *e;
+    int32_t prodPid = 0, consPid = 0;
+    const char *sep = "";
+    size_t i;
+
+    for (i=1; i<n; i++) {
+        segMin = MIN(segMin, rec[i].seg);
+        segMax = MAX(segMax, rec[i].seg);
+    }
+    st = (seg_times_t*)calloc(segMax - segMin + 1, sizeof(seg_times_t));
+    for (i=0; i<n; i++) {
+        e = &st[rec[i].seg - segMin];
+        switch (rec[i].kind) {
+        case SHM_TRACE_FILL_START: e->fillStart = rec[i].tNs; e->prodPid = prodPid = rec[i].pid; break;
+        case SHM_TRACE_FILL_DONE:  e->fillDone  = rec[i].tNs; e->prodPid = prodPid = rec[i].pid; break;
+        case SHM_TRACE_ACQUIRE:    e->acquire   = rec[i].tNs; e->consPid = consPid = rec[i].pid; break;
+        case SHM_TRACE_PERSISTED:  e->persisted = rec[i].tNs; e->consPid = consPid = rec[i].pid; break;
+        default: break;
+        }
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    if (prodPid) {
+        fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"producer\"}}", prodPid, prodPid);
+        sep = ",\n";
+    }
+    if (consPid) {
+        fprintf(fp, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"consumer\"}}", sep, consPid, consPid);
+        sep = ",\n";
+    }
+    for (s=segMin; s<=segMax; s++) {
+        e = &st[s - segMin];
+        if (e->fillStart && e->fillDone) {
+            fprintf(fp, "%s{\"name\":\"fill\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,"
+                    "\"dur\":%.3f,\"args\":{\"seg\":%" PRIu64 "}}", sep, e->prodPid, e->prodPid,
+                    us(e->fillStart, t0), us(e->fillDone, e->fillStart), s);
+            sep = ",\n";
+        }
+        /* Spans of consecutive segments overlap, so they are async. */
+        if (e->fillDone && e->acquire) {
+            fprintf(fp, "%s{\"name\":\"ring\",\"cat\":\"ring\",\"ph\":\"b\",\"id\":%" PRIu64
+                    ",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"args\":{\"seg\":%" PRIu64 "}},\n"
+                    "{\"name\":\"ring\",\"cat\":\"ring\",\"ph\":\"e\",\"id\":%" PRIu64
+                    ",\"pid\":%d,\"tid\":%d,\"ts\":%.3f}", sep, s, e->consPid, e->consPid,
+                    us(e->fillDone, t0), s, s, e->consPid, e->consPid, us(e->acquire, t0));
+            sep = ",\n";
+        }
+        if (e->acquire && e->persisted) {
+            fprintf(fp, "%s{\"name\":\"save\",\"cat\":\"save\",\"ph\":\"b\",\"id\":%" PRIu64
+                    ",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"args\":{\"seg\":%" PRIu64 "}},\n"
+                    "{\"name\":\"save\",\"cat\":\"save\",\"ph\":\"e\",\"id\":%" PRIu64
+                    ",\"pid\":%d,\"tid\":%d,\"ts\":%.3f}", sep, s, e->consPid, e->consPid,
+                    us(e->acquire, t0), s, s, e->consPid, e->consPid, us(e->persisted, t0));
+            sep = ",\n";
+        }
+    }
+    /* Lag at every acquire: segments completed by then, not yet read.
+     * Both fills and acquires happen in segment order. */
+    for (s=segMin; s<=segMax; s++) {
+        e = &st[s - segMin];
+        if (!e->acquire) continue;
+        k = MAX(k, s);
+        while (k < segMax && st[k + 1 - segMin].fillDone
+               && st[k + 1 - segMin].fillDone <= e->acquire) k++;
+        fprintf(fp, "%s{\"name\":\"lag\",\"ph\":\"C\",\"pid\":%d,\"ts\":%.3f,"
+                "\"args\":{\"segments\":%" PRIu64 "}}", sep, e->consPid, us(e->acquire, t0),
+                k - s);
+        sep = ",\n";
+    }
+    fprintf(fp, "\n]}\n");
+    free(st);
+}
+
+int main(int argc, char **argv)
+{
+    param_t pm;
+    int optC = 0, ret = EXIT_SUCCESS;
+    char traceName[256];
+    shm_trace_t *tr;
+    shm_trace_rec_t *rec;
+    size_t n;
+    FILE *fp = stdout;
+
+    memcpy(&pm, &paramDefault, sizeof(pm));
+    while ((optC = getopt(argc, argv, "n:o:u")) != -1) {
+        switch (optC) {
+        case 'n':
+            pm.shmName = optarg;
+            break;
+        case 'o':
+            pm.outFName = optarg;
+            break;
+        case 'u':
+            pm.unlinkQ = 1;
+            break;
+        default:
+            print_usage(&pm, stderr);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+
+    snprintf(traceName, sizeof(traceName), "%s%s", pm.shmName, SHM_TRACE_SUFFIX);
+    if ((tr = shm_trace_open(traceName, SHM_TRACE_READ)) == NULL) {
+        error_printf("No trace ring %s, run ndrecv with -t.\n", traceName);
+        return EXIT_FAILURE;
+    }
+    rec = (shm_trace_rec_t*)malloc(SHM_TRACE_NREC * sizeof(shm_trace_rec_t));
+    n = shm_trace_read(tr, rec);
+    shm_trace_close(tr);
+    if (pm.unlinkQ) shm_unlink(traceName);
+    fprintf(stderr, "%zd trace records.\n", n);
+    if (n == 0) {
+        free(rec);
+        return EXIT_SUCCESS;
+    }
+    /* Records are claimed before they are stamped, so concurrent writers
+     * can leave them slightly out of time order. */
+    qsort(rec, n, sizeof(shm_trace_rec_t), cmp_rec_time);
+
+    if (pm.outFName && (fp = fopen(pm.outFName, "w")) == NULL) {
+        perror(pm.outFName);
+        free(rec);
+        return EXIT_FAILURE;
+    }
+    write_json(fp, rec, n);
+    if (fp != stdout && fclose(fp) != 0) {
+        perror(pm.outFName);
+        ret = EXIT_FAILURE;
+    }
+    free(rec);
+    return ret;
+}
@@ -0,0 +1,542 @@
+/** \file
+ * NetDAQ software trigger and zero suppression.
+ *
+ * A synchronous consumer, in place of ndsave, for runs where the
+ * signal is sparse.  Every event record in the shm stream is scanned
+ * with vectorized level or slope triggers on selected channels; only
+ * windows of nPre + nPost samples around the triggers are kept, all
+ * channels, and written to HDF5 as events of one frame whose time
+ * stamp is the trigger time.  The bytes left out are recorded in the
+ * root attributes scannedBytes and suppressedBytes.
+ *
+ * With -W, every record is first denoised with a wavelet transform,
+ * channels spread over a thread pool, and both the trigger and the
+ * stored windows see the denoised samples.  Records are transformed
+ * with the samples of their neighbours around them, so they are
+ * triggered on with a delay of a record or a few.
+ */
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "utils.h"
+#include "ipc.h"
+#include "hdf5rawWaveformIo.h"
+#include "thpool.h"
+#include "wavelet.h"
+#include "wavproc.h"
+
+/** Parameters settable from commandline */
+typedef struct param
+{
+    char   *shmName;       //!< shared memory object name, system-wide.
+    char   *outFName;      //!< HDF5 output file, NULL: only report trigger rates.
+    size_t  nCh;           //!< channels in each event record.
+    size_t  nPt;           //!< points per channel in each event record.
+    size_t  nPre;          //!< samples kept before a trigger.
+    size_t  nPost;         //!< samples kept from a trigger on.
+    size_t  holdoff;       //!< samples after a trigger without a new one, 0: nPre + nPost.
+    size_t  baseWin;       //!< samples of the rolling baseline of level triggers, 0: none.
+    double  dt;            //!< sampling interval.
+    size_t  nWfmPerChunk;  //!< waveforms per HDF5 dataset.
+    size_t  nBuf;          //!< events buffered for the writer thread.
+    char   *compSpec;      //!< compression spec.
+    size_t  nThreads;      //!< denoising threads, 0: online CPUs.
+    struct wavelet_denoise_param wp;           //!< denoising, nLevels 0: off.
+    size_t  nTrig;
+    unsigned trigCh[SCOPE_NCH];                //!< channel of each trigger, from 0.
+    struct wavproc_trigger trig[SCOPE_NCH];    //!< triggers, OR-ed.
+} param_t;
+
+param_t paramDefault = {
+    .shmName      = SHM_NAME,
+    .outFName     = NULL,
+    .nCh          = SCOPE_NCH,
+    .nPt          = 1000,
+    .nPre         = 100,
+    .nPost        = 400,
+    .holdoff      = 0,
+    .baseWin      = 0,
+    .dt           = 1.0,
+    .nWfmPerChunk = 100,
+    .nBuf         = 256,
+    .compSpec     = HDF5IO_COMPRESSION_DEFAULT,
+    .nThreads     = 1,
+    .wp           = {.nLevels = 0, .threshold = 0.0, .blockLen = 4096},
+    .nTrig        = 0,
+};
+
+static void print_usage(const param_t *pm, FILE *s)
+{
+    fprintf(s, "Usage:\n");
+    fprintf(s, "      -a nPre [%zd]: Samples kept before a trigger.\n", pm->nPre);
+    fprintf(s, "      -B baseWin [%zd]: Level triggers count from the median of the last\n"
+               "         baseWin samples of their channel before each record, 0: from 0.\n",
+            pm->baseWin);
+    fprintf(s, "      -b nBuf [%zd]: Events buffered for the writer thread.\n", pm->nBuf);
+    fprintf(s, "      -c nCh [%zd]: Channels in each event record.\n", pm->nCh);
+    fprintf(s, "      -d dt [%g]: Sampling interval.\n", pm->dt);
+    fprintf(s, "      -e nPost [%zd]: Samples kept from a trigger on.\n", pm->nPost);
+    fprintf(s, "      -h holdoff [%zd]: Samples after a trigger without a new one, "
+            "0: nPre + nPost.\n", pm->holdoff);
+    fprintf(s, "      -j nThreads [%zd]: Denoising threads, 0: online CPUs.\n", pm->nThreads);
+    fprintf(s, "      -n shmName [\"%s\"]: Shared memory object name, system-wide.\n", pm->shmName);
+    fprintf(s, "      -o outFName [none]: HDF5 output file.  Without it trigger rates are "
+            "only printed.\n");
+    fprintf(s, "      -p nPt [%zd]: Points per channel in each event record.\n", pm->nPt);
+    fprintf(s, "      -t ch,edge,value[,span]: Trigger on channel ch (from 1) when the\n"
+               "         sample (span 0) or its change over span samples crosses value,\n"
+               "         edge r(ising) or f(alling).  Repeat to OR triggers [1,r,20].\n");
+    fprintf(s, "      -W nLevels[,threshold] [off]: Denoise with a CDF 9/7 wavelet transform\n"
+               "         of nLevels (1-%d) before triggering, soft threshold in ADC counts,\n"
+               "         0 or none: from the noise of each block.\n", WAVELET_MAX_LEVELS);
+    fprintf(s, "      -w nWfmPerChunk [%zd]: Waveforms per HDF5 dataset.\n", pm->nWfmPerChunk);
+    fprintf(s, "      -z compSpec [\"%s\"]: Compression, e.g. none, deflate:6, shuffle,zstd:3.\n",
+            pm->compSpec);
+    fprintf(s, "  The shm stream is taken as back-to-back event records of\n"
+               "  nCh x nPt samples, channel by channel.  Windows are shifted to stay\n"
+               "  inside their record, the time stamp is that of sample nPre.\n");
+}
+
+/** Parse "ch,edge,value[,span]" into pm's next trigger.
+ * @return 0 on success, -1 if malformed.
+ */
+static int parse_trigger(const char *spec, param_t *pm)
+{
+    struct wavproc_trigger *t;
+    unsigned ch;
+    char edge;
+    int value;
+    size_t span = 0;
+
+    if (pm->nTrig >= SCOPE_NCH) return -1;
+    if (sscanf(spec, "%u,%c,%d,%zu", &ch, &edge, &value, &span) < 3
+        || ch < 1 || ch > SCOPE_NCH || (edge != 'r' && edge != 'f'))
+        return -1;
+    t = &pm->trig[pm->nTrig];
+    t->polarity = edge == 'r' ? 1 : -1;
+    t->level = t->polarity * value;
+    t->span = span;
+    pm->trigCh[pm->nTrig++] = ch - 1;
+    return 0;
+}
+
+/** Parse "nLevels[,threshold]" into pm->wp.
+ * @return 0 on success, -1 if malformed.
+ */
+static int parse_denoise(const char *spec, param_t *pm)
+{
+    unsigned nLevels;
+    double threshold = 0.0;
+
+    if (sscanf(spec, "%u,%lf", &nLevels, &threshold) < 1
+        || nLevels < 1 || nLevels > WAVELET_MAX_LEVELS || threshold < 0)
+        return -1;
+    pm->wp.nLevels = nLevels;
+    pm->wp.threshold = threshold;
+    return 0;
+}
+
+static volatile sig_atomic_t stopQ = 0;
+static void signal_kill_handler(int sig)
+{
+    stopQ = 1;
+}
+
+static int cmp_size(const void *a, const void *b)
+{
+    const size_t x = *(const size_t*)a, y = *(const size_t*)b;
+    return (x > y) - (x < y);
+}
+
+/** Running totals. */
+typedef struct counts
+{
+    size_t records;
+    size_t triggers;       //!< kept after the common holdoff.
+    size_t scannedBytes;
+    size_t keptBytes;
+} counts_t;
+
+/** Rolling baselines of the channels with level triggers. */
+typedef struct baseline
+{
+    struct wavproc_rolling rm[SCOPE_NCH];  //!< ring NULL: channel not tracked.
+    int median[SCOPE_NCH];                  //!< of the samples before the record.
+} baseline_t;
+
+/** Scan one record and queue the windows around its triggers.
+ * @param[in] pos scratch space for nTrig * nPt positions.
+ * @param[in] bl NULL: level triggers count from 0.
+ * @return 0, or -1 if the writer failed.
+ */
+static int trigger_record(const SCOPE_DATA_TYPE *rec, size_t recIdx, const param_t *pm,
+                          baseline_t *bl, struct HDF5IO(async_writer) *aw, size_t *pos,
+                          counts_t *cnt)
+{
+    const size_t winLen = pm->nPre + pm->nPost;
+    struct HDF5IO(waveform_event) *evt;
+    struct wavproc_trigger trig;
+    size_t k, n = 0, next = 0, start, ch;
+
+    for (k=0; k<pm->nTrig; k++) {
+        trig = pm->trig[k];
+        if (bl && trig.span == 0) trig.level += trig.polarity * bl->median[pm->trigCh[k]];
+        n += wavproc_trigger_scan(pos + n, pm->nPt, rec + pm->trigCh[k] * pm->nPt, pm->nPt,
+                                  &trig);
+    }
+    for (ch=0; bl && ch<pm->nCh; ch++) {
+        if (bl->rm[ch].ring)
+            bl->median[ch] = wavproc_rolling_median(NULL, &bl->rm[ch], rec + ch * pm->nPt,
+                                                    pm->nPt);
+    }
+    if (pm->nTrig > 1) qsort(pos, n, sizeof(size_t), cmp_size);
+    for (k=0; k<n; k++) {
+        if (pos[k] < next) continue; /* within the holdoff of another trigger */
+        next = pos[k] + 1 + pm->trig[0].holdoff;
+        cnt->triggers++;
+        cnt->keptBytes += pm->nCh * winLen * sizeof(SCOPE_DATA_TYPE);
+        if (!aw) continue;
+        start = MIN(pos[k] > pm->nPre ? pos[k] - pm->nPre : 0, pm->nPt - winLen);
+        evt = HDF5IO(async_get_event)(aw, 1);
+        for (ch=0; ch<pm->nCh; ch++)
+            memcpy(evt->wavBuf + ch * winLen, rec + ch * pm->nPt + start,
+                   winLen * sizeof(SCOPE_DATA_TYPE));
+        evt->eventId = cnt->triggers - 1;
+        evt->frameTimes[0] = (double)(recIdx * pm->nPt + start + pm->nPre) * pm->dt;
+        if (HDF5IO(async_submit)(aw, evt) < 0) return -1;
+    }
+    cnt->records++;
+    cnt->scannedBytes += pm->nCh * pm->nPt * sizeof(SCOPE_DATA_TYPE);
+    return 0;
+}
+
+/** Denoising of the record stream.  Every channel is a continuous
+ * stream cut into records, so each record is transformed with
+ * wavelet_margin() samples of the records around it, and is held back
+ * until enough of the following ones are in.  Only the start and the
+ * end of the run see the symmetric extension. */
+typedef struct denoiser
+{
+    const param_t *pm;
+    size_t margin;          //!< context on each side of a record.
+    size_t nHold;           //!< records held back for the context after them.
+    size_t histLen;         //!< margin + (nHold + 1) * nPt samples per channel.
+    size_t nValid;          //!< samples at the end of hist that were received.
+    size_t nIn;             //!< records pushed.
+    SCOPE_DATA_TYPE *hist;  //!< latest histLen samples of each channel.
+    SCOPE_DATA_TYPE *win;   //!< denoised window of each channel.
+    SCOPE_DATA_TYPE *out;   //!< denoised record, channel by channel.
+    size_t w0, w1, off;     //!< window and record start in hist, for the pool jobs.
+} denoiser_t;
+
+static denoiser_t *denoiser_create(const param_t *pm)
+{
+    denoiser_t *dn = (denoiser_t*)calloc(1, sizeof(denoiser_t));
+
+    if (dn == NULL) return NULL;
+    dn->pm = pm;
+    dn->margin = wavelet_margin(pm->wp.nLevels);
+    dn->nHold = (dn->margin + pm->nPt - 1) / pm->nPt;
+    dn->histLen = dn->margin + (dn->nHold + 1) * pm->nPt;
+    dn->hist = (SCOPE_DATA_TYPE*)malloc(pm->nCh * dn->histLen * sizeof(SCOPE_DATA_TYPE));
+    dn->win = (SCOPE_DATA_TYPE*)malloc(pm->nCh * (2 * dn->margin + pm->nPt)
+                                       * sizeof(SCOPE_DATA_TYPE));
+    dn->out = (SCOPE_DATA_TYPE*)malloc(pm->nCh * pm->nPt * sizeof(SCOPE_DATA_TYPE));
+    if (dn->hist == NULL || dn->win == NULL || dn->out == NULL) {
+        free(dn->hist);
+        free(dn->win);
+        free(dn->out);
+        free(dn);
+        return NULL;
+    }
+    return dn;
+}
+
+static void denoiser_destroy(denoiser_t *dn)
+{
+    if (dn == NULL) return;
+    free(dn->hist);
+    free(dn->win);
+    free(dn->out);
+    free(dn);
+}
+
+/** Append a record to the history of every channel. */
+static void denoiser_push(denoiser_t *dn, const SCOPE_DATA_TYPE *rec)
+{
+    const size_t nPt = dn->pm->nPt;
+    SCOPE_DATA_TYPE *h;
+    size_t ch;
+
+    for (ch=0; ch<dn->pm->nCh; ch++) {
+        h = dn->hist + ch * dn->histLen;
+        memmove(h, h + nPt, (dn->histLen - nPt) * sizeof(SCOPE_DATA_TYPE));
+        memcpy(h + dn->histLen - nPt, rec + ch * nPt, nPt * sizeof(SCOPE_DATA_TYPE));
+    }
+    dn->nValid = MIN(dn->histLen, dn->nValid + nPt);
+    dn->nIn++;
+}
+
+static void denoise_channel(void *arg, size_t ch)
+{
+    const denoiser_t *dn = (const denoiser_t*)arg;
+    const size_t nPt = dn->pm->nPt;
+    SCOPE_DATA_TYPE *w = dn->win + ch * (2 * dn->margin + nPt);
+
+    wavelet_denoise(w, dn->hist + ch * dn->histLen + dn->w0, dn->w1 - dn->w0, &dn->pm->wp, NULL);
+    memcpy(dn->out + ch * nPt, w + (dn->off - dn->w0), nPt * sizeof(SCOPE_DATA_TYPE));
+}
+
+/** Denoise the record held i records after the oldest into dn->out,
+ * with whatever context of the others has been received. */
+static void denoiser_run(denoiser_t *dn, thpool_t *pool, size_t i)
+{
+    dn->off = dn->margin + i * dn->pm->nPt;
+    dn->w0 = MAX(dn->histLen - dn->nValid, dn->off - dn->margin);
+    dn->w1 = MIN(dn->histLen, dn->off + dn->pm->nPt + dn->margin);
+    thpool_run(pool, denoise_channel, dn, dn->pm->nCh);
+}
+
+/** Sequence number, as in wrSegs, of the segment the next
+ * shm_acquire_next_segment_sync() after shm_consumer_init() returns.
+ * The producer's current segment is number wrSegs while it is being
+ * filled and wrSegs - 1 right after; its index tells which. */
+static size_t next_read_seg(shm_sync_t *ssv)
+{
+    size_t nSegs;
+    intptr_t iWr;
+
+    shm_get_write_count(ssv, NULL, &nSegs);
+    iWr = atomic_load(&ssv->iWr);
+    return (nSegs % ssv->nSeg == (size_t)iWr) ? nSegs + 1 : nSegs;
+}
+
+/** Trigger on rec, or with denoising, push it and trigger on the
+ * record dn->nHold before it once that has its context. */
+static int process_record(const SCOPE_DATA_TYPE *rec, size_t recIdx, const param_t *pm,
+                          thpool_t *pool, denoiser_t *dn, baseline_t *bl,
+                          struct HDF5IO(async_writer) *aw, size_t *pos, counts_t *cnt)
+{
+    if (dn == NULL) return trigger_record(rec, recIdx, pm, bl, aw, pos, cnt);
+    denoiser_push(dn, rec);
+    if (dn->nIn <= dn->nHold) return 0;
+    denoiser_run(dn, pool, 0);
+    return trigger_record(dn->out, recIdx - dn->nHold, pm, bl, aw, pos, cnt);
+}
+
+static int trigger_loop(void *shmp, shm_sync_t *ssv, shm_telem_slot_t *slot, const param_t *pm,
+                        struct HDF5IO(async_writer) *aw, counts_t *cnt)
+{
+    const size_t recBytes = pm->nCh * pm->nPt * sizeof(SCOPE_DATA_TYPE);
+    const size_t segBytes = ssv->segLen * ssv->elemSize;
+    size_t fill = 0, off, n, seg, recIdx, k;
+    size_t *pos = (size_t*)malloc(pm->nTrig * pm->nPt * sizeof(size_t));
+    SCOPE_DATA_TYPE *recBuf = (SCOPE_DATA_TYPE*)malloc(recBytes);
+    denoiser_t *dn = pm->wp.nLevels ? denoiser_create(pm) : NULL;
+    thpool_t *pool = pm->wp.nLevels ? thpool_create(pm->nThreads) : NULL;
+    baseline_t baseline = {0}, *bl = pm->baseWin ? &baseline : NULL;
+    counts_t last = *cnt;
+    double t, tLast = time_now();
+    uint64_t t0, tWait = 0;
+    char *p;
+    int ret = 0;
+
+    if (pm->wp.nLevels && dn == NULL) {
+        error_printf("%s(): out of memory for denoising.\n", __func__);
+        ret = -1;
+    }
+    for (k=0; bl && k<pm->nTrig && ret==0; k++) {
+        if (pm->trig[k].span == 0 && bl->rm[pm->trigCh[k]].ring == NULL)
+            ret = wavproc_rolling_init(&bl->rm[pm->trigCh[k]], pm->baseWin);
+    }
+    seg = next_read_seg(ssv);
+    off = shm_record_offset(ssv, seg, recBytes); /* skip a partial first record */
+    recIdx = (seg * segBytes + off) / recBytes;
+    while (!stopQ && ret == 0) {
+        if (!aw && (t = time_now()) - tLast >= 1.0) {
+            fprintf(stderr, "%zd records/s, %zd triggers/s, kept %.3g%%\n",
+                    (size_t)((cnt->records - last.records) / (t - tLast)),
+                    (size_t)((cnt->triggers - last.triggers) / (t - tLast)),
+                    cnt->scannedBytes > last.scannedBytes ? 100.0
+                    * (cnt->keptBytes - last.keptBytes)
+                    / (cnt->scannedBytes - last.scannedBytes) : 0.0);
+            last = *cnt;
+            tLast = t;
+        }
+        if ((p = (char*)shm_acquire_next_segment_sync(shmp, ssv, SHM_SEG_READ)) == NULL) {
+            if (!tWait) tWait = shm_telem_now();
+            continue;
+        }
+        t0 = shm_telem_now();
+        if (tWait) {
+            shm_telem_wait(slot, t0 - tWait);
+            tWait = 0;
+        }
+        for (; off < segBytes && ret == 0; off += n) {
+            if (fill == 0 && segBytes - off >= recBytes) { /* in place */
+                n = recBytes;
+                ret = process_record((SCOPE_DATA_TYPE*)(p + off), recIdx++, pm, pool, dn,
+                                     bl, aw, pos, cnt);
+                continue;
+            }
+            n = MIN(recBytes - fill, segBytes - off);
+            memcpy((char*)recBuf + fill, p + off, n);
+            if ((fill += n) == recBytes) {
+                ret = process_record(recBuf, recIdx++, pm, pool, dn, bl, aw, pos, cnt);
+                fill = 0;
+            }
+        }
+        off = 0;
+        shm_telem_segment(slot, ssv, segBytes, shm_telem_now() - t0);
+    }
+    if (dn) { /* The records still held get no context after them. */
+        for (k=dn->nHold + 1 - MIN(dn->nIn, dn->nHold); k<=dn->nHold && ret==0; k++) {
+            denoiser_run(dn, pool, k);
+            ret = trigger_record(dn->out, recIdx - 1 - (dn->nHold - k), pm, bl, aw, pos, cnt);
+        }
+    }
+    if (pool) thpool_destroy(pool);
+    denoiser_destroy(dn);
+    for (k=0; bl && k<SCOPE_NCH; k++) wavproc_rolling_free(&bl->rm[k]);
+    free(pos);
+    free(recBuf);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int shmfd;
+    void *shmp;
+    shm_sync_t *ssv;
+    shm_telem_slot_t *slot;
+    size_t shmSize, k;
+    param_t pm;
+    int optC = 0, ret;
+    struct HDF5IO(compression) comp;
+    struct HDF5IO(waveform_file) *wavFile = NULL;
+    struct HDF5IO(async_writer) *aw = NULL;
+    struct waveform_attribute wavAttr = {0};
+    counts_t cnt = {0};
+
+    memcpy(&pm, &paramDefault, sizeof(pm));
+    while ((optC = getopt(argc, argv, "a:B:b:c:d:e:h:j:n:o:p:t:W:w:z:")) != -1) {
+        switch (optC) {
+        case 'a':
+            pm.nPre = strtoull(optarg, NULL, 10);
+            break;
+        case 'B':
+            pm.baseWin = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            pm.nBuf = strtoull(optarg, NULL, 10);
+            break;
+        case 'c':
+            pm.nCh = MIN(SCOPE_NCH, strtoull(optarg, NULL, 10));
+            break;
+        case 'd':
+            pm.dt = strtod(optarg, NULL);
+            break;
+        case 'e':
+            pm.nPost = strtoull(optarg, NULL, 10);
+            break;
+        case 'h':
+            pm.holdoff = strtoull(optarg, NULL, 10);
+            break;
+        case 'j':
+            pm.nThreads = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            pm.shmName = optarg;
+            break;
+        case 'o':
+            pm.outFName = optarg;
+            break;
+        case 'p':
+            pm.nPt = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            if (parse_trigger(optarg, &pm) < 0) {
+                error_printf("Bad trigger \"%s\".\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'W':
+            if (parse_denoise(optarg, &pm) < 0) {
+                error_printf("Bad denoising \"%s\".\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'w':
+            pm.nWfmPerChunk = strtoull(optarg, NULL, 10);
+            break;
+        case 'z':
+            pm.compSpec = optarg;
+            break;
+        default:
+            print_usage(&pm, stderr);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+    if (pm.nTrig == 0) parse_trigger("1,r,20", &pm);
+    if (pm.holdoff == 0) pm.holdoff = pm.nPre + pm.nPost;
+    for (k=0; k<pm.nTrig; k++) {
+        pm.trig[k].holdoff = pm.holdoff;
+        if (pm.trigCh[k] >= pm.nCh) {
+            error_printf("Trigger channel %u is not recorded.\n", pm.trigCh[k] + 1);
+            return EXIT_FAILURE;
+        }
+    }
+    if (pm.nPre + pm.nPost == 0 || pm.nPre + pm.nPost > pm.nPt) {
+        error_printf("The window of %zd samples does not fit in a record of %zd.\n",
+                     pm.nPre + pm.nPost, pm.nPt);
+        return EXIT_FAILURE;
+    }
+
+    shmfd = shm_connect(pm.shmName, &shmp, &shmSize, &ssv);
+    if (shmfd<0 || shmp==NULL) return EXIT_FAILURE;
+    close(shmfd);
+
+    if (pm.outFName) {
+        if (HDF5IO(parse_compression)(pm.compSpec, &comp) < 0) return EXIT_FAILURE;
+        if ((wavFile = HDF5IO(open_file)(pm.outFName, pm.nWfmPerChunk, pm.nCh, &comp)) == NULL)
+            return EXIT_FAILURE;
+        wavAttr.chMask = (1U << pm.nCh) - 1;
+        wavAttr.nPt = pm.nPre + pm.nPost;
+        wavAttr.nFrames = 1;
+        wavAttr.dt = pm.dt;
+        wavAttr.t0 = -(double)pm.nPre * pm.dt;
+        for (k=0; k<SCOPE_NCH; k++) wavAttr.ymult[k] = 1.0;
+        HDF5IO(write_waveform_attribute_in_file_header)(wavFile, &wavAttr);
+        if ((aw = HDF5IO(async_open)(wavFile, pm.nBuf, 0)) == NULL) {
+            HDF5IO(close_file)(wavFile);
+            return EXIT_FAILURE;
+        }
+    }
+    signal(SIGINT,  signal_kill_handler);
+    signal(SIGTERM, signal_kill_handler);
+
+    shm_consumer_init(ssv);
+    slot = shm_telem_attach(ssv, "ndtrig", SHM_TELEM_CONSUMER);
+    ret = trigger_loop(shmp, ssv, slot, &pm, aw, &cnt);
+    shm_telem_detach(slot);
+    if (aw && HDF5IO(async_close)(aw) < 0) ret = -1;
+    fprintf(stderr, "%zd triggers in %zd records, kept %zd of %zd bytes (1/%.3g).\n",
+            cnt.triggers, cnt.records, cnt.keptBytes, cnt.scannedBytes,
+            cnt.keptBytes ? (double)cnt.scannedBytes / cnt.keptBytes : 0.0);
+    if (wavFile) {
+        HDF5IO(write_count)(wavFile, "scannedBytes", cnt.scannedBytes);
+        HDF5IO(write_count)(wavFile, "suppressedBytes",
+                            cnt.scannedBytes > cnt.keptBytes ? cnt.scannedBytes - cnt.keptBytes : 0);
+        HDF5IO(flush_file)(wavFile);
+        HDF5IO(close_file)(wavFile);
+    }
+    return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,182 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fftw3.h>
+
+#include "common.h"
+#include "psd.h"
+
+struct psd
+{
+    size_t nFft;
+    size_t nBins;
+    size_t nBatch;
+    size_t nCh;
+    size_t nPend;            /**< blocks waiting in in */
+    FFT_BASE_TYPE *in;       /**< nBatch blocks of nFft windowed samples */
+    FFTW(complex) *out;      /**< nBatch spectra of nBins */
+    FFTW(plan) plan;
+    FFT_BASE_TYPE *win;
+    double winNorm;          /**< sum of win^2 */
+    unsigned *slotCh;        /**< spectrum of each pending block */
+    double *sum;             /**< nCh accumulated |X|^2 */
+    size_t *nAvg;
+};
+
+int psd_init(const char *wisdomFName)
+{
+    if (FFTW(init_threads)() == 0) {
+        error_printf("%s(): FFTW threads are not available\n", __func__);
+        return -1;
+    }
+    if (wisdomFName && access(wisdomFName, R_OK) == 0
+        && FFTW(import_wisdom_from_filename)(wisdomFName) == 0)
+        error_printf("%s(): ignoring unreadable wisdom in %s\n", __func__, wisdomFName);
+    return 0;
+}
+
+int psd_cleanup(const char *wisdomFName)
+{
+    int ret = 0;
+    if (wisdomFName && FFTW(export_wisdom_to_filename)(wisdomFName) == 0) {
+        error_printf("%s(): cannot write wisdom to %s\n", __func__, wisdomFName);
+        ret = -1;
+    }
+    FFTW(cleanup_threads)();
+    return ret;
+}
+
+psd_t *psd_create(size_t nFft, size_t nBatch, size_t nCh, size_t nThreads)
+{
+    psd_t *p;
+    int n = (int)nFft;
+    size_t i;
+    long ncpu;
+
+    if (nFft < 2 || nBatch == 0 || nCh == 0) return NULL;
+    if (nThreads == 0) {
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nThreads = ncpu > 0 ? (size_t)ncpu : 1;
+    }
+    p = (psd_t*)calloc(1, sizeof(psd_t));
+    p->nFft = nFft;
+    p->nBins = nFft / 2 + 1;
+    p->nBatch = nBatch;
+    p->nCh = nCh;
+    p->in = (FFT_BASE_TYPE*)FFTW(malloc)(nBatch * nFft * sizeof(FFT_BASE_TYPE));
+    p->out = (FFTW(complex)*)FFTW(malloc)(nBatch * p->nBins * sizeof(FFTW(complex)));
+    p->win = (FFT_BASE_TYPE*)FFTW(malloc)(nFft * sizeof(FFT_BASE_TYPE));
+    p->slotCh = (unsigned*)calloc(nBatch, sizeof(unsigned));
+    p->sum = (double*)calloc(nCh * p->nBins, sizeof(double));
+    p->nAvg = (size_t*)calloc(nCh, sizeof(size_t));
+    if (!p->in || !p->out || !p->win || !p->slotCh || !p->sum || !p->nAvg) {
+        psd_destroy(p);
+        return NULL;
+    }
+    for (i=0; i<nFft; i++) {
+        p->win[i] = (FFT_BASE_TYPE)(0.5 - 0.5 * cos(2.0 * M_PI * i / nFft));
+        p->winNorm += (double)p->win[i] * p->win[i];
+    }
+    /* The planner is not thread safe; plans are only made here.  With
+     * wisdom from an earlier run, MEASURE costs next to nothing. */
+    FFTW(plan_with_nthreads)((int)nThreads);
+    p->plan = FFTW(plan_many_dft_r2c)(1, &n, (int)nBatch, p->in, NULL, 1, (int)nFft,
+                                      p->out, NULL, 1, (int)p->nBins, FFTW_MEASURE);
+    if (p->plan == NULL) {
+        error_printf("%s(): no plan for %zd x %zd\n", __func__, nBatch, nFft);
+        psd_destroy(p);
+        return NULL;
+    }
+    return p;
+}
+
+void psd_destroy(psd_t *p)
+{
+    if (!p) return;
+    if (p->plan) FFTW(destroy_plan)(p->plan);
+    FFTW(free)(p->in);
+    FFTW(free)(p->out);
+    FFTW(free)(p->win);
+    free(p->slotCh);
+    free(p->sum);
+    free(p->nAvg);
+    free(p);
+}
+
+SIMD_CLONES
+static void window_block(FFT_BASE_TYPE *restrict dst, const RAW_WAVEFORM_BASE_TYPE *restrict raw,
+                         const FFT_BASE_TYPE *restrict win, size_t n)
+{
+    size_t i;
+    for (i=0; i<n; i++)
+        dst[i] = (FFT_BASE_TYPE)raw[i] * win[i];
+}
+
+/* c holds nBins interleaved re, im pairs. */
+SIMD_CLONES
+static void add_power(double *restrict sum, const FFT_BASE_TYPE *restrict c, size_t nBins)
+{
+    size_t k;
+    for (k=0; k<nBins; k++)
+        sum[k] += (double)c[2*k] * c[2*k] + (double)c[2*k+1] * c[2*k+1];
+}
+
+void psd_flush(psd_t *p)
+{
+    size_t b;
+
+    if (p->nPend == 0) return;
+    /* Blocks past nPend still hold earlier samples; transforming them
+     * costs the same as a smaller plan would and they are not added. */
+    FFTW(execute)(p->plan);
+    for (b=0; b<p->nPend; b++) {
+        add_power(p->sum + p->slotCh[b] * p->nBins, (const FFT_BASE_TYPE*)(p->out + b * p->nBins),
+                  p->nBins);
+        p->nAvg[p->slotCh[b]]++;
+    }
+    p->nPend = 0;
+}
+
+void psd_accumulate(psd_t *p, unsigned ch, const RAW_WAVEFORM_BASE_TYPE *raw, size_t n)
+{
+    size_t i;
+
+    if (ch >= p->nCh) return;
+    for (i=0; i+p->nFft<=n; i+=p->nFft) {
+        window_block(p->in + p->nPend * p->nFft, raw + i, p->win, p->nFft);
+        p->slotCh[p->nPend] = ch;
+        if (++p->nPend == p->nBatch) psd_flush(p);
+    }
+}
+
+size_t psd_result(psd_t *p, unsigned ch, double *psd, double fs)
+{
+    size_t k;
+    double scale;
+
+    if (ch >= p->nCh) return 0;
+    if (p->nAvg[ch] == 0) {
+        for (k=0; k<p->nBins; k++) psd[k] = NAN;
+        return 0;
+    }
+    /* One-sided: every bin but DC and Nyquist holds both signs. */
+    scale = 1.0 / (fs * p->winNorm * p->nAvg[ch]);
+    for (k=0; k<p->nBins; k++)
+        psd[k] = p->sum[ch * p->nBins + k] * scale * ((k == 0 || 2*k == p->nFft) ? 1.0 : 2.0);
+    return p->nAvg[ch];
+}
+
+void psd_reset(psd_t *p)
+{
+    p->nPend = 0;
+    memset(p->sum, 0, p->nCh * p->nBins * sizeof(double));
+    memset(p->nAvg, 0, p->nCh * sizeof(size_t));
+}
+
+size_t psd_nbins(const psd_t *p)
+{
+    return p->nBins;
+}
@@ -0,0 +1,53 @@
+/** \file psd.h
+ * Averaged power spectral densities of raw waveforms with FFTW.
+ *
+ * Samples are cut into blocks of nFft, Hann windowed and transformed
+ * nBatch blocks at a time by one batched real-to-complex plan, made
+ * once per psd_t.  Precision follows FFT_BASE_TYPE and FFTW().
+ */
+#ifndef __PSD_H__
+#define __PSD_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+
+typedef struct psd psd_t;
+
+/** Set up FFTW threads and load wisdom.  Call once, before psd_create().
+ * @param[in] wisdomFName file of accumulated wisdom, NULL for none.  A
+ *                        missing file is not an error.
+ * @return 0, or -1 if FFTW threads are not available.
+ */
+int psd_init(const char *wisdomFName);
+/** Save the wisdom gathered by psd_create() calls and clean FFTW up.
+ * @return 0, or -1 if the file could not be written.
+ */
+int psd_cleanup(const char *wisdomFName);
+
+/** Make the batched plan and the accumulators.
+ * @param[in] nFft block length, the spectra have nFft/2 + 1 bins.
+ * @param[in] nBatch blocks per FFTW call.
+ * @param[in] nCh number of independent spectra.
+ * @param[in] nThreads FFTW threads, 0: online CPUs.
+ * @return NULL on failure.
+ */
+psd_t *psd_create(size_t nFft, size_t nBatch, size_t nCh, size_t nThreads);
+void psd_destroy(psd_t *p);
+/** Add the whole blocks of raw[0, n) to spectrum ch.  The remainder
+ * is dropped, so that records are never joined. */
+void psd_accumulate(psd_t *p, unsigned ch, const RAW_WAVEFORM_BASE_TYPE *raw, size_t n);
+/** One-sided PSD of spectrum ch, averaged over the blocks added since
+ * psd_reset(), in raw units squared per Hz.
+ * @param[out] psd nFft/2 + 1 values, bin k at k * fs / nFft.
+ * @param[in] fs sampling frequency.
+ * @return number of blocks averaged.
+ */
+size_t psd_result(psd_t *p, unsigned ch, double *psd, double fs);
+/** Transform pending blocks, so that psd_result() sees them. */
+void psd_flush(psd_t *p);
+/** Clear the accumulated spectra. */
+void psd_reset(psd_t *p);
+size_t psd_nbins(const psd_t *p);
+
+#endif /* __PSD_H__ */
@@ -0,0 +1,166 @@
+/** \file
+ * Throughput of the rand_stream fills against the global generator.
+ */
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "thpool.h"
+#include "utils.h"
+
+/** Parameters settable from commandline */
+typedef struct param
+{
+    size_t  n;         //!< deviates per case.
+    size_t  nRep;      //!< repetitions of each case.
+    size_t  nThreads;  //!< threads of the parallel fill, 0: online CPUs.
+} param_t;
+
+param_t paramDefault = {
+    .n        = 1 << 22,
+    .nRep     = 20,
+    .nThreads = 0,
+};
+
+static void print_usage(const param_t *pm, FILE *s)
+{
+    fprintf(s, "Usage:\n");
+    fprintf(s, "      -j nThreads [%zd]: Threads of the parallel fill, 0: online CPUs.\n",
+            pm->nThreads);
+    fprintf(s, "      -n n [%zd]: Deviates per case.\n", pm->n);
+    fprintf(s, "      -r nRep [%zd]: Repetitions of each case.\n", pm->nRep);
+}
+
+static void report(const char *name, double sec, size_t n)
+{
+    printf("%-26s %8.3f ns/value %8.2f GB/s\n", name, sec / n * 1e9, 8.0 * n / sec / 1e9);
+}
+
+static void moments(const char *name, const double *x, size_t n)
+{
+    double s = 0, s2 = 0;
+    size_t i;
+    for (i=0; i<n; i++) {
+        s += x[i];
+        s2 += x[i] * x[i];
+    }
+    s /= n;
+    printf("%-26s mean %9.6f  var %9.6f\n", name, s, s2 / n - s * s);
+}
+
+/** One stream per slice, slice i of stream i. */
+typedef struct fill_job
+{
+    double *x;
+    size_t n;
+    size_t nSlices;
+    rand_stream_t *rs;
+} fill_job_t;
+
+static void fill_slice(void *arg, size_t i)
+{
+    const fill_job_t *job = (const fill_job_t*)arg;
+    const size_t i0 = i * job->n / job->nSlices, i1 = (i + 1) * job->n / job->nSlices;
+    rand_fill_gauss(&job->rs[i], job->x + i0, i1 - i0, 0.0, 1.0);
+}
+
+int main(int argc, char **argv)
+{
+    param_t pm;
+    int optC = 0;
+    size_t i, r, nTail = 0;
+    double t0, *x, *y;
+    uint64_t *u;
+    rand_stream_t rs, *streams;
+    thpool_t *pool;
+    fill_job_t job;
+
+    memcpy(&pm, &paramDefault, sizeof(pm));
+    while ((optC = getopt(argc, argv, "j:n:r:")) != -1) {
+        switch (optC) {
+        case 'j':
+            pm.nThreads = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            pm.n = MAX(1, strtoull(optarg, NULL, 10));
+            break;
+        case 'r':
+            pm.nRep = MAX(1, strtoull(optarg, NULL, 10));
+            break;
+        default:
+            print_usage(&pm, stderr);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+    x = (double*)malloc(pm.n * sizeof(double));
+    y = (double*)malloc(pm.n * sizeof(double));
+    u = (uint64_t*)malloc(pm.n * sizeof(uint64_t));
+
+    rand_init(1237026722LL);
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) {
+        for (i=0; i<pm.n; i++) u[i] = rand_int64();
+    }
+    report("rand_int64", time_now() - t0, pm.nRep * pm.n);
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) {
+        for (i=0; i<pm.n; i++) x[i] = rand_gauss();
+    }
+    report("rand_gauss", time_now() - t0, pm.nRep * pm.n);
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) {
+        for (i=0; i<pm.n; i++) x[i] = rand_exp(1.0);
+    }
+    report("rand_exp", time_now() - t0, pm.nRep * pm.n);
+
+    rand_stream_init(&rs, 1237026722LL, 0);
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) rand_fill_u64(&rs, u, pm.n);
+    report("rand_fill_u64", time_now() - t0, pm.nRep * pm.n);
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) rand_fill_uniform(&rs, x, pm.n);
+    report("rand_fill_uniform", time_now() - t0, pm.nRep * pm.n);
+    moments("  uniform", x, pm.n);
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) rand_fill_exp(&rs, x, pm.n, 1.0);
+    report("rand_fill_exp", time_now() - t0, pm.nRep * pm.n);
+    moments("  exp", x, pm.n);
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) rand_fill_gauss(&rs, x, pm.n, 0.0, 1.0);
+    report("rand_fill_gauss", time_now() - t0, pm.nRep * pm.n);
+    moments("  gauss", x, pm.n);
+    for (i=0; i<pm.n; i++) nTail += fabs(x[i]) > 4.0;
+    printf("  P(|x| > 4) %.3g, expected 6.33e-05\n", (double)nTail / pm.n);
+
+    pool = thpool_create(pm.nThreads);
+    job.x = x;
+    job.n = pm.n;
+    job.nSlices = thpool_nthreads(pool);
+    job.rs = streams = (rand_stream_t*)malloc(job.nSlices * sizeof(rand_stream_t));
+    for (i=0; i<job.nSlices; i++) rand_stream_init(&streams[i], 1237026722LL, i);
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) thpool_run(pool, fill_slice, &job, job.nSlices);
+    report("rand_fill_gauss threads", time_now() - t0, pm.nRep * pm.n);
+    printf("  %zd threads\n", job.nSlices);
+
+    /* Same seed and stream, same values. */
+    for (i=0; i<job.nSlices; i++) rand_stream_init(&streams[i], 1237026722LL, i);
+    thpool_run(pool, fill_slice, &job, job.nSlices);
+    memcpy(y, x, pm.n * sizeof(double));
+    for (i=0; i<job.nSlices; i++) rand_stream_init(&streams[i], 1237026722LL, i);
+    thpool_run(pool, fill_slice, &job, job.nSlices);
+    printf("repeat mismatch       = %d\n", memcmp(x, y, pm.n * sizeof(double)) != 0);
+
+    thpool_destroy(pool);
+    free(streams);
+    free(x);
+    free(y);
+    free(u);
+    return EXIT_SUCCESS;
+}
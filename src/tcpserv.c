@@ -1,5 +1,24 @@
 /** \file
  * NetDAQ tcp server.  Primarily for generating data to feed ndrecv for testing.
+ *
+ * Sends either a uint32_t counter ramp or, with -m pulses, synthetic
+ * int8 event records from wavgen.  By default the data is generated
+ * once, on a thread pool, into a loop of -L bytes that every client is
+ * sent over and over, with sendfile() from a memfd on Linux so that the
+ * data is not copied through user space.  With -L 0 the data is
+ * generated live, ahead of the sender, into a ring of blocks, for one
+ * client at a time.
+ *
+ * With -f, a recorded file is replayed in a loop instead: a raw dump
+ * is sent like the generated loop, straight from the file, and the
+ * events of an HDF5 file are sent as back-to-back records of nCh x nPt
+ * samples, channel by channel, paced by their time stamps if the file
+ * has them.  -x sets the speed relative to the recording.
+ *
+ * Each client is served by its own thread.  Like a digitizer, tcpserv
+ * sends dblksz bytes for every query line ("a\n" from ndrecv) it
+ * receives; -q 0 sends without queries.  Sending can be paced to a
+ * rate, and gated into bursts.
  */
 #define _GNU_SOURCE
 
@@ -27,17 +46,126 @@
 #include <util.h>
 #endif
 
+#include <math.h>
 #include <signal.h>
+#include <inttypes.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h> /* mmap */
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__linux)
+#include <sys/sendfile.h>
+#endif
 #include <pthread.h>
 #include <getopt.h>
 
 #include "common.h"
+#include "utils.h"
+#include "hdf5rawWaveformIo.h"
+#include "thpool.h"
+#include "wavgen.h"
+
+/** Parameters settable from commandline */
+typedef struct param
+{
+    int     pulsesQ;       //!< 1: synthetic waveforms, 0: counter ramp.
+    size_t  loopSz;        //!< bytes of the loop sent over and over, 0: live generation.
+    size_t  nBuf;          //!< blocks in the ring of live generation.
+    size_t  nThreads;      //!< generator threads, 0: online CPUs.
+    size_t  maxClients;    //!< clients served at once.
+    size_t  dblksz;        //!< bytes sent per query, 0: no queries.
+    size_t  chunk;         //!< bytes per send.
+    double  rate;          //!< bytes per second per client, 0: unlimited.
+    double  burstOn;       //!< seconds of sending per burst, 0: no bursts.
+    double  burstOff;      //!< seconds of pause after each burst.
+    char   *replayFName;   //!< raw or HDF5 file to replay, NULL: generate.
+    double  speed;         //!< replay speed relative to the recording, 0: as fast as possible.
+    double  dt;            //!< sampling interval of a raw file, for speed.
+    struct wavgen_param gp;
+} param_t;
+
+param_t paramDefault = {
+    .pulsesQ    = 0,
+    .loopSz     = 64*1024*1024,
+    .nBuf       = 16,
+    .nThreads   = 0,
+    .maxClients = 16,
+    .dblksz     = 64*1024*1024,
+    .chunk      = 1024*1024,
+    .rate       = 0.0,
+    .burstOn    = 0.0,
+    .burstOff   = 0.0,
+    .replayFName = NULL,
+    .speed      = 0.0,
+    .dt         = 0.0,
+    .gp       = {
+        .nCh       = SCOPE_NCH,
+        .nPt       = 1000,
+        .nRec      = 256,
+        .baseline  = 0.0,
+        .sigma     = 2.0,
+        .rho       = 0.3,
+        .rate      = 1e-3,
+        .amplitude = 60.0,
+        .ampSigma  = 5.0,
+        .rise      = 2.0,
+        .tau       = 20.0,
+        .polarity  = 1,
+        .seed      = 1237026722LL,
+    },
+};
+
+/** Counter values per block of the counter ramp. */
+#define COUNTER_BLOCK_LEN (1024*1024)
+
+static void print_usage(const param_t *pm, FILE *s)
+{
+    const struct wavgen_param *gp = &pm->gp;
+    fprintf(s, "Usage:\n");
+    fprintf(s, "      -B nBuf [%zd]: Blocks generated ahead of the sender, live generation.\n",
+            pm->nBuf);
+    fprintf(s, "      -C chunk [%zd]: Bytes per send.\n", pm->chunk);
+    fprintf(s, "      -j nThreads [%zd]: Generator threads, 0: online CPUs.\n", pm->nThreads);
+    fprintf(s, "      -L loopSz [%zd]: Bytes generated once and sent over and over, rounded\n"
+               "         up to whole blocks.  0: generate live, one client at a time.\n",
+            pm->loopSz);
+    fprintf(s, "      -M maxClients [%zd]: Clients served at once.\n", pm->maxClients);
+    fprintf(s, "      -m mode [%s]: counter: uint32_t ramp, pulses: synthetic waveforms.\n",
+            pm->pulsesQ ? "pulses" : "counter");
+    fprintf(s, "      -q dblksz [%zd]: Bytes sent per query line from the client, as ndrecv\n"
+               "         expects.  0: send without queries.\n", pm->dblksz);
+    fprintf(s, "      -f replayFName [none]: Replay a raw dump, or the events of an HDF5 file,\n"
+               "         in a loop, instead of generating data.\n");
+    fprintf(s, "      -d dt [%g]: Sampling interval of a raw dump; with nCh it sets the\n"
+               "         recorded rate, for -x.\n", pm->dt);
+    fprintf(s, "      -x speed [%g]: Replay at this multiple of the recorded rate, from the\n"
+               "         event time stamps or the sampling rate; 0: as fast as possible.\n",
+            pm->speed);
+    fprintf(s, "      -s rate [%g]: MiB/s sent to each client, 0: as fast as possible.\n",
+            pm->rate / 1048576.0);
+    fprintf(s, "      -u on,off [%g,%g]: Send in bursts of on seconds every on + off seconds,\n"
+               "         at rate if given.  ndrecv gives up after 0.5 s without data.\n",
+            pm->burstOn, pm->burstOff);
+    fprintf(s, "    Synthetic waveforms, times in samples, levels in ADC counts:\n");
+    fprintf(s, "      -a amplitude[,sigma] [%g,%g]: Pulse height and its rms spread.\n",
+            gp->amplitude, gp->ampSigma);
+    fprintf(s, "      -b baseline [%g]: Level without signal.\n", gp->baseline);
+    fprintf(s, "      -c nCh [%zd]: Channels in each event record.\n", gp->nCh);
+    fprintf(s, "      -e sigma [%g]: Noise rms of each channel.\n", gp->sigma);
+    fprintf(s, "      -k rho [%g]: Noise correlation coefficient between channels.\n", gp->rho);
+    fprintf(s, "      -P polarity [%d]: 1: positive, -1: negative pulses.\n", gp->polarity);
+    fprintf(s, "      -p nPt [%zd]: Points per channel in each event record.\n", gp->nPt);
+    fprintf(s, "      -R nRec [%zd]: Event records per block.\n", gp->nRec);
+    fprintf(s, "      -r rate [%g]: Mean pulses per sample, Poisson.\n", gp->rate);
+    fprintf(s, "      -S seed [%" PRIu64 "]: Random seed; the stream is reproducible.\n", gp->seed);
+    fprintf(s, "      -t rise,tau [%g,%g]: Rise and decay time constants.\n", gp->rise, gp->tau);
+    fprintf(s, "      host port : TCP host:port to listen on.\n");
+}
 
 static int nsfd=0; /**< network socket fd (server) */
 static int sock_open(const char *host, const char *port)
@@ -91,14 +219,654 @@ static void sock_close(int sockfd)
     close(sockfd);
 }
 
+static volatile sig_atomic_t stopQ = 0;
+static void signal_kill_handler(int sig)
+{
+    stopQ = 1;
+}
+
+static void sleep_until(double t)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)t;
+    ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* Block number blk of the stream into p. */
+static void fill_block(const wavgen_t *gen, char *p, uint64_t blk)
+{
+    SHM_ELEM_TYPE *d = (SHM_ELEM_TYPE*)p;
+    size_t k;
+
+    if (gen) {
+        wavgen_block(gen, (RAW_WAVEFORM_BASE_TYPE*)p, blk);
+    } else {
+        for (k=0; k<COUNTER_BLOCK_LEN; k++) d[k] = (SHM_ELEM_TYPE)(blk * COUNTER_BLOCK_LEN + k);
+    }
+}
+
+/* Ring of nBuf blocks.  The generator thread fills all free blocks at
+ * once, on the pool, when at least batch of them are free; the sender
+ * holds one block while it is being sent. */
+typedef struct block_ring
+{
+    char *buf;
+    size_t blkSz;
+    size_t nBuf;
+    size_t batch;
+    uint64_t iRd, iWr;         /* blocks taken and filled, monotonic */
+    int held;
+    int stopQ;
+    thpool_t *pool;
+    const wavgen_t *gen;       /* NULL: counter ramp */
+    pthread_t tid;
+    pthread_mutex_t mtx;
+    pthread_cond_t filled;
+    pthread_cond_t freed;
+} block_ring_t;
+
+static void ring_fill_block(void *arg, size_t i)
+{
+    const block_ring_t *ring = (const block_ring_t*)arg;
+    const uint64_t blk = ring->iWr + i;
+    fill_block(ring->gen, ring->buf + (blk % ring->nBuf) * ring->blkSz, blk);
+}
+
+static void *ring_generate(void *arg)
+{
+    block_ring_t *ring = (block_ring_t*)arg;
+    size_t n;
+
+    for (;;) {
+        pthread_mutex_lock(&ring->mtx);
+        while (!ring->stopQ && ring->nBuf - (ring->iWr - ring->iRd) - ring->held < ring->batch)
+            pthread_cond_wait(&ring->freed, &ring->mtx);
+        if (ring->stopQ) {
+            pthread_mutex_unlock(&ring->mtx);
+            break;
+        }
+        n = ring->nBuf - (ring->iWr - ring->iRd) - ring->held;
+        pthread_mutex_unlock(&ring->mtx);
+
+        /* Only this thread moves iWr, ring_fill_block() may read it. */
+        thpool_run(ring->pool, ring_fill_block, ring, n);
+
+        pthread_mutex_lock(&ring->mtx);
+        ring->iWr += n;
+        pthread_cond_signal(&ring->filled);
+        pthread_mutex_unlock(&ring->mtx);
+    }
+    return NULL;
+}
+
+/* Give back the block held, if any, and wait for the next one. */
+static const char *ring_next(block_ring_t *ring)
+{
+    const char *p;
+    pthread_mutex_lock(&ring->mtx);
+    if (ring->held) {
+        ring->held = 0;
+        pthread_cond_signal(&ring->freed);
+    }
+    while (ring->iRd == ring->iWr)
+        pthread_cond_wait(&ring->filled, &ring->mtx);
+    p = ring->buf + (ring->iRd % ring->nBuf) * ring->blkSz;
+    ring->iRd++;
+    ring->held = 1;
+    pthread_mutex_unlock(&ring->mtx);
+    return p;
+}
+
+/* What the clients are sent: the loop, shared by all clients, or the
+ * live ring or the events of an HDF5 file, for one client at a time. */
+typedef struct source
+{
+    const param_t *pm;
+    char *loop;
+    size_t loopSz;
+    size_t blkSz;
+    int loopFd;                /* memfd or file holding the loop, -1: send() from loop */
+    const wavgen_t *gen;
+    block_ring_t *ring;
+    struct HDF5IO(waveform_file) *wavFile;
+    size_t evtBytes;           /* bytes of a record of wavFile */
+    double *evtTimes;          /* time stamps of the events, NULL: none */
+    double loopTime;           /* recorded duration of the loop, 0: unknown */
+} source_t;
+
+static void loop_fill_block(void *arg, size_t i)
+{
+    const source_t *src = (const source_t*)arg;
+    fill_block(src->gen, src->loop + i * src->blkSz, i);
+}
+
+/* The loop of nBlk blocks of blkSz, in a memfd where sendfile() can
+ * take it from. */
+static int loop_create(source_t *src, size_t nBlk, size_t blkSz, thpool_t *pool)
+{
+    src->loopSz = nBlk * blkSz;
+    src->blkSz = blkSz;
+    src->loopFd = -1;
+#if defined(__linux)
+    if ((src->loopFd = memfd_create("tcpserv", 0)) < 0) {
+        warn("memfd_create");
+    } else if (ftruncate(src->loopFd, src->loopSz) < 0
+               || (src->loop = mmap(NULL, src->loopSz, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                    src->loopFd, 0)) == MAP_FAILED) {
+        warn("memfd");
+        close(src->loopFd);
+        src->loopFd = -1;
+        src->loop = NULL;
+    }
+#endif
+    if (src->loopFd < 0 && (src->loop = (char*)malloc(src->loopSz)) == NULL) {
+        error_printf("Cannot allocate a loop of %zd bytes.\n", src->loopSz);
+        return -1;
+    }
+    thpool_run(pool, loop_fill_block, src, nBlk);
+    return 0;
+}
+
+/* The raw file fname as the loop, sent straight from the file. */
+static int loop_open_file(source_t *src, const char *fname)
+{
+    struct stat st;
+
+    if ((src->loopFd = open(fname, O_RDONLY)) < 0) {
+        warn("%s", fname);
+        return -1;
+    }
+    if (fstat(src->loopFd, &st) < 0 || st.st_size == 0) {
+        error_printf("%s is empty or cannot be read.\n", fname);
+        close(src->loopFd);
+        return -1;
+    }
+    src->loopSz = st.st_size;
+    src->loop = mmap(NULL, src->loopSz, PROT_READ, MAP_SHARED, src->loopFd, 0);
+    if (src->loop == MAP_FAILED) {
+        warn("mmap");
+        close(src->loopFd);
+        return -1;
+    }
+    return 0;
+}
+
+/* HDF5 files written here start with the signature, without a user
+ * block. */
+static int is_hdf5_file(const char *fname)
+{
+    static const char sig[8] = {'\x89', 'H', 'D', 'F', '\r', '\n', '\x1a', '\n'};
+    char buf[8];
+    FILE *fp;
+    int q = 0;
+
+    if ((fp = fopen(fname, "rb")) == NULL) return 0;
+    q = fread(buf, 1, sizeof(buf), fp) == sizeof(buf) && memcmp(buf, sig, sizeof(sig)) == 0;
+    fclose(fp);
+    return q;
+}
+
+/* Open the HDF5 file fname for replay and read the time stamps of its
+ * events, those of the first frame for FastFrame files.
+ * @return -1 if it is not an HDF5 file with events. */
+static int events_open(source_t *src, const char *fname)
+{
+    struct waveform_attribute attr;
+    struct HDF5IO(waveform_file) *wf;
+    SCOPE_DATA_TYPE *frame;
+    size_t i, n, nTimes = 0;
+
+    if ((wf = HDF5IO(open_file_for_read)(fname)) == NULL) return -1;
+    if ((n = HDF5IO(get_number_of_events)(wf)) == 0) {
+        error_printf("%s has no events.\n", fname);
+        HDF5IO(close_file)(wf);
+        return -1;
+    }
+    HDF5IO(read_waveform_attribute_in_file_header)(wf, &attr);
+    src->wavFile = wf;
+    src->evtBytes = wf->nCh * wf->nPt * sizeof(SCOPE_DATA_TYPE);
+    if (wf->nFrames > 0) {
+        src->evtTimes = (double*)malloc(n * sizeof(double));
+        frame = (SCOPE_DATA_TYPE*)malloc(wf->nPt / wf->nFrames * sizeof(SCOPE_DATA_TYPE));
+        for (i=0; i<n; i++) {
+            if (HDF5IO(read_frames)(wf, i, 0, 1, wf->chMask & -wf->chMask, frame,
+                                    &src->evtTimes[i]) < 0)
+                src->evtTimes[i] = NAN;
+            nTimes += !isnan(src->evtTimes[i]);
+        }
+        free(frame);
+        if (nTimes < n) {
+            free(src->evtTimes);
+            src->evtTimes = NULL;
+        }
+    }
+    /* The loop lasts one mean event interval past its last event. */
+    if (src->evtTimes && n > 1) {
+        src->loopTime = (src->evtTimes[n-1] - src->evtTimes[0]) * n / (n - 1);
+    } else if (attr.dt > 0) {
+        src->loopTime = n * wf->nPt * attr.dt;
+    }
+    src->loopSz = n * src->evtBytes;
+    return 0;
+}
+
+static void loop_destroy(source_t *src)
+{
+    if (src->wavFile) {
+        HDF5IO(close_file)(src->wavFile);
+        free(src->evtTimes);
+    } else if (src->loopFd >= 0) {
+        munmap(src->loop, src->loopSz);
+        close(src->loopFd);
+    } else {
+        free(src->loop);
+    }
+}
+
+/* Pacing.  Bursts of burstOn seconds start every burstOn + burstOff
+ * seconds; within them at most rate bytes per second are sent.
+ * @return the time, from the start, at which sent bytes may have gone
+ * out. */
+static double pace_time(const param_t *pm, double sent, double now)
+{
+    const double period = pm->burstOn + pm->burstOff;
+    double on, k;
+
+    if (pm->burstOn <= 0) return pm->rate > 0 ? sent / pm->rate : 0.0;
+    if (pm->rate <= 0) { /* free within bursts */
+        k = floor(now / period);
+        return now - k * period < pm->burstOn ? 0.0 : (k + 1) * period;
+    }
+    on = sent / pm->rate;
+    k = ceil(on / pm->burstOn) - 1;
+    return k < 0 ? 0.0 : k * period + (on - k * pm->burstOn);
+}
+
+typedef struct client
+{
+    int fd;
+    size_t id;
+    const source_t *src;
+    pthread_t tid;
+    atomic_int doneQ;
+} client_t;
+
+/* Count the query lines waiting on the socket; wait for one if waitQ.
+ * @return the number of queries, -1 if the client is gone. */
+static ssize_t read_queries(int fd, int waitQ)
+{
+    char q[256];
+    ssize_t nr, i, n = 0;
+
+    for (;;) {
+        nr = recv(fd, q, sizeof(q), (waitQ && n == 0) ? 0 : MSG_DONTWAIT);
+        if (nr == 0) return -1;
+        if (nr < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return n;
+            if (errno == EINTR) {
+                if (stopQ) return -1;
+                continue;
+            }
+            warn("recv");
+            return -1;
+        }
+        for (i=0; i<nr; i++) n += q[i] == '\n';
+    }
+}
+
+/* Send n bytes starting at off of the loop, or from p.
+ * @return 0 on success, -1 if the client is gone. */
+static int send_data(int fd, const source_t *src, const char *p, off_t off, size_t n)
+{
+    ssize_t r;
+    while (n > 0) {
+#if defined(__linux)
+        if (!p && src->loopFd >= 0) {
+            r = sendfile(fd, src->loopFd, &off, n);
+        } else
+#endif
+        {
+            r = send(fd, p ? p : src->loop + off, n, MSG_NOSIGNAL);
+            if (r > 0) {
+                if (p) p += r; else off += r;
+            }
+        }
+        if (r < 0) {
+            if (errno == EINTR) {
+                if (stopQ) return -1;
+                continue;
+            }
+            if (errno != EPIPE && errno != ECONNRESET) warn("send");
+            return -1;
+        }
+        n -= r;
+    }
+    return 0;
+}
+
+/* A client's position in its source.  Data goes out piece by piece:
+ * the loop, a block of the ring, or a record of wavFile. */
+typedef struct feed
+{
+    const source_t *src;
+    const char *p;             /* data left of the piece, NULL: at off in the loop */
+    off_t off;
+    size_t left;
+    double t;                  /* when the piece is due, from the start; NAN: any time */
+    size_t nLoops;
+    struct HDF5IO(event_iterator) *it;
+    const struct HDF5IO(event_batch) *batch;
+    size_t k;                  /* next record of batch */
+    char *rec;                 /* records of batch, interleaved */
+} feed_t;
+
+/* The recorded time of event e in pass nLoops, over speed. */
+static double event_time(const feed_t *fd, size_t e)
+{
+    const source_t *src = fd->src;
+    return (fd->nLoops * src->loopTime + src->evtTimes[e] - src->evtTimes[0]) / src->pm->speed;
+}
+
+/* Move fd to its next piece.
+ * @return 1 when the loop starts over, 0 otherwise, -1 on errors. */
+static int feed_next(feed_t *fd)
+{
+    const source_t *src = fd->src;
+    const struct HDF5IO(waveform_file) *wf = src->wavFile;
+    const struct HDF5IO(event_batch) *b;
+    int wrapQ = 0;
+    size_t k, c;
+
+    fd->t = NAN;
+    if (src->ring) {
+        fd->p = ring_next(src->ring);
+        fd->left = src->ring->blkSz;
+        return 0;
+    }
+    if (!wf) {
+        wrapQ = fd->off > 0;
+        fd->nLoops += wrapQ;
+        fd->p = NULL;
+        fd->off = 0;
+        fd->left = src->loopSz;
+        return wrapQ;
+    }
+    if (!fd->batch || fd->k == fd->batch->n) {
+        if (!fd->it || (b = HDF5IO(iterator_next)(fd->it)) == NULL) {
+            if (fd->it) {
+                HDF5IO(iterator_close)(fd->it);
+                fd->nLoops++;
+                wrapQ = 1;
+            }
+            if ((fd->it = HDF5IO(iterator_open)(src->wavFile, 0, 0, 0, 4)) == NULL
+                || (b = HDF5IO(iterator_next)(fd->it)) == NULL)
+                return -1;
+        }
+        fd->batch = b;
+        fd->k = 0;
+        fd->rec = (char*)realloc(fd->rec, b->n * src->evtBytes);
+        for (k=0; k<b->n; k++) {
+            for (c=0; c<wf->nCh; c++)
+                memcpy(fd->rec + k * src->evtBytes + c * wf->nPt * sizeof(SCOPE_DATA_TYPE),
+                       HDF5IO_BATCH_WAVEFORM(b, wf, k, c), wf->nPt * sizeof(SCOPE_DATA_TYPE));
+        }
+    }
+    fd->p = fd->rec + fd->k * src->evtBytes;
+    fd->left = src->evtBytes;
+    if (src->evtTimes && src->pm->speed > 0)
+        fd->t = event_time(fd, fd->batch->eventId + fd->k);
+    fd->k++;
+    return wrapQ;
+}
+
+static void *client_serve(void *arg)
+{
+    client_t *cl = (client_t*)arg;
+    const source_t *src = cl->src;
+    const param_t *pm = src->pm;
+    feed_t fd;
+    size_t n;
+    uint64_t sent = 0, credit = 0, loopSent = 0;
+    ssize_t nq;
+    double t0, t, tLoop;
+    int r;
+
+    memset(&fd, 0, sizeof(fd));
+    fd.src = src;
+    t0 = tLoop = time_now();
+    while (!stopQ) {
+        if (pm->dblksz) {
+            if ((nq = read_queries(cl->fd, credit == 0)) < 0) break;
+            credit += nq * pm->dblksz;
+            if (credit == 0) continue;
+        }
+        if (fd.left == 0) {
+            if ((r = feed_next(&fd)) < 0) break;
+            /* Passes of the replay done, reported at most once a second. */
+            if (r && pm->replayFName && (t = time_now()) - tLoop >= 1.0) {
+                printf("Client %zd: %zd loops, %g MiB/s", cl->id, fd.nLoops,
+                       (sent - loopSent) / 1048576.0 / (t - tLoop));
+                if (src->loopTime > 0)
+                    printf(", %.3g x recorded", (sent - loopSent) / (t - tLoop)
+                           / (src->loopSz / src->loopTime));
+                printf(".\n");
+                fflush(stdout);
+                loopSent = sent;
+                tLoop = t;
+            }
+            if (!isnan(fd.t)) sleep_until(t0 + fd.t);
+        }
+        n = MIN(fd.left, pm->chunk);
+        if (pm->dblksz) n = MIN(n, credit);
+        if (isnan(fd.t) && (pm->rate > 0 || pm->burstOn > 0)) {
+            t = time_now() - t0;
+            sleep_until(t0 + pace_time(pm, (double)(sent + n), t));
+        }
+        if (send_data(cl->fd, src, fd.p, fd.off, n) < 0) break;
+        if (fd.p) fd.p += n; else fd.off += n;
+        fd.left -= n;
+        sent += n;
+        if (pm->dblksz) credit -= n;
+    }
+    if (fd.it) HDF5IO(iterator_close)(fd.it);
+    free(fd.rec);
+    t = time_now() - t0;
+    printf("Client %zd: sent %g MiB in %g s, %g MiB/s.\n", cl->id, sent / 1048576.0, t,
+           sent / 1048576.0 / t);
+    fflush(stdout);
+    atomic_store(&cl->doneQ, 1);
+    return NULL;
+}
+
 int main(int argc, char **argv)
 {
     char *host, *port;
-    SHM_ELEM_TYPE *data;
-    size_t dlen = 1024*1024;
+    param_t pm;
+    int optC = 0, fd, ret = EXIT_SUCCESS;
+    block_ring_t ring;
+    source_t src;
+    wavgen_t *gen = NULL;
+    thpool_t *pool;
+    client_t **clients;
+    size_t i, nClients = 0, nAccepted = 0, blkSz;
+    struct sigaction sa;
+    sigset_t sigs;
+
+    memcpy(&pm, &paramDefault, sizeof(pm));
+    while ((optC = getopt(argc, argv, "B:C:L:M:a:b:c:d:e:f:j:k:m:P:p:q:R:r:S:s:t:u:x:")) != -1) {
+        switch (optC) {
+        case 'B':
+            pm.nBuf = MAX(2, strtoull(optarg, NULL, 10));
+            break;
+        case 'C':
+            pm.chunk = MAX(1, strtoull(optarg, NULL, 10));
+            break;
+        case 'L':
+            pm.loopSz = strtoull(optarg, NULL, 10);
+            break;
+        case 'M':
+            pm.maxClients = MAX(1, strtoull(optarg, NULL, 10));
+            break;
+        case 'a':
+            sscanf(optarg, "%lf,%lf", &pm.gp.amplitude, &pm.gp.ampSigma);
+            break;
+        case 'b':
+            pm.gp.baseline = atof(optarg);
+            break;
+        case 'c':
+            pm.gp.nCh = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            pm.dt = atof(optarg);
+            break;
+        case 'e':
+            pm.gp.sigma = atof(optarg);
+            break;
+        case 'f':
+            pm.replayFName = optarg;
+            break;
+        case 'j':
+            pm.nThreads = strtoull(optarg, NULL, 10);
+            break;
+        case 'k':
+            pm.gp.rho = atof(optarg);
+            break;
+        case 'm':
+            if (strcmp(optarg, "counter") == 0) {
+                pm.pulsesQ = 0;
+            } else if (strcmp(optarg, "pulses") == 0) {
+                pm.pulsesQ = 1;
+            } else {
+                error_printf("Unknown mode: %s\n", optarg);
+                print_usage(&pm, stderr);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'P':
+            pm.gp.polarity = atoi(optarg);
+            break;
+        case 'p':
+            pm.gp.nPt = strtoull(optarg, NULL, 10);
+            break;
+        case 'q':
+            pm.dblksz = strtoull(optarg, NULL, 10);
+            break;
+        case 'R':
+            pm.gp.nRec = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            pm.gp.rate = atof(optarg);
+            break;
+        case 'S':
+            pm.gp.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            pm.rate = atof(optarg) * 1048576.0;
+            break;
+        case 't':
+            sscanf(optarg, "%lf,%lf", &pm.gp.rise, &pm.gp.tau);
+            break;
+        case 'u':
+            if (sscanf(optarg, "%lf,%lf", &pm.burstOn, &pm.burstOff) != 2
+                || pm.burstOn < 0 || pm.burstOff < 0) {
+                error_printf("Malformed bursts: %s\n", optarg);
+                print_usage(&pm, stderr);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'x':
+            pm.speed = MAX(0.0, atof(optarg));
+            break;
+        default:
+            print_usage(&pm, stderr);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 2) {
+        fprintf(stderr, "host and port needed!\n");
+        print_usage(&pm, stderr);
+        return EXIT_FAILURE;
+    }
+    host = argv[0];
+    port = argv[1];
 
-    host = argv[1];
-    port = argv[2];
+    /* Only the main thread takes SIGINT and SIGTERM, so that they
+     * interrupt accept(); every thread started from here inherits. */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    if (pm.pulsesQ && !pm.replayFName) {
+        if ((gen = wavgen_create(&pm.gp)) == NULL) return EXIT_FAILURE;
+        blkSz = wavgen_block_size(gen);
+    } else {
+        blkSz = COUNTER_BLOCK_LEN * sizeof(SHM_ELEM_TYPE);
+    }
+    pool = thpool_create(pm.nThreads);
+    memset(&src, 0, sizeof(src));
+    src.pm = &pm;
+    src.gen = gen;
+    memset(&ring, 0, sizeof(ring));
+    if (pm.replayFName) {
+        if (is_hdf5_file(pm.replayFName)) {
+            if (events_open(&src, pm.replayFName) < 0) return EXIT_FAILURE;
+            pm.maxClients = 1; /* HDF5 is read by one iterator at a time */
+        } else {
+            if (loop_open_file(&src, pm.replayFName) < 0) return EXIT_FAILURE;
+            if (pm.dt > 0)
+                src.loopTime = (double)src.loopSz / (pm.gp.nCh * sizeof(SCOPE_DATA_TYPE)) * pm.dt;
+        }
+        if (pm.speed > 0 && !src.evtTimes) {
+            if (src.loopTime <= 0) {
+                error_printf("The recorded rate of %s is unknown, give -d dt or -s rate.\n",
+                             pm.replayFName);
+                return EXIT_FAILURE;
+            }
+            pm.rate = pm.speed * src.loopSz / src.loopTime;
+        }
+        printf("Replaying %s, %g MiB per loop", pm.replayFName, src.loopSz / 1048576.0);
+        if (src.loopTime > 0) printf(", recorded at %g MiB/s", src.loopSz / src.loopTime / 1048576.0);
+        printf(".\n");
+        fflush(stdout);
+    } else if (pm.loopSz) {
+        if (loop_create(&src, (pm.loopSz + blkSz - 1) / blkSz, blkSz, pool) < 0)
+            return EXIT_FAILURE;
+    } else {
+        pm.maxClients = 1;
+        src.ring = &ring;
+        ring.gen = gen;
+        ring.blkSz = blkSz;
+        ring.nBuf = pm.nBuf;
+        ring.pool = pool;
+        ring.batch = MAX(1, MIN(thpool_nthreads(pool), ring.nBuf / 2));
+        if ((ring.buf = (char*)malloc(ring.nBuf * ring.blkSz)) == NULL) {
+            error_printf("Cannot allocate %zd blocks of %zd bytes.\n", ring.nBuf, ring.blkSz);
+            return EXIT_FAILURE;
+        }
+        pthread_mutex_init(&ring.mtx, NULL);
+        pthread_cond_init(&ring.filled, NULL);
+        pthread_cond_init(&ring.freed, NULL);
+        /* Generate while waiting for the client. */
+        if ((optC = pthread_create(&ring.tid, NULL, ring_generate, &ring)) != 0) {
+            error_printf("Cannot start the generator thread: %s\n", strerror(optC));
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* No SA_RESTART, so that accept() returns on SIGINT. */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_kill_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    /* sendfile() has no MSG_NOSIGNAL. */
+    signal(SIGPIPE, SIG_IGN);
 
     if ((nsfd = sock_open(host, port)) < 0) {
         return EXIT_FAILURE;
@@ -107,24 +875,70 @@ int main(int argc, char **argv)
         warn("listen");
         return EXIT_FAILURE;
     }
-    int acptfd;
-    if ((acptfd = accept(nsfd, NULL, 0)) < 0) {
-        warn("accept");
-        goto EXIT;
-    }
-    size_t dsz = dlen * sizeof(SHM_ELEM_TYPE);
-    data = malloc(dsz);
-    intptr_t j=0;
-    for (;;) {
-        for (intptr_t i=0; i<dlen; i++) {
-            data[i] = j;
-            j++;
+    fprintf(stderr, "Listening on %s:%s.\n", host, port);
+    clients = (client_t**)calloc(pm.maxClients, sizeof(client_t*));
+    while (!stopQ) {
+        pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+        fd = accept(nsfd, NULL, 0);
+        pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            warn("accept");
+            ret = EXIT_FAILURE;
+            break;
+        }
+        for (i=0; i<nClients; ) { /* reap finished clients */
+            if (atomic_load(&clients[i]->doneQ)) {
+                pthread_join(clients[i]->tid, NULL);
+                close(clients[i]->fd);
+                free(clients[i]);
+                clients[i] = clients[--nClients];
+            } else {
+                i++;
+            }
+        }
+        if (nClients == pm.maxClients) {
+            error_printf("Refused a client, %zd already connected.\n", nClients);
+            close(fd);
+            continue;
         }
-        send(acptfd, data, dsz, 0);
+        clients[nClients] = (client_t*)calloc(1, sizeof(client_t));
+        clients[nClients]->fd = fd;
+        clients[nClients]->id = nAccepted++;
+        clients[nClients]->src = &src;
+        atomic_init(&clients[nClients]->doneQ, 0);
+        if ((optC = pthread_create(&clients[nClients]->tid, NULL, client_serve,
+                                   clients[nClients])) != 0) {
+            error_printf("Cannot start a client thread: %s\n", strerror(optC));
+            close(fd);
+            free(clients[nClients]);
+            continue;
+        }
+        nClients++;
+    }
+    /* Wake up clients blocked on the socket. */
+    for (i=0; i<nClients; i++) shutdown(clients[i]->fd, SHUT_RDWR);
+    for (i=0; i<nClients; i++) {
+        pthread_join(clients[i]->tid, NULL);
+        close(clients[i]->fd);
+        free(clients[i]);
+    }
+    free(clients);
+    if (src.ring) {
+        pthread_mutex_lock(&ring.mtx);
+        ring.stopQ = 1;
+        pthread_cond_signal(&ring.freed);
+        pthread_mutex_unlock(&ring.mtx);
+        pthread_join(ring.tid, NULL);
+        pthread_cond_destroy(&ring.freed);
+        pthread_cond_destroy(&ring.filled);
+        pthread_mutex_destroy(&ring.mtx);
+        free(ring.buf);
+    } else if (src.loop || src.wavFile) {
+        loop_destroy(&src);
     }
-    free(data);
-    close(acptfd);
-EXIT:
+    thpool_destroy(pool);
+    wavgen_destroy(gen);
     sock_close(nsfd);
-    return EXIT_SUCCESS;
+    return ret;
 }
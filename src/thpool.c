@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "thpool.h"
+
+struct thpool
+{
+    size_t          nThreads;   //!< including the caller of thpool_run().
+    pthread_t      *tids;       //!< nThreads-1 workers.
+    pthread_mutex_t mtx;
+    pthread_cond_t  wake;       //!< signalled on a new job or on exit.
+    pthread_cond_t  done;       //!< signalled when the last worker leaves a job.
+    uint64_t        gen;        //!< job generation, incremented by thpool_run().
+    int             exitQ;
+    size_t          nBusy;      //!< workers still inside the current job.
+    /* current job */
+    thpool_func_t   fn;
+    void           *arg;
+    size_t          n;
+    atomic_size_t   next;       //!< next index to be handed out.
+};
+
+/** Grab indices until the current job is exhausted. */
+static void thpool_drain(thpool_t *pool)
+{
+    size_t i;
+    while ((i = atomic_fetch_add(&pool->next, 1)) < pool->n) {
+        pool->fn(pool->arg, i);
+    }
+}
+
+static void *thpool_worker(void *p)
+{
+    thpool_t *pool = (thpool_t*)p;
+    uint64_t gen = 0;
+
+    pthread_mutex_lock(&pool->mtx);
+    for (;;) {
+        while (pool->gen == gen && !pool->exitQ)
+            pthread_cond_wait(&pool->wake, &pool->mtx);
+        if (pool->exitQ) break;
+        gen = pool->gen;
+        pthread_mutex_unlock(&pool->mtx);
+
+        thpool_drain(pool);
+
+        pthread_mutex_lock(&pool->mtx);
+        if (--pool->nBusy == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mtx);
+    return NULL;
+}
+
+thpool_t *thpool_create(size_t nThreads)
+{
+    thpool_t *pool;
+    size_t i;
+    long ncpu;
+
+    if (nThreads == 0) {
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nThreads = ncpu > 0 ? (size_t)ncpu : 1;
+    }
+    if ((pool = (thpool_t*)calloc(1, sizeof(thpool_t))) == NULL) {
+        error_printf("%s(): pool allocation failure.\n", __func__);
+        return NULL;
+    }
+    pool->nThreads = nThreads;
+    pthread_mutex_init(&pool->mtx, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    atomic_init(&pool->next, 0);
+    pool->tids = (pthread_t*)calloc(nThreads, sizeof(pthread_t));
+    for (i=0; i+1<nThreads; i++) {
+        if (pthread_create(&pool->tids[i], NULL, thpool_worker, pool) != 0) {
+            error_printf("%s(): only %zd of %zd threads started.\n", __func__, i+1, nThreads);
+            pool->nThreads = i+1;
+            break;
+        }
+    }
+    return pool;
+}
+
+void thpool_destroy(thpool_t *pool)
+{
+    size_t i;
+    if (!pool) return;
+    pthread_mutex_lock(&pool->mtx);
+    pool->exitQ = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mtx);
+    for (i=0; i+1<pool->nThreads; i++) {
+        pthread_join(pool->tids[i], NULL);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->mtx);
+    free(pool->tids);
+    free(pool);
+}
+
+size_t thpool_nthreads(const thpool_t *pool)
+{
+    return pool->nThreads;
+}
+
+void thpool_run(thpool_t *pool, thpool_func_t fn, void *arg, size_t n)
+{
+    if (n == 0) return;
+    if (pool->nThreads == 1 || n == 1) { /* not worth waking anyone */
+        for (size_t i=0; i<n; i++) fn(arg, i);
+        return;
+    }
+    pthread_mutex_lock(&pool->mtx);
+    pool->fn   = fn;
+    pool->arg  = arg;
+    pool->n    = n;
+    atomic_store(&pool->next, 0);
+    pool->nBusy = pool->nThreads - 1;
+    pool->gen++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mtx);
+
+    thpool_drain(pool);
+
+    pthread_mutex_lock(&pool->mtx);
+    while (pool->nBusy > 0)
+        pthread_cond_wait(&pool->done, &pool->mtx);
+    pthread_mutex_unlock(&pool->mtx);
+}
+
+#ifdef THPOOL_DEBUG_ENABLEMAIN
+static void square(void *arg, size_t i)
+{
+    ((double*)arg)[i] = (double)i * i;
+}
+
+int main(int argc, char **argv)
+{
+    double v[1000];
+    size_t i, r, bad=0;
+    thpool_t *pool = thpool_create(argc > 1 ? strtoull(argv[1], NULL, 10) : 0);
+
+    printf("%zd threads\n", thpool_nthreads(pool));
+    for (r=0; r<1000; r++) {
+        for (i=0; i<1000; i++) v[i] = -1.0;
+        thpool_run(pool, square, v, 1 + r % 1000);
+        for (i=0; i<1+r%1000; i++) bad += (v[i] != (double)i * i);
+    }
+    printf("%zd mismatches\n", bad);
+    thpool_destroy(pool);
+    return bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,29 @@
+/** \file thpool.h
+ * A fixed-size pool of worker threads for data-parallel loops.
+ */
+#ifndef __THPOOL_H__
+#define __THPOOL_H__
+
+#include <stddef.h>
+
+typedef struct thpool thpool_t;
+/** Work function, called once for every index i of a thpool_run(). */
+typedef void (*thpool_func_t)(void *arg, size_t i);
+
+/** Create a pool.
+ * @param[in] nThreads number of threads, including the caller of
+ *                     thpool_run().  0 selects the number of online CPUs.
+ * @return NULL on failure.
+ */
+thpool_t *thpool_create(size_t nThreads);
+/** Stop and join all workers, then free the pool. */
+void thpool_destroy(thpool_t *pool);
+/** Number of threads working on a thpool_run(), including the caller. */
+size_t thpool_nthreads(const thpool_t *pool);
+/** Run fn(arg, i) for i in [0, n) on the pool and the calling thread.
+ * Returns when all n calls have completed.  Not reentrant: only one
+ * thread may call thpool_run() on a given pool at a time.
+ */
+void thpool_run(thpool_t *pool, thpool_func_t fn, void *arg, size_t n);
+
+#endif /* __THPOOL_H__ */
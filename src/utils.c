@@ -1,8 +1,10 @@
+#define _GNU_SOURCE
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "common.h"
 #include "utils.h"
 
@@ -96,6 +98,314 @@ double *rand_gaussnd(size_t n, const double *L, const double *mean, double *pt)
 #undef RAND_GAUSSND_NMAX
 }
 
+/* Random number streams: xoshiro256++ of Blackman and Vigna, lanes
+ * interleaved so that each state word of all lanes is one vector.  The
+ * auto-vectorizer does not see through the recurrence, so the lanes are
+ * written with GCC vector extensions. */
+#define RS_L RAND_STREAM_LANES
+typedef uint64_t rand_vec_t __attribute__((vector_size(RS_L * sizeof(uint64_t))));
+
+static inline uint64_t rotl64(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t xoshiro_next(uint64_t *s)
+{
+    const uint64_t r = rotl64(s[0] + s[3], 23) + s[0], t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl64(s[3], 45);
+    return r;
+}
+
+/* Advance s by the polynomial poly: 2^128 or 2^192 draws. */
+static void xoshiro_jump(uint64_t *s, const uint64_t *poly)
+{
+    uint64_t t[4] = {0, 0, 0, 0};
+    int i, b, k;
+    for (i=0; i<4; i++) {
+        for (b=0; b<64; b++) {
+            if (poly[i] & ((uint64_t)1 << b)) {
+                for (k=0; k<4; k++) t[k] ^= s[k];
+            }
+            xoshiro_next(s);
+        }
+    }
+    memcpy(s, t, sizeof(t));
+}
+
+static const uint64_t xoshiro_jump128[4] = {
+    0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL};
+static const uint64_t xoshiro_jump192[4] = {
+    0x76e15d3efefdcbbfULL, 0xc5004e441c522fb3ULL, 0x77710069854ee241ULL, 0x39109bb02acbe635ULL};
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Lanes and the slow path generator from lane 0's state in base. */
+static void rand_stream_spread(rand_stream_t *rs, const uint64_t *base)
+{
+    uint64_t s[4];
+    int j, k;
+    memcpy(s, base, sizeof(s));
+    for (j=0; j<RS_L; j++) {
+        for (k=0; k<4; k++) rs->s[k][j] = s[k];
+        xoshiro_jump(s, xoshiro_jump128);
+    }
+    memcpy(rs->fix, s, sizeof(s));
+}
+
+/* Ziggurat tables of Marsaglia and Tsang, with 53 bit integers. */
+static void rand_zig_tables(rand_stream_t *rs)
+{
+    const double m1 = 4503599627370496.0, m2 = 9007199254740992.0; /* 2^52, 2^53 */
+    double dn = 3.442619855899, tn = dn, vn = 9.91256303526217e-3;
+    double de = 7.697117470131487, te = de, ve = 3.949659822581572e-3, q;
+    int i;
+
+    q = vn / exp(-0.5 * dn * dn);
+    rs->kn[0] = (int64_t)((dn / q) * m1);
+    rs->kn[1] = 0;
+    rs->wn[0] = q / m1;
+    rs->wn[RAND_ZIG_NORM_LAYERS-1] = dn / m1;
+    rs->fn[0] = 1.0;
+    rs->fn[RAND_ZIG_NORM_LAYERS-1] = exp(-0.5 * dn * dn);
+    for (i=RAND_ZIG_NORM_LAYERS-2; i>=1; i--) {
+        dn = sqrt(-2.0 * log(vn / dn + exp(-0.5 * dn * dn)));
+        rs->kn[i+1] = (int64_t)((dn / tn) * m1);
+        tn = dn;
+        rs->fn[i] = exp(-0.5 * dn * dn);
+        rs->wn[i] = dn / m1;
+    }
+
+    q = ve / exp(-de);
+    rs->ke[0] = (uint64_t)((de / q) * m2);
+    rs->ke[1] = 0;
+    rs->we[0] = q / m2;
+    rs->we[RAND_ZIG_EXP_LAYERS-1] = de / m2;
+    rs->fe[0] = 1.0;
+    rs->fe[RAND_ZIG_EXP_LAYERS-1] = exp(-de);
+    for (i=RAND_ZIG_EXP_LAYERS-2; i>=1; i--) {
+        de = -log(ve / de + exp(-de));
+        rs->ke[i+1] = (uint64_t)((de / te) * m2);
+        te = de;
+        rs->fe[i] = exp(-de);
+        rs->we[i] = de / m2;
+    }
+}
+
+void rand_stream_init(rand_stream_t *rs, uint64_t seed, uint64_t stream)
+{
+    uint64_t s[4], x = seed;
+    int k;
+    for (k=0; k<4; k++) s[k] = splitmix64(&x);
+    for (; stream>0; stream--) xoshiro_jump(s, xoshiro_jump192);
+    rand_stream_spread(rs, s);
+    rand_zig_tables(rs);
+}
+
+void rand_stream_jump(rand_stream_t *rs)
+{
+    uint64_t s[4];
+    int k;
+    for (k=0; k<4; k++) s[k] = rs->s[k][0];
+    xoshiro_jump(s, xoshiro_jump192);
+    rand_stream_spread(rs, s);
+}
+
+/* nBlocks times RS_L draws, one per lane each time, into x. */
+static inline void rand_blocks(rand_stream_t *rs, uint64_t *x, size_t nBlocks)
+{
+    rand_vec_t s0, s1, s2, s3, t;
+    size_t i;
+
+    memcpy(&s0, rs->s[0], sizeof(s0));
+    memcpy(&s1, rs->s[1], sizeof(s1));
+    memcpy(&s2, rs->s[2], sizeof(s2));
+    memcpy(&s3, rs->s[3], sizeof(s3));
+    for (i=0; i<nBlocks; i++) {
+        t = s0 + s3;
+        t = ((t << 23) | (t >> 41)) + s0;
+        memcpy(x + i * RS_L, &t, sizeof(t));
+        t = s1 << 17;
+        s2 ^= s0;
+        s3 ^= s1;
+        s1 ^= s2;
+        s0 ^= s3;
+        s2 ^= t;
+        s3 = (s3 << 45) | (s3 >> 19);
+    }
+    memcpy(rs->s[0], &s0, sizeof(s0));
+    memcpy(rs->s[1], &s1, sizeof(s1));
+    memcpy(rs->s[2], &s2, sizeof(s2));
+    memcpy(rs->s[3], &s3, sizeof(s3));
+}
+
+/* Samples per pass of the fills below, a multiple of RS_L.  The draws
+ * of a last partial block are dropped. */
+#define RAND_FILL_CHUNK 256
+
+SIMD_CLONES
+void rand_fill_u64(rand_stream_t *rs, uint64_t *x, size_t n)
+{
+    uint64_t u[RS_L];
+    rand_blocks(rs, x, n / RS_L);
+    if (n % RS_L) {
+        rand_blocks(rs, u, 1);
+        memcpy(x + n / RS_L * RS_L, u, n % RS_L * sizeof(uint64_t));
+    }
+}
+
+SIMD_CLONES
+void rand_fill_uniform(rand_stream_t *rs, double *x, size_t n)
+{
+    uint64_t u[RAND_FILL_CHUNK];
+    size_t i, j, m;
+    for (i=0; i<n; i+=m) {
+        m = MIN(RAND_FILL_CHUNK, n - i);
+        rand_blocks(rs, u, (m + RS_L - 1) / RS_L);
+        for (j=0; j<m; j++) x[i+j] = (double)(u[j] >> 11) * 0x1p-53;
+    }
+}
+
+static double rand_fix_uniform(rand_stream_t *rs)
+{
+    return (double)(xoshiro_next(rs->fix) >> 11) * 0x1p-53;
+}
+
+/* Slow path of the normal ziggurat for draw u, rejected by the fast
+ * test: the wedges and the tail beyond r. */
+static double rand_zig_norm_fix(rand_stream_t *rs, uint64_t u)
+{
+    const double r = 3.442619855899;
+    int64_t hz = (int64_t)u >> 11;
+    int iz = (int)(u & (RAND_ZIG_NORM_LAYERS - 1));
+    double x, y;
+
+    for (;;) {
+        x = hz * rs->wn[iz];
+        if (iz == 0) {
+            do {
+                x = -log(1.0 - rand_fix_uniform(rs)) / r;
+                y = -log(1.0 - rand_fix_uniform(rs));
+            } while (y + y < x * x);
+            return hz > 0 ? r + x : -r - x;
+        }
+        if (rs->fn[iz] + rand_fix_uniform(rs) * (rs->fn[iz-1] - rs->fn[iz]) < exp(-0.5 * x * x))
+            return x;
+        u = xoshiro_next(rs->fix);
+        hz = (int64_t)u >> 11;
+        iz = (int)(u & (RAND_ZIG_NORM_LAYERS - 1));
+        if (llabs(hz) < rs->kn[iz]) return hz * rs->wn[iz];
+    }
+}
+
+static double rand_zig_exp_fix(rand_stream_t *rs, uint64_t u)
+{
+    uint64_t jz = u >> 11;
+    int iz = (int)(u & (RAND_ZIG_EXP_LAYERS - 1));
+    double x;
+
+    for (;;) {
+        if (iz == 0) return 7.697117470131487 - log(1.0 - rand_fix_uniform(rs));
+        x = jz * rs->we[iz];
+        if (rs->fe[iz] + rand_fix_uniform(rs) * (rs->fe[iz-1] - rs->fe[iz]) < exp(-x)) return x;
+        u = xoshiro_next(rs->fix);
+        jz = u >> 11;
+        iz = (int)(u & (RAND_ZIG_EXP_LAYERS - 1));
+        if (jz < rs->ke[iz]) return jz * rs->we[iz];
+    }
+}
+
+/* The ziggurat fills take the fast path over a whole chunk, vectorized,
+ * and redo the rare rejections afterwards. */
+SIMD_CLONES
+static void zig_norm_chunk(rand_stream_t *restrict rs, double *restrict x, uint64_t *restrict u,
+                           uint8_t *restrict rej, size_t n)
+{
+    int64_t hz;
+    size_t i, iz;
+    rand_blocks(rs, u, n / RS_L);
+    for (i=0; i<n; i++) {
+        hz = (int64_t)u[i] >> 11;
+        iz = u[i] & (RAND_ZIG_NORM_LAYERS - 1);
+        x[i] = hz * rs->wn[iz];
+        rej[i] = (hz < 0 ? -hz : hz) >= rs->kn[iz];
+    }
+}
+
+void rand_fill_gauss(rand_stream_t *rs, double *x, size_t n, double mean, double sigma)
+{
+    double v[RAND_FILL_CHUNK];
+    uint64_t u[RAND_FILL_CHUNK];
+    uint8_t rej[RAND_FILL_CHUNK];
+    size_t i, j, m;
+
+    for (i=0; i<n; i+=m) {
+        m = MIN(RAND_FILL_CHUNK, n - i);
+        zig_norm_chunk(rs, v, u, rej, RAND_FILL_CHUNK);
+        for (j=0; j<m; j++) {
+            if (rej[j]) v[j] = rand_zig_norm_fix(rs, u[j]);
+            x[i+j] = mean + sigma * v[j];
+        }
+    }
+}
+
+SIMD_CLONES
+static void zig_exp_chunk(rand_stream_t *restrict rs, double *restrict x, uint64_t *restrict u,
+                          uint8_t *restrict rej, size_t n)
+{
+    uint64_t jz;
+    size_t i, iz;
+    rand_blocks(rs, u, n / RS_L);
+    for (i=0; i<n; i++) {
+        jz = u[i] >> 11;
+        iz = u[i] & (RAND_ZIG_EXP_LAYERS - 1);
+        x[i] = jz * rs->we[iz];
+        rej[i] = jz >= rs->ke[iz];
+    }
+}
+
+void rand_fill_exp(rand_stream_t *rs, double *x, size_t n, double alpha)
+{
+    double v[RAND_FILL_CHUNK];
+    uint64_t u[RAND_FILL_CHUNK];
+    uint8_t rej[RAND_FILL_CHUNK];
+    size_t i, j, m;
+
+    for (i=0; i<n; i+=m) {
+        m = MIN(RAND_FILL_CHUNK, n - i);
+        zig_exp_chunk(rs, v, u, rej, RAND_FILL_CHUNK);
+        for (j=0; j<m; j++) {
+            if (rej[j]) v[j] = rand_zig_exp_fix(rs, u[j]);
+            x[i+j] = v[j] / alpha;
+        }
+    }
+}
+
+double time_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+uint64_t time_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
 static inline size_t qs_partition(QS_TYPE *list, size_t left, size_t right, size_t pivotIndex)
 {
     QS_TYPE pivotValue, tmp;
@@ -3,6 +3,7 @@
  */
 #ifndef __UTILS_H__
 #define __UTILS_H__
+#include <stddef.h>
 #include <stdint.h>
 
 #define QS_TYPE double
@@ -25,6 +26,51 @@ double *rand_gaussnd(size_t n, const double *L, const double *mean, double *pt);
  * @param[in] alpha \f$\exp(-\alpha t)\f$
  */
 double rand_exp(double alpha);
+/** Lanes of a rand_stream_t, generated side by side in SIMD registers. */
+#define RAND_STREAM_LANES 8
+#define RAND_ZIG_NORM_LAYERS 128
+#define RAND_ZIG_EXP_LAYERS 256
+
+/** A random number stream for one thread: RAND_STREAM_LANES xoshiro256++
+ * generators, 2^128 draws apart, plus one for the rare slow paths of the
+ * ziggurat.  Streams share nothing, so every thread can own one, and
+ * streams of one seed never overlap.  The ziggurat tables are kept in
+ * the stream for the same reason.  Fills are deterministic for a given
+ * seed, stream and sequence of calls. */
+typedef struct rand_stream
+{
+    uint64_t s[4][RAND_STREAM_LANES];  /**< lane j is s[0..3][j] */
+    uint64_t fix[4];                    /**< slow paths */
+    int64_t  kn[RAND_ZIG_NORM_LAYERS];  /**< normal ziggurat */
+    double   wn[RAND_ZIG_NORM_LAYERS];
+    double   fn[RAND_ZIG_NORM_LAYERS];
+    uint64_t ke[RAND_ZIG_EXP_LAYERS];   /**< exponential ziggurat */
+    double   we[RAND_ZIG_EXP_LAYERS];
+    double   fe[RAND_ZIG_EXP_LAYERS];
+} rand_stream_t;
+
+/** Seed stream number stream of seed.  Streams are 2^192 draws apart,
+ * so distinct streams of the same seed are independent.
+ * @param[in] stream e.g. the thread index.  Costs one jump per stream.
+ */
+void rand_stream_init(rand_stream_t *rs, uint64_t seed, uint64_t stream);
+/** Move rs ahead by 2^192 draws, to the start of the next stream. */
+void rand_stream_jump(rand_stream_t *rs);
+/** Fill x[0, n) with uniform 64 bit integers. */
+void rand_fill_u64(rand_stream_t *rs, uint64_t *x, size_t n);
+/** Fill x[0, n) with uniform deviates in [0, 1), 53 bits. */
+void rand_fill_uniform(rand_stream_t *rs, double *x, size_t n);
+/** Fill x[0, n) with normal deviates of mean and sigma (ziggurat). */
+void rand_fill_gauss(rand_stream_t *rs, double *x, size_t n, double mean, double sigma);
+/** Fill x[0, n) with exponential deviates of \f$\exp(-\alpha t)\f$
+ * (ziggurat), as rand_exp(). */
+void rand_fill_exp(rand_stream_t *rs, double *x, size_t n, double alpha);
+
+/** CLOCK_MONOTONIC in seconds, for timing intervals. */
+double time_now(void);
+/** CLOCK_MONOTONIC in ns. */
+uint64_t time_now_ns(void);
+
 /** Quickselect for finding median or kth smallest element, k starts from 0.
  * @param[in] a input array, will be destroyed.
  * @param[in] n length of array a.
@@ -0,0 +1,205 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "utils.h"
+#include "wavelet.h"
+#include "wavproc.h"
+
+/* CDF 9/7 lifting coefficients and the scaling of Daubechies and
+ * Sweldens, which leaves both bands close to unit gain for white noise. */
+#define CDF97_A (-1.586134342059924)
+#define CDF97_B (-0.052980118572961)
+#define CDF97_C ( 0.882911075530934)
+#define CDF97_D ( 0.443506852043971)
+#define CDF97_K ( 1.149604398860241)
+
+/* d[i] += c * (s[i] + s[i+1]) for the nd odd samples between the ns
+ * even ones; past the end s mirrors onto itself. */
+SIMD_CLONES
+static void lift_predict(WAVELET_BASE_TYPE *restrict d, const WAVELET_BASE_TYPE *restrict s,
+                         size_t nd, size_t ns, WAVELET_BASE_TYPE c)
+{
+    size_t i, m = MIN(nd, ns - 1);
+    for (i=0; i<m; i++)
+        d[i] += c * (s[i] + s[i+1]);
+    if (nd == ns) d[nd-1] += 2 * c * s[ns-1];
+}
+
+/* s[i] += c * (d[i-1] + d[i]); before the start and past the end d
+ * mirrors onto itself. */
+SIMD_CLONES
+static void lift_update(WAVELET_BASE_TYPE *restrict s, const WAVELET_BASE_TYPE *restrict d,
+                        size_t ns, size_t nd, WAVELET_BASE_TYPE c)
+{
+    size_t i;
+    s[0] += 2 * c * d[0];
+    for (i=1; i<nd; i++)
+        s[i] += c * (d[i-1] + d[i]);
+    if (ns > nd) s[ns-1] += 2 * c * d[nd-1];
+}
+
+SIMD_CLONES
+static void scale(WAVELET_BASE_TYPE *restrict x, size_t n, WAVELET_BASE_TYPE c)
+{
+    size_t i;
+    for (i=0; i<n; i++) x[i] *= c;
+}
+
+/* One level on x[0, n), n >= 2: s to x[0, ns), d to x[ns, n). */
+static void forward_level(WAVELET_BASE_TYPE *x, size_t n, WAVELET_BASE_TYPE *tmp)
+{
+    const size_t ns = (n + 1) / 2, nd = n / 2;
+    WAVELET_BASE_TYPE *s = tmp, *d = tmp + ns;
+    size_t i;
+
+    for (i=0; i<nd; i++) {
+        s[i] = x[2*i];
+        d[i] = x[2*i+1];
+    }
+    if (ns > nd) s[ns-1] = x[n-1];
+    lift_predict(d, s, nd, ns, CDF97_A);
+    lift_update(s, d, ns, nd, CDF97_B);
+    lift_predict(d, s, nd, ns, CDF97_C);
+    lift_update(s, d, ns, nd, CDF97_D);
+    scale(s, ns, CDF97_K);
+    scale(d, nd, 1.0 / CDF97_K);
+    memcpy(x, tmp, n * sizeof(WAVELET_BASE_TYPE));
+}
+
+static void inverse_level(WAVELET_BASE_TYPE *x, size_t n, WAVELET_BASE_TYPE *tmp)
+{
+    const size_t ns = (n + 1) / 2, nd = n / 2;
+    WAVELET_BASE_TYPE *s = tmp, *d = tmp + ns;
+    size_t i;
+
+    memcpy(tmp, x, n * sizeof(WAVELET_BASE_TYPE));
+    scale(s, ns, 1.0 / CDF97_K);
+    scale(d, nd, CDF97_K);
+    lift_update(s, d, ns, nd, -CDF97_D);
+    lift_predict(d, s, nd, ns, -CDF97_C);
+    lift_update(s, d, ns, nd, -CDF97_B);
+    lift_predict(d, s, nd, ns, -CDF97_A);
+    for (i=0; i<nd; i++) {
+        x[2*i] = s[i];
+        x[2*i+1] = d[i];
+    }
+    if (ns > nd) x[n-1] = s[ns-1];
+}
+
+/* Length of the approximation after each level, len[0] = n.
+ * @return levels that leave at least 2 samples to split. */
+static unsigned level_lengths(size_t n, unsigned nLevels, size_t *len)
+{
+    unsigned j;
+    len[0] = n;
+    for (j=0; j<nLevels && j<WAVELET_MAX_LEVELS && len[j]>=2; j++)
+        len[j+1] = (len[j] + 1) / 2;
+    return j;
+}
+
+void wavelet_forward(WAVELET_BASE_TYPE *x, size_t n, unsigned nLevels, WAVELET_BASE_TYPE *tmp)
+{
+    size_t len[WAVELET_MAX_LEVELS+1];
+    unsigned j, nL = level_lengths(n, nLevels, len);
+    for (j=0; j<nL; j++) forward_level(x, len[j], tmp);
+}
+
+void wavelet_inverse(WAVELET_BASE_TYPE *x, size_t n, unsigned nLevels, WAVELET_BASE_TYPE *tmp)
+{
+    size_t len[WAVELET_MAX_LEVELS+1];
+    unsigned j, nL = level_lengths(n, nLevels, len);
+    for (j=nL; j>0; j--) inverse_level(x, len[j-1], tmp);
+}
+
+SIMD_CLONES
+static void soft_threshold(WAVELET_BASE_TYPE *restrict x, size_t n, WAVELET_BASE_TYPE t)
+{
+    size_t i;
+    for (i=0; i<n; i++)
+        x[i] -= MAX(-t, MIN(t, x[i])); /* sign(x) * max(|x| - t, 0) */
+}
+
+SIMD_CLONES
+static void from_raw(WAVELET_BASE_TYPE *restrict x, const RAW_WAVEFORM_BASE_TYPE *restrict raw,
+                     size_t n)
+{
+    size_t i;
+    for (i=0; i<n; i++) x[i] = raw[i];
+}
+
+typedef struct denoise_job
+{
+    RAW_WAVEFORM_BASE_TYPE *out;
+    const RAW_WAVEFORM_BASE_TYPE *raw;
+    size_t n;
+    size_t margin;
+    size_t align;
+    const struct wavelet_denoise_param *wp;
+} denoise_job_t;
+
+static void denoise_block(void *arg, size_t b)
+{
+    const denoise_job_t *job = (const denoise_job_t*)arg;
+    const struct wavelet_denoise_param *wp = job->wp;
+    size_t c0, c1, e0, e1, m, i, nD, len[WAVELET_MAX_LEVELS+1];
+    WAVELET_BASE_TYPE *x, *tmp, t;
+    double *ad;
+    unsigned nL;
+
+    c0 = b * wp->blockLen;
+    c1 = MIN(job->n, c0 + wp->blockLen);
+    /* Start on the coarsest grid, so that every block decimates in
+     * the same phase as a transform of the whole buffer would. */
+    e0 = c0 > job->margin ? (c0 - job->margin) & ~(job->align - 1) : 0;
+    e1 = MIN(job->n, c1 + job->margin);
+    m = e1 - e0;
+    x = (WAVELET_BASE_TYPE*)malloc(2 * m * sizeof(WAVELET_BASE_TYPE));
+    tmp = x + m;
+    from_raw(x, job->raw + e0, m);
+    nL = level_lengths(m, wp->nLevels, len);
+    wavelet_forward(x, m, nL, tmp);
+    if (nL > 0) {
+        if (wp->threshold > 0) {
+            t = (WAVELET_BASE_TYPE)wp->threshold;
+        } else {
+            /* Noise from the finest details, MAD / 0.6745, and the
+             * universal threshold sigma * sqrt(2 ln m). */
+            nD = m - len[1];
+            ad = (double*)malloc(nD * sizeof(double));
+            for (i=0; i<nD; i++) ad[i] = fabs((double)x[len[1] + i]);
+            t = (WAVELET_BASE_TYPE)(quickselect(ad, nD, nD / 2) / 0.6745
+                                    * sqrt(2.0 * log((double)m)));
+            free(ad);
+        }
+        soft_threshold(x + len[nL], m - len[nL], t);
+        wavelet_inverse(x, m, nL, tmp);
+    }
+    wavproc_quantize(job->out + c0, x + (c0 - e0), c1 - c0);
+    free(x);
+}
+
+size_t wavelet_margin(unsigned nLevels)
+{
+    return (size_t)8 << MIN(nLevels, WAVELET_MAX_LEVELS);
+}
+
+void wavelet_denoise(RAW_WAVEFORM_BASE_TYPE *out, const RAW_WAVEFORM_BASE_TYPE *raw, size_t n,
+                     const struct wavelet_denoise_param *wp, thpool_t *pool)
+{
+    denoise_job_t job = {out, raw, n, 0, 0, wp};
+    size_t b, nBlocks;
+
+    if (n == 0 || wp->blockLen == 0) return;
+    job.align = (size_t)1 << MIN(wp->nLevels, WAVELET_MAX_LEVELS);
+    job.margin = wavelet_margin(wp->nLevels);
+    nBlocks = (n + wp->blockLen - 1) / wp->blockLen;
+    if (pool) {
+        thpool_run(pool, denoise_block, &job, nBlocks);
+    } else {
+        for (b=0; b<nBlocks; b++) denoise_block(&job, b);
+    }
+}
@@ -0,0 +1,53 @@
+/** \file wavelet.h
+ * Discrete wavelet transform (CDF 9/7 lifting) and denoising of raw
+ * waveforms.
+ */
+#ifndef __WAVELET_H__
+#define __WAVELET_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+#include "thpool.h"
+
+/** Largest number of decomposition levels. */
+#define WAVELET_MAX_LEVELS 10
+
+/** Forward transform, in place, with symmetric extension at both ends.
+ * The result is laid out as [s_J | d_J | d_J-1 | ... | d_1], level j
+ * halving (rounding up) the length of the one before.
+ * @param[in] tmp scratch of n values.
+ */
+void wavelet_forward(WAVELET_BASE_TYPE *x, size_t n, unsigned nLevels, WAVELET_BASE_TYPE *tmp);
+/** Inverse of wavelet_forward(). */
+void wavelet_inverse(WAVELET_BASE_TYPE *x, size_t n, unsigned nLevels, WAVELET_BASE_TYPE *tmp);
+
+/** Denoising settings. */
+struct wavelet_denoise_param
+{
+    unsigned nLevels;     /**< decomposition levels, 1 to WAVELET_MAX_LEVELS */
+    double   threshold;   /**< soft threshold in ADC counts, 0: universal
+                               threshold from the noise of each block */
+    size_t   blockLen;    /**< samples per independently transformed block */
+};
+
+/** Samples of context wavelet_denoise() needs on each side of a
+ * sample for the result not to depend on the ends of the buffer: the
+ * 9 tap analysis and 7 tap synthesis filters reach 4 and 3 samples at
+ * the finest level, twice as far at each next one.  A multiple of the
+ * coarsest grid, 2^nLevels. */
+size_t wavelet_margin(unsigned nLevels);
+
+/** Soft-threshold the detail coefficients of raw[0, n) into out.
+ * The buffer is cut into blocks of blockLen that are transformed with
+ * a margin of their neighbours' samples on both sides, wide enough to
+ * hold the filter support at the coarsest level, and only the block
+ * itself is kept.  Blocks start in the phase of a transform of the
+ * whole buffer, so with a fixed threshold the result does not depend
+ * on blockLen, and blocks can be spread over pool.
+ * @param[in] pool thread pool, NULL: the calling thread only.
+ */
+void wavelet_denoise(RAW_WAVEFORM_BASE_TYPE *out, const RAW_WAVEFORM_BASE_TYPE *raw, size_t n,
+                     const struct wavelet_denoise_param *wp, thpool_t *pool);
+
+#endif /* __WAVELET_H__ */
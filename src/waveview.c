@@ -0,0 +1,207 @@
+/** \file
+ * Waveform viewer for hdf5rawWaveformIo files.
+ *
+ * Every channel is drawn as a min/max envelope, one vertical line per
+ * pixel column, from HDF5IO(read_envelope).  Files written with a
+ * min/max pyramid (HDF5IO(set_lod), ndconv -l) only read the level that
+ * matches the zoom, so panning over full length records stays
+ * interactive; other files fall back to reading the visible samples.
+ *
+ * Keys: left/right pan, up/down or +/- zoom, mouse wheel zoom about the
+ * pointer, n/p next/previous event, r reset, q quit.
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __APPLE__
+#include <GLUT/glut.h>
+#else
+#include <GL/glut.h>
+#endif
+
+#include "common.h"
+#include "hdf5rawWaveformIo.h"
+
+#define WAVEVIEW_MAX_WIDTH 8192
+
+static struct HDF5IO(waveform_file) *wavFile;
+static struct waveform_attribute wavAttr;
+static size_t eventId, tStart, tEnd, winW = 1024, winH = 600;
+static int level;
+static SCOPE_DATA_TYPE mn[WAVEVIEW_MAX_WIDTH], mx[WAVEVIEW_MAX_WIDTH];
+
+static const GLfloat colors[][3] = {
+    {1.0, 1.0, 0.0}, {0.0, 1.0, 1.0}, {1.0, 0.0, 1.0}, {0.0, 1.0, 0.0}
+};
+
+static void update_title(void)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "event %zd/%zd  [%zd, %zd)  %s %d", eventId, wavFile->nEvents,
+             tStart, tEnd, level > 0 ? "level" : "samples", level);
+    glutSetWindowTitle(buf);
+}
+
+static void display(void)
+{
+    size_t ch, row = 0, x, width;
+    GLfloat y0, h;
+
+    glClear(GL_COLOR_BUFFER_BIT);
+    width = MIN(MIN(winW, WAVEVIEW_MAX_WIDTH), tEnd - tStart);
+    h = (GLfloat)winH / MAX(1, __builtin_popcount(wavAttr.chMask));
+    for (ch=0; ch<SCOPE_NCH; ch++) {
+        if (!(wavAttr.chMask & (1U << ch))) continue;
+        y0 = winH - (row + 0.5f) * h;
+        glColor3f(0.25, 0.25, 0.25);
+        glBegin(GL_LINES);
+        glVertex2f(0, y0);
+        glVertex2f(winW, y0);
+        glEnd();
+        level = HDF5IO(read_envelope)(wavFile, eventId, ch, tStart, tEnd, width, mn, mx);
+        if (level >= 0) {
+            glColor3fv(colors[ch % (sizeof(colors)/sizeof(colors[0]))]);
+            glBegin(GL_LINES);
+            for (x=0; x<width; x++) {
+                /* +0.5 keeps single valued columns one pixel tall. */
+                glVertex2f((x + 0.5f) * winW / width, y0 + mn[x] * h / 256.0f - 0.5f);
+                glVertex2f((x + 0.5f) * winW / width, y0 + mx[x] * h / 256.0f + 0.5f);
+            }
+            glEnd();
+        }
+        row++;
+    }
+    glutSwapBuffers();
+    update_title();
+}
+
+static void reshape(int w, int h)
+{
+    winW = MAX(1, w);
+    winH = MAX(1, h);
+    glViewport(0, 0, w, h);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluOrtho2D(0, winW, 0, winH);
+    glMatrixMode(GL_MODELVIEW);
+}
+
+/** Zoom by factor about sample tc, keeping at least a sample per pixel
+ * column of the window, or the whole record. */
+static void zoom(double factor, size_t tc)
+{
+    double len = (double)(tEnd - tStart) * factor, a;
+    size_t nPt = wavAttr.nPt;
+
+    len = MIN((double)nPt, MAX(len, (double)MIN(winW, nPt)));
+    a = (tc - tStart) / (double)(tEnd - tStart);
+    tStart = (size_t)MAX(0.0, MIN((double)nPt - len, tc - a * len));
+    tEnd = tStart + (size_t)len;
+}
+
+static void pan(double frac)
+{
+    double d = frac * (tEnd - tStart);
+    if (d < 0 && (size_t)-d > tStart) d = -(double)tStart;
+    if (d > 0 && tEnd + (size_t)d > wavAttr.nPt) d = wavAttr.nPt - tEnd;
+    tStart += (ptrdiff_t)d;
+    tEnd += (ptrdiff_t)d;
+}
+
+static void keyboard(unsigned char key, int x, int y)
+{
+    switch (key) {
+    case '+': case '=':
+        zoom(0.5, (tStart + tEnd) / 2);
+        break;
+    case '-': case '_':
+        zoom(2.0, (tStart + tEnd) / 2);
+        break;
+    case 'n':
+        if (eventId + 1 < wavFile->nEvents) eventId++;
+        break;
+    case 'p':
+        if (eventId > 0) eventId--;
+        break;
+    case 'r':
+        tStart = 0;
+        tEnd = wavAttr.nPt;
+        break;
+    case 'q': case 27:
+        HDF5IO(close_file)(wavFile);
+        exit(EXIT_SUCCESS);
+    default:
+        return;
+    }
+    glutPostRedisplay();
+}
+
+static void special(int key, int x, int y)
+{
+    switch (key) {
+    case GLUT_KEY_LEFT:
+        pan(-0.25);
+        break;
+    case GLUT_KEY_RIGHT:
+        pan(0.25);
+        break;
+    case GLUT_KEY_UP:
+        zoom(0.5, (tStart + tEnd) / 2);
+        break;
+    case GLUT_KEY_DOWN:
+        zoom(2.0, (tStart + tEnd) / 2);
+        break;
+    default:
+        return;
+    }
+    glutPostRedisplay();
+}
+
+static void mouse(int button, int state, int x, int y)
+{
+    size_t tc = tStart + (size_t)((double)x / winW * (tEnd - tStart));
+    if (state != GLUT_DOWN) return;
+    if (button == 3) zoom(0.8, tc);      /* wheel up */
+    else if (button == 4) zoom(1.25, tc); /* wheel down */
+    else return;
+    glutPostRedisplay();
+}
+
+int main(int argc, char **argv)
+{
+    glutInit(&argc, argv);
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s file.h5 [eventId]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if ((wavFile = HDF5IO(open_file_for_read)(argv[1])) == NULL) {
+        error_printf("Cannot open %s.\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    HDF5IO(read_waveform_attribute_in_file_header)(wavFile, &wavAttr);
+    if (wavFile->nEvents == 0 || wavAttr.nPt == 0) {
+        error_printf("%s holds no events.\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    if (argc > 2) eventId = MIN(wavFile->nEvents - 1, strtoull(argv[2], NULL, 10));
+    if (wavFile->lodFactor == 0)
+        fprintf(stderr, "%s has no min/max pyramid, zoomed out views read whole records.\n",
+                argv[1]);
+    tStart = 0;
+    tEnd = wavAttr.nPt;
+
+    glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB);
+    glutInitWindowSize(winW, winH);
+    glutCreateWindow(argv[1]);
+    glClearColor(0.0, 0.0, 0.0, 0.0);
+    glutDisplayFunc(display);
+    glutReshapeFunc(reshape);
+    glutKeyboardFunc(keyboard);
+    glutSpecialFunc(special);
+    glutMouseFunc(mouse);
+    glutMainLoop();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,177 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "utils.h"
+#include "wavgen.h"
+#include "wavproc.h"
+
+/* Pulses are drawn in windows of one block length, window w from the
+ * stream of seed + 2 w, the noise of block b from seed + 2 b + 1. */
+
+struct wavgen
+{
+    struct wavgen_param p;
+    double *L;          /* Cholesky factor of the noise covariance */
+    uint64_t span;      /* samples per channel per block */
+    size_t margin;      /* samples after which a pulse is below 1/20 count */
+    size_t nBack;       /* earlier windows whose pulses reach into a block */
+    double norm;        /* peak of the unit pulse shape */
+    double d1, d2;      /* per sample decay of the two exponentials */
+};
+
+struct wavgen_pulse
+{
+    double t;           /* sample of the start of the pulse */
+    double a;           /* height */
+};
+
+wavgen_t *wavgen_create(const struct wavgen_param *gp)
+{
+    wavgen_t *g;
+    double R[SCOPE_NCH * SCOPE_NCH], amax, u;
+    size_t i, j, n = gp->nCh;
+
+    if (n < 1 || n > SCOPE_NCH || gp->nPt == 0 || gp->nRec == 0 || gp->sigma < 0
+        || gp->rate < 0 || gp->ampSigma < 0 || gp->tau <= 0 || gp->rise < 0
+        || gp->rise >= gp->tau || (gp->polarity != 1 && gp->polarity != -1)
+        || gp->rho >= 1 || (n > 1 && gp->rho <= -1.0 / (n - 1))) {
+        error_printf("%s(): parameters out of range.\n", __func__);
+        return NULL;
+    }
+    if ((g = (wavgen_t*)calloc(1, sizeof(wavgen_t))) == NULL) {
+        error_printf("%s(): cannot allocate the generator.\n", __func__);
+        return NULL;
+    }
+    memcpy(&g->p, gp, sizeof(g->p));
+    for (i=0; i<n; i++)
+        for (j=0; j<n; j++)
+            R[i * n + j] = i == j ? 1.0 : gp->rho;
+    if (!cholesky_decomp(R, n, &g->L)) {
+        wavgen_destroy(g);
+        return NULL;
+    }
+    for (i=0; i<n*n; i++) g->L[i] *= gp->sigma;
+
+    g->span = (uint64_t)gp->nRec * gp->nPt;
+    amax = MAX(1.0, fabs(gp->amplitude) + 5.0 * gp->ampSigma);
+    g->margin = (size_t)ceil(gp->tau * log(20.0 * amax)) + 1;
+    g->nBack = (g->margin + g->span - 1) / g->span;
+    g->d1 = exp(-1.0 / gp->tau);
+    g->d2 = gp->rise > 0 ? exp(-1.0 / gp->rise) : 0.0;
+    if (gp->rise > 0) {
+        u = gp->rise * gp->tau / (gp->tau - gp->rise) * log(gp->tau / gp->rise);
+        g->norm = exp(-u / gp->tau) - exp(-u / gp->rise);
+    } else {
+        g->norm = 1.0;
+    }
+    return g;
+}
+
+void wavgen_destroy(wavgen_t *g)
+{
+    if (!g) return;
+    free(g->L);
+    free(g);
+}
+
+size_t wavgen_block_size(const wavgen_t *g)
+{
+    return g->p.nCh * g->span * sizeof(RAW_WAVEFORM_BASE_TYPE);
+}
+
+/* Append the pulses of window w to *ps, growing it as needed.
+ * @return the new number of pulses. */
+static size_t draw_pulses(const wavgen_t *g, uint64_t w, struct wavgen_pulse **ps, size_t n,
+                          size_t *cap)
+{
+    rand_stream_t rs;
+    double dt[64], a[64], t = (double)(w * g->span);
+    const double end = (double)((w + 1) * g->span);
+    size_t i;
+
+    if (g->p.rate <= 0) return n;
+    rand_stream_init(&rs, g->p.seed + 2 * w, 0);
+    for (;;) {
+        rand_fill_exp(&rs, dt, 64, g->p.rate);
+        rand_fill_gauss(&rs, a, 64, g->p.amplitude, g->p.ampSigma);
+        for (i=0; i<64; i++) {
+            t += dt[i];
+            if (t >= end) return n;
+            if (n == *cap) {
+                *cap = MAX(64, 2 * *cap);
+                *ps = (struct wavgen_pulse*)realloc(*ps, *cap * sizeof(struct wavgen_pulse));
+            }
+            (*ps)[n].t = t;
+            (*ps)[n].a = a[i];
+            n++;
+        }
+    }
+}
+
+/* Add a pulse of height a starting at tp, relative to sig[0], to
+ * sig[0, n).  The exponentials are stepped by multiplication. */
+static void add_pulse(double *sig, size_t n, double tp, double a, const wavgen_t *g)
+{
+    const size_t i0 = tp < 0 ? 0 : (size_t)ceil(tp);
+    const size_t i1 = MIN(n, (size_t)MAX(0.0, tp + g->margin));
+    double e1, e2, u;
+    size_t i;
+
+    if (i0 >= i1) return;
+    u = i0 - tp;
+    e1 = a / g->norm * exp(-u / g->p.tau);
+    e2 = g->p.rise > 0 ? a / g->norm * exp(-u / g->p.rise) : 0.0;
+    for (i=i0; i<i1; i++) {
+        sig[i] += e1 - e2;
+        e1 *= g->d1;
+        e2 *= g->d2;
+    }
+}
+
+/* y = base + pol * sig + sum_k l[k] * z[k * n, (k + 1) * n) */
+SIMD_CLONES
+static void mix_channel(double *restrict y, const double *restrict sig, const double *restrict z,
+                        const double *restrict l, size_t nk, size_t n, double base, double pol)
+{
+    size_t i, k;
+    for (i=0; i<n; i++) y[i] = base + pol * sig[i];
+    for (k=0; k<nk; k++) {
+        for (i=0; i<n; i++) y[i] += l[k] * z[k * n + i];
+    }
+}
+
+void wavgen_block(const wavgen_t *g, RAW_WAVEFORM_BASE_TYPE *out, uint64_t block)
+{
+    const size_t nCh = g->p.nCh, nPt = g->p.nPt;
+    struct wavgen_pulse *ps = NULL;
+    rand_stream_t rs;
+    double *sig, *z, *y, t0;
+    size_t nPs = 0, cap = 0, p0 = 0, p, r, c;
+    uint64_t w;
+
+    for (w=block-MIN(block, g->nBack); w<=block; w++) nPs = draw_pulses(g, w, &ps, nPs, &cap);
+    rand_stream_init(&rs, g->p.seed + 2 * block + 1, 0);
+    sig = (double*)malloc(nPt * sizeof(double));
+    y = (double*)malloc(nPt * sizeof(double));
+    z = (double*)malloc(nCh * nPt * sizeof(double));
+
+    for (r=0; r<g->p.nRec; r++) {
+        t0 = (double)(block * g->span + r * nPt);
+        memset(sig, 0, nPt * sizeof(double));
+        while (p0 < nPs && ps[p0].t + g->margin <= t0) p0++;
+        for (p=p0; p<nPs && ps[p].t < t0 + nPt; p++) add_pulse(sig, nPt, ps[p].t - t0, ps[p].a, g);
+        rand_fill_gauss(&rs, z, nCh * nPt, 0.0, 1.0);
+        for (c=0; c<nCh; c++) {
+            mix_channel(y, sig, z, g->L + c * nCh, c + 1, nPt, g->p.baseline, g->p.polarity);
+            wavproc_quantize(out + (r * nCh + c) * nPt, y, nPt);
+        }
+    }
+    free(ps);
+    free(sig);
+    free(y);
+    free(z);
+}
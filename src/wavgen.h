@@ -0,0 +1,52 @@
+/** \file wavgen.h
+ * Synthetic digitizer data: multi-channel waveforms of exponentially
+ * decaying pulses at Poisson times on correlated Gaussian noise.
+ *
+ * The output is a stream of event records of nCh x nPt samples,
+ * channel by channel, cut into blocks of nRec records.  Each channel
+ * is one continuous time line across records and blocks, and pulses
+ * hit all channels at once.  Every block is a pure function of the
+ * seed and its index, so blocks can be generated by any number of
+ * threads in any order and the stream is the same.
+ */
+#ifndef __WAVGEN_H__
+#define __WAVGEN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+
+/** Generator settings, times in samples, levels in ADC counts. */
+struct wavgen_param
+{
+    size_t   nCh;         /**< channels per record, 1 to SCOPE_NCH */
+    size_t   nPt;         /**< samples per channel per record */
+    size_t   nRec;        /**< records per block */
+    double   baseline;    /**< level without signal */
+    double   sigma;       /**< rms of the noise of each channel */
+    double   rho;         /**< correlation coefficient of the noise of any two
+                               channels, -1 / (nCh - 1) < rho < 1 */
+    double   rate;        /**< mean pulses per sample */
+    double   amplitude;   /**< mean pulse height */
+    double   ampSigma;    /**< rms spread of the pulse heights */
+    double   rise;        /**< rise time constant, 0: instantaneous */
+    double   tau;         /**< decay time constant, > rise */
+    int      polarity;    /**< +1 positive pulses, -1 negative */
+    uint64_t seed;
+};
+
+typedef struct wavgen wavgen_t;
+
+/** Check gp and prepare a generator.
+ * @return NULL if gp is out of range.
+ */
+wavgen_t *wavgen_create(const struct wavgen_param *gp);
+void wavgen_destroy(wavgen_t *g);
+/** Bytes in one block. */
+size_t wavgen_block_size(const wavgen_t *g);
+/** Write block number block, wavgen_block_size() bytes, into out.
+ * Thread safe.
+ */
+void wavgen_block(const wavgen_t *g, RAW_WAVEFORM_BASE_TYPE *out, uint64_t block);
+
+#endif /* __WAVGEN_H__ */
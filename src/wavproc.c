@@ -0,0 +1,459 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "wavproc.h"
+
+/* Time axis loops run on an int index so that the conversion to
+ * floating point vectorizes without AVX-512DQ. */
+#define WAVPROC_BLOCK ((size_t)1 << 30)
+
+SIMD_CLONES
+void wavproc_calibrate(ANALYSIS_WAVEFORM_BASE_TYPE *restrict v,
+                       const RAW_WAVEFORM_BASE_TYPE *restrict raw,
+                       size_t n, double ymult, double yoff, double yzero)
+{
+    size_t i;
+    for (i=0; i<n; i++)
+        v[i] = ((ANALYSIS_WAVEFORM_BASE_TYPE)raw[i] - yoff) * ymult + yzero;
+}
+
+SIMD_CLONES
+void wavproc_calibrate_float(float *restrict v, const RAW_WAVEFORM_BASE_TYPE *restrict raw,
+                             size_t n, double ymult, double yoff, double yzero)
+{
+    const float m = (float)ymult, o = (float)yoff, z = (float)yzero;
+    size_t i;
+    for (i=0; i<n; i++)
+        v[i] = ((float)raw[i] - o) * m + z;
+}
+
+SIMD_CLONES
+void wavproc_time_axis(double *t, size_t n, double t0, double dt)
+{
+    size_t i;
+    int k, m;
+    for (i=0; i<n; i+=m) {
+        m = (int)MIN(WAVPROC_BLOCK, n-i);
+        for (k=0; k<m; k++)
+            t[i+k] = t0 + (double)(i+k) * dt;
+    }
+}
+
+SIMD_CLONES
+static void calibrate_time(ANALYSIS_WAVEFORM_BASE_TYPE *restrict v, double *restrict t,
+                           const RAW_WAVEFORM_BASE_TYPE *restrict raw, size_t n,
+                           double ymult, double yoff, double yzero, double t0, double dt)
+{
+    size_t i;
+    int k, m;
+    double tb;
+    for (i=0; i<n; i+=m) {
+        m = (int)MIN(WAVPROC_BLOCK, n-i);
+        tb = t0 + (double)i * dt;
+        for (k=0; k<m; k++) {
+            v[i+k] = ((ANALYSIS_WAVEFORM_BASE_TYPE)raw[i+k] - yoff) * ymult + yzero;
+            t[i+k] = tb + (double)k * dt;
+        }
+    }
+}
+
+SIMD_CLONES
+static void calibrate_time_float(float *restrict v, float *restrict t,
+                                 const RAW_WAVEFORM_BASE_TYPE *restrict raw, size_t n,
+                                 double ymult, double yoff, double yzero, double t0, double dt)
+{
+    const float m = (float)ymult, o = (float)yoff, z = (float)yzero, d = (float)dt;
+    size_t i;
+    int k, l;
+    float tb;
+    for (i=0; i<n; i+=l) {
+        l = (int)MIN(WAVPROC_BLOCK, n-i);
+        tb = (float)(t0 + (double)i * dt);
+        for (k=0; k<l; k++) {
+            v[i+k] = ((float)raw[i+k] - o) * m + z;
+            t[i+k] = tb + (float)k * d;
+        }
+    }
+}
+
+size_t wavproc_calibrate_event(ANALYSIS_WAVEFORM_BASE_TYPE *v, double *t,
+                               const RAW_WAVEFORM_BASE_TYPE *wavBuf,
+                               const struct waveform_attribute *wavAttr)
+{
+    const size_t nPt = wavAttr->nPt;
+    size_t ch, row = 0;
+
+    for (ch=0; ch<SCOPE_NCH; ch++) {
+        if (!(wavAttr->chMask & (1U << ch))) continue;
+        if (row == 0 && t) {
+            calibrate_time(v, t, wavBuf, nPt, wavAttr->ymult[ch], wavAttr->yoff[ch],
+                           wavAttr->yzero[ch], wavAttr->t0, wavAttr->dt);
+        } else {
+            wavproc_calibrate(v + row * nPt, wavBuf + row * nPt, nPt, wavAttr->ymult[ch],
+                              wavAttr->yoff[ch], wavAttr->yzero[ch]);
+        }
+        row++;
+    }
+    if (row == 0 && t) wavproc_time_axis(t, nPt, wavAttr->t0, wavAttr->dt);
+    return row;
+}
+
+size_t wavproc_calibrate_event_float(float *v, float *t, const RAW_WAVEFORM_BASE_TYPE *wavBuf,
+                                     const struct waveform_attribute *wavAttr)
+{
+    const size_t nPt = wavAttr->nPt;
+    size_t i, ch, row = 0;
+
+    for (ch=0; ch<SCOPE_NCH; ch++) {
+        if (!(wavAttr->chMask & (1U << ch))) continue;
+        if (row == 0 && t) {
+            calibrate_time_float(v, t, wavBuf, nPt, wavAttr->ymult[ch], wavAttr->yoff[ch],
+                                 wavAttr->yzero[ch], wavAttr->t0, wavAttr->dt);
+        } else {
+            wavproc_calibrate_float(v + row * nPt, wavBuf + row * nPt, nPt, wavAttr->ymult[ch],
+                                    wavAttr->yoff[ch], wavAttr->yzero[ch]);
+        }
+        row++;
+    }
+    if (row == 0 && t) {
+        for (i=0; i<nPt; i++) t[i] = (float)(wavAttr->t0 + (double)i * wavAttr->dt);
+    }
+    return row;
+}
+
+/* Round half away from zero and saturate; lrint() would be a call per
+ * sample. */
+SIMD_CLONES
+void wavproc_quantize(RAW_WAVEFORM_BASE_TYPE *restrict raw, const double *restrict x, size_t n)
+{
+    double v;
+    size_t i;
+
+    _Static_assert(sizeof(RAW_WAVEFORM_BASE_TYPE) == 1, "clamping assumes 8 bit samples");
+    for (i=0; i<n; i++) {
+        v = x[i] + (x[i] < 0 ? -0.5 : 0.5);
+        raw[i] = (RAW_WAVEFORM_BASE_TYPE)(int)MAX(-128, MIN(127, v));
+    }
+}
+
+SIMD_CLONES
+void wavproc_minmax(RAW_WAVEFORM_BASE_TYPE *restrict mn, RAW_WAVEFORM_BASE_TYPE *restrict mx,
+                    const RAW_WAVEFORM_BASE_TYPE *restrict raw, size_t n, size_t nBins)
+{
+    size_t b, i, i0, i1;
+    RAW_WAVEFORM_BASE_TYPE lo, hi;
+
+    if (n == 0) return;
+    for (b=0; b<nBins; b++) {
+        i0 = b * n / nBins;
+        i1 = (b+1) * n / nBins;
+        if (i1 <= i0) i1 = i0 + 1;
+        if (i0 >= n) i0 = n - 1, i1 = n;
+        lo = hi = raw[i0];
+        for (i=i0; i<i1; i++) {
+            lo = MIN(lo, raw[i]);
+            hi = MAX(hi, raw[i]);
+        }
+        mn[b] = lo;
+        mx[b] = hi;
+    }
+}
+
+SIMD_CLONES
+void wavproc_minmax_pairs(RAW_WAVEFORM_BASE_TYPE *restrict mm,
+                          const RAW_WAVEFORM_BASE_TYPE *restrict raw, size_t n, size_t binLen)
+{
+    size_t b, i, i1;
+    RAW_WAVEFORM_BASE_TYPE lo, hi;
+
+    for (b=0; b*binLen<n; b++) {
+        i1 = MIN(n, (b+1) * binLen);
+        lo = hi = raw[b * binLen];
+        for (i=b*binLen; i<i1; i++) {
+            lo = MIN(lo, raw[i]);
+            hi = MAX(hi, raw[i]);
+        }
+        mm[2*b]   = lo;
+        mm[2*b+1] = hi;
+    }
+}
+
+void wavproc_minmax_reduce(RAW_WAVEFORM_BASE_TYPE *restrict dst,
+                           const RAW_WAVEFORM_BASE_TYPE *restrict mm, size_t nPairs, size_t factor)
+{
+    size_t b, i, i1;
+    RAW_WAVEFORM_BASE_TYPE lo, hi;
+
+    for (b=0; b*factor<nPairs; b++) {
+        i1 = MIN(nPairs, (b+1) * factor);
+        lo = mm[2 * b * factor];
+        hi = mm[2 * b * factor + 1];
+        for (i=b*factor; i<i1; i++) {
+            lo = MIN(lo, mm[2*i]);
+            hi = MAX(hi, mm[2*i+1]);
+        }
+        dst[2*b]   = lo;
+        dst[2*b+1] = hi;
+    }
+}
+
+/* Samples tested at once by wavproc_trigger_scan before looking for
+ * the exact position. */
+#define WAVPROC_TRIGGER_BLOCK 4096
+#define WAVPROC_TRIGGER_SUBBLOCK 64
+
+/* Whether raw[i-1] < lv <= raw[i] for any i in [1, n), or with
+ * reversed comparisons for falling edges.  8 bit compares keep all
+ * 64 lanes of AVX-512 busy. */
+SIMD_CLONES
+static int level_block(const int8_t *restrict raw, size_t n, int8_t lv, int rising)
+{
+    uint8_t hit = 0;
+    size_t i;
+    if (rising) {
+        for (i=1; i<n; i++) hit |= (raw[i-1] < lv) & (raw[i] >= lv);
+    } else {
+        for (i=1; i<n; i++) hit |= (raw[i-1] > lv) & (raw[i] <= lv);
+    }
+    return hit;
+}
+
+SIMD_CLONES
+static int slope_block(const int8_t *restrict raw, size_t n, size_t span, int level, int polarity)
+{
+    const int16_t lv = (int16_t)level, pol = (int16_t)polarity;
+    uint8_t hit = 0;
+    size_t i;
+    for (i=span+1; i<n; i++) {
+        hit |= (pol * (int16_t)(raw[i-1] - raw[i-1-span]) < lv)
+            & (pol * (int16_t)(raw[i] - raw[i-span]) >= lv);
+    }
+    return hit;
+}
+
+static int trigger_at(const RAW_WAVEFORM_BASE_TYPE *raw, size_t i, const struct wavproc_trigger *trig)
+{
+    int a, b;
+    if (trig->span) {
+        a = raw[i-1] - raw[i-1-trig->span];
+        b = raw[i] - raw[i-trig->span];
+    } else {
+        a = raw[i-1];
+        b = raw[i];
+    }
+    return trig->polarity * a < trig->level && trig->polarity * b >= trig->level;
+}
+
+/* Whether trig may fire in [i0, i1), i0 > trig->span. */
+static int block_hit(const RAW_WAVEFORM_BASE_TYPE *raw, size_t i0, size_t i1,
+                     const struct wavproc_trigger *trig, int8_t lv)
+{
+    if (trig->span)
+        return slope_block((const int8_t*)raw + i0 - trig->span - 1, i1 - i0 + trig->span + 1,
+                           trig->span, trig->level, trig->polarity);
+    return level_block((const int8_t*)raw + i0 - 1, i1 - i0 + 1, lv, trig->polarity > 0);
+}
+
+size_t wavproc_trigger_scan(size_t *pos, size_t maxPos, const RAW_WAVEFORM_BASE_TYPE *raw,
+                            size_t n, const struct wavproc_trigger *trig)
+{
+    size_t i, i0, i1, j0, j1, k = 0, next;
+    int m;
+    int8_t lv = 0;
+
+    _Static_assert(sizeof(RAW_WAVEFORM_BASE_TYPE) == 1, "trigger assumes 8 bit samples");
+    if (!trig->span) {
+        /* polarity * raw crosses level: raw crosses m in the direction
+         * of polarity.  Outside the sample range no crossing exists. */
+        m = trig->polarity > 0 ? trig->level : -trig->level;
+        if (trig->polarity > 0 ? (m <= INT8_MIN || m > INT8_MAX)
+                               : (m < INT8_MIN || m >= INT8_MAX))
+            return 0;
+        lv = (int8_t)m;
+    }
+    next = trig->span + 1; /* first sample with a full history */
+    /* Narrow hits down through sub-blocks before testing sample by
+     * sample, so that noise near the level stays cheap. */
+    for (i0=next; i0<n && k<maxPos; i0=i1) {
+        i1 = MIN(n, i0 + WAVPROC_TRIGGER_BLOCK);
+        if (i1 <= next || !block_hit(raw, MAX(i0, next), i1, trig, lv)) continue;
+        for (j0=MAX(i0, next); j0<i1 && k<maxPos; j0=MAX(j1, next)) {
+            j1 = MIN(i1, j0 + WAVPROC_TRIGGER_SUBBLOCK);
+            if (!block_hit(raw, j0, j1, trig, lv)) continue;
+            for (i=j0; i<j1 && k<maxPos; i++) {
+                if (trigger_at(raw, i, trig)) {
+                    pos[k++] = i;
+                    next = i + 1 + trig->holdoff;
+                    j1 = next; /* go on from there */
+                    break;
+                }
+            }
+        }
+    }
+    return k;
+}
+
+/* Block length for the 32 bit partial sums of wavproc_stats_accumulate,
+ * 2^16 * 128^2 < 2^31. */
+#define WAVPROC_STATS_BLOCK 65536
+
+SIMD_CLONES
+static void stats_block(const int8_t *restrict raw, size_t n, int32_t *sum, int32_t *sum2,
+                        int32_t *mn, int32_t *mx)
+{
+    int32_t s = 0, s2 = 0, lo = *mn, hi = *mx;
+    size_t i;
+    for (i=0; i<n; i++) {
+        s  += raw[i];
+        s2 += raw[i] * raw[i];
+        lo = MIN(lo, raw[i]);
+        hi = MAX(hi, raw[i]);
+    }
+    *sum = s;
+    *sum2 = s2;
+    *mn = lo;
+    *mx = hi;
+}
+
+void wavproc_stats_accumulate(struct wavproc_stats *st, const RAW_WAVEFORM_BASE_TYPE *raw,
+                              size_t n)
+{
+    int32_t s, s2, lo, hi;
+    size_t i, m;
+
+    lo = st->n ? st->min : INT32_MAX;
+    hi = st->n ? st->max : INT32_MIN;
+    for (i=0; i<n; i+=m) {
+        m = MIN(WAVPROC_STATS_BLOCK, n-i);
+        stats_block((const int8_t*)raw + i, m, &s, &s2, &lo, &hi);
+        st->sum += s;
+        st->sum2 += (uint32_t)s2;
+    }
+    wavproc_histogram(st->hist, raw, n);
+    st->n += n;
+    st->min = lo;
+    st->max = hi;
+}
+
+double wavproc_stats_median(const struct wavproc_stats *st)
+{
+    if (st->n == 0) return NAN;
+    return (double)wavproc_hist_select(st->hist, (st->n - 1) / 2);
+}
+
+/* Samples counted into 32 bit tables between folds into hist. */
+#define WAVPROC_HIST_BLOCK ((size_t)1 << 30)
+
+SIMD_CLONES
+static void fold_hist(uint64_t *restrict hist, const uint32_t (*restrict h)[256])
+{
+    size_t j;
+    for (j=0; j<256; j++) hist[j] += (uint64_t)h[0][j] + h[1][j] + h[2][j] + h[3][j];
+}
+
+void wavproc_histogram(uint64_t *hist, const RAW_WAVEFORM_BASE_TYPE *raw, size_t n)
+{
+    /* Four tables break the store-to-load dependency between equal
+     * consecutive samples. */
+    uint32_t h[4][256];
+    const uint8_t *u = (const uint8_t*)raw;
+    size_t i, j, m;
+
+    _Static_assert(sizeof(RAW_WAVEFORM_BASE_TYPE) == 1, "histogram assumes 8 bit samples");
+    for (i=0; i<n; i+=m) {
+        m = MIN(WAVPROC_HIST_BLOCK, n-i);
+        memset(h, 0, sizeof(h));
+        for (j=0; j+4<=m; j+=4) {
+            h[0][u[i+j]   ^ 0x80]++;
+            h[1][u[i+j+1] ^ 0x80]++;
+            h[2][u[i+j+2] ^ 0x80]++;
+            h[3][u[i+j+3] ^ 0x80]++;
+        }
+        for (; j<m; j++) h[0][u[i+j] ^ 0x80]++;
+        fold_hist(hist, (const uint32_t (*)[256])h);
+    }
+}
+
+int wavproc_hist_select(const uint64_t *hist, uint64_t k)
+{
+    uint64_t c = 0;
+    size_t b;
+    for (b=0; b<255; b++) {
+        if ((c += hist[b]) > k) break;
+    }
+    return (int)b - 128;
+}
+
+int wavproc_select(const RAW_WAVEFORM_BASE_TYPE *raw, size_t n, size_t k)
+{
+    uint64_t hist[256] = {0};
+    wavproc_histogram(hist, raw, n);
+    return wavproc_hist_select(hist, k);
+}
+
+int wavproc_rolling_init(struct wavproc_rolling *rm, size_t win)
+{
+    memset(rm, 0, sizeof(*rm));
+    rm->win = MAX(1, win);
+    if ((rm->ring = (RAW_WAVEFORM_BASE_TYPE*)malloc(rm->win)) == NULL) {
+        error_printf("%s(): cannot allocate a window of %zd\n", __func__, rm->win);
+        return -1;
+    }
+    wavproc_rolling_clear(rm);
+    return 0;
+}
+
+void wavproc_rolling_clear(struct wavproc_rolling *rm)
+{
+    rm->n = rm->head = 0;
+    memset(rm->hist, 0, sizeof(rm->hist));
+    rm->bin = 128;
+    rm->below = 0;
+}
+
+void wavproc_rolling_free(struct wavproc_rolling *rm)
+{
+    free(rm->ring);
+    rm->ring = NULL;
+}
+
+int wavproc_rolling_median(RAW_WAVEFORM_BASE_TYPE *out, struct wavproc_rolling *rm,
+                           const RAW_WAVEFORM_BASE_TYPE *raw, size_t n)
+{
+    uint64_t *hist = rm->hist, k;
+    int b = rm->bin, x;
+    size_t i;
+
+    for (i=0; i<n; i++) {
+        x = (uint8_t)raw[i] ^ 0x80;
+        hist[x]++;
+        rm->below += x < b;
+        if (rm->n == rm->win) {
+            x = (uint8_t)rm->ring[rm->head] ^ 0x80;
+            hist[x]--;
+            rm->below -= x < b;
+        } else {
+            rm->n++;
+        }
+        rm->ring[rm->head] = raw[i];
+        if (++rm->head == rm->win) rm->head = 0;
+        /* Walk to the bin holding the lower median. */
+        k = (rm->n - 1) / 2;
+        while (rm->below > k) rm->below -= hist[--b];
+        while (rm->below + hist[b] <= k) rm->below += hist[b++];
+        if (out) out[i] = (RAW_WAVEFORM_BASE_TYPE)(b - 128);
+    }
+    rm->bin = b;
+    return b - 128;
+}
+
+double wavproc_rolling_baseline(const struct wavproc_rolling *rm)
+{
+    /* Bin b holds the values [b - 128.5, b - 127.5). */
+    if (rm->n == 0) return NAN;
+    return rm->bin - 128.5 + (0.5 * rm->n - rm->below) / rm->hist[rm->bin];
+}
@@ -0,0 +1,134 @@
+/** \file wavproc.h
+ * Vectorized kernels for raw waveforms.
+ */
+#ifndef __WAVPROC_H__
+#define __WAVPROC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+
+/** Convert raw samples to volts, (raw - yoff) * ymult + yzero.
+ * @param[out] v n calibrated samples.
+ * @param[in] raw n raw samples.
+ */
+void wavproc_calibrate(ANALYSIS_WAVEFORM_BASE_TYPE *v, const RAW_WAVEFORM_BASE_TYPE *raw,
+                       size_t n, double ymult, double yoff, double yzero);
+/** Single precision wavproc_calibrate(). */
+void wavproc_calibrate_float(float *v, const RAW_WAVEFORM_BASE_TYPE *raw,
+                             size_t n, double ymult, double yoff, double yzero);
+/** Time axis, t[i] = t0 + i * dt. */
+void wavproc_time_axis(double *t, size_t n, double t0, double dt);
+/** Convert every channel of a raw event.
+ * @param[out] v one row of wavAttr->nPt volts per channel in wavAttr->chMask.
+ * @param[out] t if not NULL, the time axis, generated in the same pass
+ *               as the first channel.
+ * @param[in] wavBuf raw event, rows in the same order as v.
+ * @return number of channels converted.
+ */
+size_t wavproc_calibrate_event(ANALYSIS_WAVEFORM_BASE_TYPE *v, double *t,
+                               const RAW_WAVEFORM_BASE_TYPE *wavBuf,
+                               const struct waveform_attribute *wavAttr);
+/** Single precision wavproc_calibrate_event(). */
+size_t wavproc_calibrate_event_float(float *v, float *t, const RAW_WAVEFORM_BASE_TYPE *wavBuf,
+                                     const struct waveform_attribute *wavAttr);
+/** Back to raw samples: x rounded half away from zero and saturated
+ * to the int8 range. */
+void wavproc_quantize(RAW_WAVEFORM_BASE_TYPE *raw, const double *x, size_t n);
+
+/** Min/max envelope for display: bin b covers samples
+ * [b * n / nBins, (b+1) * n / nBins).
+ * Bins that get no sample (nBins > n) repeat their nearest sample.
+ * @param[out] mn nBins minima.
+ * @param[out] mx nBins maxima.
+ */
+void wavproc_minmax(RAW_WAVEFORM_BASE_TYPE *mn, RAW_WAVEFORM_BASE_TYPE *mx,
+                    const RAW_WAVEFORM_BASE_TYPE *raw, size_t n, size_t nBins);
+/** Min/max pairs over fixed bins of binLen samples, the last one
+ * possibly short.
+ * @param[out] mm 2 * ceil(n / binLen) values, min then max of each bin.
+ */
+void wavproc_minmax_pairs(RAW_WAVEFORM_BASE_TYPE *mm, const RAW_WAVEFORM_BASE_TYPE *raw,
+                          size_t n, size_t binLen);
+/** Merge every factor consecutive min/max pairs into one.
+ * @param[out] dst 2 * ceil(nPairs / factor) values.
+ * @param[in] mm nPairs min/max pairs.
+ */
+void wavproc_minmax_reduce(RAW_WAVEFORM_BASE_TYPE *dst, const RAW_WAVEFORM_BASE_TYPE *mm,
+                           size_t nPairs, size_t factor);
+
+/** Software trigger on one channel.  A level trigger (span 0) fires at
+ * sample i when x[i-1] < level <= x[i] with x = polarity * raw; a slope
+ * trigger (span > 0) does the same with x[i] = polarity * (raw[i] -
+ * raw[i-span]).  After firing, the next holdoff samples are ignored.
+ */
+struct wavproc_trigger
+{
+    int     level;
+    int     polarity;     /**< +1 rising, -1 falling */
+    size_t  span;
+    size_t  holdoff;
+};
+/** Positions of the triggers in raw[0, n), in increasing order.
+ * Blocks without a trigger are rejected by a vectorized test, so the
+ * cost is that of one pass over the samples when triggers are sparse.
+ * @param[out] pos at most maxPos positions.
+ * @return number of positions stored.
+ */
+size_t wavproc_trigger_scan(size_t *pos, size_t maxPos, const RAW_WAVEFORM_BASE_TYPE *raw,
+                            size_t n, const struct wavproc_trigger *trig);
+
+/** Running statistics of raw int8 samples.  Zero it to start. */
+struct wavproc_stats
+{
+    uint64_t n;
+    int64_t  sum;
+    uint64_t sum2;
+    int32_t  min;          /**< valid when n > 0 */
+    int32_t  max;
+    uint64_t hist[256];    /**< bin 0 is -128 */
+};
+/** Add n samples to st. */
+void wavproc_stats_accumulate(struct wavproc_stats *st, const RAW_WAVEFORM_BASE_TYPE *raw,
+                              size_t n);
+/** Sample value below which half of the histogram lies. */
+double wavproc_stats_median(const struct wavproc_stats *st);
+
+/** Add the counts of raw[0, n) to a histogram of 256 bins, bin 0 is -128. */
+void wavproc_histogram(uint64_t *hist, const RAW_WAVEFORM_BASE_TYPE *raw, size_t n);
+/** kth smallest sample, k from 0, of a histogram of wavproc_histogram(). */
+int wavproc_hist_select(const uint64_t *hist, uint64_t k);
+/** kth smallest of raw[0, n), k < n, by a histogram: exact, one pass and
+ * raw is left alone.  The median is k = (n - 1) / 2, percentile p is
+ * k = p * (n - 1) / 100. */
+int wavproc_select(const RAW_WAVEFORM_BASE_TYPE *raw, size_t n, size_t k);
+
+/** Median of the last win samples of a stream, for baseline tracking.
+ * Updates cost O(1) but for the distance the median moves. */
+struct wavproc_rolling
+{
+    size_t   win;
+    size_t   n;           /**< samples in the window, up to win */
+    size_t   head;        /**< ring slot of the oldest sample once full */
+    RAW_WAVEFORM_BASE_TYPE *ring;
+    uint64_t hist[256];   /**< of the window, bin 0 is -128 */
+    int      bin;         /**< bin of the median */
+    uint64_t below;       /**< samples in the bins below it */
+};
+/** @return 0, or -1 if the window cannot be allocated. */
+int wavproc_rolling_init(struct wavproc_rolling *rm, size_t win);
+void wavproc_rolling_free(struct wavproc_rolling *rm);
+/** Empty the window, e.g. after a gap in the stream. */
+void wavproc_rolling_clear(struct wavproc_rolling *rm);
+/** Push raw[0, n) through the window.
+ * @param[out] out if not NULL, n medians, each of the window ending at
+ *                 the corresponding sample.
+ * @return the median of the window after the last sample.
+ */
+int wavproc_rolling_median(RAW_WAVEFORM_BASE_TYPE *out, struct wavproc_rolling *rm,
+                           const RAW_WAVEFORM_BASE_TYPE *raw, size_t n);
+/** Median of the window interpolated within its bin, a baseline finer
+ * than one ADC count.  NAN if the window is empty. */
+double wavproc_rolling_baseline(const struct wavproc_rolling *rm);
+
+#endif /* __WAVPROC_H__ */
@@ -0,0 +1,293 @@
+/** \file
+ * Throughput of the wavproc kernels against plain scalar loops.
+ */
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "utils.h"
+#include "wavproc.h"
+
+/** Parameters settable from commandline */
+typedef struct param
+{
+    size_t  nPt;      //!< points per waveform.
+    size_t  nRep;     //!< repetitions of each case.
+    size_t  nBins;    //!< min/max envelope width.
+} param_t;
+
+param_t paramDefault = {
+    .nPt   = 1000000,
+    .nRep  = 200,
+    .nBins = 1920,
+};
+
+static void print_usage(const param_t *pm, FILE *s)
+{
+    fprintf(s, "Usage:\n");
+    fprintf(s, "      -b nBins [%zd]: Min/max envelope width.\n", pm->nBins);
+    fprintf(s, "      -p nPt [%zd]: Points per waveform.\n", pm->nPt);
+    fprintf(s, "      -r nRep [%zd]: Repetitions of each case.\n", pm->nRep);
+}
+
+/* What analyses used to do by hand, kept scalar for reference. */
+__attribute__((optimize("no-tree-vectorize")))
+static void calibrate_scalar(double *v, double *t, const SCOPE_DATA_TYPE *raw,
+                             const struct waveform_attribute *wavAttr)
+{
+    size_t i, ch, row = 0;
+    for (ch=0; ch<SCOPE_NCH; ch++) {
+        if (!(wavAttr->chMask & (1U << ch))) continue;
+        for (i=0; i<wavAttr->nPt; i++) {
+            v[row * wavAttr->nPt + i] = (raw[row * wavAttr->nPt + i] - wavAttr->yoff[ch])
+                * wavAttr->ymult[ch] + wavAttr->yzero[ch];
+        }
+        row++;
+    }
+    if (t) {
+        for (i=0; i<wavAttr->nPt; i++) t[i] = wavAttr->t0 + i * wavAttr->dt;
+    }
+}
+
+__attribute__((optimize("no-tree-vectorize")))
+static void minmax_scalar(SCOPE_DATA_TYPE *mn, SCOPE_DATA_TYPE *mx, const SCOPE_DATA_TYPE *raw,
+                          size_t n, size_t nBins)
+{
+    size_t b, i;
+    for (b=0; b<nBins; b++) {
+        mn[b] = mx[b] = raw[b * n / nBins];
+        for (i=b * n / nBins; i<(b+1) * n / nBins; i++) {
+            if (raw[i] < mn[b]) mn[b] = raw[i];
+            if (raw[i] > mx[b]) mx[b] = raw[i];
+        }
+    }
+}
+
+__attribute__((optimize("no-tree-vectorize")))
+static void stats_scalar(struct wavproc_stats *st, const SCOPE_DATA_TYPE *raw, size_t n)
+{
+    size_t i;
+    for (i=0; i<n; i++) {
+        if (st->n == 0 || raw[i] < st->min) st->min = raw[i];
+        if (st->n == 0 || raw[i] > st->max) st->max = raw[i];
+        st->sum += raw[i];
+        st->sum2 += raw[i] * raw[i];
+        st->hist[raw[i] + 128]++;
+        st->n++;
+    }
+}
+
+__attribute__((optimize("no-tree-vectorize")))
+static size_t trigger_scalar(size_t *pos, size_t maxPos, const SCOPE_DATA_TYPE *raw, size_t n,
+                             const struct wavproc_trigger *trig)
+{
+    size_t i, k = 0;
+    for (i=trig->span+1; i<n && k<maxPos; i++) {
+        if (trig->polarity * raw[i-1] < trig->level && trig->polarity * raw[i] >= trig->level) {
+            pos[k++] = i;
+            i += trig->holdoff;
+        }
+    }
+    return k;
+}
+
+/* Baseline as analyses took it: copy a channel to doubles, select. */
+static double median_quickselect(const SCOPE_DATA_TYPE *raw, size_t n, size_t k, double *buf)
+{
+    size_t i;
+    for (i=0; i<n; i++) buf[i] = raw[i];
+    return quickselect(buf, n, k);
+}
+
+static const char *isa_name(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return "avx512f";
+    if (__builtin_cpu_supports("avx2")) return "avx2";
+#endif
+    return "default";
+}
+
+/** Time per sample and bandwidth of what dominates memory traffic,
+ * bytes per sample written (out) or read (in). */
+static void report(const char *name, double sec, size_t nSamples, size_t bytes, const char *dir)
+{
+    printf("%-26s %8.3f ns/sample %8.2f GB/s %s\n", name, sec / nSamples * 1e9,
+           (double)bytes * nSamples / sec / 1e9, dir);
+}
+
+int main(int argc, char **argv)
+{
+    param_t pm;
+    int optC = 0;
+    size_t i, r, ch, nCh, nSamples, nSel, nTrig = 0, nTrigRef = 0, *pos, *posRef;
+    const size_t win = 1001;
+    struct wavproc_trigger trig = {.level = 90, .polarity = 1, .span = 0, .holdoff = 500};
+    double t0, dmax;
+    struct waveform_attribute wavAttr = {0};
+    SCOPE_DATA_TYPE *raw, *mn, *mx, *mnRef, *mxRef;
+    double *v, *vRef, *t, *tRef, *sel, med = 0, medRef = 0;
+    struct wavproc_rolling rm;
+    SCOPE_DATA_TYPE *base;
+    struct wavproc_stats st, stRef;
+    float *vf, *tf;
+
+    memcpy(&pm, &paramDefault, sizeof(pm));
+    while ((optC = getopt(argc, argv, "b:p:r:")) != -1) {
+        switch (optC) {
+        case 'b':
+            pm.nBins = MAX(1, strtoull(optarg, NULL, 10));
+            break;
+        case 'p':
+            pm.nPt = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            pm.nRep = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            print_usage(&pm, stderr);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+
+    nCh = SCOPE_NCH;
+    wavAttr.chMask = (1U << nCh) - 1;
+    wavAttr.nPt = pm.nPt;
+    wavAttr.dt = 1e-10;
+    wavAttr.t0 = -5e-6;
+    for (i=0; i<nCh; i++) {
+        wavAttr.ymult[i] = 4e-3 * (i+1);
+        wavAttr.yoff[i] = 3.0 - i;
+        wavAttr.yzero[i] = 0.01 * i;
+    }
+    nSamples = nCh * pm.nPt;
+    raw  = (SCOPE_DATA_TYPE*)malloc(nSamples * sizeof(SCOPE_DATA_TYPE));
+    v    = (double*)malloc(nSamples * sizeof(double));
+    vRef = (double*)malloc(nSamples * sizeof(double));
+    vf   = (float*)malloc(nSamples * sizeof(float));
+    t    = (double*)malloc(pm.nPt * sizeof(double));
+    tRef = (double*)malloc(pm.nPt * sizeof(double));
+    tf   = (float*)malloc(pm.nPt * sizeof(float));
+    rand_init(1237026722LL);
+    for (i=0; i<nSamples; i++) raw[i] = (SCOPE_DATA_TYPE)lrint(20.0 * rand_gauss());
+
+    printf("%zd channels x %zd points, kernels dispatched to %s\n", nCh, pm.nPt, isa_name());
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) calibrate_scalar(vRef, NULL, raw, &wavAttr);
+    report("scalar", time_now() - t0, pm.nRep * nSamples, sizeof(double), "out");
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) wavproc_calibrate_event(v, NULL, raw, &wavAttr);
+    report("calibrate_event", time_now() - t0, pm.nRep * nSamples, sizeof(double), "out");
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) wavproc_calibrate_event_float(vf, NULL, raw, &wavAttr);
+    report("calibrate_event_float", time_now() - t0, pm.nRep * nSamples, sizeof(float), "out");
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) calibrate_scalar(vRef, tRef, raw, &wavAttr);
+    report("scalar + time", time_now() - t0, pm.nRep * nSamples, sizeof(double), "out");
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) wavproc_calibrate_event(v, t, raw, &wavAttr);
+    report("calibrate_event + time", time_now() - t0, pm.nRep * nSamples, sizeof(double), "out");
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) wavproc_calibrate_event_float(vf, tf, raw, &wavAttr);
+    report("calibrate_event_float + t", time_now() - t0, pm.nRep * nSamples, sizeof(float), "out");
+
+    mn    = (SCOPE_DATA_TYPE*)malloc(pm.nBins * sizeof(SCOPE_DATA_TYPE));
+    mx    = (SCOPE_DATA_TYPE*)malloc(pm.nBins * sizeof(SCOPE_DATA_TYPE));
+    mnRef = (SCOPE_DATA_TYPE*)malloc(pm.nBins * sizeof(SCOPE_DATA_TYPE));
+    mxRef = (SCOPE_DATA_TYPE*)malloc(pm.nBins * sizeof(SCOPE_DATA_TYPE));
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) minmax_scalar(mnRef, mxRef, raw, nSamples, pm.nBins);
+    report("minmax scalar", time_now() - t0, pm.nRep * nSamples, sizeof(SCOPE_DATA_TYPE), "in");
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) wavproc_minmax(mn, mx, raw, nSamples, pm.nBins);
+    report("minmax", time_now() - t0, pm.nRep * nSamples, sizeof(SCOPE_DATA_TYPE), "in");
+
+    memset(&stRef, 0, sizeof(stRef));
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) stats_scalar(&stRef, raw, nSamples);
+    report("stats scalar", time_now() - t0, pm.nRep * nSamples, sizeof(SCOPE_DATA_TYPE), "in");
+    memset(&st, 0, sizeof(st));
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) wavproc_stats_accumulate(&st, raw, nSamples);
+    report("stats_accumulate", time_now() - t0, pm.nRep * nSamples, sizeof(SCOPE_DATA_TYPE), "in");
+
+    /* Sparse pulses on the noise: one per 100k samples. */
+    for (i=50000; i+20<nSamples; i+=100000) raw[i+10] = 100;
+    pos    = (size_t*)malloc(nSamples / 1000 * sizeof(size_t));
+    posRef = (size_t*)malloc(nSamples / 1000 * sizeof(size_t));
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) nTrigRef = trigger_scalar(posRef, nSamples / 1000, raw, nSamples, &trig);
+    report("trigger scalar", time_now() - t0, pm.nRep * nSamples, sizeof(SCOPE_DATA_TYPE), "in");
+    t0 = time_now();
+    for (r=0; r<pm.nRep; r++) nTrig = wavproc_trigger_scan(pos, nSamples / 1000, raw, nSamples, &trig);
+    report("trigger_scan", time_now() - t0, pm.nRep * nSamples, sizeof(SCOPE_DATA_TYPE), "in");
+
+    /* Selection is slower per sample; fewer repetitions. */
+    nSel = MAX(1, pm.nRep / 20);
+    sel = (double*)malloc(pm.nPt * sizeof(double));
+    t0 = time_now();
+    for (r=0; r<nSel; r++) {
+        for (ch=0; ch<nCh; ch++)
+            medRef += median_quickselect(raw + ch * pm.nPt, pm.nPt, (pm.nPt - 1) / 2, sel);
+    }
+    report("median quickselect", time_now() - t0, nSel * nSamples, sizeof(SCOPE_DATA_TYPE), "in");
+    t0 = time_now();
+    for (r=0; r<nSel; r++) {
+        for (ch=0; ch<nCh; ch++) med += wavproc_select(raw + ch * pm.nPt, pm.nPt, (pm.nPt - 1) / 2);
+    }
+    report("median histogram", time_now() - t0, nSel * nSamples, sizeof(SCOPE_DATA_TYPE), "in");
+    base = (SCOPE_DATA_TYPE*)malloc(nSamples * sizeof(SCOPE_DATA_TYPE));
+    wavproc_rolling_init(&rm, win);
+    t0 = time_now();
+    for (r=0; r<nSel; r++) wavproc_rolling_median(base, &rm, raw, nSamples);
+    report("rolling median", time_now() - t0, nSel * nSamples, sizeof(SCOPE_DATA_TYPE), "in");
+
+    printf("median mismatch       = %d\n", med != medRef);
+    for (ch=0, dmax=0; ch<nCh; ch++) { /* 1st and 99th percentiles */
+        dmax += wavproc_select(raw + ch * pm.nPt, pm.nPt, (pm.nPt - 1) / 100)
+            != median_quickselect(raw + ch * pm.nPt, pm.nPt, (pm.nPt - 1) / 100, sel);
+        dmax += wavproc_select(raw + ch * pm.nPt, pm.nPt, (pm.nPt - 1) * 99 / 100)
+            != median_quickselect(raw + ch * pm.nPt, pm.nPt, (pm.nPt - 1) * 99 / 100, sel);
+    }
+    printf("percentile mismatches = %g\n", dmax);
+    for (i=win-1, dmax=0; i<nSamples; i+=9973)
+        dmax += base[i] != wavproc_select(raw + i - (win-1), win, (win-1) / 2);
+    printf("rolling mismatches    = %g\n", dmax);
+    wavproc_rolling_free(&rm);
+    free(base);
+    free(sel);
+
+    printf("trigger mismatch      = %d (%zd triggers)\n",
+           nTrig != nTrigRef || memcmp(pos, posRef, nTrig * sizeof(size_t)) != 0, nTrig);
+    printf("stats mismatch        = %d\n", memcmp(&st, &stRef, sizeof(st)) != 0);
+    for (i=0, dmax=0; i<pm.nBins; i++) dmax += (mn[i] != mnRef[i]) + (mx[i] != mxRef[i]);
+    printf("minmax mismatches     = %g\n", dmax);
+    for (i=0, dmax=0; i<nSamples; i++) dmax = MAX(dmax, fabs(v[i] - vRef[i]));
+    printf("max |double - scalar| = %g\n", dmax);
+    for (i=0, dmax=0; i<nSamples; i++) dmax = MAX(dmax, fabs(vf[i] - vRef[i]));
+    printf("max |float - scalar|  = %g\n", dmax);
+    for (i=0, dmax=0; i<pm.nPt; i++) dmax = MAX(dmax, fabs(t[i] - tRef[i]));
+    printf("max |t - scalar t|    = %g\n", dmax);
+
+    free(raw);
+    free(v);
+    free(vRef);
+    free(vf);
+    free(t);
+    free(tRef);
+    free(tf);
+    free(mn);
+    free(mx);
+    free(mnRef);
+    free(mxRef);
+    free(pos);
+    free(posRef);
+    return EXIT_SUCCESS;
+}